@@ -0,0 +1,26 @@
+#ifndef memcounter_BlockDetails_h
+#define memcounter_BlockDetails_h
+
+#include <stddef.h> // needed for size_t
+#include <stdint.h>
+
+namespace memcounter
+{
+	/** @brief What is remembered about each tracked block, whether it's kept in a header or in the side table. */
+	struct BlockDetails
+	{
+		size_t size; ///< The number of bytes the program asked for
+		/// How many blocks this one stands for in the counters. Always 1 unless allocations are being
+		/// sampled, in which case it's the reciprocal of the chance the block had of being picked.
+		uint32_t weight;
+		/// The node in the allocating thread's call site trie for where the block was allocated, or zero if call sites aren't being recorded.
+		uint32_t callSite;
+		/// ThreadMemoryCounterPool::index() of the thread that allocated the block
+		uint32_t allocatingPool;
+		/// The cycle count when the block was allocated. Only set if block lifetimes are being recorded.
+		uint64_t allocationTime;
+	};
+
+} // end of the memcounter namespace
+
+#endif
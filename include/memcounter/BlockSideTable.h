@@ -0,0 +1,102 @@
+#ifndef memcounter_BlockSideTable_h
+#define memcounter_BlockSideTable_h
+
+#include <stddef.h> // needed for size_t
+#include <stdint.h>
+#include <iostream>
+
+#include "memcounter/BlockDetails.h"
+
+namespace memcounter
+{
+	/** @brief Sharded hash table from block address to the block details, as an alternative to storing them in a header.
+	 *
+	 * The table is split into a number of shards, each an independent open addressing table using
+	 * linear probing. The shard and the starting slot are both picked from the hash of the block
+	 * address, so any thread can find a block no matter which thread allocated it. Each shard has a
+	 * spin lock of its own on a separate cache line, held for one probe sequence, so threads only wait
+	 * for each other when they happen to hash to the same shard.
+	 *
+	 * Erasing an entry moves the later entries of its cluster back into the gap where that keeps them
+	 * on or after their home slot, rather than leaving a tombstone. So the table never fills up with
+	 * erased entries, and a lookup for a block that isn't there stops at the end of the cluster no
+	 * matter how much has been allocated and freed before. That's what needs the lock, since entries
+	 * move.
+	 *
+	 * The memory for the table is mmapped rather than taken from malloc so that the hooks can use it
+	 * without recursing, and so that pages are only committed once something hashes to them.
+	 *
+	 * If a probe goes all the way round a shard the insert fails and the block simply isn't tracked.
+	 * This is recorded in the statistics so that the table can be sized properly.
+	 */
+	class BlockSideTable
+	{
+	public:
+		/** @brief Statistics about how full the table is and how long the probe sequences are. */
+		struct Statistics
+		{
+			size_t capacity;
+			size_t numberOfShards;
+			size_t liveEntries;
+			size_t failedInserts;
+			size_t maximumProbeLength;
+			double averageProbeLength; ///< Average over the live entries of how far they are from their home slot, plus one
+			double loadFactor; ///< liveEntries/capacity, which is what the probe length depends on since there are no tombstones
+			/// Number of live entries needing each probe length. The last bin is everything greater or equal.
+			size_t probeLengthHistogram[16];
+		};
+
+		/** @brief Constructs an unusable table, call initialise() before use.
+		 *
+		 * This is so that a global instance can be set up after the options have been read. The memory
+		 * is never unmapped, because other threads may still be freeing blocks while the globals are
+		 * being destructed at exit.
+		 */
+		BlockSideTable();
+
+		/** @brief Allocates room for the given number of blocks, rounded up to a power of two. Returns false on failure. */
+		bool initialise( size_t capacity );
+		bool isInitialised() const;
+
+		/** @brief Records the details for the block. Returns false if there was no room. */
+		bool insert( const void* pBlock, const memcounter::BlockDetails& details );
+
+		/** @brief Removes the block, returning true and setting details if it was found. */
+		bool erase( const void* pBlock, memcounter::BlockDetails& details );
+
+		/** @brief Scans the whole table to work out how full it is. Doesn't block anything else using the table. */
+		Statistics statistics() const;
+		void dumpStatistics( std::ostream& stream ) const;
+	protected:
+		struct Entry
+		{
+			uintptr_t key; ///< Address of the block, or one of the reserved values below
+			memcounter::BlockDetails details;
+		};
+		static const uintptr_t emptyKey=0;
+		static const size_t maximumNumberOfShards=64;
+
+		/// Everything for a shard apart from its entries, on a cache line of its own
+		struct ShardState
+		{
+			bool lock;
+			size_t failedInserts;
+			char padding[64-2*sizeof(size_t)];
+		};
+
+		/// Splits the hash of the address into a shard and a slot within that shard
+		inline size_t homeSlot( uintptr_t key ) const;
+		inline void lockShard( size_t shard );
+		inline void unlockShard( size_t shard );
+
+		Entry* pEntries_;
+		size_t capacity_;
+		size_t shardSize_;
+		unsigned hashShift_;
+		size_t numberOfShards_;
+		ShardState shards_[maximumNumberOfShards];
+	}; // end of the BlockSideTable class
+
+} // end of the memcounter namespace
+
+#endif
@@ -0,0 +1,118 @@
+#ifndef memcounter_CInterface_h
+#define memcounter_CInterface_h
+
+/*
+ * A plain C interface to the memory counters, for C programs and for code built with a different
+ * compiler or standard library to intrusiveMemoryAnalyser. Nothing in here depends on the C++ ABI:
+ * counters are referred to by integer handles and their counts are copied out into plain structs.
+ *
+ * The functions are only there when the program is run with intrusiveMemoryAnalyser, so look them
+ * up with dlsym the same way as createNewMemoryCounter, e.g.
+ *
+ *	int (*memcounterSnapshots)( const MemcounterHandle*, size_t, MemcounterSnapshot*, size_t );
+ *	*(void**)(&memcounterSnapshots)=dlsym( 0, "memcounterSnapshots" );
+ *	if( memcounterSnapshots ) ...
+ *
+ * A handle from memcounterCreateCounter belongs to the thread that created it, the same as the
+ * IMemoryCounter it stands for, and the functions return MEMCOUNTER_WRONG_THREAD if it's used from
+ * any other, apart from memcounterSnapshot and memcounterSnapshots which can read it from anywhere.
+ * Handles from memcounterCreateGlobalCounter can be used from any thread. A thread's handles stop
+ * being valid when the thread exits.
+ */
+
+#include <stddef.h> /* needed for size_t */
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/** @brief Refers to a counter. Zero is never a valid handle. */
+typedef uint32_t MemcounterHandle;
+
+/* Return codes. Anything negative is an error. */
+#define MEMCOUNTER_SUCCESS 0
+#define MEMCOUNTER_INVALID_HANDLE (-1) /**< Never created, or its thread has exited */
+#define MEMCOUNTER_WRONG_THREAD (-2) /**< A per thread counter used from a thread other than the one that created it */
+
+/* Bits of MemcounterSnapshot::flags */
+#define MEMCOUNTER_SNAPSHOT_VALID 0x1u /**< The handle was valid and the counts were filled in. If not the counts are all zero. */
+#define MEMCOUNTER_SNAPSHOT_ENABLED 0x2u /**< The counter is enabled in the calling thread, or for another thread's counter in that thread */
+#define MEMCOUNTER_SNAPSHOT_GLOBAL 0x4u /**< The counter adds up every thread it's enabled in */
+
+/** @brief Everything a counter counts, copied out in one go.
+ *
+ * Fields will only ever be added to the end. The snapshot functions take the size of the struct the
+ * caller was compiled with, and only fill in that much.
+ */
+typedef struct MemcounterSnapshot
+{
+	MemcounterHandle handle;
+	uint32_t flags; /**< MEMCOUNTER_SNAPSHOT_* bits */
+	int64_t currentSize;
+	int64_t maximumSize;
+	int64_t currentUsableSize;
+	int64_t maximumUsableSize;
+	int64_t currentNumberOfAllocations;
+	int64_t maximumNumberOfAllocations;
+} MemcounterSnapshot;
+
+/** @brief The totals for one of the names given to createNamedMemoryCounter, see memcounterNamedTotals.
+ *
+ * The same as MemcounterSnapshot, fields will only ever be added to the end.
+ */
+typedef struct MemcounterNamedTotals
+{
+	const char* name; /**< Stays valid until the program exits */
+	uint32_t nameId; /**< What memoryCounterNameId returns for the name */
+	uint32_t numberOfThreads; /**< How many threads the totals are for */
+	int64_t currentSize;
+	int64_t maximumSize; /**< The sum of each thread's maximum */
+	int64_t currentUsableSize;
+	int64_t maximumUsableSize;
+	int64_t currentNumberOfAllocations;
+	int64_t maximumNumberOfAllocations;
+} MemcounterNamedTotals;
+
+/** @brief Creates a counter for the calling thread. Returns zero if the thread has no counter pool or there are too many handles. */
+MemcounterHandle memcounterCreateCounter( void );
+/** @brief Creates a counter that adds up every thread it's enabled in. Returns zero if there are too many. */
+MemcounterHandle memcounterCreateGlobalCounter( void );
+
+/* These return MEMCOUNTER_SUCCESS or one of the error codes. Enabling a global counter only enables it in the calling thread. */
+int memcounterEnable( MemcounterHandle handle );
+int memcounterDisable( MemcounterHandle handle );
+int memcounterReset( MemcounterHandle handle );
+int memcounterResetMaximum( MemcounterHandle handle );
+/** @brief Returns 1 if the counter is enabled in the calling thread, 0 if not, or one of the error codes. */
+int memcounterIsEnabled( MemcounterHandle handle );
+
+/** @brief Copies the counts of one counter into pSnapshot. snapshotSize should be sizeof(MemcounterSnapshot).
+ *
+ * Another thread's counter is read without stopping it, so changes it has batched up with
+ * MEMCOUNTER_BATCH_SIZE aren't included yet.
+ */
+int memcounterSnapshot( MemcounterHandle handle, MemcounterSnapshot* pSnapshot, size_t snapshotSize );
+/** @brief Copies the counts of numberOfHandles counters into the array at pSnapshots.
+ *
+ * Returns how many were valid. The others have MEMCOUNTER_SNAPSHOT_VALID clear in their flags.
+ * snapshotSize should be sizeof(MemcounterSnapshot), and is also the stride through the array.
+ */
+int memcounterSnapshots( const MemcounterHandle* handles, size_t numberOfHandles, MemcounterSnapshot* pSnapshots, size_t snapshotSize );
+
+/** @brief Fills in the totals for each counter name, up to maximumNumber of them, and returns how many names there are.
+ *
+ * The totals are for the counters with the name in every thread, including the ones that have exited.
+ * Other running threads' counters are read the same way as memcounterSnapshot, so changes they've
+ * batched up with MEMCOUNTER_BATCH_SIZE and their counters' sub-counters aren't included. totalsSize
+ * should be sizeof(MemcounterNamedTotals), and is also the stride through the array. Call with
+ * maximumNumber zero to find out how many there are.
+ */
+size_t memcounterNamedTotals( MemcounterNamedTotals* pTotals, size_t maximumNumber, size_t totalsSize );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,86 @@
+#ifndef memcounter_CallSiteTrie_h
+#define memcounter_CallSiteTrie_h
+
+#include <stddef.h> // needed for size_t
+#include <stdint.h>
+#include <vector>
+
+namespace memcounter
+{
+	/** @brief The counts a memory counter keeps for each call site. */
+	struct CallSiteStatistics
+	{
+		long int currentBytes;
+		long int maximumBytes;
+		long int currentAllocations;
+		long int totalAllocations;
+		long int totalBytes; ///< Including freed blocks, like totalAllocations
+
+		inline void add( long int bytes, long int allocations )
+		{
+			currentBytes+=bytes;
+			maximumBytes=currentBytes>maximumBytes ? currentBytes : maximumBytes;
+			currentAllocations+=allocations;
+			totalAllocations+=allocations;
+			totalBytes+=bytes;
+		}
+
+		inline void remove( long int bytes, long int allocations )
+		{
+			currentBytes-=bytes;
+			currentAllocations-=allocations;
+		}
+	};
+
+	/** @brief Stores every distinct call stack seen by a thread once, as a trie of return addresses.
+	 *
+	 * Each node is a return address plus the node for the rest of the stack above it, with the root
+	 * (node 0) standing for the empty stack. Nodes are hash-consed, i.e. looked up in a hash table on
+	 * (parent, address) before a new one is made, so a stack is turned into a single 32 bit node index
+	 * and stacks that share their outer frames share nodes. The index is what gets stored with each
+	 * block, and what the counters key their per call site counts on.
+	 *
+	 * There's one of these per thread so no locking is needed. It uses std::vector, so the caller must
+	 * make sure memory counting is disabled while calling intern.
+	 */
+	class CallSiteTrie
+	{
+	public:
+		CallSiteTrie();
+
+		/** @brief Returns the node for the stack, adding it if it hasn't been seen before.
+		 *
+		 * @param pFrames  The return addresses, innermost first, as captureStack gives them
+		 * @param depth    How many addresses there are
+		 */
+		uint32_t intern( void* const* pFrames, size_t depth );
+
+		size_t numberOfNodes() const;
+
+		/** @brief Forgets every stack and frees the memory, leaving just the root. */
+		void clear();
+
+		/** @brief Fills frames with the return addresses for the node, innermost first. */
+		void stack( uint32_t node, std::vector<void*>& frames ) const;
+	protected:
+		struct Node
+		{
+			uint32_t parent;
+			void* address;
+		};
+
+		inline uint32_t child( uint32_t parent, void* address );
+		void growTable();
+
+		std::vector<Node> nodes_;
+		std::vector<uint32_t> table_; ///< Open addressing with linear probing from (parent, address) to node index. Zero means empty since the root is never a child.
+		size_t tableMask_;
+
+		// The last stack interned, since allocations in a loop often come from the same stack
+		std::vector<void*> lastFrames_;
+		uint32_t lastNode_;
+	}; // end of the CallSiteTrie class
+
+} // end of the memcounter namespace
+
+#endif
@@ -0,0 +1,29 @@
+#ifndef memcounter_ClientThreadState_h
+#define memcounter_ClientThreadState_h
+
+#include <stdint.h>
+
+namespace memcounter
+{
+	/** @brief The part of the library's per thread state that client code can write to directly.
+	 *
+	 * This is what the inline functions in ThreadCounter.h use to switch counters on and off without
+	 * calling into the library. Each enabled counter has a slot in its thread's pool, and setting the
+	 * slot's bit in pausedSlots stops the counter being changed until the bit is cleared again. The
+	 * library notices the next time the thread allocates or frees anything.
+	 *
+	 * Only the thread the state belongs to can write to it, and never from inside the library.
+	 */
+	struct ClientThreadState
+	{
+		/// Non-zero when the thread has enabled counters and isn't already inside one of the hooks. Client
+		/// code sets this when it unpauses a counter. It's cleared by the library once it sees that nothing
+		/// is left to count.
+		bool countingEnabled;
+		/// Bit mask of the enabled counters' slots that are paused
+		uint32_t pausedSlots;
+	};
+
+} // end of the memcounter namespace
+
+#endif
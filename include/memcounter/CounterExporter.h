@@ -0,0 +1,54 @@
+#ifndef memcounter_CounterExporter_h
+#define memcounter_CounterExporter_h
+
+#include <stddef.h> // needed for size_t
+#include <stdint.h>
+
+// Forward declarations
+namespace memcounter
+{
+	class IMemoryCounter;
+	class ReportWriter;
+}
+
+namespace memcounter
+{
+	/** @brief Writes counters out in formats other programs can read: JSON, CSV and folded stacks for flame graphs.
+	 *
+	 * Everything goes through a ReportWriter, so the text is formatted into its fixed buffer and written
+	 * with write(2), without any strings or streams being allocated. The counters are only read through
+	 * IMemoryCounter, so the same rules apply as for calling it directly: a thread's counters can only be
+	 * written out by that thread, global counters by any thread. Reading the call sites builds vectors, so
+	 * the caller has to make sure memory counting is disabled for the thread while writing.
+	 */
+	class CounterExporter
+	{
+	public:
+		/** @brief Writes the counter and all of its sub-counters as one JSON object, followed by a newline. */
+		static void writeJson( memcounter::ReportWriter& writer, const memcounter::IMemoryCounter& counter );
+
+		/** @brief Writes the line of column names for writeCsvRows. */
+		static void writeCsvHeader( memcounter::ReportWriter& writer );
+		/** @brief Writes one row for the counter and one for each sub-counter below it.
+		 *
+		 * @param snapshot     Goes in the first column, so that the rows written at the same time can be told apart
+		 * @param milliseconds The unix time of the snapshot in milliseconds, written out in seconds
+		 * @param counterName  Goes in the counter column, quoted if it needs to be. Sub-counters get it followed by
+		 *                     their position in each level of subCounters(), e.g. "2.0.1", and the parent column
+		 *                     is the part before that.
+		 */
+		static void writeCsvRows( memcounter::ReportWriter& writer, const memcounter::IMemoryCounter& counter, uint64_t snapshot, uint64_t milliseconds, const char* counterName );
+
+		/** @brief Writes a line for each call site with bytes still allocated from it, in the folded format that flamegraph.pl and similar tools read.
+		 *
+		 * Each line is the frames from the outermost in, separated by semicolons, then a space and the bytes.
+		 * Frames are the symbol name if dladdr can find one, otherwise the file it's in and the offset.
+		 * Symbol names are left mangled, since demangling allocates, so pipe the output through c++filt.
+		 * Returns the number of lines, which is zero if call sites aren't being recorded.
+		 */
+		static size_t writeFoldedStacks( memcounter::ReportWriter& writer, const memcounter::IMemoryCounter& counter );
+	}; // end of the CounterExporter class
+
+} // end of the memcounter namespace
+
+#endif
@@ -0,0 +1,70 @@
+#ifndef memcounter_CounterHandleTable_h
+#define memcounter_CounterHandleTable_h
+
+#include <stddef.h> // needed for size_t
+#include <stdint.h>
+#include <pthread.h>
+
+
+// Forward declarations
+namespace memcounter
+{
+	class IMemoryCounter;
+}
+
+
+namespace memcounter
+{
+	/** @brief Gives out the integer handles that the C interface in CInterface.h uses for counters.
+	 *
+	 * A handle is the counter's entry in a fixed size table in the bottom 16 bits, and the number of times
+	 * that entry has been used in the top 16, so a handle that's been given up can't be mistaken for the
+	 * one that replaced it. Looking a handle up doesn't lock. Adding one takes a mutex, which is fine since
+	 * it's rare.
+	 *
+	 * Each entry remembers the ThreadMemoryCounterPool::index() of the thread the counter belongs to, zero
+	 * for global counters. Per thread counters are deleted when their thread exits, so an entry is given up
+	 * once its pool has gone from the registry, and lookups from any other thread are refused.
+	 */
+	class CounterHandleTable
+	{
+	public:
+		CounterHandleTable();
+		~CounterHandleTable();
+
+		/** @brief Returns a handle for the counter, or zero if every entry is in use. ownerPool is zero if the counter can be used from any thread. */
+		uint32_t add( memcounter::IMemoryCounter* pCounter, uint32_t ownerPool, bool isGlobal );
+
+		/** @brief Finds the counter for the handle if the thread with callingPool as its pool index can use it.
+		 *
+		 * Returns MEMCOUNTER_SUCCESS, MEMCOUNTER_INVALID_HANDLE or MEMCOUNTER_WRONG_THREAD, and only fills in
+		 * pCounter and isGlobal on success. If pOwnerPool isn't NULL, another thread's counter is returned
+		 * rather than refused, and *pOwnerPool is set to the pool index of its thread, or zero if the calling
+		 * thread can use the counter directly. The counter can then only be read, with
+		 * ThreadMemoryCounterPool::readCounterValues.
+		 */
+		int lookup( uint32_t handle, uint32_t callingPool, memcounter::IMemoryCounter*& pCounter, bool& isGlobal, uint32_t* pOwnerPool=NULL ) const;
+
+		static const size_t capacity=65536;
+	protected:
+		struct Entry
+		{
+			uint32_t handle; ///< Zero while the entry is unused or being changed
+			uint32_t ownerPool;
+			memcounter::IMemoryCounter* pCounter;
+			bool isGlobal;
+		};
+
+		/// Returns an entry whose counter's thread has exited, or capacity if there aren't any. The mutex must be held.
+		size_t findReclaimableEntry();
+
+		Entry entries_[capacity];
+		uint16_t generations_[capacity]; ///< How many times each entry has been used, only changed with the mutex held
+		size_t numberOfUsedEntries_; ///< Entries past this have never been used
+		size_t reclaimPosition_; ///< Where the next search for an entry to reuse starts
+		pthread_mutex_t mutex_;
+	}; // end of the CounterHandleTable class
+
+} // end of the memcounter namespace
+
+#endif
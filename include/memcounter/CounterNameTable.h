@@ -0,0 +1,59 @@
+#ifndef memcounter_CounterNameTable_h
+#define memcounter_CounterNameTable_h
+
+#include <stddef.h> // needed for size_t
+#include <stdint.h>
+
+#include "memcounter/CounterValues.h"
+
+namespace memcounter
+{
+	/** @brief Turns counter names into small integer ids that are the same in every thread, and keeps the totals of exited threads for each name.
+	 *
+	 * The names are kept in a fixed size open addressed hash table. Each entry is claimed with a compare
+	 * and swap on its record pointer, so looking up or adding a name never locks, and a record is never
+	 * moved or deleted once it's in, so the id and the name pointer stay valid until the program exits.
+	 * The id is the entry's position plus one, so zero means there's no name. Each thread's pool keeps its
+	 * named counters in a vector indexed by id, which is what makes a cached id free to use.
+	 *
+	 * The totals for threads that have exited are kept with the names under a spinlock, since that's only
+	 * changed as threads exit.
+	 */
+	class CounterNameTable
+	{
+	public:
+		CounterNameTable();
+		~CounterNameTable();
+
+		/** @brief Returns the id for the name, adding it if it isn't already in. Zero if the table is full. Counting must be disabled. */
+		uint32_t intern( const char* name );
+		/** @brief Returns the name for an id, or NULL if nothing has been given it. */
+		const char* name( uint32_t id ) const;
+
+		/** @brief Adds the counts of a counter whose thread is exiting to the totals for its name. */
+		void addRetired( uint32_t id, const long int (&current)[memcounter::CounterValues::numberOfQuantities], const long int (&maximum)[memcounter::CounterValues::numberOfQuantities] );
+		/** @brief Adds the totals of exited threads for the name to current and maximum, and returns how many threads there were. */
+		uint32_t addRetiredTotals( uint32_t id, long int (&current)[memcounter::CounterValues::numberOfQuantities], long int (&maximum)[memcounter::CounterValues::numberOfQuantities] ) const;
+
+		static const size_t capacity=4096; ///< Must be a power of two
+	protected:
+		struct Record
+		{
+			uint64_t hash;
+			// The retired totals are arrays rather than a CounterValues, so that the record doesn't need aligning past what malloc gives
+			long int retiredCurrent[memcounter::CounterValues::numberOfQuantities];
+			long int retiredMaximum[memcounter::CounterValues::numberOfQuantities];
+			uint32_t numberOfRetiredThreads;
+			char name[1]; ///< The rest of the name follows on from the end of the record
+		};
+
+		void lockRetired() const;
+		void unlockRetired() const;
+
+		Record* records_[capacity];
+		mutable bool retiredLock_;
+	}; // end of the CounterNameTable class
+
+} // end of the memcounter namespace
+
+#endif
@@ -0,0 +1,63 @@
+#ifndef memcounter_CounterValues_h
+#define memcounter_CounterValues_h
+
+namespace memcounter
+{
+	/** @brief The numbers a memory counter keeps, laid out so that a pool can update all of its enabled counters in one tight loop.
+	 *
+	 * Each quantity has a current value and the maximum it has reached. They're kept in small arrays rather
+	 * than named members so that an allocation, reallocation or free is just adding a delta to every element
+	 * of current and taking the maximum, with no branches, which the compiler can vectorise. The struct is
+	 * exactly one cache line.
+	 *
+	 * The owning thread writes the values with plain stores. Other threads read them with loadFrom,
+	 * between two reads of the ThreadMemoryCounterPool's sequence number, see
+	 * ThreadMemoryCounterPool::readCounterValues.
+	 */
+	struct CounterValues
+	{
+		enum Quantity
+		{
+			size=0,
+			usableSize=1,
+			numberOfAllocations=2,
+			totalAllocations=3, ///< Every allocation since the last reset, which only goes up. Also makes the arrays fill vector registers.
+			numberOfQuantities=4
+		};
+
+		long int current[numberOfQuantities];
+		long int maximum[numberOfQuantities];
+
+		inline void applyDelta( const long int (&delta)[numberOfQuantities] )
+		{
+			for( int index=0; index<numberOfQuantities; ++index )
+			{
+				current[index]+=delta[index];
+				maximum[index]=current[index]>maximum[index] ? current[index] : maximum[index];
+			}
+		}
+
+		inline void reset()
+		{
+			for( int index=0; index<numberOfQuantities; ++index ) current[index]=maximum[index]=0;
+		}
+
+		inline void resetMaximum()
+		{
+			for( int index=0; index<numberOfQuantities; ++index ) maximum[index]=current[index];
+		}
+
+		/// Copies another instance that might be being changed by another thread. Each value is read whole, but they might not be consistent with each other.
+		inline void loadFrom( const memcounter::CounterValues& other )
+		{
+			for( int index=0; index<numberOfQuantities; ++index )
+			{
+				current[index]=__atomic_load_n( &other.current[index], __ATOMIC_RELAXED );
+				maximum[index]=__atomic_load_n( &other.maximum[index], __ATOMIC_RELAXED );
+			}
+		}
+	} __attribute__((aligned(64)));
+
+} // end of the memcounter namespace
+
+#endif
@@ -0,0 +1,25 @@
+#ifndef memcounter_CycleClock_h
+#define memcounter_CycleClock_h
+
+#include <stdint.h>
+#include "macros.h"
+
+namespace memcounter
+{
+	/** @brief Reads the processor's timestamp counter, which is much cheaper than asking the kernel for the time. */
+	inline uint64_t cycleCount()
+	{
+		uint64_t cycles;
+		RDTSC( cycles );
+		return cycles;
+	}
+
+	/** @brief Works out how long a cycle is by comparing the cycle count with the real time since the library was loaded.
+	 *
+	 * If that was less than 10ms ago this waits until it's been 10ms so that the answer is reasonably accurate.
+	 */
+	double nanosecondsPerCycle();
+
+} // end of the memcounter namespace
+
+#endif
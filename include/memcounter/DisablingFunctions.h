@@ -1,6 +1,17 @@
 #ifndef memcounter_DisablingFunctions_h
 #define memcounter_DisablingFunctions_h
 
+#include <stddef.h> // needed for size_t
+#include <stdint.h>
+
+#include "memcounter/ClientThreadState.h"
+
+// Forward declarations
+namespace memcounter
+{
+	class ThreadMemoryCounterPool;
+}
+
 // This extern stops the malloc etc. hooks from doing anything different to the normal
 // calls until MemoryCounterManager is fully constructed. It is also used to switch
 // off special behaviour when MemoryCounterManager has been destructed.
@@ -8,6 +19,29 @@ extern bool memcounter_globallyDisabled;
 
 namespace memcounter
 {
+	/** @brief Everything the allocation hooks need to know about the current thread.
+	 *
+	 * This used to be spread over two pthread keys, which meant up to two pthread_getspecific and
+	 * two pthread_setspecific calls for every malloc. It's now a single thread local block using
+	 * the initial-exec TLS model (fine since the library is always LD_PRELOADed), so the check in
+	 * the hooks for whether the thread is counting is one load from the thread pointer and a branch.
+	 * Thread locals are zero initialised, so a new thread starts off with counting disabled and no
+	 * pool. The first members are the ClientThreadState, which client code gets a pointer to.
+	 */
+	struct ThreadState : public memcounter::ClientThreadState
+	{
+		/// The pool of counters for this thread, NULL until the pool has been created
+		memcounter::ThreadMemoryCounterPool* pPool;
+		/// When sampling, how many more bytes the thread can allocate before the next allocation is recorded
+		long int bytesUntilSample;
+		/// The sampling interval that bytesUntilSample was drawn with, so that a change can be noticed
+		size_t samplingInterval;
+		/// State of the random number generator used for sampling, zero until first used
+		uint64_t randomState;
+	};
+
+	extern __thread memcounter::ThreadState threadState __attribute__((tls_model("initial-exec")));
+
 	// Note that these functions are defined in MemoryCounterManager.cpp
 	void enableThisThread();
 	void disableThisThread();
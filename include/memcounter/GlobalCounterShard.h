@@ -0,0 +1,134 @@
+#ifndef memcounter_GlobalCounterShard_h
+#define memcounter_GlobalCounterShard_h
+
+#include <stdint.h>
+
+#include "memcounter/CounterValues.h"
+
+namespace memcounter
+{
+	/** @brief Resets of a global counter that each thread applies to its own shard the next time it updates it.
+	 *
+	 * Only the owning thread ever writes to a shard, so a reset from another thread is made by bumping
+	 * one of these. A shard whose generation is behind is treated as reset by anything reading it.
+	 */
+	struct GlobalCounterGenerations
+	{
+		uint32_t reset;
+		uint32_t maximumReset;
+	};
+
+	/** @brief One thread's part of a global counter.
+	 *
+	 * Each thread's pool has one of these per global counter, each on its own cache line, so that
+	 * counting never writes to memory another thread writes to. Readers on other threads add up every
+	 * thread's shard. The sequence number makes the read of each shard consistent: it's odd while the
+	 * owner is part way through an update, and a reader that sees it odd or changed tries again.
+	 */
+	struct GlobalCounterShard
+	{
+		enum Quantity
+		{
+			size=0,
+			usableSize=1,
+			numberOfAllocations=2,
+			numberOfQuantities=3
+		};
+
+		uint32_t sequence;
+		uint32_t resetGeneration; ///< The GlobalCounterGenerations this shard has caught up with
+		uint32_t maximumResetGeneration;
+		uint32_t unused;
+		long int current[numberOfQuantities];
+		long int maximum[numberOfQuantities];
+
+		/** @brief Adds the change, catching up with any resets first. Only the owning thread can call this. */
+		inline void apply( const long int (&delta)[memcounter::CounterValues::numberOfQuantities], const memcounter::GlobalCounterGenerations& generations )
+		{
+			uint32_t reset=__atomic_load_n( &generations.reset, __ATOMIC_RELAXED );
+			uint32_t maximumReset=__atomic_load_n( &generations.maximumReset, __ATOMIC_RELAXED );
+
+			__atomic_store_n( &sequence, sequence+1, __ATOMIC_RELAXED );
+			__atomic_thread_fence( __ATOMIC_RELEASE );
+
+			for( int index=0; index<numberOfQuantities; ++index )
+			{
+				long int newCurrent=( reset==resetGeneration ? current[index] : 0 )+delta[index];
+				long int oldMaximum=( reset==resetGeneration ? ( maximumReset==maximumResetGeneration ? maximum[index] : current[index] ) : 0 );
+				__atomic_store_n( &current[index], newCurrent, __ATOMIC_RELAXED );
+				__atomic_store_n( &maximum[index], newCurrent>oldMaximum ? newCurrent : oldMaximum, __ATOMIC_RELAXED );
+			}
+			__atomic_store_n( &resetGeneration, reset, __ATOMIC_RELAXED );
+			__atomic_store_n( &maximumResetGeneration, maximumReset, __ATOMIC_RELAXED );
+
+			__atomic_store_n( &sequence, sequence+1, __ATOMIC_RELEASE );
+		}
+
+		/** @brief Adds another shard's counts to this one, including its maximums.
+		 *
+		 * This is how the shards of threads that have exited are kept. Only one thread can write to
+		 * this shard at a time, and the other shard's owner mustn't be changing it.
+		 */
+		inline void fold( const GlobalCounterShard& other, const memcounter::GlobalCounterGenerations& generations )
+		{
+			long int otherCurrent[numberOfQuantities]={ 0, 0, 0 };
+			long int otherMaximum[numberOfQuantities]={ 0, 0, 0 };
+			other.addTo( otherCurrent, otherMaximum, generations );
+
+			uint32_t reset=__atomic_load_n( &generations.reset, __ATOMIC_RELAXED );
+			uint32_t maximumReset=__atomic_load_n( &generations.maximumReset, __ATOMIC_RELAXED );
+
+			__atomic_store_n( &sequence, sequence+1, __ATOMIC_RELAXED );
+			__atomic_thread_fence( __ATOMIC_RELEASE );
+
+			for( int index=0; index<numberOfQuantities; ++index )
+			{
+				long int newCurrent=( reset==resetGeneration ? current[index] : 0 )+otherCurrent[index];
+				long int newMaximum=( reset==resetGeneration ? ( maximumReset==maximumResetGeneration ? maximum[index] : current[index] ) : 0 )+otherMaximum[index];
+				__atomic_store_n( &current[index], newCurrent, __ATOMIC_RELAXED );
+				__atomic_store_n( &maximum[index], newCurrent>newMaximum ? newCurrent : newMaximum, __ATOMIC_RELAXED );
+			}
+			__atomic_store_n( &resetGeneration, reset, __ATOMIC_RELAXED );
+			__atomic_store_n( &maximumResetGeneration, maximumReset, __ATOMIC_RELAXED );
+
+			__atomic_store_n( &sequence, sequence+1, __ATOMIC_RELEASE );
+		}
+
+		/** @brief Adds a consistent copy of this shard to the totals, allowing for resets the owner hasn't caught up with yet. Can be called from any thread.
+		 *
+		 * If maximumAttempts isn't zero, the copy is used after that many tries even if it isn't consistent. That's
+		 * for signal handlers, which could otherwise wait forever on an update the signal interrupted.
+		 */
+		inline void addTo( long int (&currentTotal)[numberOfQuantities], long int (&maximumTotal)[numberOfQuantities], const memcounter::GlobalCounterGenerations& generations, unsigned maximumAttempts=0 ) const
+		{
+			long int currentCopy[numberOfQuantities];
+			long int maximumCopy[numberOfQuantities];
+			uint32_t resetCopy, maximumResetCopy, before, after;
+			unsigned attempts=0;
+			do
+			{
+				before=__atomic_load_n( &sequence, __ATOMIC_ACQUIRE );
+				for( int index=0; index<numberOfQuantities; ++index )
+				{
+					currentCopy[index]=__atomic_load_n( &current[index], __ATOMIC_RELAXED );
+					maximumCopy[index]=__atomic_load_n( &maximum[index], __ATOMIC_RELAXED );
+				}
+				resetCopy=__atomic_load_n( &resetGeneration, __ATOMIC_RELAXED );
+				maximumResetCopy=__atomic_load_n( &maximumResetGeneration, __ATOMIC_RELAXED );
+				__atomic_thread_fence( __ATOMIC_ACQUIRE );
+				after=__atomic_load_n( &sequence, __ATOMIC_RELAXED );
+			} while( ( (before & 1) || before!=after ) && ++attempts!=maximumAttempts );
+
+			if( resetCopy!=__atomic_load_n( &generations.reset, __ATOMIC_RELAXED ) ) return; // Counts as zero until the owner catches up
+			bool maximumIsReset=( maximumResetCopy!=__atomic_load_n( &generations.maximumReset, __ATOMIC_RELAXED ) );
+			for( int index=0; index<numberOfQuantities; ++index )
+			{
+				currentTotal[index]+=currentCopy[index];
+				maximumTotal[index]+=( maximumIsReset ? currentCopy[index] : maximumCopy[index] );
+			}
+		}
+	} __attribute__((aligned(64)));
+
+} // end of the memcounter namespace
+
+#endif
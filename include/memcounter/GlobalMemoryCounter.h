@@ -0,0 +1,87 @@
+#ifndef memcounter_GlobalMemoryCounter_h
+#define memcounter_GlobalMemoryCounter_h
+
+#include "memcounter/IMemoryCounter.h"
+#include "memcounter/GlobalCounterShard.h"
+
+namespace memcounter
+{
+	/** @brief A counter that adds up the allocations of every thread it's enabled in.
+	 *
+	 * Enabling and disabling only affect the calling thread, the same as for a normal counter, but the
+	 * counter can be enabled in any number of threads at once and read from any thread. Each thread's
+	 * pool keeps a GlobalCounterShard for it, which only that thread writes, so there's no contention
+	 * between threads when counting. Reading walks every pool and adds up the shards without taking any
+	 * locks. Each shard is read consistently, but they aren't all read at the same instant.
+	 *
+	 * The maximums are the sum of each thread's maximum, so they're an upper limit on the process wide
+	 * maximum rather than exact. Size histograms, lifetimes and call sites are only kept by the per
+	 * thread counters.
+	 *
+	 * There can only be maximumNumberOfCounters of them at once. Each index has a reference count: one
+	 * for whoever created it, and one for every thread it's enabled in. The ones made for threads spawned
+	 * from counted code are given back with releaseReference when the counter they belong to is deleted,
+	 * and once nothing refers to an index it's reset and handed out again by create(). The objects are
+	 * never deleted, so a pointer read by another thread can always be dereferenced, although it might
+	 * be for the next user of the index by then. The ones users create are never given back.
+	 */
+	class GlobalMemoryCounter : public memcounter::IMemoryCounter
+	{
+	public:
+		/** @brief Returns a new global counter, or NULL if there are already maximumNumberOfCounters. Counting must be disabled.
+		 *
+		 * The caller holds the one reference to it. If reportFailure is false nothing is printed when there's no
+		 * counter left, so that the caller can say something more useful.
+		 */
+		static memcounter::GlobalMemoryCounter* create( bool reportFailure=true );
+		/** @brief Takes a reference to each global counter in the bit mask of indices. Can be called from any thread. */
+		static void addReferences( uint32_t indices );
+		/** @brief Gives back a reference to each global counter in the bit mask. The last one resets the counter and makes its index free again. */
+		static void releaseReferences( uint32_t indices );
+		/** @brief The resets for the counter with the given index, which the pools need when updating their shards. */
+		static const memcounter::GlobalCounterGenerations& generations( size_t index );
+
+		/** @brief How many global counters have been created, so their indices are zero up to this. Can be called from any thread. */
+		static size_t numberCreated();
+
+		static const size_t maximumNumberOfCounters=32; ///< Each thread has a bit mask of the ones enabled in it, so this can't be more than 32
+
+		/// Which shard in each pool belongs to this counter
+		inline size_t index() const { return index_; }
+
+		//
+		// These methods are from the IMemoryCounter interface
+		//
+		virtual bool setEnabled( bool enable ); ///< Returns the state before the call, for the calling thread
+		virtual bool isEnabled() const; ///< Returns true if the counter is enabled in the calling thread
+		virtual void enable();
+		virtual void disable();
+		virtual void reset(); ///< Resets the counts for every thread
+		virtual void resetMaximum();
+
+		virtual void dumpContents( std::ostream& stream=std::cout, const std::string& prefix=std::string() ) const;
+		virtual long int currentSize() const;
+		virtual long int maximumSize() const;
+		virtual long int currentNumberOfAllocations() const;
+		virtual long int maximumNumberOfAllocations() const;
+
+		virtual const std::vector<IMemoryCounter*>& subCounters() const;
+		virtual long int currentUsableSize() const;
+		virtual long int maximumUsableSize() const;
+		virtual std::vector<memcounter::SizeClassCounts> sizeHistogram() const;
+		virtual std::vector<memcounter::LifetimeBinCounts> lifetimeHistogram() const;
+		virtual std::vector<memcounter::CallSiteCounts> callSites() const;
+
+		/** @brief Adds up the shards of every thread. */
+		void totals( long int (&current)[memcounter::GlobalCounterShard::numberOfQuantities], long int (&maximum)[memcounter::GlobalCounterShard::numberOfQuantities] ) const;
+	protected:
+		GlobalMemoryCounter( size_t index );
+		virtual ~GlobalMemoryCounter();
+
+		size_t index_;
+		std::vector<IMemoryCounter*> subCounters_; ///< Always empty
+	}; // end of the GlobalMemoryCounter class
+
+} // end of the memcounter namespace
+
+#endif
@@ -0,0 +1,75 @@
+#ifndef memcounter_HeapProfile_h
+#define memcounter_HeapProfile_h
+
+#include <stddef.h> // needed for size_t
+#include <stdint.h>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "memcounter/ProtobufWriter.h"
+
+namespace memcounter
+{
+	/** @brief Collects samples of allocations by call stack and writes them as a pprof heap profile.
+	 *
+	 * The output is the profile.proto message that "go tool pprof" and the other pprof tools read, not
+	 * gzipped, which they accept as well. Each sample has the four values Go heap profiles have, in the same
+	 * order: the bytes and blocks still in use, and the bytes and blocks allocated since the counter was
+	 * reset. Samples are labelled with the counter and thread they came from, so "-tagfocus counter=..."
+	 * picks out one counter.
+	 *
+	 * Stacks are given as return addresses. Each becomes a location one byte earlier, so that it's in the
+	 * call instruction, with the function name from dladdr if there is one and the mapping it's in, so that
+	 * pprof can find the binary and symbolise it properly. Everything is kept in std containers, so memory
+	 * counting has to be disabled while using one.
+	 */
+	class HeapProfile
+	{
+	public:
+		enum SampleType
+		{
+			inuseSpace=0,
+			inuseObjects=1,
+			allocSpace=2,
+			allocObjects=3,
+			numberOfSampleTypes=4
+		};
+
+		HeapProfile();
+
+		/** @brief Adds a sample. The stack is innermost first and can be empty if call sites aren't being recorded. */
+		void addSample( const std::vector<void*>& stack, const long int (&values)[numberOfSampleTypes], const char* counterName, uint32_t threadIndex );
+		inline size_t numberOfSamples() const { return numberOfSamples_; }
+
+		/** @brief Encodes the profile and writes it out. Returns false if it couldn't all be written. Can only be called once. */
+		bool write( int fileDescriptor );
+	protected:
+		/** @brief Returns the index of the string in the string table, adding it if it isn't there. */
+		uint64_t stringIndex( const std::string& text );
+		uint64_t locationId( uintptr_t address );
+		void writeValueType( uint32_t field, const char* type, const char* unit );
+		/** @brief Adds a Mapping for each executable segment of the program and its libraries, which the locations refer to. */
+		void writeMappings();
+		void writeLocations();
+
+		memcounter::ProtobufWriter profile_; ///< The Profile message, apart from the samples
+		memcounter::ProtobufWriter samples_; ///< The Sample fields of the Profile message, which go in as they're added
+		size_t numberOfSamples_;
+
+		std::vector<std::string> strings_;
+		std::map<std::string,uint64_t> stringIndices_;
+		std::vector<uintptr_t> locations_; ///< The address of each location, indexed by its id minus one
+		std::map<uintptr_t,uint64_t> locationIds_;
+
+		struct AddressRange
+		{
+			uintptr_t start;
+			uintptr_t limit;
+		};
+		std::vector<AddressRange> mappings_; ///< Indexed by mapping id minus one, filled by writeMappings
+	}; // end of the HeapProfile class
+
+} // end of the memcounter namespace
+
+#endif
@@ -15,9 +15,11 @@ namespace memcounter
 	public:
 		virtual ~ICountingInterface() {}
 
-		virtual void add( size_t size ) = 0;
-		virtual void modify( size_t oldSize, size_t newSize ) = 0;
-		virtual void remove( size_t size ) = 0;
+		/// @param size        The number of bytes the program asked for
+		/// @param usableSize  The number of bytes the allocator actually set aside for the program
+		virtual void add( size_t size, size_t usableSize ) = 0;
+		virtual void modify( size_t oldSize, size_t oldUsableSize, size_t newSize, size_t newUsableSize ) = 0;
+		virtual void remove( size_t size, size_t usableSize ) = 0;
 	}; // end of the ICountingInterface class
 
 } // end of the memcounter namespace
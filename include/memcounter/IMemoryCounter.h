@@ -8,6 +8,36 @@
 
 namespace memcounter
 {
+	/** @brief The counts for one of the size classes returned by IMemoryCounter::sizeHistogram. */
+	struct SizeClassCounts
+	{
+		size_t lowestSize; ///< The smallest block size in this class
+		size_t highestSize; ///< The largest block size in this class
+		long int totalAllocations; ///< Blocks allocated since the counter was reset, including freed ones. A realloc counts as an allocation of the new size.
+		long int totalBytes;
+		long int currentAllocations; ///< Blocks still outstanding
+		long int currentBytes;
+	};
+
+	/** @brief The counts for one of the bins returned by IMemoryCounter::lifetimeHistogram. */
+	struct LifetimeBinCounts
+	{
+		double shortestNanoseconds; ///< The shortest lifetime that goes in this bin
+		double longestNanoseconds; ///< The lifetime where the next bin starts
+		long int allocations; ///< Number of blocks freed with a lifetime in this bin. A realloc counts as freeing the old block.
+		long int bytes;
+	};
+
+	/** @brief The counts for one of the call sites returned by IMemoryCounter::callSites. */
+	struct CallSiteCounts
+	{
+		std::vector<void*> stack; ///< Return addresses, innermost first. Use dladdr or addr2line to turn them into names.
+		long int currentBytes; ///< Bytes allocated from here that are still outstanding
+		long int maximumBytes; ///< The highest currentBytes has been
+		long int currentAllocations;
+		long int totalAllocations; ///< Including freed ones. A realloc counts as an allocation from where realloc was called.
+	};
+
 	/** @brief Interface to a class that keeps track of the size of memory blocks that get allocated.
 	 *
 	 * Modified 22/Feb/2013 to allow sub-counters.
@@ -32,12 +62,35 @@ namespace memcounter
 		virtual long int maximumSize() const = 0;
 
 		///< Returns the number of allocations still outstanding
-		virtual int currentNumberOfAllocations() const = 0;
+		virtual long int currentNumberOfAllocations() const = 0;
 
 		/// Returns the number of allocations when the memory was at a maximum (N.B. this is not necessarily the same as the maximum number of allocations)
-		virtual int maximumNumberOfAllocations() const = 0;
+		virtual long int maximumNumberOfAllocations() const = 0;
 
 		virtual const std::vector<IMemoryCounter*>& subCounters() const = 0;
+
+		/// @brief The size of the outstanding blocks as reported by the allocator, i.e. including any rounding up to the allocator's size classes.
+		///
+		/// Added at the end of the interface so that programs compiled against the older header still work.
+		virtual long int currentUsableSize() const = 0;
+		virtual long int maximumUsableSize() const = 0;
+
+		/// @brief Counts of allocations by requested size. There are four classes for each power of two, so none is more than 25% wide.
+		///
+		/// The classes run from size zero up to the largest class that has had anything allocated in it.
+		virtual std::vector<memcounter::SizeClassCounts> sizeHistogram() const = 0;
+
+		/// @brief How long blocks were allocated for before being freed, in bins that double in width each time.
+		///
+		/// Only filled if the MEMCOUNTER_LIFETIMES environment variable was set when the program started. The
+		/// bins run from the shortest to the longest one that has had anything in it.
+		virtual std::vector<memcounter::LifetimeBinCounts> lifetimeHistogram() const = 0;
+
+		/// @brief Allocations broken down by the stack they were made from, largest current bytes first.
+		///
+		/// Only filled if the MEMCOUNTER_CALLSITE_DEPTH environment variable was set when the program started.
+		/// Only call sites that have had something allocated since the counter was reset are included.
+		virtual std::vector<memcounter::CallSiteCounts> callSites() const = 0;
 	protected:
 		virtual ~IMemoryCounter() {}
 	}; // end of the MemoryCounter class
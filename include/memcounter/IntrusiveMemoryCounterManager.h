@@ -2,6 +2,8 @@
 #define memcounter_IntrusiveMemoryCounterManager_h
 
 #include <stddef.h> // needed for size_t
+#include <stdint.h>
+#include <iosfwd>
 
 
 // Forward declarations
@@ -9,6 +11,8 @@ namespace memcounter
 {
 	class IMemoryCounter;
 }
+struct MemcounterSnapshot;
+struct MemcounterNamedTotals;
 
 
 namespace memcounter
@@ -25,10 +29,60 @@ namespace memcounter
 		static IntrusiveMemoryCounterManager& instance();
 
 		virtual IMemoryCounter* createNewMemoryCounter() = 0;
+		/// Returns a counter that adds up every thread it's enabled in, see GlobalMemoryCounter. NULL if there are too many.
+		virtual IMemoryCounter* createNewGlobalMemoryCounter() = 0;
+		/** @brief Returns a new counter for the current thread that's enabled but paused, for the client API in ThreadCounter.h.
+		 *
+		 * slotBit is set to the bit for the counter in ClientThreadState::pausedSlots, or zero if the counter
+		 * couldn't be given a slot. If it got one, slotBit is set back to zero when the counter gives the slot
+		 * up, so it has to stay valid until the counter is disabled. Returns NULL if the thread has no counter pool.
+		 */
+		virtual IMemoryCounter* createNewPausedMemoryCounter( uint32_t& slotBit ) = 0;
 
-		virtual void addToAllEnabledCountersForCurrentThread( size_t size ) = 0;
-		virtual void modifyAllEnabledCountersForCurrentThread( size_t oldSize, size_t newSize ) = 0;
-		virtual void removeFromAllEnabledCountersForCurrentThread( size_t size ) = 0;
+		/** @brief Returns the id for a counter name, which is the same in every thread and can be cached. Zero if there are too many names. */
+		virtual uint32_t memoryCounterNameId( const char* name ) = 0;
+		/** @brief Returns the calling thread's counter for the name id, creating it the first time. NULL if the id isn't valid or the thread has no pool. */
+		virtual IMemoryCounter* namedMemoryCounter( uint32_t nameId ) = 0;
+		/** @brief Returns the name the calling thread's counter was created with by createNamedMemoryCounter, or NULL if it hasn't got one.
+		 *
+		 * Also NULL for global counters, sub-counters and other threads' counters. The name stays valid until the program exits.
+		 */
+		virtual const char* counterName( const IMemoryCounter* pCounter ) = 0;
+		/** @brief Fills in the totals for each name, see memcounterNamedTotals in CInterface.h. Returns the number of names. */
+		virtual size_t namedCounterTotals( MemcounterNamedTotals* pTotals, size_t maximumNumber, size_t totalsSize ) = 0;
+		/// Prints the totals for every named counter
+		virtual void dumpNamedCounters( std::ostream& stream ) = 0;
+
+		/** @brief Creates a counter and returns a handle to it for the C interface in CInterface.h, or zero if that isn't possible.
+		 *
+		 * If global is false the counter belongs to the calling thread, and so does the handle.
+		 */
+		virtual uint32_t createCounterHandle( bool global ) = 0;
+		/// Finds the counter for a handle if the calling thread can use it. Returns one of the MEMCOUNTER_ codes from CInterface.h.
+		virtual int counterForHandle( uint32_t handle, memcounter::IMemoryCounter*& pCounter, bool& isGlobal ) const = 0;
+		/// Copies out the counts for each handle, see memcounterSnapshots in CInterface.h. Returns how many handles were valid.
+		virtual int snapshotCounters( const uint32_t* handles, size_t numberOfHandles, MemcounterSnapshot* pSnapshots, size_t snapshotSize ) = 0;
+
+		virtual void addToAllEnabledCountersForCurrentThread( size_t size, size_t usableSize ) = 0;
+		virtual void modifyAllEnabledCountersForCurrentThread( size_t oldSize, size_t oldUsableSize, size_t newSize, size_t newUsableSize ) = 0;
+		virtual void removeFromAllEnabledCountersForCurrentThread( size_t size, size_t usableSize ) = 0;
+
+		/// Prints the load factor and probe length statistics for the block side table, if it's in use
+		virtual void dumpSideTableStatistics( std::ostream& stream ) const = 0;
+
+		/** @brief Records only one allocation in every averageBytes bytes allocated, and scales up the counters to match.
+		 *
+		 * Zero switches sampling off. The calling thread picks up the change with its next allocation, other
+		 * threads when they next pick a block, i.e. after about as many bytes as the old interval.
+		 * Returns false if sampling isn't possible with the size tracking method in use.
+		 */
+		virtual bool setSamplingInterval( size_t averageBytes ) = 0;
+
+		/** @brief Writes the calling thread's counters, or just pOnlyCounter if it isn't NULL, to the file descriptor as a pprof heap profile.
+		 *
+		 * Returns false if the thread has no counter pool or the profile couldn't all be written.
+		 */
+		virtual bool writeHeapProfile( const IMemoryCounter* pOnlyCounter, int fileDescriptor ) = 0;
 	protected:
 		IntrusiveMemoryCounterManager();
 		virtual ~IntrusiveMemoryCounterManager();
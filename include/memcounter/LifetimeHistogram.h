@@ -0,0 +1,60 @@
+#ifndef memcounter_LifetimeHistogram_h
+#define memcounter_LifetimeHistogram_h
+
+#include <stddef.h> // needed for size_t
+#include <stdint.h>
+
+namespace memcounter
+{
+	/** @brief Counts of freed blocks broken down by how long they were allocated for.
+	 *
+	 * Lifetimes are measured in processor cycles and binned by powers of two, so bin b holds
+	 * lifetimes from 2^b up to 2^(b+1) cycles. With 64 bins that covers everything from a few
+	 * nanoseconds up to the lifetime of the process.
+	 */
+	struct LifetimeHistogram
+	{
+		enum Quantity
+		{
+			allocations=0, ///< Number of blocks freed with a lifetime in the bin
+			bytes=1, ///< The total size of those blocks
+			numberOfQuantities=2
+		};
+
+		static const size_t numberOfBins=64;
+
+		/// Returns which bin a lifetime goes in. Lifetimes of zero and one cycle both go in the first bin.
+		static inline size_t bin( uint64_t cycles )
+		{
+			return 63-__builtin_clzll( cycles|1 );
+		}
+
+		inline void record( uint64_t cycles, size_t size, long int weight )
+		{
+			long int* pCounts=counts[bin(cycles)];
+			pCounts[allocations]+=weight;
+			pCounts[bytes]+=long(size)*weight;
+		}
+
+		inline void add( const LifetimeHistogram& other )
+		{
+			for( size_t index=0; index<numberOfBins; ++index )
+			{
+				for( int quantity=0; quantity<numberOfQuantities; ++quantity ) counts[index][quantity]+=other.counts[index][quantity];
+			}
+		}
+
+		inline void reset()
+		{
+			for( size_t index=0; index<numberOfBins; ++index )
+			{
+				for( int quantity=0; quantity<numberOfQuantities; ++quantity ) counts[index][quantity]=0;
+			}
+		}
+
+		long int counts[numberOfBins][numberOfQuantities];
+	};
+
+} // end of the memcounter namespace
+
+#endif
@@ -0,0 +1,49 @@
+#ifndef memcounter_LiveExport_h
+#define memcounter_LiveExport_h
+
+#include <stddef.h> // needed for size_t
+#include <stdint.h>
+
+#include "memcounter/LiveFormat.h"
+
+namespace memcounter
+{
+	/** @brief Publishes every thread's counters in a POSIX shared memory segment, for memcounterTop or anything else to watch.
+	 *
+	 * The format is in LiveFormat.h. Nothing is ever copied into the segment: each ThreadMemoryCounterPool
+	 * keeps the values of its enabled counters and its global counter shards in a LiveThreadBlock, which is
+	 * in the segment while exporting and part of the pool otherwise, and the resets of the global counters
+	 * and the shards of exited threads are kept in the segment's LiveGlobalBlock. So being watched costs a
+	 * process nothing more than the counting it does anyway. The only extra work is copying each counter
+	 * name into the segment the first time it's used.
+	 *
+	 * Everything is static, because there's only one segment per process. start() has to be called before
+	 * any pool or global counter is created. After a fork the child carries on with a private copy of the
+	 * segment, so it still counts but can't be watched.
+	 */
+	class LiveExport
+	{
+	public:
+		/** @brief Creates the segment. Prints why and returns false if that isn't possible. */
+		static bool start( size_t maximumNumberOfThreads );
+		/** @brief Removes the segment's name so that nothing else can attach. Whatever is attached keeps its mapping. */
+		static void stop();
+
+		/** @brief Returns the block for the pool with the given pool number in the segment, or NULL if there isn't one. */
+		static memcounter::LiveThreadBlock* threadBlock( uint32_t poolNumber );
+		/// The process wide part, which is in the segment while exporting
+		static inline memcounter::LiveGlobalBlock& globals() { return *pGlobals_; }
+		/** @brief Copies the name into the segment if it isn't already there. Never allocates. */
+		static void publishName( uint32_t nameId, const char* name );
+	protected:
+		/// Swaps the segment for a private copy in a forked child, so that it doesn't write over the parent's counters
+		static void afterForkInChild();
+
+		static memcounter::LiveGlobalBlock* pGlobals_;
+		static char* pSegment_; ///< NULL unless exporting
+		static size_t segmentSize_;
+	}; // end of the LiveExport class
+
+} // end of the memcounter namespace
+
+#endif
@@ -0,0 +1,87 @@
+#ifndef memcounter_LiveFormat_h
+#define memcounter_LiveFormat_h
+
+#include <stdint.h>
+
+#include "memcounter/CounterValues.h"
+#include "memcounter/GlobalCounterShard.h"
+#include "memcounter/GlobalMemoryCounter.h"
+
+namespace memcounter
+{
+	/** @brief The start of the shared memory segment that a process publishes its counters in, see LiveExport.
+	 *
+	 * The segment is called "/memcounter.<pid>" and is laid out as this header, maximumNumberOfNames
+	 * LiveNames, one LiveGlobalBlock, then maximumNumberOfThreads LiveThreadBlocks, each at the offset
+	 * given here. Only the header is fixed for every version, a reader should check the version and sizes
+	 * before using the rest. Everything is written in place by the threads doing the counting, so all a
+	 * reader sees is the same memory the counters are kept in.
+	 */
+	struct LiveFileHeader
+	{
+		char magic[8]; ///< "MCLIVE" and two nulls
+		uint32_t version;
+		int32_t processId;
+		uint64_t startTimeNanoseconds; ///< The wall clock time the library started, since the epoch
+		uint32_t headerSize; ///< sizeof(LiveFileHeader)
+		uint32_t nameSize; ///< sizeof(LiveName)
+		uint32_t globalBlockSize; ///< sizeof(LiveGlobalBlock)
+		uint32_t threadBlockSize; ///< sizeof(LiveThreadBlock)
+		uint64_t namesOffset;
+		uint64_t globalsOffset;
+		uint64_t threadsOffset;
+		uint32_t maximumNumberOfNames;
+		uint32_t maximumNumberOfThreads; ///< How many LiveThreadBlocks there are
+		uint32_t numberOfThreadBlocksUsed; ///< Blocks from here on have never been used
+		uint32_t unused[5]; ///< Pads the header to 96 bytes
+	};
+
+	/** @brief A name given to createNamedMemoryCounter. Entry n-1 is for name id n. */
+	struct LiveName
+	{
+		uint32_t length; ///< Zero until the text has been written. Longer names are cut short.
+		char text[60]; ///< Not null terminated if it fills the array
+	};
+
+	/** @brief What's needed to add up the global counters, apart from each thread's shards.
+	 *
+	 * The same as the library does for GlobalMemoryCounter, a reader adds up the shards of every thread
+	 * block that has a threadIndex and the retired shards, allowing for the generations, and tries again
+	 * if retirementSequence was odd or changed because a thread exited at the same time.
+	 */
+	struct LiveGlobalBlock
+	{
+		uint32_t retirementSequence;
+		uint32_t numberOfGlobalCounters; ///< How many GlobalMemoryCounters have been created, can go past the maximum for a moment
+		uint32_t unused[14]; ///< Pads to a cache line
+		memcounter::GlobalCounterGenerations generations[memcounter::GlobalMemoryCounter::maximumNumberOfCounters];
+		memcounter::GlobalCounterShard retiredShards[memcounter::GlobalMemoryCounter::maximumNumberOfCounters]; ///< The parts of threads that have exited
+	};
+
+	/** @brief The counters of one thread, which are what its ThreadMemoryCounterPool updates on every allocation.
+	 *
+	 * Only the counters enabled in the thread are here, in the slots given by enabledSlots. The slots and
+	 * values can be read consistently with sequence, which is odd while the thread is changing them.
+	 * Blocks are reused by new threads once their thread has exited, which is when threadIndex changes.
+	 */
+	struct LiveThreadBlock
+	{
+		static const uint32_t numberOfSlots=32;
+
+		uint32_t sequence;
+		uint32_t threadIndex; ///< ThreadMemoryCounterPool::index() of the thread using the block, zero if there isn't one
+		int32_t threadId; ///< What the kernel calls the thread, as shown by top -H
+		uint32_t enabledSlots; ///< Bit mask of the slots with a counter in them
+		uint32_t activeSlots; ///< enabledSlots without the paused counters
+		uint32_t unused[11]; ///< Pads to a cache line
+		uint32_t nameIds[numberOfSlots]; ///< The name id of the counter in each slot, zero if it hasn't got a name
+		memcounter::CounterValues values[numberOfSlots];
+		memcounter::GlobalCounterShard globalShards[memcounter::GlobalMemoryCounter::maximumNumberOfCounters];
+	};
+
+	static const char liveMagic[8]={ 'M', 'C', 'L', 'I', 'V', 'E', 0, 0 };
+	static const uint32_t liveVersion=1;
+
+} // end of the memcounter namespace
+
+#endif
@@ -2,6 +2,12 @@
 #define memcounter_MemoryCounterImplementation_h
 
 #include "memcounter/ICountingInterface.h"
+#include "memcounter/CounterValues.h"
+#include "memcounter/SizeHistogram.h"
+#include "memcounter/LifetimeHistogram.h"
+#include "memcounter/CallSiteTrie.h"
+#include "memcounter/GlobalMemoryCounter.h"
+#include "memcounter/HeapProfile.h"
 
 
 // Forward declarations
@@ -19,6 +25,7 @@ namespace memcounter
 	 */
 	class MemoryCounterImplementation : public memcounter::ICountingInterface
 	{
+		friend class memcounter::ThreadMemoryCounterPool; // So that the pool can move the values in and out of its dispatch array
 	public:
 		MemoryCounterImplementation( memcounter::ThreadMemoryCounterPool& parentPool );
 		MemoryCounterImplementation( memcounter::MemoryCounterImplementation* pParentCounter );
@@ -37,17 +44,37 @@ namespace memcounter
 		virtual void dumpContents( std::ostream& stream=std::cout, const std::string& prefix=std::string() ) const;
 		virtual long int currentSize() const;
 		virtual long int maximumSize() const;
-		virtual int currentNumberOfAllocations() const;
-		virtual int maximumNumberOfAllocations() const;
+		virtual long int currentNumberOfAllocations() const;
+		virtual long int maximumNumberOfAllocations() const;
 
 		virtual const std::vector<IMemoryCounter*>& subCounters() const;
+		virtual long int currentUsableSize() const;
+		virtual long int maximumUsableSize() const;
+		virtual std::vector<memcounter::SizeClassCounts> sizeHistogram() const;
+		virtual std::vector<memcounter::LifetimeBinCounts> lifetimeHistogram() const;
+		virtual std::vector<memcounter::CallSiteCounts> callSites() const;
 
 		//
 		// These methods are from the ICountingInterface interface
 		//
-		virtual void add( size_t size );
-		virtual void modify( size_t oldSize, size_t newSize );
-		virtual void remove( size_t size );
+		virtual void add( size_t size, size_t usableSize );
+		virtual void modify( size_t oldSize, size_t oldUsableSize, size_t newSize, size_t newUsableSize );
+		virtual void remove( size_t size, size_t usableSize );
+
+		/// The counter's slot in the pool's dispatch array, or -1 if it doesn't have one
+		inline int enabledSlot() const { return enabledSlot_; }
+		/// Where the client API in ThreadCounter.h keeps the counter's slot bit, which the pool sets to zero if the
+		/// counter gives up its slot, e.g. because it was disabled directly. Only one is kept, and it's forgotten then.
+		inline void setClientSlotBit( uint32_t* pSlotBit ) { pClientSlotBit_=pSlotBit; }
+
+		/** @brief Adds the current and maximum values of every quantity to the totals, including sub-counters and spawned threads.
+		 *
+		 * Gives the same numbers as currentSize(), maximumSize() and so on, but only catches up with the
+		 * pool's pending changes once.
+		 */
+		void addTotals( long int (&current)[memcounter::CounterValues::numberOfQuantities], long int (&maximum)[memcounter::CounterValues::numberOfQuantities] ) const;
+		/** @brief Adds a sample for each call site to the profile, or one sample for the whole counter if call sites aren't being recorded. Counting must be disabled. */
+		void addToProfile( memcounter::HeapProfile& profile, const char* counterName, uint32_t threadIndex ) const;
 
 	private:
 		//
@@ -57,12 +84,33 @@ namespace memcounter
 		void childEnabled( memcounter::MemoryCounterImplementation* pEnabledSubCounter );
 		void childDisabled( memcounter::MemoryCounterImplementation* pDisabledSubCounter );
 		void rawSetEnabled( bool enable ); ///< Allows a parent to set the status of a sub-counter without causing a notification
+
+		/// Returns wherever the values are currently kept, i.e. the pool's dispatch array if enabled or values_ if not
+		inline memcounter::CounterValues& values();
+		inline const memcounter::CounterValues& values() const;
+		/// Returns the size histogram after making sure any changes pending in the pool have been added
+		inline memcounter::SizeHistogram& histogram();
+		inline const memcounter::SizeHistogram& histogram() const;
+		/// Returns the lifetime histogram after making sure any changes pending in the pool have been added
+		inline memcounter::LifetimeHistogram& lifetimes();
+		inline const memcounter::LifetimeHistogram& lifetimes() const;
+		/// Adds the counts for each call site, including the sub-counters', to sites. Counting must be disabled.
+		void addCallSites( std::vector<memcounter::CallSiteStatistics>& sites ) const;
+		/// Returns the pool at the top of the tree of counters, whose call site trie the indices in callSites_ refer to
+		const memcounter::ThreadMemoryCounterPool& pool() const;
+		/// Returns the global counter that threads spawned while this counter is enabled count into, creating it if
+		/// needed. NULL if there are no global counters left. Counting must be disabled.
+		memcounter::GlobalMemoryCounter* inheritedCounter();
 	protected:
 		bool enabled_;
-		long int currentSize_;
-		long int maximumSize_;
-		int currentNumberOfAllocations_;
-		int maximumNumberOfAllocations_;
+		memcounter::CounterValues values_; ///< Only up to date while the counter doesn't have a slot in the pool
+		int enabledSlot_; ///< Index into the parent pool's dispatch array, or -1 if the counter isn't in it
+		uint32_t nameId_; ///< The CounterNameTable id if the counter was made by ThreadMemoryCounterPool::namedCounter, otherwise zero
+		uint32_t* pClientSlotBit_; ///< See setClientSlotBit, NULL if there isn't one
+		memcounter::SizeHistogram histogram_;
+		memcounter::LifetimeHistogram lifetimes_;
+		std::vector<memcounter::CallSiteStatistics> callSites_; ///< Indexed by call site trie node. Only as long as the highest node seen.
+		memcounter::GlobalMemoryCounter* pInheritedCounter_; ///< Totals for threads spawned while enabled, NULL until there have been any
 		bool verbose_;
 		std::vector<IMemoryCounter*> subCounters_;
 		memcounter::MemoryCounterImplementation* pCurrentlyActiveSubCounter_;
@@ -0,0 +1,96 @@
+#ifndef memcounter_NamedCounter_h
+#define memcounter_NamedCounter_h
+
+#include <dlfcn.h>
+#include <stddef.h> // needed for NULL
+#include <stdint.h>
+
+#include "memcounter/IMemoryCounter.h"
+
+namespace memcounter
+{
+	/** @brief Finds the calling thread's counter for a name, so that the same counter can be used from anywhere without passing it around.
+	 *
+	 * Meant to be a static, e.g. one in each translation unit that instruments a subsystem:
+	 * @code
+	 *     static memcounter::NamedCounter physicsCounter( "physics" );
+	 *     ...
+	 *     if( memcounter::IMemoryCounter* pCounter=physicsCounter.counter() ) pCounter->enable();
+	 * @endcode
+	 * Every NamedCounter with the same name gives the same counter within a thread, and a different one
+	 * in each thread. The name is looked up the first time counter() is called and the id kept, and each
+	 * thread caches the counters it gets for the ids, so after that it's a thread local load and a compare.
+	 * Everything returns NULL if the program wasn't started with intrusiveMemoryAnalyser. Header only, so
+	 * all a program needs to do is include it and link with -ldl.
+	 */
+	class NamedCounter
+	{
+	public:
+		typedef uint32_t (*NameIdFunction)( const char* );
+		typedef memcounter::IMemoryCounter* (*CounterFunction)( uint32_t );
+
+		/// The name isn't copied, so it has to last as long as this object. A string literal is best.
+		explicit NamedCounter( const char* name ) : name_(name), nameId_(0) {}
+
+		/// The calling thread's counter for the name, or NULL if the library isn't loaded or the thread has no counter pool
+		inline memcounter::IMemoryCounter* counter()
+		{
+			// A thread's counter for a name never changes while the thread is running, so it can be cached
+			// per thread. The cache is small and indexed by id, so names that clash just go to the library.
+			uint32_t nameId=__atomic_load_n( &nameId_, __ATOMIC_RELAXED );
+			CacheEntry& entry=threadCache()[nameId & (cacheSize-1)];
+			if( nameId!=0 && entry.nameId==nameId ) return entry.pCounter;
+
+			CounterFunction counterForId=counterFunction();
+			if( counterForId==NULL ) return NULL;
+
+			// Several threads might look the name up at once, but they all get the same id
+			if( nameId==0 )
+			{
+				nameId=nameIdFunction()( name_ );
+				__atomic_store_n( &nameId_, nameId, __ATOMIC_RELAXED );
+			}
+			memcounter::IMemoryCounter* pCounter=counterForId( nameId );
+			if( pCounter )
+			{
+				CacheEntry& newEntry=threadCache()[nameId & (cacheSize-1)];
+				newEntry.nameId=nameId;
+				newEntry.pCounter=pCounter;
+			}
+			return pCounter;
+		}
+
+		inline const char* name() const { return name_; }
+
+		/// The library's functions, or NULL if the library isn't loaded. Only looked up once.
+		static NameIdFunction nameIdFunction()
+		{
+			static NameIdFunction function=__extension__ reinterpret_cast<NameIdFunction>( dlsym( 0, "memoryCounterNameId" ) );
+			return function;
+		}
+		static CounterFunction counterFunction()
+		{
+			static CounterFunction function=( nameIdFunction() ? __extension__ reinterpret_cast<CounterFunction>( dlsym( 0, "namedMemoryCounterForId" ) ) : NULL );
+			return function;
+		}
+	private:
+		struct CacheEntry
+		{
+			uint32_t nameId; ///< Zero if the entry is empty
+			memcounter::IMemoryCounter* pCounter;
+		};
+		static const size_t cacheSize=16; ///< Must be a power of two
+
+		static inline CacheEntry* threadCache()
+		{
+			static __thread CacheEntry cache[cacheSize];
+			return cache;
+		}
+
+		const char* name_;
+		uint32_t nameId_;
+	}; // end of the NamedCounter class
+
+} // end of the memcounter namespace
+
+#endif
@@ -0,0 +1,43 @@
+#ifndef memcounter_ProtobufWriter_h
+#define memcounter_ProtobufWriter_h
+
+#include <stddef.h> // needed for size_t
+#include <stdint.h>
+#include <vector>
+
+namespace memcounter
+{
+	/** @brief Encodes a protocol buffers message into memory, with just the parts that HeapProfile needs.
+	 *
+	 * Fields are appended in whatever order they're written, which the format allows. Only the varint and
+	 * length delimited wire types are supported. A nested message is built in a ProtobufWriter of its own
+	 * and then added with writeMessage, since its length has to go in front of it. The buffer is a
+	 * std::vector, so memory counting has to be disabled while using one.
+	 */
+	class ProtobufWriter
+	{
+	public:
+		/** @brief Any of the integer types, bool and enums. Negative numbers take ten bytes, the same as int64 in the format. */
+		void writeVarint( uint32_t field, uint64_t value );
+		inline void writeInt64( uint32_t field, int64_t value ) { writeVarint( field, static_cast<uint64_t>(value) ); }
+		/** @brief Bytes or string fields. */
+		void writeBytes( uint32_t field, const void* pData, size_t size );
+		void writeString( uint32_t field, const char* text );
+		void writeMessage( uint32_t field, const memcounter::ProtobufWriter& message );
+		/** @brief A repeated integer field, packed into one length delimited field as proto3 does by default. Nothing is written if it's empty. */
+		void writePackedVarints( uint32_t field, const std::vector<uint64_t>& values );
+
+		inline void clear() { buffer_.clear(); }
+		inline size_t size() const { return buffer_.size(); }
+		inline const unsigned char* data() const { return buffer_.empty() ? NULL : &buffer_[0]; }
+	protected:
+		enum WireType { varint=0, lengthDelimited=2 };
+		inline void appendTag( uint32_t field, WireType wireType ) { appendVarint( ( uint64_t(field)<<3 ) | wireType ); }
+		void appendVarint( uint64_t value );
+
+		std::vector<unsigned char> buffer_;
+	}; // end of the ProtobufWriter class
+
+} // end of the memcounter namespace
+
+#endif
@@ -0,0 +1,80 @@
+#ifndef memcounter_RemoteFreeQueue_h
+#define memcounter_RemoteFreeQueue_h
+
+#include <stddef.h> // needed for size_t
+#include <stdint.h>
+
+namespace memcounter
+{
+	/** @brief Lock free queue of blocks freed by other threads, for the pool of the thread that allocated them.
+	 *
+	 * Any number of threads can push but only the owning thread pops. It's a bounded ring in the style
+	 * of Dmitry Vyukov's queue: each cell has a sequence number that says whether it's ready to be
+	 * written or read, producers claim a cell with a compare and swap on the enqueue position, and the
+	 * consumer only ever touches its own position and the cells. Nothing blocks and nothing allocates,
+	 * so it's safe to push from inside the free hook.
+	 *
+	 * The cells are mmapped in the same way as the side table. Each cell keeps its sequence number
+	 * less its own index, so the zeroed pages from mmap are already the starting state and nothing
+	 * has to be written to set the queue up. Pages are only committed once the queue has been that
+	 * full. If the queue fills up because the owning thread hasn't allocated or read a counter for a
+	 * long time, the totals are added to an overflow entry with atomic adds instead. Those still come
+	 * off the counters, but not off the size histogram or call site.
+	 */
+	class RemoteFreeQueue
+	{
+	public:
+		/** @brief What the owning pool needs to take a freed block off its counters. */
+		struct Entry
+		{
+			size_t size;
+			size_t usableSize;
+			uint32_t weight;
+			uint32_t callSite;
+			uint64_t lifetime; ///< In cycles, or noLifetime if lifetimes aren't being recorded
+		};
+		static const uint64_t noLifetime=~uint64_t(0);
+
+		RemoteFreeQueue();
+		/** @brief Maps the memory for the cells. Returns false on failure, in which case every push overflows. */
+		bool initialise( size_t capacity );
+
+		/// Can be called from any thread
+		void push( const Entry& entry );
+
+		/// Only the owning thread can call these
+		inline bool mightHaveEntries() const
+		{
+			return __atomic_load_n( &enqueuePosition_, __ATOMIC_RELAXED )!=dequeuePosition_
+					|| __atomic_load_n( &overflow_.numberOfEntries, __ATOMIC_RELAXED )!=0;
+		}
+		bool pop( Entry& entry );
+		/** @brief Takes the totals of everything that overflowed since the last call. Returns false if nothing did. */
+		bool popOverflow( long int& bytes, long int& usableBytes, long int& allocations );
+	protected:
+		struct Cell
+		{
+			size_t sequenceOffset; ///< The sequence number minus the cell's index, so zero for a cell that's never been used
+			Entry entry;
+		};
+
+		Cell* pCells_;
+		size_t mask_;
+		char padding1_[64-sizeof(Cell*)-sizeof(size_t)];
+		size_t enqueuePosition_; ///< Written by the producers, so it's kept on its own cache line
+		char padding2_[64-sizeof(size_t)];
+		size_t dequeuePosition_; ///< Only ever touched by the owning thread
+		char padding3_[64-sizeof(size_t)];
+
+		struct Overflow
+		{
+			size_t numberOfEntries;
+			long int bytes;
+			long int usableBytes;
+			long int allocations;
+		} overflow_;
+	}; // end of the RemoteFreeQueue class
+
+} // end of the memcounter namespace
+
+#endif
@@ -0,0 +1,40 @@
+#ifndef memcounter_ReportWriter_h
+#define memcounter_ReportWriter_h
+
+#include <stddef.h> // needed for size_t
+
+namespace memcounter
+{
+	/** @brief Formats text into a fixed buffer and writes it out with write(2), so that it can be used from a signal handler.
+	 *
+	 * Nothing here allocates, locks or uses stdio or iostreams, which aren't safe if the signal interrupted
+	 * them. The buffer is written out whenever it fills up and by flush(). Only one thread can use an
+	 * instance at a time. The buffer makes an instance about 4 KB, which the exporters put on the calling
+	 * thread's stack; the signal handlers and the snapshot thread keep theirs as statics or members instead.
+	 */
+	class ReportWriter
+	{
+	public:
+		ReportWriter();
+
+		/** @brief Starts writing to the file descriptor. Anything still in the buffer from before is thrown away. */
+		void start( int fileDescriptor );
+		/** @brief Writes out whatever is in the buffer. Errors are ignored, there's nowhere to report them. */
+		void flush();
+
+		memcounter::ReportWriter& operator<<( const char* text );
+		memcounter::ReportWriter& operator<<( char character );
+		memcounter::ReportWriter& operator<<( long int number );
+		memcounter::ReportWriter& operator<<( unsigned long int number );
+		inline memcounter::ReportWriter& operator<<( int number ) { return *this << static_cast<long int>(number); }
+		inline memcounter::ReportWriter& operator<<( unsigned int number ) { return *this << static_cast<unsigned long int>(number); }
+	protected:
+		static const size_t bufferSize=4096;
+		char buffer_[bufferSize];
+		size_t used_;
+		int fileDescriptor_;
+	}; // end of the ReportWriter class
+
+} // end of the memcounter namespace
+
+#endif
@@ -0,0 +1,93 @@
+#ifndef memcounter_SizeHistogram_h
+#define memcounter_SizeHistogram_h
+
+#include <stddef.h> // needed for size_t
+
+namespace memcounter
+{
+	/** @brief Counts of allocations and bytes broken down by the size of the block.
+	 *
+	 * Sizes are split into classes on a log2 scale, and each power of two is split again into
+	 * 2^subClassBits linear sub-classes so that no class is more than 25% wide. Sizes below
+	 * 2^(subClassBits+1) get a class each. Working out the class is a count-leading-zeros and a
+	 * couple of shifts with no branches, and each class keeps all of its counts together so that
+	 * recording a block only touches one small row.
+	 */
+	struct SizeHistogram
+	{
+		enum Quantity
+		{
+			allocations=0, ///< Blocks allocated since the last reset, whether or not they've been freed
+			bytes=1, ///< The total size of those blocks
+			liveAllocations=2, ///< Blocks still outstanding
+			liveBytes=3, ///< The total size of those blocks
+			numberOfQuantities=4
+		};
+
+		static const unsigned subClassBits=2;
+		static const size_t numberOfClasses=( sizeof(size_t)*8-subClassBits+1 )<<subClassBits;
+
+		/// Returns which class a block of the given size goes in
+		static inline size_t sizeClass( size_t size )
+		{
+			const size_t subClasses=size_t(1)<<subClassBits;
+			// The OR makes sure the argument to clz isn't zero, which is undefined, and puts all the
+			// small sizes in the first set of classes where the shift is zero.
+			unsigned log2Size=sizeof(size_t)*8-1-__builtin_clzl( size | subClasses );
+			unsigned shift=log2Size-subClassBits;
+			return ( size_t(shift)<<subClassBits )+( size>>shift );
+		}
+
+		/// Returns the smallest size that goes in the given class
+		static inline size_t lowestSize( size_t sizeClass )
+		{
+			const size_t subClasses=size_t(1)<<subClassBits;
+			if( sizeClass<2*subClasses ) return sizeClass;
+			return ( (sizeClass & (subClasses-1)) | subClasses )<<( (sizeClass>>subClassBits)-1 );
+		}
+
+		/// Returns the largest size that goes in the given class
+		static inline size_t highestSize( size_t sizeClass )
+		{
+			return sizeClass+1<numberOfClasses ? lowestSize( sizeClass+1 )-1 : ~size_t(0);
+		}
+
+		inline void recordAllocation( size_t sizeClass, size_t size, long int weight )
+		{
+			long int* pCounts=counts[sizeClass];
+			pCounts[allocations]+=weight;
+			pCounts[bytes]+=long(size)*weight;
+			pCounts[liveAllocations]+=weight;
+			pCounts[liveBytes]+=long(size)*weight;
+		}
+
+		inline void recordFree( size_t sizeClass, size_t size, long int weight )
+		{
+			long int* pCounts=counts[sizeClass];
+			pCounts[liveAllocations]-=weight;
+			pCounts[liveBytes]-=long(size)*weight;
+		}
+
+		/// Adds the counts for the classes from firstClass to lastClass inclusive from the other histogram
+		inline void add( const SizeHistogram& other, size_t firstClass, size_t lastClass )
+		{
+			for( size_t sizeClass=firstClass; sizeClass<=lastClass; ++sizeClass )
+			{
+				for( int index=0; index<numberOfQuantities; ++index ) counts[sizeClass][index]+=other.counts[sizeClass][index];
+			}
+		}
+
+		inline void reset( size_t firstClass=0, size_t lastClass=numberOfClasses-1 )
+		{
+			for( size_t sizeClass=firstClass; sizeClass<=lastClass; ++sizeClass )
+			{
+				for( int index=0; index<numberOfQuantities; ++index ) counts[sizeClass][index]=0;
+			}
+		}
+
+		long int counts[numberOfClasses][numberOfQuantities];
+	};
+
+} // end of the memcounter namespace
+
+#endif
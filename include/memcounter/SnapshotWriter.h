@@ -0,0 +1,48 @@
+#ifndef memcounter_SnapshotWriter_h
+#define memcounter_SnapshotWriter_h
+
+#include <stddef.h> // needed for size_t
+#include <stdint.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+#include "memcounter/ReportWriter.h"
+
+namespace memcounter
+{
+	/** @brief Writes a snapshot of every counter to a file whenever the process gets a signal.
+	 *
+	 * The signal handler only posts a semaphore, which is async signal safe, so it doesn't matter what the
+	 * signal interrupted. A thread of its own waits on the semaphore and writes the snapshot with
+	 * ThreadMemoryCounterPool::writeReport, which reads the other threads' counters without locking or
+	 * making them wait. Signals that arrive while a snapshot is being written are merged into one more.
+	 *
+	 * Like the telemetry thread, the thread has to be started before the hooks are installed.
+	 */
+	class SnapshotWriter
+	{
+	public:
+		SnapshotWriter();
+
+		/** @brief Starts the thread and installs the signal handler. Prints why and returns false if that isn't possible.
+		 *
+		 * Each snapshot is appended to a file called filePrefix followed by a dot and the process id. The
+		 * handler isn't installed if the program already does something with the signal.
+		 */
+		bool start( const char* filePrefix, int signalNumber );
+	protected:
+		static void* threadFunction( void* pWriter );
+		static void signalHandler( int signalNumber );
+		void writeSnapshot();
+
+		static memcounter::SnapshotWriter* pRunningWriter_; ///< For the signal handler to find the semaphore
+		sem_t requests_;
+		char filePrefix_[4096];
+		uint64_t numberOfSnapshots_;
+		memcounter::ReportWriter writer_;
+		pthread_t thread_;
+	}; // end of the SnapshotWriter class
+
+} // end of the memcounter namespace
+
+#endif
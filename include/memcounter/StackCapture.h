@@ -0,0 +1,29 @@
+#ifndef memcounter_StackCapture_h
+#define memcounter_StackCapture_h
+
+#include <stddef.h> // needed for size_t
+
+namespace memcounter
+{
+	/** @brief Returns the highest address of the current thread's stack, or NULL if it can't be found.
+	 *
+	 * Can call malloc, so memory counting has to be disabled when calling it. Call it once per
+	 * thread and pass the result to captureStack.
+	 */
+	const void* currentThreadStackTop();
+
+	/** @brief Fills pFrames with the return addresses on the current stack, innermost first, leaving out the frames in this library.
+	 *
+	 * Walks the chain of frame pointers, which is just a load per frame. Each step is checked to be going
+	 * up the stack and staying below pStackTop, so if the program was built without frame pointers the
+	 * walk stops early rather than crashing. If it didn't get past this library's own frames, or
+	 * useFramePointers is false, _Unwind_Backtrace is used instead, which reads the unwind tables and is
+	 * much slower but doesn't need frame pointers.
+	 *
+	 * @return The number of addresses put in pFrames, which is at most maximumDepth.
+	 */
+	size_t captureStack( void** pFrames, size_t maximumDepth, const void* pStackTop, bool useFramePointers );
+
+} // end of the memcounter namespace
+
+#endif
@@ -0,0 +1,63 @@
+#ifndef memcounter_TelemetryFormat_h
+#define memcounter_TelemetryFormat_h
+
+#include <stdint.h>
+
+#include "memcounter/LiveFormat.h"
+
+namespace memcounter
+{
+	/** @brief The start of a telemetry file, which is followed by the counter names and then capacity TelemetryRecords used as a ring buffer.
+	 *
+	 * The file is memory mapped by the writer, so it can be read while the program is still running.
+	 * The names are maximumNumberOfNames LiveNames straight after the header, entry n-1 for name id n,
+	 * each written the first time a sample has a counter with that name. Record number n (counting from
+	 * zero) is at recordsOffset plus n%capacity records, and only the last capacity records written are
+	 * still in the file. numberOfRecordsWritten is updated after each record is complete.
+	 */
+	struct TelemetryFileHeader
+	{
+		char magic[8]; ///< "MCTELEM" and a null
+		uint32_t version;
+		uint32_t recordSize; ///< sizeof(TelemetryRecord) when the file was written
+		uint64_t capacity;
+		uint64_t numberOfRecordsWritten;
+		uint64_t intervalNanoseconds;
+		uint64_t startTimeNanoseconds; ///< The wall clock time the first sample was taken, since the epoch
+		uint32_t nameSize; ///< sizeof(LiveName)
+		uint32_t maximumNumberOfNames;
+		uint64_t recordsOffset;
+	};
+
+	/** @brief The values of one counter at one time. */
+	struct TelemetryRecord
+	{
+		/// What's been counted
+		enum Kind
+		{
+			globalCounter=0, ///< A GlobalMemoryCounter, counter is its index()
+			threadCounter=1, ///< A counter enabled in a running thread, counter is its slot in the thread
+			namedTotal=2 ///< The totals for a name over every thread, including exited ones, counter is the name id
+		};
+
+		uint32_t counter; ///< Which counter of its kind it is
+		/// The low 32 bits of the record number plus one, written last. A reader that finds something else
+		/// has caught the writer part way through this record, or is looking at one that's been overwritten.
+		uint32_t sequence;
+		uint64_t nanoseconds; ///< Since startTimeNanoseconds
+		uint32_t kind; ///< One of the Kind values
+		uint32_t thread; ///< For a thread counter the thread's index, for named totals how many threads they're for, otherwise zero
+		uint32_t nameId; ///< The name id of a thread counter or named total, zero if it hasn't got a name
+		uint32_t unused; ///< Pads the record to 64 bytes
+		int64_t currentSize;
+		int64_t maximumSize;
+		int64_t currentNumberOfAllocations;
+		int64_t maximumNumberOfAllocations;
+	};
+
+	static const char telemetryMagic[8]={ 'M', 'C', 'T', 'E', 'L', 'E', 'M', 0 };
+	static const uint32_t telemetryVersion=2;
+
+} // end of the memcounter namespace
+
+#endif
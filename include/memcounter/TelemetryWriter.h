@@ -0,0 +1,67 @@
+#ifndef memcounter_TelemetryWriter_h
+#define memcounter_TelemetryWriter_h
+
+#include <stddef.h> // needed for size_t
+#include <stdint.h>
+#include <pthread.h>
+
+#include "memcounter/TelemetryFormat.h"
+
+// Forward declarations
+namespace memcounter
+{
+	class CounterNameTable;
+}
+
+
+namespace memcounter
+{
+	/** @brief A thread that records the counters at a fixed interval into a memory mapped ring buffer file.
+	 *
+	 * Each sample has a record for every global counter, every counter enabled in a running thread, and the
+	 * totals for every counter name. The format is in TelemetryFormat.h. Everything that can allocate or fail
+	 * is done in start(), so taking a sample is just reading the counters and writing fixed size records into
+	 * the mapping. The file never grows, so the overhead is the same however long the program runs. Other
+	 * threads' counters are read the same way as ThreadMemoryCounterPool::readCounterValues, so changes they've
+	 * batched up aren't included, and the named totals wait for any thread that's part way through exiting.
+	 *
+	 * The thread must be started before the hooks are installed, so that it's created without a counter pool
+	 * and nothing it does is ever counted.
+	 */
+	class TelemetryWriter
+	{
+	public:
+		TelemetryWriter();
+		~TelemetryWriter();
+
+		/** @brief Creates the file and starts the thread. Prints why and returns false if that isn't possible.
+		 *
+		 * The totals for the names in counterNames are recorded too, so it has to stay valid until stop() is called.
+		 */
+		bool start( const char* filename, uint64_t intervalNanoseconds, size_t capacity, const memcounter::CounterNameTable& counterNames );
+		/** @brief Takes a last sample and stops the thread taking any more. Doesn't wait for the thread to finish sleeping. */
+		void stop();
+	protected:
+		static void* threadFunction( void* pWriter );
+		/// Writes a record for each counter. The sample lock must be held.
+		void sample();
+		/// Copies everything but the sequence into the record with the given number. The sample lock must be held.
+		void writeRecord( uint64_t recordNumber, const memcounter::TelemetryRecord& values );
+		/// Puts the name into the file the first time it's needed. The sample lock must be held.
+		void writeName( uint32_t nameId );
+
+		memcounter::TelemetryFileHeader* pHeader_;
+		memcounter::LiveName* pNames_;
+		memcounter::TelemetryRecord* pRecords_;
+		const memcounter::CounterNameTable* pCounterNames_;
+		uint64_t intervalNanoseconds_;
+		uint64_t startTime_; ///< CLOCK_MONOTONIC when the first sample was taken
+		bool running_;
+		bool stopping_;
+		bool sampleLock_; ///< Stops stop() writing at the same time as the thread
+		pthread_t thread_;
+	}; // end of the TelemetryWriter class
+
+} // end of the memcounter namespace
+
+#endif
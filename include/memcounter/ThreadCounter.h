@@ -0,0 +1,119 @@
+#ifndef memcounter_ThreadCounter_h
+#define memcounter_ThreadCounter_h
+
+#include <dlfcn.h>
+#include <stddef.h> // needed for NULL
+#include <stdint.h>
+
+#include "memcounter/IMemoryCounter.h"
+#include "memcounter/ClientThreadState.h"
+
+namespace memcounter
+{
+	/** @brief A counter for the current thread that can be switched on and off with a couple of inline instructions.
+	 *
+	 * This is header only, so all a program needs to do is include it. The library is looked up with dlsym
+	 * the first time a ThreadCounter is created. If the program wasn't started with intrusiveMemoryAnalyser
+	 * everything still works but does nothing, and counter() returns NULL.
+	 *
+	 * The counter is enabled in the library when it's created, which gives it a slot in the thread's pool,
+	 * and then paused. enable() and disable() just clear or set the slot's bit in the thread's
+	 * ClientThreadState, without any calls into the library. The library catches up the next time the
+	 * thread allocates or frees anything.
+	 *
+	 * A ThreadCounter must only be used by the thread that created it, because the counter belongs to
+	 * that thread. Use counter() for the counts and everything else in the IMemoryCounter interface.
+	 * Enabling and disabling should be done through the ThreadCounter though. If the counter is disabled
+	 * directly it gives up its slot, and the library clears slotBit_ so that the ThreadCounter doesn't
+	 * pause and unpause whichever counter gets the slot next. After that isEnabled() is false and
+	 * enable() does nothing, and the IMemoryCounter carries on as an ordinary counter.
+	 * A thread can have at most 32 counters enabled, including these; past that enable() does nothing.
+	 * @code
+	 *     void fineGrainedFunction()
+	 *     {
+	 *         static __thread memcounter::ThreadCounter* pCounter=NULL;
+	 *         if( pCounter==NULL ) pCounter=new memcounter::ThreadCounter;
+	 *         memcounter::ScopedCounter scope( *pCounter );
+	 *         // ...
+	 *     }
+	 * @endcode
+	 */
+	class ThreadCounter
+	{
+	public:
+		typedef memcounter::IMemoryCounter* (*CreateFunction)( memcounter::ClientThreadState**, uint32_t* );
+
+		ThreadCounter() : pCounter_(NULL), pState_(&unloadedState_), slotBit_(0)
+		{
+			unloadedState_.countingEnabled=false;
+			unloadedState_.pausedSlots=0;
+			// If the library can't give the counter a slot it leaves pState_ and slotBit_ alone, so
+			// enable and disable write to unloadedState_ instead.
+			if( CreateFunction create=createFunction() ) pCounter_=create( &pState_, &slotBit_ );
+		}
+
+		/// Disables the counter in the library, which frees its slot. The IMemoryCounter stays valid until the thread exits.
+		~ThreadCounter()
+		{
+			if( pCounter_ ) pCounter_->disable();
+		}
+
+		inline void enable()
+		{
+			pState_->pausedSlots&=~slotBit_;
+			pState_->countingEnabled|=( slotBit_!=0 );
+		}
+
+		inline void disable()
+		{
+			pState_->pausedSlots|=slotBit_;
+		}
+
+		inline bool isEnabled() const
+		{
+			return slotBit_!=0 && ( pState_->pausedSlots & slotBit_ )==0;
+		}
+
+		/// The counter in the library, or NULL if the library isn't loaded
+		inline memcounter::IMemoryCounter* counter() const { return pCounter_; }
+
+		/// The library's entry point for these counters, or NULL if the library isn't loaded. Only looked up once.
+		static CreateFunction createFunction()
+		{
+			static CreateFunction function=__extension__ reinterpret_cast<CreateFunction>( dlsym( 0, "createNewClientMemoryCounter" ) );
+			return function;
+		}
+	private:
+		ThreadCounter( const ThreadCounter& ); // No copying, since only one object should pause and unpause the slot
+		ThreadCounter& operator=( const ThreadCounter& );
+
+		memcounter::IMemoryCounter* pCounter_;
+		memcounter::ClientThreadState* pState_;
+		uint32_t slotBit_; ///< The library sets this back to zero if the counter loses its slot
+		memcounter::ClientThreadState unloadedState_; ///< Written to instead of the library's when there's no slot, so that enable and disable don't need to check
+	}; // end of the ThreadCounter class
+
+	/** @brief Enables a ThreadCounter for the lifetime of the object. The counter is left enabled afterwards if it already was. */
+	class ScopedCounter
+	{
+	public:
+		explicit ScopedCounter( memcounter::ThreadCounter& counter ) : counter_(counter), wasEnabled_(counter.isEnabled())
+		{
+			counter_.enable();
+		}
+
+		~ScopedCounter()
+		{
+			if( !wasEnabled_ ) counter_.disable();
+		}
+	private:
+		ScopedCounter( const ScopedCounter& );
+		ScopedCounter& operator=( const ScopedCounter& );
+
+		memcounter::ThreadCounter& counter_;
+		bool wasEnabled_;
+	}; // end of the ScopedCounter class
+
+} // end of the memcounter namespace
+
+#endif
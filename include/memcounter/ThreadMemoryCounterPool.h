@@ -3,17 +3,38 @@
 
 #include <cstring> // in case size_t isn't declared automatically
 #include <vector>
-#include <list>
+
+#include "memcounter/CounterValues.h"
+#include "memcounter/SizeHistogram.h"
+#include "memcounter/LifetimeHistogram.h"
+#include "memcounter/CallSiteTrie.h"
+#include "memcounter/RemoteFreeQueue.h"
+#include "memcounter/GlobalMemoryCounter.h"
+#include "memcounter/DisablingFunctions.h"
+#include "memcounter/TraceWriter.h"
+#include "memcounter/ReportWriter.h"
+#include "memcounter/LiveFormat.h"
+#include "memcounter/HeapProfile.h"
 
 // Forward declarations
 namespace memcounter
 {
 	class IMemoryCounter;
 	class ICountingInterface;
+	class MemoryCounterImplementation;
+	class CounterNameTable;
 }
 
 namespace memcounter
 {
+	/** @brief What's left of the pools of threads that have exited. */
+	struct RetiredPoolSummary
+	{
+		size_t numberOfPools;
+		/// The sums of the values of every counter that was still enabled when its thread exited
+		memcounter::CounterValues values;
+	};
+
 	/** @brief Class to keep track of all MemoryCounters for the thread. There will be one instance per thread.
 	 *
 	 * The name "ThreadMemoryCounterPool" is meant that it's the thread's pool of MemoryCounters, not a pool of
@@ -21,34 +42,303 @@ namespace memcounter
 	 * I don't need to do any locking for this class. Since each thread has its own instance only one thread will
 	 * ever be going through the methods.
 	 *
+	 * If constructed with a non-zero batch size the enabled counters aren't updated on every allocation. Instead
+	 * the pool keeps a running total of the changes and the highest that running total has reached, and
+	 * applies them to every enabled counter when batchSize changes have built up, when a counter is enabled or
+	 * disabled, or when anything reads a counter. Since every enabled counter sees the same changes the peak of
+	 * each one over the batch is its value before plus the peak of the running total, so the maximums are
+	 * still exact. This makes the cost of an allocation independent of how many counters are enabled.
+	 *
+	 * The size and lifetime histograms are always batched in the same way, since they don't have any maximums.
+	 * Changes go into a single pending histogram, which is added to every enabled counter's histogram when one
+	 * of them is read or a counter is enabled or disabled.
+	 *
+	 * A counter that's enabled can also be paused by setting its bit in the thread's ClientThreadState,
+	 * which is how the inline client API in ThreadCounter.h switches counters on and off without calling
+	 * into the library. The pool notices the next time it's used (syncActiveSlots) and applies anything
+	 * pending to the counters that were active before the change. So that the bits mean the same thing
+	 * for as long as the counter is enabled, a counter keeps its slot until it's disabled.
+	 *
+	 * Call site counts are never batched. They're spread over a lot of trie nodes so there's no small
+	 * pending set to keep, and they're only recorded if asked for, which is already slow because of
+	 * capturing the stack.
+	 *
+	 * Blocks freed by a different thread to the one that allocated them still have to come off this
+	 * thread's counters. The freeing thread can't touch them, so it pushes the block onto this pool's
+	 * remote free queue instead, and the pool takes the blocks off its counters the next time this
+	 * thread allocates or reads one of its counters. pushRemoteFree, poolWithIndex, readCounterValues,
+	 * readEnabledCounters and the static global counter methods are the only ones that can be called
+	 * from another thread.
+	 *
+	 * The values of the enabled counters and the global counter shards are kept in a LiveThreadBlock,
+	 * which is in a shared memory segment if LiveExport is running, so that other processes can watch
+	 * them. Every change to the values of the pool's counters, enabled or not, is made between two
+	 * increments of the block's sequence number, odd while the change is being made. That's just two plain stores for the
+	 * pool's thread, however many counters are enabled, and lets a monitoring thread get a consistent
+	 * copy of a counter's values without locking by reading them until the sequence number is even and
+	 * the same before and after. Changes that are batched up but not applied yet aren't included.
+	 *
+	 * The pool also keeps this thread's shard of every GlobalMemoryCounter. The shards enabled in this
+	 * thread are updated straight away on every change, whether or not batching.
+	 *
+	 * When the thread exits retire() is called from a pthread key destructor. The values of the counters
+	 * still enabled are added to the retiredSummary(), the global counter shards are added to a shard per
+	 * global counter that's kept for exited threads, and the counters created in the thread are deleted.
+	 * The pool object itself is put on a free list for the next new thread to use rather than deleted,
+	 * because another thread might still be about to push a remote free onto it. That also means there
+	 * are never more pool objects than the most threads that have been running at once. Looking up and
+	 * reusing pools is all lock free, the only lock is a spin lock taken when a thread exits.
+	 *
 	 * @author Mark Grimes (mark.grimes@bristol.ac.uk)
 	 * @date 31/Jul/2011
 	 */
 	class ThreadMemoryCounterPool
 	{
 	public:
-		ThreadMemoryCounterPool();
-		virtual ~ThreadMemoryCounterPool();
+		/** @brief Returns a pool for the calling thread, reusing one from an exited thread if there is one. Counting must be disabled. */
+		static memcounter::ThreadMemoryCounterPool* createForCurrentThread( size_t batchSize=0 );
+		/** @brief Folds the pool's counts into what's kept for exited threads and puts it up for reuse. Only the pool's own thread can call this, as it exits.
+		 *
+		 * The named counters go into the totals kept for their names in counterNames one at a time, while
+		 * the pool is still registered with a zero index, so that addNamedCounterTotals waits rather than
+		 * seeing them both there and in the pool. Nothing is allocated, since this runs in a pthread key
+		 * destructor. The rest is folded in under a spin lock, one exiting thread at a time.
+		 */
+		void retire( memcounter::CounterNameTable& counterNames );
+		/** @brief Deletes every pool. Only for the end of the program. */
+		static void deleteAllPools();
+		/** @brief Returns a copy of the totals for every pool that has been retired. */
+		static memcounter::RetiredPoolSummary retiredSummary();
 
 		//
 		// These methods deal with the registered ICountingInterfaces
 		//
 		memcounter::IMemoryCounter* createNewMemoryCounter();
+		/** @brief Returns this thread's counter for the name with the given CounterNameTable id, creating it the first time. Counting must be disabled. */
+		memcounter::IMemoryCounter* namedCounter( uint32_t nameId );
+		/// The named counters created so far, indexed by name id up to CounterNameTable::capacity. NULL if this thread
+		/// hasn't used any names, and entries are NULL for names it hasn't used.
+		inline memcounter::IMemoryCounter* const* namedCounters() const { return pNamedCounters_; }
+		/// The CounterNameTable id of one of this pool's counters, zero if it hasn't got a name or the pool didn't create it
+		uint32_t nameIdOf( const memcounter::IMemoryCounter* pCounter ) const;
+		/** @brief Adds up the counter with the name id in every running thread except pCallingPool's, and in every thread that has exited. Can be called from any thread.
+		 *
+		 * Returns how many threads had the counter. Running threads are read with readCounterValues, so changes
+		 * they've batched up aren't included, and neither are their counters' sub-counters. The calling thread
+		 * can add its own counter directly. If another thread is part way through exiting this waits until
+		 * it's finished, so the thread is counted exactly once.
+		 */
+		static uint32_t addNamedCounterTotals( const memcounter::CounterNameTable& counterNames, uint32_t nameId, const memcounter::ThreadMemoryCounterPool* pCallingPool,
+				long int (&current)[memcounter::CounterValues::numberOfQuantities], long int (&maximum)[memcounter::CounterValues::numberOfQuantities] );
+
+		/// @param weight    How many blocks the change stands for. More than one if allocations are being sampled,
+		///                  in which case the sizes are scaled up to match.
+		/// @param callSite  The node in callSiteTrie() for where the block was allocated, or zero to not count it by call site.
+		///                  Only non-zero if counting is disabled, because the counters' call site vectors may need to grow.
+		void addToAllEnabledCounters( size_t size, size_t usableSize, size_t weight=1, uint32_t callSite=0 );
+		void modifyAllEnabledCounters( size_t oldSize, size_t oldUsableSize, size_t newSize, size_t newUsableSize, size_t weight=1, uint32_t oldCallSite=0, uint32_t newCallSite=0 );
+		void removeFromAllEnabledCounters( size_t size, size_t usableSize, size_t weight=1, uint32_t callSite=0 );
+		/// Records how many cycles a block was allocated for in the lifetime histograms
+		void recordLifetime( size_t size, size_t weight, uint64_t cycles );
+
+		/** @brief Captures the current stack and returns its node in callSiteTrie(). Counting must be disabled. */
+		uint32_t currentCallSite( size_t maximumDepth, bool useFramePointers );
+		inline const memcounter::CallSiteTrie& callSiteTrie() const { return callSiteTrie_; }
+
+		/// A number unique to this thread's use of the pool, so that a free can tell which thread allocated the block. Zero if
+		/// there were too many threads running to register the pool, in which case blocks are treated as the freeing thread's.
+		inline uint32_t index() const { return index_; }
+		/// Returns the pool with the given index(), or NULL if its thread has exited
+		static memcounter::ThreadMemoryCounterPool* poolWithIndex( uint32_t index );
+		/** @brief Copies the values of a counter that belongs to the pool with the given index(). Can be called from any thread.
+		 *
+		 * Returns false if the pool's thread has exited, in which case the counter has been deleted. Also
+		 * gives whether the counter is enabled and not paused, and the global counter its spawned threads
+		 * count into, which can be NULL. If maximumAttempts isn't zero, the copy is used after that many
+		 * tries even if it isn't consistent.
+		 */
+		static bool readCounterValues( uint32_t poolIndex, const memcounter::MemoryCounterImplementation* pCounter, memcounter::CounterValues& values, bool& isActive, memcounter::GlobalMemoryCounter*& pInheritedCounter, unsigned maximumAttempts=0 );
+		/// One of a thread's enabled counters, as copied by readEnabledCounters
+		struct EnabledCounterValues
+		{
+			int slot;
+			uint32_t nameId; ///< Zero if the counter hasn't got a name
+			bool isActive;
+			memcounter::CounterValues values;
+		};
+		/// How far through the pool registry readEnabledCounters needs to be called, which only ever goes up
+		static size_t numberOfRegistrySlots();
+		/** @brief Copies the values of every counter enabled in the thread registered at registrySlot. Can be called from any thread.
+		 *
+		 * Returns how many there are and sets poolIndex to the thread's index(), or returns zero if there's no
+		 * running thread there. Which counters are in which slots is read with the sequence number, and then
+		 * each counter with readCounterValues, so a counter disabled part way through still gives its values
+		 * as they were then. Changes the thread has batched up aren't included, and neither are sub-counters.
+		 */
+		static size_t readEnabledCounters( size_t registrySlot, uint32_t& poolIndex, EnabledCounterValues (&counters)[memcounter::LiveThreadBlock::numberOfSlots] );
 
-		void addToAllEnabledCounters( size_t size );
-		void modifyAllEnabledCounters( size_t oldSize, size_t newSize );
-		void removeFromAllEnabledCounters( size_t size );
+		/** @brief Queues a block allocated by this pool's thread but freed by the calling thread. Never blocks or allocates.
+		 *
+		 * Returns false without queueing anything if the pool no longer has the index the block was allocated
+		 * with, because its thread has exited since poolWithIndex was called.
+		 */
+		bool pushRemoteFree( const memcounter::RemoteFreeQueue::Entry& entry, uint32_t allocatingPool );
+		/** @brief Takes a block allocated by a thread that has since exited off the global counters that were enabled when it exited.
+		 *
+		 * The change is made to the freeing thread's own shards, which is fine since only the totals matter.
+		 * Nothing is done if the freeing thread has no pool, or so many threads have come and gone since
+		 * that the record of the exited thread has been reused.
+		 */
+		static void releaseRetiredBlock( memcounter::ThreadMemoryCounterPool* pFreeingPool, uint32_t allocatingPool, size_t size, size_t usableSize, size_t weight );
+		/** @brief Stops frees of exited threads' blocks coming off the global counter with the given index, for when the index is about to be reused. */
+		static void forgetRetiredGlobalCounter( size_t globalCounterIndex );
+		/// Takes everything on the remote free queue off the enabled counters. Only the pool's own thread can call this.
+		inline void drainRemoteFrees() { if( remoteFrees_.mightHaveEntries() ) applyRemoteFrees(); }
 
-		void informEnabled( memcounter::ICountingInterface* pEnabledCounter );
-		void informDisabled( memcounter::ICountingInterface* pDisabledCounter );
+		/** @brief Gives the counter a slot in the dispatch array. Returns false if all the slots are in use. */
+		bool informEnabled( memcounter::MemoryCounterImplementation* pEnabledCounter );
+		void informDisabled( memcounter::MemoryCounterImplementation* pDisabledCounter );
 
+		/** @brief Starts or stops adding this thread's changes to its shard of the global counter with the given index.
+		 *
+		 * The thread holds a reference to the global counter while it's enabled, see GlobalMemoryCounter.
+		 */
+		void informGlobalEnabled( size_t globalCounterIndex );
+		void informGlobalDisabled( size_t globalCounterIndex );
+		inline bool isGlobalCounterEnabled( size_t globalCounterIndex ) const { return enabledGlobalCounters_ & (1u<<globalCounterIndex); }
+		/** @brief Adds up the global counter's shards in every pool, including those of exited threads. Can be called from any thread.
+		 *
+		 * maximumAttempts is passed on to GlobalCounterShard::addTo, and also limits how many times the whole
+		 * sum is tried again because a thread exited part way through.
+		 */
+		static void addGlobalCounterTotals( size_t globalCounterIndex, long int (&current)[memcounter::GlobalCounterShard::numberOfQuantities], long int (&maximum)[memcounter::GlobalCounterShard::numberOfQuantities], unsigned maximumAttempts=0 );
+		/** @brief Writes out every running thread's enabled counters, the global counters and the totals for exited threads.
+		 *
+		 * Never allocates, locks or waits, so it can be called from a signal handler in any thread. Other
+		 * threads' counters are read with the sequence number, but only a limited number of times in case
+		 * the signal interrupted a change, so a value can still be slightly out. Changes a thread has
+		 * batched up but not applied yet aren't included.
+		 */
+		static void writeReport( memcounter::ReportWriter& writer );
+
+		/** @brief Adds samples for the pool's counters to the profile, or just for pOnlyCounter if it isn't NULL. Counting must be disabled.
+		 *
+		 * Samples are labelled with the counter's name if it has one in pNames, otherwise with where it is in
+		 * the order the pool's counters were created. Returns the number of samples added.
+		 */
+		size_t addToProfile( memcounter::HeapProfile& profile, const memcounter::IMemoryCounter* pOnlyCounter, const memcounter::CounterNameTable* pNames );
+		/** @brief Makes writeProfileFile write to "<filePrefix>.<pid>.<number>.pb", and also call it whenever a counter is disabled if onDisable is set.
+		 *
+		 * The pointers are kept, so they have to stay valid until the end of the program. A NULL prefix
+		 * switches it off again.
+		 */
+		static void setProfileFile( const char* filePrefix, bool onDisable, const memcounter::CounterNameTable* pNames );
+		/** @brief Writes the pool's counters, or just pOnlyCounter, as a pprof heap profile to a new file if setProfileFile was given one. Only the pool's own thread can call this. */
+		void writeProfileFile( const memcounter::IMemoryCounter* pOnlyCounter=NULL );
+
+		/** @brief Returns a bit mask of the global counters a thread spawned now should count into.
+		 *
+		 * That's the ones enabled in this thread, plus the inherited counter of each enabled counter.
+		 * Counting must be disabled, because the inherited counters are created when first needed.
+		 */
+		uint32_t globalCountersForSpawnedThread();
+
+		/// Where the values for an enabled counter are kept while it's enabled. Call flushPendingChanges first if batching.
+		inline memcounter::CounterValues& enabledCounterValues( int slot ) { return pLive_->values[slot]; }
+		/// Anything that changes the values of one of the pool's counters has to be between these, see the class description
+		inline void beginValuesChange()
+		{
+			__atomic_store_n( &pLive_->sequence, pLive_->sequence+1, __ATOMIC_RELAXED );
+			__atomic_thread_fence( __ATOMIC_RELEASE );
+		}
+		inline void endValuesChange() { __atomic_store_n( &pLive_->sequence, pLive_->sequence+1, __ATOMIC_RELEASE ); }
+
+		/// Applies any changes that have been batched up to the enabled counters
+		void flushPendingChanges();
+		/// Adds the pending size and lifetime histogram changes to the histograms of the enabled counters
+		void flushPendingHistogram();
+
+		/** @brief Catches up with counters that have been paused or unpaused through the thread's ClientThreadState. */
+		inline void syncActiveSlots()
+		{
+			uint32_t newActiveSlots=enabledSlots_ & ~memcounter::threadState.pausedSlots;
+			if( newActiveSlots!=activeSlots_ ) changeActiveSlots( newActiveSlots );
+		}
+		/// True if any changes need recording, i.e. a counter is enabled and not paused or a global counter is enabled
+		inline bool hasActiveCounters() const { return ( activeSlots_ | enabledGlobalCounters_ )!=0; }
+		/// The slots of the counters that are enabled and not paused, as of the last syncActiveSlots
+		inline uint32_t activeSlots() const { return activeSlots_; }
+		/// Bit mask of the global counters enabled in this thread
+		inline uint32_t enabledGlobalCounters() const { return enabledGlobalCounters_; }
+
+		/// This thread's part of the allocation trace, if MEMCOUNTER_TRACE_FILE is set. Only the pool's own thread can use it.
+		inline memcounter::TraceBuffer& traceBuffer() { return traceBuffer_; }
+
+		static const size_t maximumEnabledCounters=memcounter::LiveThreadBlock::numberOfSlots; ///< One for each bit of the slot masks
 	protected:
-//		std::vector<memcounter::ICountingInterface*> createdCounters_;
-		// I'm having performance issues so currently only using the most recent counter
-//		memcounter::ICountingInterface* pLastEnabledCounter_;
+		ThreadMemoryCounterPool( size_t batchSize );
+		virtual ~ThreadMemoryCounterPool();
+		/// Sets up everything that depends on the thread using the pool, and publishes it so that other threads can find it
+		void attachToCurrentThread();
+
+		/// Adds delta to every enabled counter. This is the only thing that happens on the hot path.
+		inline void applyToAllEnabledCounters( const long int (&delta)[memcounter::CounterValues::numberOfQuantities] );
+		/// Widens the range of classes that need to be flushed from pendingHistogram_ to include sizeClass
+		inline void pendingHistogramChanged( size_t sizeClass );
+		/// Adds the change to the call site's counts in every enabled counter
+		inline void applyToCallSite( uint32_t callSite, long int bytes, long int allocations );
+		void applyRemoteFrees();
+		void changeActiveSlots( uint32_t newActiveSlots );
+		/// The flush methods without syncActiveSlots
+		void applyPendingChanges();
+		void applyPendingHistogram();
+		/// Copies the slot masks into the live block, between beginValuesChange and endValuesChange
+		inline void publishSlots()
+		{
+			__atomic_store_n( &pLive_->enabledSlots, enabledSlots_, __ATOMIC_RELAXED );
+			__atomic_store_n( &pLive_->activeSlots, activeSlots_, __ATOMIC_RELAXED );
+		}
 
 		std::vector<memcounter::ICountingInterface*> createdCounters_;
-		std::list<memcounter::ICountingInterface*> enabledCounters_;
+		/// Indexed by name id, so that looking up a cached id is just an index. It's allocated at its full size the first time the
+		/// thread uses a name and never moved, and stays with the pool when it's reused, so that other threads can read it.
+		memcounter::IMemoryCounter** pNamedCounters_;
+
+		// The enabled counters are kept as a flat array of their values rather than a list of pointers
+		// to them, so that an allocation is one loop over contiguous memory with no virtual calls. When a
+		// counter is enabled its values are copied into the lowest free slot of pLive_->values, and the
+		// counter remembers the slot index. When it's disabled the values are copied back and the slot is
+		// freed, so both are O(1). The loops go over the bits of activeSlots_.
+		memcounter::MemoryCounterImplementation* enabledCounters_[maximumEnabledCounters]; ///< Which counter is using each slot
+		uint32_t enabledSlots_; ///< Bit mask of the slots in use
+		uint32_t activeSlots_; ///< enabledSlots_ without the paused ones, as of the last syncActiveSlots
+		memcounter::LiveThreadBlock* pLive_; ///< The values, sequence number and global shards. Either privateLive_ or in the shared memory segment.
+		memcounter::LiveThreadBlock privateLive_;
+
+		// These are only used if batching changes, see the class description
+		size_t batchSize_; ///< Zero if changes are applied immediately
+		size_t numberOfPendingChanges_;
+		long int pendingDelta_[memcounter::CounterValues::numberOfQuantities]; ///< Sum of the changes since the last flush
+		long int pendingPeak_[memcounter::CounterValues::numberOfQuantities]; ///< Highest pendingDelta_ has been since the last flush
+
+		memcounter::SizeHistogram pendingHistogram_; ///< Histogram changes since the last flush, see the class description
+		size_t firstPendingClass_; ///< The range of classes in pendingHistogram_ that aren't zero. Empty if first is after last.
+		size_t lastPendingClass_;
+		memcounter::LifetimeHistogram pendingLifetimes_;
+		bool lifetimesPending_;
+
+		memcounter::CallSiteTrie callSiteTrie_;
+		const void* pStackTop_; ///< Where stack walks have to stop. Found when the pool is created, which is in its own thread.
+		uint32_t index_; ///< Also set to zero when the thread exits, to stop anything else being pushed onto remoteFrees_
+		uint32_t pushersInFlight_; ///< How many other threads are part way through pushRemoteFree
+		uint32_t readersInFlight_; ///< How many other threads are part way through readCounterValues
+		memcounter::RemoteFreeQueue remoteFrees_;
+		uint32_t poolNumber_; ///< Where the pool object is in the list of all pools, which doesn't change when it's reused. Zero if it isn't in the list.
+		uint32_t nextFreePool_; ///< The poolNumber_ of the next pool on the free list
+
+		uint32_t enabledGlobalCounters_; ///< Bit mask of the global counters enabled in this thread
+
+		memcounter::TraceBuffer traceBuffer_;
 	}; // end of the MemoryCounter class
 
 } // end of the memcounter namespace
@@ -0,0 +1,172 @@
+#ifndef memcounter_TraceFormat_h
+#define memcounter_TraceFormat_h
+
+#include <stddef.h> // needed for size_t
+#include <stdint.h>
+
+namespace memcounter
+{
+	/** @brief The start of an allocation trace file, which is followed by any number of chunks.
+	 *
+	 * Each chunk is a TraceChunkHeader followed by numberOfBytes bytes of events, all from one thread. Chunks
+	 * are written as threads fill them, so chunks from different threads overlap in time, but the events
+	 * within a chunk are in order.
+	 */
+	struct TraceFileHeader
+	{
+		char magic[8]; ///< "MCTRACE" and a null
+		uint32_t version;
+		uint32_t chunkHeaderSize; ///< sizeof(TraceChunkHeader) when the file was written
+		uint64_t startCycles; ///< The cycle count when tracing started
+		uint64_t startTimeNanoseconds; ///< The wall clock time then, since the epoch
+		double nanosecondsPerCycle; ///< Filled in when the trace is finished. Zero if the program didn't exit normally.
+		uint64_t unused[3]; ///< Pads the header to 64 bytes
+	};
+
+	struct TraceChunkHeader
+	{
+		uint32_t numberOfBytes; ///< Of event data following this header
+		uint32_t numberOfEvents;
+		uint32_t thread; ///< ThreadMemoryCounterPool::index() of the thread that recorded the events
+		uint32_t droppedEvents; ///< Events the thread had to drop before this chunk because no buffer was free
+		uint64_t firstCycles; ///< The first event's time is relative to this
+		uint64_t lastCycles; ///< The time of the last event in the chunk
+	};
+
+	/** @brief How events are encoded, and the decoder.
+	 *
+	 * Each event starts with a byte with the type in the bottom three bits and flags above that. Then comes
+	 * the cycles since the previous event (or since firstCycles for the first one) as a varint, and the
+	 * address as a zigzag varint of the difference from the previous address in the chunk. Allocations are
+	 * followed by the size as a varint. A realloc has the old address first, which is zero if the old block
+	 * wasn't tracked, then the new one, which is zero if the new block isn't tracked, then the size. Either
+	 * way both are differences from the previous address. Events with hasCounters then have the thread's
+	 * active counter slots and enabled global counters as varints, which is only written when they change
+	 * within the chunk, and events with hasWeight have the sampling weight as a varint. Frees and reallocs
+	 * don't say which counters they were in, that comes from the allocation.
+	 */
+	struct TraceEvent
+	{
+		enum Type
+		{
+			malloc=1,
+			calloc=2,
+			realloc=3,
+			free=4,
+			memalign=5,
+			valloc=6,
+			posixMemalign=7
+		};
+		enum Flags
+		{
+			typeMask=0x07,
+			hasCounters=0x08,
+			hasWeight=0x10
+		};
+		static const size_t maximumEncodedSize=1+10+10+10+10+5+5+5; ///< The longest an event can be
+
+		Type type;
+		uint64_t cycles; ///< Absolute, i.e. not relative to the previous event
+		uint64_t address; ///< For a realloc this is the new address
+		uint64_t oldAddress; ///< Only used for reallocs
+		uint64_t size; ///< Zero for frees
+		uint32_t activeSlots; ///< The slots of the allocating thread's counters that were enabled. Kept from the previous event if not in this one.
+		uint32_t globalCounters; ///< The same for global counters
+		uint32_t weight; ///< One unless sampling
+
+		static inline uint8_t* writeVarint( uint8_t* pOutput, uint64_t value )
+		{
+			while( value>=0x80 )
+			{
+				*pOutput++=uint8_t( value | 0x80 );
+				value>>=7;
+			}
+			*pOutput++=uint8_t( value );
+			return pOutput;
+		}
+
+		static inline uint64_t zigzag( int64_t value ) { return ( uint64_t(value)<<1 ) ^ uint64_t( value>>63 ); }
+		static inline int64_t unzigzag( uint64_t value ) { return int64_t( value>>1 ) ^ -int64_t( value & 1 ); }
+
+		/// Returns NULL if the varint runs past pEnd
+		static inline const uint8_t* readVarint( const uint8_t* pInput, const uint8_t* pEnd, uint64_t& value )
+		{
+			value=0;
+			for( unsigned shift=0; pInput<pEnd && shift<64; shift+=7 )
+			{
+				uint8_t byte=*pInput++;
+				value|=uint64_t( byte & 0x7f )<<shift;
+				if( (byte & 0x80)==0 ) return pInput;
+			}
+			return NULL;
+		}
+	};
+
+	/** @brief Reads the events out of one chunk's data, one at a time. */
+	class TraceChunkDecoder
+	{
+	public:
+		TraceChunkDecoder( const memcounter::TraceChunkHeader& header, const uint8_t* pData )
+			: pPosition_(pData), pEnd_(pData+header.numberOfBytes), previousCycles_(header.firstCycles), previousAddress_(0),
+			  activeSlots_(0), globalCounters_(0) {}
+
+		/** @brief Decodes the next event. Returns false at the end of the chunk, or if the data is corrupt. */
+		inline bool next( memcounter::TraceEvent& event )
+		{
+			if( pPosition_>=pEnd_ ) return false;
+			uint8_t typeAndFlags=*pPosition_++;
+			event.type=memcounter::TraceEvent::Type( typeAndFlags & memcounter::TraceEvent::typeMask );
+
+			uint64_t value;
+			if( !( pPosition_=memcounter::TraceEvent::readVarint( pPosition_, pEnd_, value ) ) ) return false;
+			previousCycles_+=value;
+			event.cycles=previousCycles_;
+
+			event.oldAddress=0;
+			if( event.type==memcounter::TraceEvent::realloc )
+			{
+				if( !( pPosition_=memcounter::TraceEvent::readVarint( pPosition_, pEnd_, value ) ) ) return false;
+				event.oldAddress=previousAddress_+memcounter::TraceEvent::unzigzag( value );
+				previousAddress_=event.oldAddress;
+			}
+			if( !( pPosition_=memcounter::TraceEvent::readVarint( pPosition_, pEnd_, value ) ) ) return false;
+			event.address=previousAddress_+memcounter::TraceEvent::unzigzag( value );
+			previousAddress_=event.address;
+
+			event.size=0;
+			if( event.type!=memcounter::TraceEvent::free )
+			{
+				if( !( pPosition_=memcounter::TraceEvent::readVarint( pPosition_, pEnd_, event.size ) ) ) return false;
+			}
+			if( typeAndFlags & memcounter::TraceEvent::hasCounters )
+			{
+				if( !( pPosition_=memcounter::TraceEvent::readVarint( pPosition_, pEnd_, value ) ) ) return false;
+				activeSlots_=uint32_t( value );
+				if( !( pPosition_=memcounter::TraceEvent::readVarint( pPosition_, pEnd_, value ) ) ) return false;
+				globalCounters_=uint32_t( value );
+			}
+			event.activeSlots=activeSlots_;
+			event.globalCounters=globalCounters_;
+			event.weight=1;
+			if( typeAndFlags & memcounter::TraceEvent::hasWeight )
+			{
+				if( !( pPosition_=memcounter::TraceEvent::readVarint( pPosition_, pEnd_, value ) ) ) return false;
+				event.weight=uint32_t( value );
+			}
+			return true;
+		}
+	private:
+		const uint8_t* pPosition_;
+		const uint8_t* pEnd_;
+		uint64_t previousCycles_;
+		uint64_t previousAddress_;
+		uint32_t activeSlots_;
+		uint32_t globalCounters_;
+	}; // end of the TraceChunkDecoder class
+
+	static const char traceMagic[8]={ 'M', 'C', 'T', 'R', 'A', 'C', 'E', 0 };
+	static const uint32_t traceVersion=1;
+
+} // end of the memcounter namespace
+
+#endif
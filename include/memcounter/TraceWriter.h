@@ -0,0 +1,145 @@
+#ifndef memcounter_TraceWriter_h
+#define memcounter_TraceWriter_h
+
+#include <stddef.h> // needed for size_t
+#include <stdint.h>
+#include <pthread.h>
+
+#include "macros.h"
+#include "memcounter/TraceFormat.h"
+
+namespace memcounter
+{
+	/** @brief Writes the allocation trace file in a background thread, from chunks that each thread fills in its own TraceBuffer.
+	 *
+	 * All the chunks are allocated up front in start(). Threads take empty chunks off a lock-free free
+	 * list and push full ones onto a lock-free list for the writer, so recording an event never locks,
+	 * allocates or makes a system call. The writer thread takes the whole full list every few milliseconds,
+	 * writes the chunks out oldest first, and puts them back on the free list. If the writer can't keep up
+	 * and there are no empty chunks, threads drop events and count how many they dropped.
+	 *
+	 * Like the telemetry thread, the writer thread has to be started before the hooks are installed.
+	 */
+	class TraceWriter
+	{
+	public:
+		static const size_t chunkDataSize=65536-48; ///< Makes each chunk, including its header and list links, 64kB
+
+		struct Chunk
+		{
+			uint32_t nextChunk; ///< Chunk number of the next chunk in whichever list this is in, or zero for the end
+			uint32_t number; ///< Which chunk this is, starting from one
+			uint64_t unused; ///< Pads the chunk out to a round size
+			memcounter::TraceChunkHeader header;
+			uint8_t data[chunkDataSize];
+		};
+
+		TraceWriter();
+		~TraceWriter();
+
+		/** @brief Creates the file, allocates the chunks and starts the thread. Prints why and returns false if that isn't possible.
+		 *
+		 * maximumFileSize is where the writer stops writing so that the disk doesn't fill up, zero for no limit.
+		 */
+		bool start( const char* filename, size_t numberOfChunks, uint64_t maximumFileSize );
+		/** @brief Waits for the thread to write out everything that has been handed to it, then finishes the file.
+		 *
+		 * Chunks that threads still running haven't handed over yet are lost.
+		 */
+		void stop();
+
+		/// Returns an empty chunk, or NULL if there aren't any. Can be called from any thread.
+		Chunk* takeEmptyChunk();
+		/// Hands a chunk over to the writer thread. Can be called from any thread.
+		void submit( Chunk* pChunk );
+	protected:
+		static void* threadFunction( void* pWriter );
+		/// Writes out everything on the full list. Only the writer thread calls this, or stop() once it has finished.
+		void writeFullChunks();
+		void putBackEmptyChunk( Chunk* pChunk );
+
+		int fileDescriptor_;
+		Chunk* pChunks_; ///< Chunk number n is at pChunks_[n-1]
+		size_t numberOfChunks_;
+		uint64_t emptyHead_; ///< The top 32 bits count changes so that a stale head can't be swapped in, the bottom 32 are the chunk number
+		uint32_t fullHead_; ///< Chunk number of the most recently submitted chunk, most recent first
+		uint64_t bytesWritten_;
+		uint64_t maximumFileSize_;
+		uint64_t eventsDroppedByWriter_; ///< Events in chunks that weren't written because the file hit its limit
+		memcounter::TraceFileHeader header_;
+		bool running_;
+		bool stopping_;
+		pthread_t thread_;
+	}; // end of the TraceWriter class
+
+	/** @brief A thread's chunk of the allocation trace that it's currently filling in. Only used by its own thread. */
+	class TraceBuffer
+	{
+	public:
+		TraceBuffer();
+
+		/** @brief Encodes an event into the chunk, handing the chunk to the writer when it's full.
+		 *
+		 * Never locks or allocates. oldAddress is only used for reallocs. The counters are only recorded for
+		 * allocations, and only if they've changed since the last event in the chunk.
+		 */
+		inline void record( memcounter::TraceWriter& writer, uint32_t thread, memcounter::TraceEvent::Type type, uint64_t cycles, uint64_t oldAddress,
+				uint64_t address, uint64_t size, uint32_t weight, uint32_t activeSlots, uint32_t globalCounters )
+		{
+			if( UNLIKELY( pPosition_==NULL || pPosition_+memcounter::TraceEvent::maximumEncodedSize>pLimit_ ) )
+			{
+				if( !startNewChunk( writer, thread, cycles ) ) return;
+			}
+
+			uint8_t* pTypeAndFlags=pPosition_++;
+			uint8_t typeAndFlags=uint8_t( type );
+			pPosition_=memcounter::TraceEvent::writeVarint( pPosition_, cycles-previousCycles_ );
+			previousCycles_=cycles;
+			if( type==memcounter::TraceEvent::realloc )
+			{
+				pPosition_=memcounter::TraceEvent::writeVarint( pPosition_, memcounter::TraceEvent::zigzag( int64_t(oldAddress-previousAddress_) ) );
+				previousAddress_=oldAddress;
+			}
+			pPosition_=memcounter::TraceEvent::writeVarint( pPosition_, memcounter::TraceEvent::zigzag( int64_t(address-previousAddress_) ) );
+			previousAddress_=address;
+			if( type!=memcounter::TraceEvent::free )
+			{
+				pPosition_=memcounter::TraceEvent::writeVarint( pPosition_, size );
+				if( activeSlots!=activeSlots_ || globalCounters!=globalCounters_ )
+				{
+					typeAndFlags|=memcounter::TraceEvent::hasCounters;
+					pPosition_=memcounter::TraceEvent::writeVarint( pPosition_, activeSlots );
+					pPosition_=memcounter::TraceEvent::writeVarint( pPosition_, globalCounters );
+					activeSlots_=activeSlots;
+					globalCounters_=globalCounters;
+				}
+			}
+			if( weight!=1 )
+			{
+				typeAndFlags|=memcounter::TraceEvent::hasWeight;
+				pPosition_=memcounter::TraceEvent::writeVarint( pPosition_, weight );
+			}
+			*pTypeAndFlags=typeAndFlags;
+
+			++pChunk_->header.numberOfEvents;
+		}
+
+		/** @brief Hands over the chunk even if it isn't full, e.g. because the thread is exiting. */
+		void flush( memcounter::TraceWriter& writer );
+	protected:
+		/// Hands over the current chunk and takes an empty one. Returns false, and counts the event as dropped, if there isn't one.
+		bool startNewChunk( memcounter::TraceWriter& writer, uint32_t thread, uint64_t cycles );
+
+		memcounter::TraceWriter::Chunk* pChunk_;
+		uint8_t* pPosition_; ///< Where the next event goes in pChunk_, NULL if there isn't a chunk
+		uint8_t* pLimit_;
+		uint64_t previousCycles_;
+		uint64_t previousAddress_;
+		uint32_t activeSlots_;
+		uint32_t globalCounters_;
+		uint32_t droppedEvents_; ///< Since the last chunk was started
+	}; // end of the TraceBuffer class
+
+} // end of the memcounter namespace
+
+#endif
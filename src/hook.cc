@@ -341,8 +341,8 @@ parse(const char *func, void *address, unsigned *patches)
     else if (insns[0] == 0x41 && insns[1] == 0xb9)  /* mov $0x*,%r9d */
       n += 6, insns += 6;
 
-    else if (insns[0] == 0x48 && insns[1] == 0x85 && insns[2] == 0xf6)
-      n += 3, insns += 3;                         /* test  %rsi,%rsi */
+    else if (insns[0] == 0x48 && insns[1] == 0x85 && insns[2] >= 0xc0)
+      n += 3, insns += 3;                         /* test  %r*,%r* */
 
     else if (insns[0] == 0x48 && insns[1] == 0x63 && insns[2] == 0xf7)
       n += 3, insns += 3;                         /* movslq %edi,%rsi */
@@ -383,6 +383,12 @@ parse(const char *func, void *address, unsigned *patches)
     else if (insns[0] == 0x55 || insns[0] == 0x53)
       n += 1, insns += 1;                         /* push %rbp / %rbx */
 
+    else if (insns[0] == 0x0f && insns[1] == 0x84)  /* je (32-bit offset) */
+      *patches++ = ((n+6) << 8) + n+2, n += 6, insns += 6;
+
+    else if (insns[0] == 0x80 && insns[1] == 0x3d)  /* cmpb $0x*,$0x*(%rip) */
+      *patches++ = ((n+7) << 8) + n+2, n += 7, insns += 7;
+
     else if (insns[0] == 0x83 && insns[1] == 0xf8)  /* cmp $0x*,%eax */
       n += 3, insns += 3;
 
@@ -392,7 +398,7 @@ parse(const char *func, void *address, unsigned *patches)
     else if (insns[0] == 0x8d && insns[1] == 0x47)
       n += 3, insns += 3;                         /* lea $0x*(%rdi),%eax */
 
-    else if (insns[0] == 0xb8)                      /* mov $0x*,%eax */
+    else if (insns[0] >= 0xb8 && insns[0] <= 0xbf)  /* mov $0x*,%e*x */
       n += 5, insns += 5;
 
     else if (insns[0] == 0xe9)                      /* jmpq (32-bit offset) */
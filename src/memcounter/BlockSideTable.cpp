@@ -0,0 +1,160 @@
+#include "memcounter/BlockSideTable.h"
+
+#include <sys/mman.h>
+#include <sched.h>
+#include <cstring>
+
+memcounter::BlockSideTable::BlockSideTable()
+	: pEntries_(NULL), capacity_(0), shardSize_(0), hashShift_(0), numberOfShards_(0)
+{
+	memset( shards_, 0, sizeof(shards_) );
+}
+
+bool memcounter::BlockSideTable::initialise( size_t capacity )
+{
+	// Round up to a power of two, with a lower limit so that every shard has a reasonable size
+	unsigned log2Capacity=12;
+	while( (size_t(1)<<log2Capacity)<capacity ) ++log2Capacity;
+
+	size_t bytes=(size_t(1)<<log2Capacity)*sizeof(Entry);
+	void* pMemory=mmap( NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0 );
+	if( pMemory==MAP_FAILED ) return false;
+
+	// mmap gives zeroed memory, and zero is emptyKey, so there's nothing else to do
+	pEntries_=static_cast<Entry*>( pMemory );
+	capacity_=size_t(1)<<log2Capacity;
+	numberOfShards_=maximumNumberOfShards;
+	shardSize_=capacity_/numberOfShards_;
+	hashShift_=64-log2Capacity;
+	return true;
+}
+
+bool memcounter::BlockSideTable::isInitialised() const
+{
+	return pEntries_!=NULL;
+}
+
+inline size_t memcounter::BlockSideTable::homeSlot( uintptr_t key ) const
+{
+	// Fibonacci hashing. The bottom bits of block addresses are always zero so they're dropped
+	// first. The top bits of the result pick the shard, the ones below that the slot in the shard.
+	return ( uint64_t(key>>4)*0x9E3779B97F4A7C15ULL )>>hashShift_;
+}
+
+inline void memcounter::BlockSideTable::lockShard( size_t shard )
+{
+	while( __atomic_test_and_set( &shards_[shard].lock, __ATOMIC_ACQUIRE ) ) sched_yield();
+}
+
+inline void memcounter::BlockSideTable::unlockShard( size_t shard )
+{
+	__atomic_clear( &shards_[shard].lock, __ATOMIC_RELEASE );
+}
+
+bool memcounter::BlockSideTable::insert( const void* pBlock, const memcounter::BlockDetails& details )
+{
+	uintptr_t key=reinterpret_cast<uintptr_t>(pBlock);
+	size_t home=homeSlot( key );
+	size_t shardStart=home & ~(shardSize_-1);
+	size_t shard=shardStart/shardSize_;
+
+	lockShard( shard );
+	for( size_t probe=0; probe<shardSize_; ++probe )
+	{
+		Entry& entry=pEntries_[shardStart+((home+probe) & (shardSize_-1))];
+		if( entry.key!=emptyKey ) continue;
+
+		// A block address can only be live once, so the first empty slot is the place for it
+		entry.details=details;
+		__atomic_store_n( &entry.key, key, __ATOMIC_RELAXED );
+		unlockShard( shard );
+		return true;
+	}
+
+	++shards_[shard].failedInserts;
+	unlockShard( shard );
+	return false;
+}
+
+bool memcounter::BlockSideTable::erase( const void* pBlock, memcounter::BlockDetails& details )
+{
+	uintptr_t key=reinterpret_cast<uintptr_t>(pBlock);
+	size_t home=homeSlot( key );
+	size_t shardStart=home & ~(shardSize_-1);
+	size_t shard=shardStart/shardSize_;
+	size_t mask=shardSize_-1;
+
+	lockShard( shard );
+	size_t index=home & mask;
+	size_t probe=0;
+	for( ; probe<shardSize_; ++probe, index=(index+1) & mask )
+	{
+		uintptr_t currentKey=pEntries_[shardStart+index].key;
+		if( currentKey==emptyKey || currentKey==key ) break;
+	}
+	if( probe==shardSize_ || pEntries_[shardStart+index].key==emptyKey )
+	{
+		unlockShard( shard );
+		return false;
+	}
+	details=pEntries_[shardStart+index].details;
+
+	// Move later entries back into the gap if that's still on or after their home, so that lookups don't need tombstones
+	size_t next=(index+1) & mask;
+	for( size_t step=1; step<shardSize_ && pEntries_[shardStart+next].key!=emptyKey; ++step, next=(next+1) & mask )
+	{
+		Entry& nextEntry=pEntries_[shardStart+next];
+		size_t nextHome=homeSlot( nextEntry.key ) & mask;
+		if( ( (next-nextHome) & mask )>=( (next-index) & mask ) )
+		{
+			pEntries_[shardStart+index].details=nextEntry.details;
+			__atomic_store_n( &pEntries_[shardStart+index].key, nextEntry.key, __ATOMIC_RELAXED );
+			index=next;
+		}
+	}
+	__atomic_store_n( &pEntries_[shardStart+index].key, emptyKey, __ATOMIC_RELAXED );
+	unlockShard( shard );
+	return true;
+}
+
+memcounter::BlockSideTable::Statistics memcounter::BlockSideTable::statistics() const
+{
+	Statistics result;
+	memset( &result, 0, sizeof(result) );
+	result.capacity=capacity_;
+	result.numberOfShards=numberOfShards_;
+	if( !isInitialised() ) return result;
+
+	const size_t numberOfBins=sizeof(result.probeLengthHistogram)/sizeof(result.probeLengthHistogram[0]);
+	size_t totalProbeLength=0;
+	for( size_t index=0; index<capacity_; ++index )
+	{
+		uintptr_t key=__atomic_load_n( &pEntries_[index].key, __ATOMIC_RELAXED );
+		if( key==emptyKey ) continue;
+
+		// Work out how far along the probe sequence this entry is from where it hashed to
+		size_t probeLength=( (index-homeSlot(key)) & (shardSize_-1) )+1;
+		++result.liveEntries;
+		totalProbeLength+=probeLength;
+		if( probeLength>result.maximumProbeLength ) result.maximumProbeLength=probeLength;
+		++result.probeLengthHistogram[ probeLength<numberOfBins ? probeLength-1 : numberOfBins-1 ];
+	}
+	for( size_t shard=0; shard<numberOfShards_; ++shard ) result.failedInserts+=__atomic_load_n( &shards_[shard].failedInserts, __ATOMIC_RELAXED );
+
+	if( result.liveEntries ) result.averageProbeLength=double(totalProbeLength)/double(result.liveEntries);
+	result.loadFactor=double(result.liveEntries)/double(capacity_);
+	return result;
+}
+
+void memcounter::BlockSideTable::dumpStatistics( std::ostream& stream ) const
+{
+	Statistics stats=statistics();
+	stream << "Side table capacity=" << stats.capacity << " in " << stats.numberOfShards << " shards, live entries=" << stats.liveEntries
+			<< ", failed inserts=" << stats.failedInserts << "\n"
+			<< "Load factor=" << stats.loadFactor
+			<< ", average probe length=" << stats.averageProbeLength << ", maximum probe length=" << stats.maximumProbeLength << "\n"
+			<< "Probe length histogram:";
+	const size_t numberOfBins=sizeof(stats.probeLengthHistogram)/sizeof(stats.probeLengthHistogram[0]);
+	for( size_t bin=0; bin<numberOfBins; ++bin ) stream << " " << (bin+1) << (bin+1==numberOfBins ? "+" : "") << "=" << stats.probeLengthHistogram[bin];
+	stream << std::endl;
+}
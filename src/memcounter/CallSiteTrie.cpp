@@ -0,0 +1,83 @@
+#include "memcounter/CallSiteTrie.h"
+
+#include <algorithm>
+
+memcounter::CallSiteTrie::CallSiteTrie()
+	: table_(1024,0), tableMask_(1023), lastNode_(0)
+{
+	// Node zero is the root
+	Node root={ 0, NULL };
+	nodes_.push_back( root );
+}
+
+inline uint32_t memcounter::CallSiteTrie::child( uint32_t parent, void* address )
+{
+	uint64_t hash=( uint64_t(reinterpret_cast<uintptr_t>(address))^( uint64_t(parent)<<40 ) )*0x9E3779B97F4A7C15ULL;
+	size_t slot=( hash>>32 ) & tableMask_;
+	while( uint32_t node=table_[slot] )
+	{
+		if( nodes_[node].parent==parent && nodes_[node].address==address ) return node;
+		slot=( slot+1 ) & tableMask_;
+	}
+
+	uint32_t node=nodes_.size();
+	Node newNode={ parent, address };
+	nodes_.push_back( newNode );
+	table_[slot]=node;
+
+	// Keep the load factor below a half so the probe sequences stay short
+	if( nodes_.size()*2>table_.size() ) growTable();
+	return node;
+}
+
+void memcounter::CallSiteTrie::growTable()
+{
+	std::vector<uint32_t> newTable( table_.size()*2, 0 );
+	size_t newMask=newTable.size()-1;
+	for( uint32_t node=1; node<nodes_.size(); ++node )
+	{
+		uint64_t hash=( uint64_t(reinterpret_cast<uintptr_t>(nodes_[node].address))^( uint64_t(nodes_[node].parent)<<40 ) )*0x9E3779B97F4A7C15ULL;
+		size_t slot=( hash>>32 ) & newMask;
+		while( newTable[slot] ) slot=( slot+1 ) & newMask;
+		newTable[slot]=node;
+	}
+	table_.swap( newTable );
+	tableMask_=newMask;
+}
+
+uint32_t memcounter::CallSiteTrie::intern( void* const* pFrames, size_t depth )
+{
+	if( depth==lastFrames_.size() && std::equal( pFrames, pFrames+depth, lastFrames_.begin() ) ) return lastNode_;
+
+	// Go from the outermost frame inwards so that stacks with the same callers share nodes
+	uint32_t node=0;
+	for( size_t index=depth; index>0; --index ) node=child( node, pFrames[index-1] );
+
+	lastFrames_.assign( pFrames, pFrames+depth );
+	lastNode_=node;
+	return node;
+}
+
+size_t memcounter::CallSiteTrie::numberOfNodes() const
+{
+	return nodes_.size();
+}
+
+void memcounter::CallSiteTrie::clear()
+{
+	// Swap with empty vectors, because clear() doesn't give the memory back
+	std::vector<Node>().swap( nodes_ );
+	std::vector<uint32_t>( 1024, 0 ).swap( table_ );
+	std::vector<void*>().swap( lastFrames_ );
+	tableMask_=1023;
+	lastNode_=0;
+
+	Node root={ 0, NULL };
+	nodes_.push_back( root );
+}
+
+void memcounter::CallSiteTrie::stack( uint32_t node, std::vector<void*>& frames ) const
+{
+	frames.clear();
+	for( ; node!=0; node=nodes_[node].parent ) frames.push_back( nodes_[node].address );
+}
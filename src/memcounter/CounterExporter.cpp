@@ -0,0 +1,138 @@
+#include "memcounter/CounterExporter.h"
+
+#include <cstdio>
+#include <cstring>
+#include <dlfcn.h>
+#include <vector>
+
+#include "memcounter/IMemoryCounter.h"
+#include "memcounter/ReportWriter.h"
+
+namespace // Use the unnamed namespace
+{
+	void writeHex( memcounter::ReportWriter& writer, uintptr_t number )
+	{
+		char digits[2*sizeof(uintptr_t)];
+		size_t numberOfDigits=0;
+		do
+		{
+			digits[numberOfDigits++]="0123456789abcdef"[number & 0xf];
+			number>>=4;
+		} while( number!=0 );
+
+		writer << "0x";
+		while( numberOfDigits>0 ) writer << digits[--numberOfDigits];
+	}
+
+	/** @brief Writes the frame in a way that can't break the folded format, which uses semicolons and spaces as separators. */
+	void writeFrame( memcounter::ReportWriter& writer, void* address )
+	{
+		Dl_info info;
+		if( dladdr( address, &info )!=0 )
+		{
+			if( info.dli_sname!=NULL && strpbrk( info.dli_sname, "; " )==NULL )
+			{
+				writer << info.dli_sname;
+				return;
+			}
+			if( info.dli_fname!=NULL && info.dli_fname[0]!=0 && strpbrk( info.dli_fname, "; " )==NULL )
+			{
+				const char* baseName=strrchr( info.dli_fname, '/' );
+				writer << ( baseName ? baseName+1 : info.dli_fname ) << '+';
+				writeHex( writer, reinterpret_cast<uintptr_t>(address)-reinterpret_cast<uintptr_t>(info.dli_fbase) );
+				return;
+			}
+		}
+		writeHex( writer, reinterpret_cast<uintptr_t>(address) );
+	}
+
+	/** @brief Writes the text as one CSV field, in double quotes if it has anything in it that would otherwise split or end the field. */
+	void writeCsvField( memcounter::ReportWriter& writer, const char* text )
+	{
+		if( strpbrk( text, ",\"\r\n" )==NULL )
+		{
+			writer << text;
+			return;
+		}
+		writer << '"';
+		for( const char* pCharacter=text; *pCharacter!=0; ++pCharacter )
+		{
+			if( *pCharacter=='"' ) writer << '"';
+			writer << *pCharacter;
+		}
+		writer << '"';
+	}
+
+	void writeJsonObject( memcounter::ReportWriter& writer, const memcounter::IMemoryCounter& counter )
+	{
+		writer << "{\"enabled\":" << ( counter.isEnabled() ? "true" : "false" )
+				<< ",\"currentSize\":" << counter.currentSize() << ",\"maximumSize\":" << counter.maximumSize()
+				<< ",\"currentUsableSize\":" << counter.currentUsableSize() << ",\"maximumUsableSize\":" << counter.maximumUsableSize()
+				<< ",\"currentNumberOfAllocations\":" << counter.currentNumberOfAllocations() << ",\"maximumNumberOfAllocations\":" << counter.maximumNumberOfAllocations()
+				<< ",\"subCounters\":[";
+
+		const std::vector<memcounter::IMemoryCounter*>& subCounters=counter.subCounters();
+		for( std::vector<memcounter::IMemoryCounter*>::const_iterator iSubCounter=subCounters.begin(); iSubCounter!=subCounters.end(); ++iSubCounter )
+		{
+			if( iSubCounter!=subCounters.begin() ) writer << ',';
+			writeJsonObject( writer, **iSubCounter );
+		}
+		writer << "]}";
+	}
+
+	void writeCsvRowsFor( memcounter::ReportWriter& writer, const memcounter::IMemoryCounter& counter, uint64_t snapshot, uint64_t milliseconds, const char* counterName, const char* parentName )
+	{
+		writer << static_cast<unsigned long int>(snapshot) << ',' << static_cast<unsigned long int>(milliseconds/1000) << '.'
+				<< char( '0'+milliseconds/100%10 ) << char( '0'+milliseconds/10%10 ) << char( '0'+milliseconds%10 ) << ',';
+		writeCsvField( writer, counterName );
+		writer << ',';
+		writeCsvField( writer, parentName );
+		writer << ',' << ( counter.isEnabled() ? 1 : 0 )
+				<< ',' << counter.currentSize() << ',' << counter.maximumSize()
+				<< ',' << counter.currentUsableSize() << ',' << counter.maximumUsableSize()
+				<< ',' << counter.currentNumberOfAllocations() << ',' << counter.maximumNumberOfAllocations() << '\n';
+
+		const std::vector<memcounter::IMemoryCounter*>& subCounters=counter.subCounters();
+		for( size_t index=0; index<subCounters.size(); ++index )
+		{
+			char subCounterName[256];
+			snprintf( subCounterName, sizeof(subCounterName), "%s.%lu", counterName, static_cast<unsigned long>(index) );
+			writeCsvRowsFor( writer, *subCounters[index], snapshot, milliseconds, subCounterName, counterName );
+		}
+	}
+}
+
+void memcounter::CounterExporter::writeJson( memcounter::ReportWriter& writer, const memcounter::IMemoryCounter& counter )
+{
+	writeJsonObject( writer, counter );
+	writer << '\n';
+}
+
+void memcounter::CounterExporter::writeCsvHeader( memcounter::ReportWriter& writer )
+{
+	writer << "snapshot,unix_time,counter,parent,enabled,current_size,maximum_size,current_usable_size,maximum_usable_size,current_allocations,maximum_allocations\n";
+}
+
+void memcounter::CounterExporter::writeCsvRows( memcounter::ReportWriter& writer, const memcounter::IMemoryCounter& counter, uint64_t snapshot, uint64_t milliseconds, const char* counterName )
+{
+	writeCsvRowsFor( writer, counter, snapshot, milliseconds, counterName, "" );
+}
+
+size_t memcounter::CounterExporter::writeFoldedStacks( memcounter::ReportWriter& writer, const memcounter::IMemoryCounter& counter )
+{
+	std::vector<memcounter::CallSiteCounts> sites=counter.callSites();
+	size_t numberOfLines=0;
+	for( std::vector<memcounter::CallSiteCounts>::const_iterator iSite=sites.begin(); iSite!=sites.end(); ++iSite )
+	{
+		if( iSite->currentBytes<=0 || iSite->stack.empty() ) continue;
+		// The stacks are innermost first, the folded format wants the outermost first
+		for( std::vector<void*>::const_reverse_iterator iFrame=iSite->stack.rbegin(); iFrame!=iSite->stack.rend(); ++iFrame )
+		{
+			if( iFrame!=iSite->stack.rbegin() ) writer << ';';
+			writeFrame( writer, *iFrame );
+		}
+		writer << ' ' << iSite->currentBytes << '\n';
+		++numberOfLines;
+	}
+	return numberOfLines;
+}
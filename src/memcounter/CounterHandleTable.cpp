@@ -0,0 +1,92 @@
+#include "memcounter/CounterHandleTable.h"
+
+#include "memcounter/CInterface.h"
+#include "memcounter/ThreadMemoryCounterPool.h"
+
+memcounter::CounterHandleTable::CounterHandleTable()
+	: numberOfUsedEntries_(0), reclaimPosition_(0)
+{
+	// The entries are only set up as they're used, so that an unused table doesn't take up any memory
+	pthread_mutex_init( &mutex_, NULL );
+}
+
+memcounter::CounterHandleTable::~CounterHandleTable()
+{
+	pthread_mutex_destroy( &mutex_ );
+}
+
+uint32_t memcounter::CounterHandleTable::add( memcounter::IMemoryCounter* pCounter, uint32_t ownerPool, bool isGlobal )
+{
+	if( pCounter==NULL ) return 0;
+
+	pthread_mutex_lock( &mutex_ );
+
+	size_t slot=numberOfUsedEntries_;
+	if( slot<capacity ) generations_[slot]=0;
+	else slot=findReclaimableEntry();
+
+	if( slot==capacity )
+	{
+		pthread_mutex_unlock( &mutex_ );
+		return 0;
+	}
+
+	// Zero is never a valid handle, so skip that generation
+	if( ++generations_[slot]==0 ) ++generations_[slot];
+	uint32_t handle=( uint32_t(generations_[slot])<<16 ) | uint32_t(slot);
+
+	// Readers check the handle before and after reading the rest of the entry, so clear it while it changes
+	Entry& entry=entries_[slot];
+	__atomic_store_n( &entry.handle, 0, __ATOMIC_RELAXED );
+	__atomic_thread_fence( __ATOMIC_RELEASE );
+	__atomic_store_n( &entry.ownerPool, ownerPool, __ATOMIC_RELAXED );
+	__atomic_store_n( &entry.pCounter, pCounter, __ATOMIC_RELAXED );
+	__atomic_store_n( &entry.isGlobal, isGlobal, __ATOMIC_RELAXED );
+	__atomic_store_n( &entry.handle, handle, __ATOMIC_RELEASE );
+
+	if( slot==numberOfUsedEntries_ ) __atomic_store_n( &numberOfUsedEntries_, slot+1, __ATOMIC_RELEASE );
+
+	pthread_mutex_unlock( &mutex_ );
+	return handle;
+}
+
+int memcounter::CounterHandleTable::lookup( uint32_t handle, uint32_t callingPool, memcounter::IMemoryCounter*& pCounter, bool& isGlobal, uint32_t* pOwnerPool ) const
+{
+	size_t slot=( handle & 0xffff );
+	if( handle==0 || slot>=__atomic_load_n( &numberOfUsedEntries_, __ATOMIC_ACQUIRE ) ) return MEMCOUNTER_INVALID_HANDLE;
+
+	const Entry& entry=entries_[slot];
+	if( __atomic_load_n( &entry.handle, __ATOMIC_ACQUIRE )!=handle ) return MEMCOUNTER_INVALID_HANDLE;
+	uint32_t ownerPool=__atomic_load_n( &entry.ownerPool, __ATOMIC_RELAXED );
+	memcounter::IMemoryCounter* pEntryCounter=__atomic_load_n( &entry.pCounter, __ATOMIC_RELAXED );
+	bool entryIsGlobal=__atomic_load_n( &entry.isGlobal, __ATOMIC_RELAXED );
+	__atomic_thread_fence( __ATOMIC_ACQUIRE );
+	if( __atomic_load_n( &entry.handle, __ATOMIC_RELAXED )!=handle ) return MEMCOUNTER_INVALID_HANDLE;
+
+	if( ownerPool!=0 && ownerPool!=callingPool )
+	{
+		// The counter has been deleted if its thread has exited, in which case the handle is just stale
+		if( memcounter::ThreadMemoryCounterPool::poolWithIndex( ownerPool )==NULL ) return MEMCOUNTER_INVALID_HANDLE;
+		if( pOwnerPool==NULL ) return MEMCOUNTER_WRONG_THREAD;
+	}
+	else ownerPool=0;
+
+	pCounter=pEntryCounter;
+	isGlobal=entryIsGlobal;
+	if( pOwnerPool ) *pOwnerPool=ownerPool;
+	return MEMCOUNTER_SUCCESS;
+}
+
+size_t memcounter::CounterHandleTable::findReclaimableEntry()
+{
+	// Go round the table from where the last search stopped, so the same entries aren't checked over and over
+	for( size_t checked=0; checked<capacity; ++checked )
+	{
+		size_t slot=reclaimPosition_;
+		reclaimPosition_=( reclaimPosition_+1 )%capacity;
+
+		uint32_t ownerPool=entries_[slot].ownerPool;
+		if( ownerPool!=0 && memcounter::ThreadMemoryCounterPool::poolWithIndex( ownerPool )==NULL ) return slot;
+	}
+	return capacity;
+}
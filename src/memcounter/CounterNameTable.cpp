@@ -0,0 +1,121 @@
+#include "memcounter/CounterNameTable.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <sched.h>
+
+namespace // Use the unnamed namespace
+{
+	/// FNV-1a, which is plenty for the small number of names a program uses
+	uint64_t hashName( const char* name, size_t& length )
+	{
+		uint64_t hash=14695981039346656037ull;
+		for( length=0; name[length]!=0; ++length )
+		{
+			hash^=static_cast<unsigned char>( name[length] );
+			hash*=1099511628211ull;
+		}
+		return hash;
+	}
+}
+
+memcounter::CounterNameTable::CounterNameTable()
+	: retiredLock_(false)
+{
+	memset( records_, 0, sizeof(records_) );
+}
+
+memcounter::CounterNameTable::~CounterNameTable()
+{
+	// The records are left, since something might still be holding on to a name pointer while the program exits
+}
+
+uint32_t memcounter::CounterNameTable::intern( const char* name )
+{
+	if( name==NULL ) return 0;
+
+	size_t length;
+	uint64_t hash=hashName( name, length );
+	Record* pNewRecord=NULL;
+
+	for( size_t probe=0; probe<capacity; ++probe )
+	{
+		size_t position=( hash+probe ) & (capacity-1);
+		Record* pRecord=__atomic_load_n( &records_[position], __ATOMIC_ACQUIRE );
+
+		if( pRecord==NULL )
+		{
+			// Not in the table, so try to claim this entry. Only make the record once, however many entries are tried.
+			if( pNewRecord==NULL )
+			{
+				pNewRecord=static_cast<Record*>( malloc( sizeof(Record)+length ) );
+				if( pNewRecord==NULL ) return 0;
+				memset( pNewRecord, 0, sizeof(Record) );
+				pNewRecord->hash=hash;
+				memcpy( pNewRecord->name, name, length+1 );
+			}
+			if( __atomic_compare_exchange_n( &records_[position], &pRecord, pNewRecord, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE ) ) return position+1;
+			// Another thread got the entry first, and pRecord is now what it put there. It might be the same name.
+		}
+
+		if( pRecord->hash==hash && strcmp( pRecord->name, name )==0 )
+		{
+			free( pNewRecord );
+			return position+1;
+		}
+	}
+
+	free( pNewRecord );
+	return 0;
+}
+
+const char* memcounter::CounterNameTable::name( uint32_t id ) const
+{
+	if( id==0 || id>capacity ) return NULL;
+	Record* pRecord=__atomic_load_n( &records_[id-1], __ATOMIC_ACQUIRE );
+	return pRecord ? pRecord->name : NULL;
+}
+
+void memcounter::CounterNameTable::addRetired( uint32_t id, const long int (&current)[memcounter::CounterValues::numberOfQuantities], const long int (&maximum)[memcounter::CounterValues::numberOfQuantities] )
+{
+	if( id==0 || id>capacity ) return;
+	Record* pRecord=__atomic_load_n( &records_[id-1], __ATOMIC_ACQUIRE );
+	if( pRecord==NULL ) return;
+
+	lockRetired();
+	for( int index=0; index<memcounter::CounterValues::numberOfQuantities; ++index )
+	{
+		pRecord->retiredCurrent[index]+=current[index];
+		pRecord->retiredMaximum[index]+=maximum[index];
+	}
+	++pRecord->numberOfRetiredThreads;
+	unlockRetired();
+}
+
+uint32_t memcounter::CounterNameTable::addRetiredTotals( uint32_t id, long int (&current)[memcounter::CounterValues::numberOfQuantities], long int (&maximum)[memcounter::CounterValues::numberOfQuantities] ) const
+{
+	if( id==0 || id>capacity ) return 0;
+	Record* pRecord=__atomic_load_n( &records_[id-1], __ATOMIC_ACQUIRE );
+	if( pRecord==NULL ) return 0;
+
+	lockRetired();
+	for( int index=0; index<memcounter::CounterValues::numberOfQuantities; ++index )
+	{
+		current[index]+=pRecord->retiredCurrent[index];
+		maximum[index]+=pRecord->retiredMaximum[index];
+	}
+	uint32_t numberOfThreads=pRecord->numberOfRetiredThreads;
+	unlockRetired();
+
+	return numberOfThreads;
+}
+
+void memcounter::CounterNameTable::lockRetired() const
+{
+	while( __atomic_test_and_set( &retiredLock_, __ATOMIC_ACQUIRE ) ) sched_yield();
+}
+
+void memcounter::CounterNameTable::unlockRetired() const
+{
+	__atomic_clear( &retiredLock_, __ATOMIC_RELEASE );
+}
@@ -0,0 +1,34 @@
+#include "memcounter/CycleClock.h"
+
+#include <time.h>
+
+namespace // Use the unnamed namespace
+{
+	inline double secondsSince( const timespec& startTime )
+	{
+		timespec now;
+		clock_gettime( CLOCK_MONOTONIC, &now );
+		return double( now.tv_sec-startTime.tv_sec )+1e-9*double( now.tv_nsec-startTime.tv_nsec );
+	}
+
+	/** @brief The cycle count and time when the library was loaded, which nanosecondsPerCycle measures from. */
+	struct Calibration
+	{
+		uint64_t startCycles;
+		timespec startTime;
+		Calibration()
+		{
+			clock_gettime( CLOCK_MONOTONIC, &startTime );
+			startCycles=memcounter::cycleCount();
+		}
+	} calibration;
+
+} // end of the unnamed namespace
+
+double memcounter::nanosecondsPerCycle()
+{
+	double seconds;
+	while( (seconds=secondsSince( calibration.startTime ))<0.01 ) { /* Wait until the measurement is good enough */ }
+
+	return seconds*1e9/double( memcounter::cycleCount()-calibration.startCycles );
+}
@@ -0,0 +1,203 @@
+#include "memcounter/GlobalMemoryCounter.h"
+
+#include "memcounter/ThreadMemoryCounterPool.h"
+#include "memcounter/DisablingFunctions.h"
+#include "memcounter/LiveExport.h"
+
+// The number of counters and their generations are kept in LiveExport::globals(), so that another
+// process can add the counters up as well
+
+namespace // Use the unnamed namespace
+{
+	/// The object for each index, which is kept when the index is given back so that it can be handed out again
+	memcounter::GlobalMemoryCounter* allCounters[memcounter::GlobalMemoryCounter::maximumNumberOfCounters];
+	/// How many threads have each counter enabled, plus one for its creator until it gives it back
+	uint32_t references[memcounter::GlobalMemoryCounter::maximumNumberOfCounters];
+	/// Bit mask of the indices that have been given back and can be handed out again by create()
+	uint32_t freeIndices=0;
+}
+
+memcounter::GlobalMemoryCounter* memcounter::GlobalMemoryCounter::create( bool reportFailure )
+{
+	// Indices that have been given back are used before new ones
+	uint32_t freeMask=__atomic_load_n( &freeIndices, __ATOMIC_ACQUIRE );
+	while( freeMask!=0 )
+	{
+		size_t index=__builtin_ctz( freeMask );
+		if( __atomic_compare_exchange_n( &freeIndices, &freeMask, freeMask & ~(1u<<index), false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE ) )
+		{
+			__atomic_store_n( &references[index], 1, __ATOMIC_RELEASE );
+			return allCounters[index];
+		}
+	}
+
+	uint32_t& numberOfCounters=memcounter::LiveExport::globals().numberOfGlobalCounters;
+	size_t index=__atomic_fetch_add( &numberOfCounters, 1, __ATOMIC_RELAXED );
+	if( index>=maximumNumberOfCounters )
+	{
+		__atomic_fetch_sub( &numberOfCounters, 1, __ATOMIC_RELAXED );
+		if( reportFailure ) std::cerr << " *MEMCOUNTER* - can't have more than " << maximumNumberOfCounters << " global counters" << std::endl;
+		return NULL;
+	}
+
+	__atomic_store_n( &references[index], 1, __ATOMIC_RELEASE );
+	memcounter::GlobalMemoryCounter* pCounter=new memcounter::GlobalMemoryCounter( index );
+	__atomic_store_n( &allCounters[index], pCounter, __ATOMIC_RELEASE );
+	return pCounter;
+}
+
+void memcounter::GlobalMemoryCounter::addReferences( uint32_t indices )
+{
+	for( uint32_t mask=indices; mask; mask&=mask-1 ) __atomic_add_fetch( &references[__builtin_ctz( mask )], 1, __ATOMIC_RELAXED );
+}
+
+void memcounter::GlobalMemoryCounter::releaseReferences( uint32_t indices )
+{
+	for( uint32_t mask=indices; mask; mask&=mask-1 )
+	{
+		size_t index=__builtin_ctz( mask );
+		if( __atomic_sub_fetch( &references[index], 1, __ATOMIC_ACQ_REL )!=0 ) continue;
+
+		// Nothing can count into the index any more, apart from frees of blocks from threads that had it
+		// enabled when they exited, so forget those. Then the resets make every shard read as zero for
+		// whoever gets the index next.
+		memcounter::ThreadMemoryCounterPool::forgetRetiredGlobalCounter( index );
+		__atomic_fetch_add( &memcounter::LiveExport::globals().generations[index].reset, 1, __ATOMIC_RELAXED );
+		__atomic_fetch_add( &memcounter::LiveExport::globals().generations[index].maximumReset, 1, __ATOMIC_RELAXED );
+		__atomic_fetch_or( &freeIndices, 1u<<index, __ATOMIC_RELEASE );
+	}
+}
+
+size_t memcounter::GlobalMemoryCounter::numberCreated()
+{
+	// create() goes past the maximum for a moment when it fails
+	size_t number=__atomic_load_n( &memcounter::LiveExport::globals().numberOfGlobalCounters, __ATOMIC_ACQUIRE );
+	return number<maximumNumberOfCounters ? number : maximumNumberOfCounters;
+}
+
+const memcounter::GlobalCounterGenerations& memcounter::GlobalMemoryCounter::generations( size_t index )
+{
+	return memcounter::LiveExport::globals().generations[index];
+}
+
+memcounter::GlobalMemoryCounter::GlobalMemoryCounter( size_t index )
+	: index_(index)
+{
+}
+
+memcounter::GlobalMemoryCounter::~GlobalMemoryCounter()
+{
+}
+
+bool memcounter::GlobalMemoryCounter::setEnabled( bool enable )
+{
+	bool oldEnabled=isEnabled();
+	if( enable ) this->enable();
+	else disable();
+	return oldEnabled;
+}
+
+bool memcounter::GlobalMemoryCounter::isEnabled() const
+{
+	memcounter::ThreadMemoryCounterPool* pPool=memcounter::threadState.pPool;
+	return pPool && pPool->isGlobalCounterEnabled( index_ );
+}
+
+void memcounter::GlobalMemoryCounter::enable()
+{
+	// Threads that weren't started through the pthread_create hook don't have a pool
+	if( memcounter::ThreadMemoryCounterPool* pPool=memcounter::threadState.pPool ) pPool->informGlobalEnabled( index_ );
+	else std::cerr << " *MEMCOUNTER* - this thread has no counter pool, so the global counter can't be enabled in it" << std::endl;
+}
+
+void memcounter::GlobalMemoryCounter::disable()
+{
+	if( memcounter::ThreadMemoryCounterPool* pPool=memcounter::threadState.pPool ) pPool->informGlobalDisabled( index_ );
+}
+
+void memcounter::GlobalMemoryCounter::reset()
+{
+	__atomic_fetch_add( &memcounter::LiveExport::globals().generations[index_].reset, 1, __ATOMIC_RELAXED );
+}
+
+void memcounter::GlobalMemoryCounter::resetMaximum()
+{
+	__atomic_fetch_add( &memcounter::LiveExport::globals().generations[index_].maximumReset, 1, __ATOMIC_RELAXED );
+}
+
+void memcounter::GlobalMemoryCounter::totals( long int (&current)[GlobalCounterShard::numberOfQuantities], long int (&maximum)[GlobalCounterShard::numberOfQuantities] ) const
+{
+	for( int index=0; index<GlobalCounterShard::numberOfQuantities; ++index ) current[index]=maximum[index]=0;
+
+	memcounter::ThreadMemoryCounterPool::addGlobalCounterTotals( index_, current, maximum );
+}
+
+void memcounter::GlobalMemoryCounter::dumpContents( std::ostream& stream, const std::string& prefix ) const
+{
+	long int current[GlobalCounterShard::numberOfQuantities], maximum[GlobalCounterShard::numberOfQuantities];
+	totals( current, maximum );
+	stream << prefix << "Global total of current size=" << current[GlobalCounterShard::size] << ", maximum size=" << maximum[GlobalCounterShard::size]
+			<< " (usable current size=" << current[GlobalCounterShard::usableSize] << ", maximum size=" << maximum[GlobalCounterShard::usableSize] << ")" << std::endl;
+}
+
+long int memcounter::GlobalMemoryCounter::currentSize() const
+{
+	long int current[GlobalCounterShard::numberOfQuantities], maximum[GlobalCounterShard::numberOfQuantities];
+	totals( current, maximum );
+	return current[GlobalCounterShard::size];
+}
+
+long int memcounter::GlobalMemoryCounter::maximumSize() const
+{
+	long int current[GlobalCounterShard::numberOfQuantities], maximum[GlobalCounterShard::numberOfQuantities];
+	totals( current, maximum );
+	return maximum[GlobalCounterShard::size];
+}
+
+long int memcounter::GlobalMemoryCounter::currentNumberOfAllocations() const
+{
+	long int current[GlobalCounterShard::numberOfQuantities], maximum[GlobalCounterShard::numberOfQuantities];
+	totals( current, maximum );
+	return current[GlobalCounterShard::numberOfAllocations];
+}
+
+long int memcounter::GlobalMemoryCounter::maximumNumberOfAllocations() const
+{
+	long int current[GlobalCounterShard::numberOfQuantities], maximum[GlobalCounterShard::numberOfQuantities];
+	totals( current, maximum );
+	return maximum[GlobalCounterShard::numberOfAllocations];
+}
+
+const std::vector<memcounter::IMemoryCounter*>& memcounter::GlobalMemoryCounter::subCounters() const
+{
+	return subCounters_;
+}
+
+long int memcounter::GlobalMemoryCounter::currentUsableSize() const
+{
+	long int current[GlobalCounterShard::numberOfQuantities], maximum[GlobalCounterShard::numberOfQuantities];
+	totals( current, maximum );
+	return current[GlobalCounterShard::usableSize];
+}
+
+long int memcounter::GlobalMemoryCounter::maximumUsableSize() const
+{
+	long int current[GlobalCounterShard::numberOfQuantities], maximum[GlobalCounterShard::numberOfQuantities];
+	totals( current, maximum );
+	return maximum[GlobalCounterShard::usableSize];
+}
+
+std::vector<memcounter::SizeClassCounts> memcounter::GlobalMemoryCounter::sizeHistogram() const
+{
+	return std::vector<memcounter::SizeClassCounts>();
+}
+
+std::vector<memcounter::LifetimeBinCounts> memcounter::GlobalMemoryCounter::lifetimeHistogram() const
+{
+	return std::vector<memcounter::LifetimeBinCounts>();
+}
+
+std::vector<memcounter::CallSiteCounts> memcounter::GlobalMemoryCounter::callSites() const
+{
+	return std::vector<memcounter::CallSiteCounts>();
+}
@@ -0,0 +1,263 @@
+#include "memcounter/HeapProfile.h"
+
+#include <cerrno>
+#include <cstring>
+#include <dlfcn.h>
+#include <elf.h>
+#include <link.h>
+#include <time.h>
+#include <unistd.h>
+
+namespace // Use the unnamed namespace
+{
+	// Field numbers from profile.proto
+	namespace ProfileField { enum Field { sampleType=1, sample=2, mapping=3, location=4, function=5, stringTable=6, timeNanos=9, periodType=11, defaultSampleType=14 }; }
+	namespace ValueTypeField { enum Field { type=1, unit=2 }; }
+	namespace SampleField { enum Field { locationId=1, value=2, label=3 }; }
+	namespace LabelField { enum Field { key=1, str=2, num=3 }; }
+	namespace MappingField { enum Field { id=1, memoryStart=2, memoryLimit=3, fileOffset=4, filename=5, buildId=6 }; }
+	namespace LocationField { enum Field { id=1, mappingId=2, address=3, line=4 }; }
+	namespace LineField { enum Field { functionId=1 }; }
+	namespace FunctionField { enum Field { id=1, name=2, systemName=3, filename=4 }; }
+
+	/** @brief An executable segment of the program or one of its libraries, as found by dl_iterate_phdr. */
+	struct LoadedSegment
+	{
+		uintptr_t start;
+		uintptr_t limit;
+		uint64_t fileOffset;
+		std::string filename;
+		std::string buildId; ///< In hex, empty if the file doesn't have one
+	};
+
+	std::string buildIdOf( const dl_phdr_info& info )
+	{
+		for( int index=0; index<info.dlpi_phnum; ++index )
+		{
+			const ElfW(Phdr)& header=info.dlpi_phdr[index];
+			if( header.p_type!=PT_NOTE ) continue;
+
+			// Notes are a header, then the name and the description, each padded to four bytes
+			const char* pNote=reinterpret_cast<const char*>( info.dlpi_addr+header.p_vaddr );
+			const char* pEnd=pNote+header.p_memsz;
+			while( pNote+sizeof(ElfW(Nhdr))<=pEnd )
+			{
+				const ElfW(Nhdr)& note=*reinterpret_cast<const ElfW(Nhdr)*>( pNote );
+				const char* pName=pNote+sizeof(ElfW(Nhdr));
+				const unsigned char* pDescription=reinterpret_cast<const unsigned char*>( pName+( (note.n_namesz+3) & ~3u ) );
+				pNote=reinterpret_cast<const char*>( pDescription )+( (note.n_descsz+3) & ~3u );
+				if( pNote>pEnd ) break;
+				if( note.n_type!=NT_GNU_BUILD_ID || note.n_namesz!=4 || memcmp( pName, "GNU", 4 )!=0 ) continue;
+
+				std::string hex;
+				for( size_t byte=0; byte<note.n_descsz; ++byte )
+				{
+					hex+="0123456789abcdef"[pDescription[byte]>>4];
+					hex+="0123456789abcdef"[pDescription[byte] & 0xf];
+				}
+				return hex;
+			}
+		}
+		return std::string();
+	}
+
+	int addSegments( dl_phdr_info* pInfo, size_t /*size*/, void* pSegments )
+	{
+		std::string filename=( pInfo->dlpi_name ? pInfo->dlpi_name : "" );
+		if( filename.empty() )
+		{
+			// The program itself has no name here
+			char path[4096];
+			ssize_t length=readlink( "/proc/self/exe", path, sizeof(path)-1 );
+			if( length>0 ) filename.assign( path, length );
+		}
+
+		std::string buildId;
+		bool buildIdFound=false;
+		for( int index=0; index<pInfo->dlpi_phnum; ++index )
+		{
+			const ElfW(Phdr)& header=pInfo->dlpi_phdr[index];
+			if( header.p_type!=PT_LOAD || !( header.p_flags & PF_X ) ) continue;
+			if( !buildIdFound )
+			{
+				buildId=buildIdOf( *pInfo );
+				buildIdFound=true;
+			}
+			LoadedSegment segment;
+			segment.start=pInfo->dlpi_addr+header.p_vaddr;
+			segment.limit=segment.start+header.p_memsz;
+			segment.fileOffset=header.p_offset;
+			segment.filename=filename;
+			segment.buildId=buildId;
+			static_cast<std::vector<LoadedSegment>*>( pSegments )->push_back( segment );
+		}
+		return 0;
+	}
+
+	bool writeAll( int fileDescriptor, const unsigned char* pData, size_t size )
+	{
+		while( size>0 )
+		{
+			ssize_t result=write( fileDescriptor, pData, size );
+			if( result<0 && errno==EINTR ) continue;
+			if( result<=0 ) return false;
+			pData+=result;
+			size-=result;
+		}
+		return true;
+	}
+}
+
+memcounter::HeapProfile::HeapProfile()
+	: numberOfSamples_(0)
+{
+	// The string table always starts with the empty string
+	stringIndex( "" );
+	writeValueType( ProfileField::sampleType, "inuse_space", "bytes" );
+	writeValueType( ProfileField::sampleType, "inuse_objects", "count" );
+	writeValueType( ProfileField::sampleType, "alloc_space", "bytes" );
+	writeValueType( ProfileField::sampleType, "alloc_objects", "count" );
+	writeValueType( ProfileField::periodType, "space", "bytes" );
+	profile_.writeVarint( ProfileField::defaultSampleType, stringIndex( "inuse_space" ) );
+}
+
+uint64_t memcounter::HeapProfile::stringIndex( const std::string& text )
+{
+	std::map<std::string,uint64_t>::const_iterator iIndex=stringIndices_.find( text );
+	if( iIndex!=stringIndices_.end() ) return iIndex->second;
+
+	uint64_t index=strings_.size();
+	strings_.push_back( text );
+	stringIndices_[text]=index;
+	return index;
+}
+
+uint64_t memcounter::HeapProfile::locationId( uintptr_t address )
+{
+	std::map<uintptr_t,uint64_t>::const_iterator iId=locationIds_.find( address );
+	if( iId!=locationIds_.end() ) return iId->second;
+
+	locations_.push_back( address );
+	uint64_t id=locations_.size();
+	locationIds_[address]=id;
+	return id;
+}
+
+void memcounter::HeapProfile::writeValueType( uint32_t field, const char* type, const char* unit )
+{
+	memcounter::ProtobufWriter valueType;
+	valueType.writeVarint( ValueTypeField::type, stringIndex( type ) );
+	valueType.writeVarint( ValueTypeField::unit, stringIndex( unit ) );
+	profile_.writeMessage( field, valueType );
+}
+
+void memcounter::HeapProfile::addSample( const std::vector<void*>& stack, const long int (&values)[numberOfSampleTypes], const char* counterName, uint32_t threadIndex )
+{
+	// pprof wants the leaf first, which is the same way round as the stacks are kept
+	std::vector<uint64_t> locationIds;
+	for( std::vector<void*>::const_iterator iFrame=stack.begin(); iFrame!=stack.end(); ++iFrame )
+	{
+		locationIds.push_back( locationId( reinterpret_cast<uintptr_t>(*iFrame)-1 ) );
+	}
+	std::vector<uint64_t> sampleValues( values, values+numberOfSampleTypes );
+
+	memcounter::ProtobufWriter sample;
+	sample.writePackedVarints( SampleField::locationId, locationIds );
+	sample.writePackedVarints( SampleField::value, sampleValues );
+
+	memcounter::ProtobufWriter label;
+	label.writeVarint( LabelField::key, stringIndex( "counter" ) );
+	label.writeVarint( LabelField::str, stringIndex( counterName ) );
+	sample.writeMessage( SampleField::label, label );
+	label.clear();
+	label.writeVarint( LabelField::key, stringIndex( "thread" ) );
+	label.writeVarint( LabelField::num, threadIndex );
+	sample.writeMessage( SampleField::label, label );
+
+	samples_.writeMessage( ProfileField::sample, sample );
+	++numberOfSamples_;
+}
+
+void memcounter::HeapProfile::writeMappings()
+{
+	std::vector<LoadedSegment> segments;
+	dl_iterate_phdr( &addSegments, &segments );
+
+	mappings_.clear();
+	for( std::vector<LoadedSegment>::const_iterator iSegment=segments.begin(); iSegment!=segments.end(); ++iSegment )
+	{
+		memcounter::ProtobufWriter mapping;
+		mapping.writeVarint( MappingField::id, mappings_.size()+1 );
+		mapping.writeVarint( MappingField::memoryStart, iSegment->start );
+		mapping.writeVarint( MappingField::memoryLimit, iSegment->limit );
+		mapping.writeVarint( MappingField::fileOffset, iSegment->fileOffset );
+		mapping.writeVarint( MappingField::filename, stringIndex( iSegment->filename ) );
+		if( !iSegment->buildId.empty() ) mapping.writeVarint( MappingField::buildId, stringIndex( iSegment->buildId ) );
+		profile_.writeMessage( ProfileField::mapping, mapping );
+
+		memcounter::HeapProfile::AddressRange range={ iSegment->start, iSegment->limit };
+		mappings_.push_back( range );
+	}
+}
+
+void memcounter::HeapProfile::writeLocations()
+{
+	std::map<std::string,uint64_t> functionIds;
+	for( size_t index=0; index<locations_.size(); ++index )
+	{
+		uintptr_t address=locations_[index];
+		memcounter::ProtobufWriter location;
+		location.writeVarint( LocationField::id, index+1 );
+		for( size_t mapping=0; mapping<mappings_.size(); ++mapping )
+		{
+			if( address>=mappings_[mapping].start && address<mappings_[mapping].limit )
+			{
+				location.writeVarint( LocationField::mappingId, mapping+1 );
+				break;
+			}
+		}
+		location.writeVarint( LocationField::address, address );
+
+		// The names from dladdr are only the exported symbols, pprof replaces them if it can find the binary
+		Dl_info info;
+		if( dladdr( reinterpret_cast<void*>(address), &info )!=0 && info.dli_sname!=NULL )
+		{
+			std::map<std::string,uint64_t>::const_iterator iFunction=functionIds.find( info.dli_sname );
+			uint64_t functionId;
+			if( iFunction!=functionIds.end() ) functionId=iFunction->second;
+			else
+			{
+				functionId=functionIds.size()+1;
+				functionIds[info.dli_sname]=functionId;
+
+				memcounter::ProtobufWriter function;
+				function.writeVarint( FunctionField::id, functionId );
+				function.writeVarint( FunctionField::name, stringIndex( info.dli_sname ) );
+				function.writeVarint( FunctionField::systemName, stringIndex( info.dli_sname ) );
+				if( info.dli_fname!=NULL ) function.writeVarint( FunctionField::filename, stringIndex( info.dli_fname ) );
+				profile_.writeMessage( ProfileField::function, function );
+			}
+
+			memcounter::ProtobufWriter line;
+			line.writeVarint( LineField::functionId, functionId );
+			location.writeMessage( LocationField::line, line );
+		}
+		profile_.writeMessage( ProfileField::location, location );
+	}
+}
+
+bool memcounter::HeapProfile::write( int fileDescriptor )
+{
+	// Everything that refers to a string has to be done before the string table is written
+	writeMappings();
+	writeLocations();
+	timespec now;
+	clock_gettime( CLOCK_REALTIME, &now );
+	profile_.writeInt64( ProfileField::timeNanos, int64_t(now.tv_sec)*1000000000+now.tv_nsec );
+	for( std::vector<std::string>::const_iterator iString=strings_.begin(); iString!=strings_.end(); ++iString )
+	{
+		profile_.writeBytes( ProfileField::stringTable, iString->data(), iString->size() );
+	}
+
+	return writeAll( fileDescriptor, profile_.data(), profile_.size() ) && writeAll( fileDescriptor, samples_.data(), samples_.size() );
+}
@@ -4,13 +4,33 @@
 #include <pthread.h>
 #include <vector>
 
-#include "memcounter/MutexSentry.h"
 #include "memcounter/IMemoryCounter.h"
 #include "memcounter/ThreadMemoryCounterPool.h"
+#include "memcounter/MemoryCounterImplementation.h"
 #include "memcounter/DisablingFunctions.h"
+#include "memcounter/BlockSideTable.h"
+#include "memcounter/BlockDetails.h"
+#include "memcounter/CycleClock.h"
+#include "memcounter/GlobalMemoryCounter.h"
+#include "memcounter/CounterHandleTable.h"
+#include "memcounter/CounterNameTable.h"
+#include "memcounter/TelemetryWriter.h"
+#include "memcounter/TraceWriter.h"
+#include "memcounter/ReportWriter.h"
+#include "memcounter/SnapshotWriter.h"
+#include "memcounter/LiveExport.h"
+#include "memcounter/CounterExporter.h"
+#include "memcounter/CInterface.h"
 
 #include <malloc.h>
 #include <unistd.h> // Required to get the pagesize for valloc
+#include <cstring> // Required for strcmp and memcpy
+#include <cmath> // Required for the sampling intervals
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <algorithm>
 
 // The IgHook library
 #include <cstdlib>
@@ -37,24 +57,22 @@ LIBHOOK(4, int, dopthread_create, _pthread21, (pthread_t *thread, const pthread_
 
 // These are the implementations of the functions defined in DisablingFunctions.h
 // This is the extern from the disabling functions
-namespace // Use the unnamed namespace
-{
-	// If this key is non-zero for a given thread then the memory counting functions will just do
-	// the normal behaviour, i.e. pass the calls on to the real malloc etcetera without recording
-	// anything.
-	pthread_key_t memcounter_threadDisabled;
-}
 bool memcounter_globallyDisabled=true;
+// If countingEnabled is false for a given thread then the memory counting functions will just do
+// the normal behaviour, i.e. pass the calls on to the real malloc etcetera without recording
+// anything.
+__thread memcounter::ThreadState memcounter::threadState __attribute__((tls_model("initial-exec")));
+
 void memcounter::enableThisThread()
 {
 //	std::cerr << " *** Enabling thread *** " << std::endl;
-	pthread_setspecific( memcounter_threadDisabled, 0 );
+	memcounter::threadState.countingEnabled=true;
 }
 
 void memcounter::disableThisThread()
 {
 //	std::cerr << " *** Disabling thread *** " << std::endl;
-	pthread_setspecific( memcounter_threadDisabled, &memcounter_globallyDisabled );
+	memcounter::threadState.countingEnabled=false;
 }
 
 /*
@@ -84,6 +102,235 @@ extern "C"
 	{
 		return memcounter::IntrusiveMemoryCounterManager::instance().createNewMemoryCounter();
 	}
+
+	/** @brief Returns the calling thread's counter for the name, creating it the first time.
+	 *
+	 * Every call with the same name in the same thread gives the same counter. To avoid hashing the name
+	 * each time, get its id once with memoryCounterNameId and use namedMemoryCounterForId.
+	 */
+	VISIBLE IMemoryCounter* createNamedMemoryCounter( const char* name )
+	{
+		memcounter::IntrusiveMemoryCounterManager& manager=memcounter::IntrusiveMemoryCounterManager::instance();
+		return manager.namedMemoryCounter( manager.memoryCounterNameId( name ) );
+	}
+
+	/// Returns an id for the name that's the same in every thread, so it can be kept in a static. Zero if there are too many names.
+	VISIBLE uint32_t memoryCounterNameId( const char* name )
+	{
+		return memcounter::IntrusiveMemoryCounterManager::instance().memoryCounterNameId( name );
+	}
+
+	/// The same as createNamedMemoryCounter, but after the first call for a name in a thread it's just an array lookup
+	VISIBLE IMemoryCounter* namedMemoryCounterForId( uint32_t nameId )
+	{
+		return memcounter::IntrusiveMemoryCounterManager::instance().namedMemoryCounter( nameId );
+	}
+
+	/// Prints the totals for each named counter, for every thread whether running or exited
+	VISIBLE void dumpNamedMemoryCounters( void )
+	{
+		memcounter::IntrusiveMemoryCounterManager::instance().dumpNamedCounters( std::cerr );
+	}
+
+	/** @brief Writes the counter and its sub-counters to the file descriptor as one line of JSON.
+	 *
+	 * Like the other exports, this formats into a fixed buffer on the stack so nothing is allocated for the
+	 * output, and counting is off for the calling thread while the counters are read.
+	 */
+	VISIBLE void writeMemoryCounterJson( IMemoryCounter* pCounter, int fileDescriptor )
+	{
+		bool countingWasEnabled=memcounter::threadState.countingEnabled;
+		memcounter::threadState.countingEnabled=false;
+
+		memcounter::ReportWriter writer;
+		writer.start( fileDescriptor );
+		memcounter::CounterExporter::writeJson( writer, *pCounter );
+		writer.flush();
+
+		memcounter::threadState.countingEnabled=countingWasEnabled;
+	}
+
+	/** @brief Writes a row of CSV for each of the counters and their sub-counters, all with the same snapshot number and time.
+	 *
+	 * Counters made by createNamedMemoryCounter are called by their name, the rest by their position in the
+	 * array. The column names are written first if the file is empty, or for the first snapshot if it isn't
+	 * a regular file.
+	 */
+	VISIBLE void writeMemoryCountersCsv( IMemoryCounter* const* pCounters, size_t numberOfCounters, int fileDescriptor )
+	{
+		static uint64_t numberOfSnapshots=0;
+		bool countingWasEnabled=memcounter::threadState.countingEnabled;
+		memcounter::threadState.countingEnabled=false;
+
+		uint64_t snapshot=__atomic_add_fetch( &numberOfSnapshots, 1, __ATOMIC_RELAXED );
+		timespec now;
+		clock_gettime( CLOCK_REALTIME, &now );
+		uint64_t milliseconds=uint64_t(now.tv_sec)*1000+now.tv_nsec/1000000;
+
+		memcounter::ReportWriter writer;
+		writer.start( fileDescriptor );
+		struct stat fileStatus;
+		if( fstat( fileDescriptor, &fileStatus )==0 && ( S_ISREG(fileStatus.st_mode) ? fileStatus.st_size==0 : snapshot==1 ) )
+		{
+			memcounter::CounterExporter::writeCsvHeader( writer );
+		}
+		for( size_t index=0; index<numberOfCounters; ++index )
+		{
+			const char* counterName=memcounter::IntrusiveMemoryCounterManager::instance().counterName( pCounters[index] );
+			char numberedName[32];
+			if( counterName==NULL )
+			{
+				snprintf( numberedName, sizeof(numberedName), "%lu", static_cast<unsigned long>(index) );
+				counterName=numberedName;
+			}
+			memcounter::CounterExporter::writeCsvRows( writer, *pCounters[index], snapshot, milliseconds, counterName );
+		}
+		writer.flush();
+
+		memcounter::threadState.countingEnabled=countingWasEnabled;
+	}
+
+	/// Writes where the counter's outstanding bytes were allocated as folded stacks for a flame graph. Returns the number of stacks, zero unless MEMCOUNTER_CALLSITE_DEPTH is set.
+	VISIBLE size_t writeMemoryCounterFoldedStacks( IMemoryCounter* pCounter, int fileDescriptor )
+	{
+		bool countingWasEnabled=memcounter::threadState.countingEnabled;
+		memcounter::threadState.countingEnabled=false;
+
+		memcounter::ReportWriter writer;
+		writer.start( fileDescriptor );
+		size_t numberOfStacks=memcounter::CounterExporter::writeFoldedStacks( writer, *pCounter );
+		writer.flush();
+
+		memcounter::threadState.countingEnabled=countingWasEnabled;
+		return numberOfStacks;
+	}
+
+	/** @brief Writes every counter the calling thread has created as a pprof heap profile. Returns false if it couldn't all be written.
+	 *
+	 * Each sample is labelled with its counter, so "pprof -tagfocus counter=..." picks out one. Without
+	 * MEMCOUNTER_CALLSITE_DEPTH there are no stacks, just one sample for each counter.
+	 */
+	VISIBLE bool writeHeapProfile( int fileDescriptor )
+	{
+		return memcounter::IntrusiveMemoryCounterManager::instance().writeHeapProfile( NULL, fileDescriptor );
+	}
+
+	/// The same as writeHeapProfile but only for the one counter, which has to belong to the calling thread
+	VISIBLE bool writeMemoryCounterProfile( IMemoryCounter* pCounter, int fileDescriptor )
+	{
+		return memcounter::IntrusiveMemoryCounterManager::instance().writeHeapProfile( pCounter, fileDescriptor );
+	}
+
+	/// Returns a counter that can be enabled in any number of threads and adds them all up, see memcounter::GlobalMemoryCounter
+	VISIBLE IMemoryCounter* createNewGlobalMemoryCounter( void )
+	{
+		return memcounter::IntrusiveMemoryCounterManager::instance().createNewGlobalMemoryCounter();
+	}
+
+	/** @brief Entry point for the inline client API in ThreadCounter.h.
+	 *
+	 * Returns a paused counter for the calling thread, and if it got a slot fills in where the thread's
+	 * ClientThreadState is and the counter's bit in it. Otherwise the state is left alone and the bit is
+	 * zero, so the caller's default state has to be harmless to write to. The library keeps hold of
+	 * pSlotBit, and sets it back to zero if the counter gives up its slot.
+	 */
+	VISIBLE IMemoryCounter* createNewClientMemoryCounter( memcounter::ClientThreadState** ppState, uint32_t* pSlotBit )
+	{
+		IMemoryCounter* pCounter=memcounter::IntrusiveMemoryCounterManager::instance().createNewPausedMemoryCounter( *pSlotBit );
+		if( *pSlotBit!=0 ) *ppState=&memcounter::threadState;
+		return pCounter;
+	}
+
+	//
+	// The plain C interface from CInterface.h, which refers to counters by handle
+	//
+	VISIBLE MemcounterHandle memcounterCreateCounter( void )
+	{
+		return memcounter::IntrusiveMemoryCounterManager::instance().createCounterHandle( false );
+	}
+
+	VISIBLE MemcounterHandle memcounterCreateGlobalCounter( void )
+	{
+		return memcounter::IntrusiveMemoryCounterManager::instance().createCounterHandle( true );
+	}
+
+	VISIBLE int memcounterEnable( MemcounterHandle handle )
+	{
+		IMemoryCounter* pCounter;
+		bool isGlobal;
+		int result=memcounter::IntrusiveMemoryCounterManager::instance().counterForHandle( handle, pCounter, isGlobal );
+		if( result==MEMCOUNTER_SUCCESS ) pCounter->enable();
+		return result;
+	}
+
+	VISIBLE int memcounterDisable( MemcounterHandle handle )
+	{
+		IMemoryCounter* pCounter;
+		bool isGlobal;
+		int result=memcounter::IntrusiveMemoryCounterManager::instance().counterForHandle( handle, pCounter, isGlobal );
+		if( result==MEMCOUNTER_SUCCESS ) pCounter->disable();
+		return result;
+	}
+
+	VISIBLE int memcounterReset( MemcounterHandle handle )
+	{
+		IMemoryCounter* pCounter;
+		bool isGlobal;
+		int result=memcounter::IntrusiveMemoryCounterManager::instance().counterForHandle( handle, pCounter, isGlobal );
+		if( result==MEMCOUNTER_SUCCESS ) pCounter->reset();
+		return result;
+	}
+
+	VISIBLE int memcounterResetMaximum( MemcounterHandle handle )
+	{
+		IMemoryCounter* pCounter;
+		bool isGlobal;
+		int result=memcounter::IntrusiveMemoryCounterManager::instance().counterForHandle( handle, pCounter, isGlobal );
+		if( result==MEMCOUNTER_SUCCESS ) pCounter->resetMaximum();
+		return result;
+	}
+
+	VISIBLE int memcounterIsEnabled( MemcounterHandle handle )
+	{
+		IMemoryCounter* pCounter;
+		bool isGlobal;
+		int result=memcounter::IntrusiveMemoryCounterManager::instance().counterForHandle( handle, pCounter, isGlobal );
+		if( result==MEMCOUNTER_SUCCESS ) return pCounter->isEnabled() ? 1 : 0;
+		return result;
+	}
+
+	VISIBLE int memcounterSnapshot( MemcounterHandle handle, MemcounterSnapshot* pSnapshot, size_t snapshotSize )
+	{
+		if( memcounter::IntrusiveMemoryCounterManager::instance().snapshotCounters( &handle, 1, pSnapshot, snapshotSize )==1 ) return MEMCOUNTER_SUCCESS;
+		// Run the lookup again to find out why it failed. Other threads' counters can be read, so if it
+		// was one of those its thread must have exited part way through.
+		IMemoryCounter* pCounter;
+		bool isGlobal;
+		int result=memcounter::IntrusiveMemoryCounterManager::instance().counterForHandle( handle, pCounter, isGlobal );
+		return result==MEMCOUNTER_WRONG_THREAD ? MEMCOUNTER_INVALID_HANDLE : result;
+	}
+
+	VISIBLE int memcounterSnapshots( const MemcounterHandle* handles, size_t numberOfHandles, MemcounterSnapshot* pSnapshots, size_t snapshotSize )
+	{
+		return memcounter::IntrusiveMemoryCounterManager::instance().snapshotCounters( handles, numberOfHandles, pSnapshots, snapshotSize );
+	}
+
+	VISIBLE size_t memcounterNamedTotals( MemcounterNamedTotals* pTotals, size_t maximumNumber, size_t totalsSize )
+	{
+		return memcounter::IntrusiveMemoryCounterManager::instance().namedCounterTotals( pTotals, maximumNumber, totalsSize );
+	}
+
+	/// Prints how full the side table is and how long the probe sequences are, to help with choosing MEMCOUNTER_SIDETABLE_CAPACITY
+	VISIBLE void dumpSideTableStatistics( void )
+	{
+		memcounter::IntrusiveMemoryCounterManager::instance().dumpSideTableStatistics( std::cerr );
+	}
+
+	/// Only records one allocation in every averageBytes bytes, see IntrusiveMemoryCounterManager::setSamplingInterval
+	VISIBLE bool setSamplingInterval( size_t averageBytes )
+	{
+		return memcounter::IntrusiveMemoryCounterManager::instance().setSamplingInterval( averageBytes );
+	}
 }
 
 
@@ -113,12 +360,14 @@ namespace // Use the unnamed namespace
 	{
 		void* pOriginalPtr;
 		size_t size;
+		uint32_t weight; ///< See memcounter::BlockDetails
 		struct HeaderIdentifier do_not_access_this; // Imperative that this is the last member
 	};
 
 	struct FixedMemoryBlockHeader
 	{
 		size_t size;
+		uint32_t weight; ///< See memcounter::BlockDetails. This fits in the padding so the header is still 16 bytes.
 		struct HeaderIdentifier do_not_access_this; // Imperative that this is the last member
 	};
 
@@ -132,6 +381,456 @@ namespace // Use the unnamed namespace
 	const HeaderIdentifier sizeHasBeenStored={'g','%','z','('}; // random arbitrary bytes
 	const HeaderIdentifier variableSizeHasBeenStored={'r','q','q',''};
 
+	/** @brief The different ways of finding out the size of a block when it is freed.
+	 *
+	 * This is set once at startup from the MEMCOUNTER_SIZE_TRACKING environment variable, since a
+	 * block allocated with one method can't be freed with another.
+	 */
+	enum SizeTracking
+	{
+		HeaderSizeTracking, ///< Store the size in a header in front of every block (the default)
+		UsableSizeTracking, ///< Leave blocks untouched and ask the allocator with malloc_usable_size
+		SideTableSizeTracking ///< Leave blocks untouched and store the size in sideTable
+	};
+	SizeTracking sizeTracking=HeaderSizeTracking;
+
+	/// Where the block sizes are kept if sizeTracking is SideTableSizeTracking
+	memcounter::BlockSideTable sideTable;
+
+	/// The average number of bytes allocated between allocations that get recorded, or zero to record every
+	/// allocation. Each thread picks up a change the next time it allocates while counting.
+	size_t samplingInterval=0;
+	/// The highest weight a sampled block can have, which is only reached for tiny blocks with a large interval
+	const uint32_t maximumSampleWeight=0xffffffff;
+
+	/// If true every tracked block is stamped with the cycle count when it's allocated, and the time it was
+	/// allocated for is recorded when it's freed. Set once at startup from MEMCOUNTER_LIFETIMES since it
+	/// changes the size of the headers.
+	bool recordLifetimes=false;
+
+	/// How many return addresses of the stack to record for each block, or zero not to record call sites.
+	/// Set once at startup from MEMCOUNTER_CALLSITE_DEPTH since it changes the size of the headers.
+	size_t callSiteDepth=0;
+	/// If false, stacks are always captured with _Unwind_Backtrace. Set from MEMCOUNTER_CALLSITE_UNWINDER.
+	bool useFramePointers=true;
+
+	/// If true the pool that allocated each block is stored with it, so that when another thread frees it
+	/// it comes off the right counters. Off by default since it adds to every header, set once at startup
+	/// from MEMCOUNTER_CROSS_THREAD_FREES.
+	bool trackOwnership=false;
+
+	/// If true, threads started while any counters are enabled count their memory against those counters
+	/// as well. Set once at startup from MEMCOUNTER_INHERIT_COUNTERS.
+	bool inheritCounters=false;
+
+	/// Writes the trace of every tracked allocation and free if MEMCOUNTER_TRACE_FILE is set. It's here rather
+	/// than in the manager so that it's constructed before the manager starts it and destroyed after.
+	memcounter::TraceWriter traceWriter;
+	/// Only true while traceWriter is running, so the hooks check this rather than asking it
+	bool tracing=false;
+
+	/// Where the report on exit or a fatal signal goes, from MEMCOUNTER_REPORT_FILE. Empty for no report.
+	/// Copied into a fixed array at startup so that the signal handler doesn't need to call getenv.
+	char reportFile[4096];
+	memcounter::ReportWriter reportWriter;
+	bool reportWritten=false; ///< Only the first exit, kill or signal gets a report
+	/// The signals that get a report, as long as the program hasn't already set what they do
+	const int fatalSignals[]={ SIGSEGV, SIGBUS, SIGILL, SIGFPE, SIGABRT, SIGTERM };
+	struct sigaction previousActions[NSIG];
+
+	/** @brief Details that are only stored in front of the header if the optional features that need them are switched on.
+	 *
+	 * It's kept a multiple of 16 bytes so that the program's memory stays aligned.
+	 */
+	struct HeaderExtras
+	{
+		uint64_t allocationTime;
+		uint32_t callSite;
+		uint32_t allocatingPool;
+	};
+
+	/// Returns the size of the extras in front of every header, which is zero unless an optional feature needs them
+	inline size_t headerExtrasSize()
+	{
+		return ( recordLifetimes || callSiteDepth || trackOwnership ) ? sizeof(::HeaderExtras) : 0;
+	}
+
+	/// Returns how far into the block the program's memory starts when a fixed header is used
+	inline size_t fixedHeaderSize()
+	{
+		return sizeof(::FixedMemoryBlockHeader)+headerExtrasSize();
+	}
+
+	/** @brief Puts the header in front of the pointer handed to the program.
+	 *
+	 * @param pOriginalPtr    The pointer the allocator returned
+	 * @param pResult         The pointer that will be handed out to the program. There must be room in front
+	 *                        of it for the header, see headerOffset.
+	 * @param useFixedHeader  Whether pResult is exactly fixedHeaderSize() after pOriginalPtr
+	 */
+	inline void writeHeader( void* pOriginalPtr, void* pResult, bool useFixedHeader, const memcounter::BlockDetails& details )
+	{
+		::HeaderIdentifier* pIdentifier=((::HeaderIdentifier*)pResult)-1;
+		void* pHeaderStart;
+		if( useFixedHeader )
+		{
+			::FixedMemoryBlockHeader* pHeader=((::FixedMemoryBlockHeader*)pResult)-1;
+			pHeader->size=details.size;
+			pHeader->weight=details.weight;
+			*pIdentifier=sizeHasBeenStored;
+			pHeaderStart=pHeader;
+		}
+		else
+		{
+			::VariableMemoryBlockHeader* pHeader=((::VariableMemoryBlockHeader*)pResult)-1;
+			pHeader->size=details.size;
+			pHeader->weight=details.weight;
+			pHeader->pOriginalPtr=pOriginalPtr;
+			*pIdentifier=variableSizeHasBeenStored;
+			pHeaderStart=pHeader;
+		}
+
+		if( headerExtrasSize() )
+		{
+			::HeaderExtras* pExtras=((::HeaderExtras*)pHeaderStart)-1;
+			pExtras->allocationTime=details.allocationTime;
+			pExtras->callSite=details.callSite;
+			pExtras->allocatingPool=details.allocatingPool;
+		}
+	}
+
+	/** @brief Returns true and fills in the details and the pointer the allocator returned if the block has a header. */
+	inline bool readHeader( void* ptr, void*& pOriginalPtr, memcounter::BlockDetails& details )
+	{
+		::HeaderIdentifier* pIdentifier=((::HeaderIdentifier*)ptr)-1;
+		void* pHeaderStart;
+		if( *pIdentifier==sizeHasBeenStored )
+		{
+			::FixedMemoryBlockHeader* pHeader=((::FixedMemoryBlockHeader*)ptr)-1;
+			details.size=pHeader->size;
+			details.weight=pHeader->weight;
+			pOriginalPtr=(void*)( ((char*)pHeader)-headerExtrasSize() );
+			pHeaderStart=pHeader;
+		}
+		else if( *pIdentifier==variableSizeHasBeenStored )
+		{
+			::VariableMemoryBlockHeader* pHeader=((::VariableMemoryBlockHeader*)ptr)-1;
+			details.size=pHeader->size;
+			details.weight=pHeader->weight;
+			pOriginalPtr=pHeader->pOriginalPtr;
+			pHeaderStart=pHeader;
+		}
+		else // No identifier found, so this allocation wasn't caught by my malloc hooks
+		{
+			pOriginalPtr=ptr;
+			return false;
+		}
+
+		if( headerExtrasSize() )
+		{
+			const ::HeaderExtras* pExtras=((::HeaderExtras*)pHeaderStart)-1;
+			details.allocationTime=pExtras->allocationTime;
+			details.callSite=pExtras->callSite;
+			details.allocatingPool=pExtras->allocatingPool;
+		}
+		else
+		{
+			details.callSite=0;
+			details.allocatingPool=0;
+		}
+		return true;
+	}
+
+	/** @brief Works out how far into a block the pointer handed to the program has to be so that there's room for a header.
+	 *
+	 * The offset has to be a multiple of unit, which is the alignment for memalign etcetera or the element
+	 * size for calloc. FixedMemoryBlockHeader is smaller than VariableMemoryBlockHeader, so if a fixed header
+	 * can fit I'll use that. It will only work if it fits exactly though.
+	 */
+	inline size_t headerOffset( size_t unit, bool& useFixedHeader )
+	{
+		if( unit<=fixedHeaderSize() && fixedHeaderSize()%unit==0 )
+		{
+			useFixedHeader=true;
+			return fixedHeaderSize();
+		}
+
+		useFixedHeader=false;
+		size_t variableHeaderSize=sizeof(::VariableMemoryBlockHeader)+headerExtrasSize();
+		return ( (variableHeaderSize+unit-1)/unit )*unit; // Always round up
+	}
+
+	/** @brief Returns how much of a block that has a header in front of it the program can use.
+	 *
+	 * @param pOriginalPtr  The pointer the allocator returned
+	 * @param pResult       The pointer after the header that was handed out to the program
+	 */
+	inline size_t usableSizeAfterHeader( void* pOriginalPtr, void* pResult )
+	{
+		return malloc_usable_size( pOriginalPtr )-( static_cast<char*>(pResult)-static_cast<char*>(pOriginalPtr) );
+	}
+
+	//
+	// These are for sampling, where only one allocation in every samplingInterval bytes on average is
+	// recorded. It works the same way as tcmalloc: each thread counts down the bytes it allocates and
+	// records the allocation that takes the count past zero, then starts again from a new interval drawn
+	// from an exponential distribution. That means each byte has the same chance of being picked no
+	// matter what size of block it's in, so a block of size s is picked with probability 1-exp(-s/interval).
+	// The recorded block then stands in for the reciprocal of that many blocks.
+	//
+	/** @brief Returns a random number in [0,1) using xorshift64*, which is good enough for this and doesn't allocate. */
+	inline double randomUniform( memcounter::ThreadState& state )
+	{
+		uint64_t& x=state.randomState;
+		if( x==0 ) x=( uint64_t(reinterpret_cast<uintptr_t>(&state)) ^ uint64_t(getpid())<<32 )*0x9E3779B97F4A7C15ULL | 1;
+		x^=x>>12;
+		x^=x<<25;
+		x^=x>>27;
+		return double( (x*0x2545F4914F6CDD1DULL)>>11 )*( 1.0/9007199254740992.0 );
+	}
+
+	/** @brief Draws the number of bytes until the next sample, which is exponentially distributed with the given mean. */
+	inline long int drawSamplingCountdown( memcounter::ThreadState& state, size_t interval )
+	{
+		if( interval==0 ) return 0;
+		return long( -log(1.0-randomUniform(state))*double(interval) )+1;
+	}
+
+	/** @brief The slow part of sampleWeight, for when the countdown has run out. */
+	uint32_t __attribute__((noinline)) weightForExpiredCountdown( memcounter::ThreadState& state, size_t size )
+	{
+		size_t interval=__atomic_load_n( &samplingInterval, __ATOMIC_RELAXED );
+		if( interval!=state.samplingInterval )
+		{
+			// The interval has changed since this thread's countdown was drawn, so start again at the new
+			// rate. Otherwise the first allocation after sampling is switched on would always be picked.
+			state.samplingInterval=interval;
+			state.bytesUntilSample=drawSamplingCountdown( state, interval );
+			if( (state.bytesUntilSample-=size)>0 ) return 0;
+		}
+
+		if( interval==0 )
+		{
+			// Not sampling, so every block is recorded as itself
+			state.bytesUntilSample=0;
+			return 1;
+		}
+
+		state.bytesUntilSample=drawSamplingCountdown( state, interval );
+
+		// Round the weight up or down at random so that on average it's exactly right. For a zero sized
+		// block the weight is infinite, which is caught by the check against the maximum.
+		double weight=-1.0/expm1( -double(size)/double(interval) );
+		if( !(weight<maximumSampleWeight) ) return maximumSampleWeight;
+		uint32_t result=uint32_t(weight);
+		if( randomUniform(state)<weight-result ) ++result;
+		return result;
+	}
+
+	/** @brief Decides whether a new block should be recorded. Returns zero if not, otherwise how many blocks it stands for.
+	 *
+	 * When the countdown hasn't run out, which is almost every allocation when sampling, this is just a
+	 * subtract and a branch. If not sampling the countdown never goes above zero, so it always ends up
+	 * in weightForExpiredCountdown and returns one.
+	 */
+	inline uint32_t sampleWeight( memcounter::ThreadState& state, size_t size )
+	{
+		if( (state.bytesUntilSample-=size)>0 ) return 0;
+		return weightForExpiredCountdown( state, size );
+	}
+
+	/** @brief Fills in the details for a new block, stamping it with the time and call site if those are being recorded. */
+	inline memcounter::BlockDetails newBlockDetails( memcounter::ThreadState& state, size_t size, uint32_t weight )
+	{
+		memcounter::BlockDetails details={ size, weight, 0, state.pPool->index(), 0 };
+		if( recordLifetimes ) details.allocationTime=memcounter::cycleCount();
+		if( callSiteDepth )
+		{
+			// The trie might need more memory, so don't count it
+			bool countingWasEnabled=state.countingEnabled;
+			state.countingEnabled=false;
+			details.callSite=state.pPool->currentCallSite( callSiteDepth, useFramePointers );
+			state.countingEnabled=countingWasEnabled;
+		}
+		return details;
+	}
+
+	/** @brief Returns the call site to take a released block off, which is none if another thread allocated it.
+	 *
+	 * Call site nodes only mean something in the trie of the thread that allocated the block.
+	 */
+	inline uint32_t releasedCallSite( const memcounter::ThreadState& state, const memcounter::BlockDetails& details )
+	{
+		return details.allocatingPool==state.pPool->index() ? details.callSite : 0;
+	}
+
+	//
+	// These tell all of the enabled counters for the thread about a change. Memory counting is
+	// disabled while they do so in case any of the calls create a recursive loop. Blocks that are
+	// released, including the old block in a realloc, have their lifetime recorded if required.
+	// Counting is only switched back on if there's still something to count, since the client API
+	// can pause every counter without telling the library.
+	//
+	inline void addToEnabledCounters( memcounter::ThreadState& state, const memcounter::BlockDetails& details, size_t usableSize )
+	{
+		state.countingEnabled=false;
+		state.pPool->addToAllEnabledCounters( details.size, usableSize, details.weight, details.callSite );
+		state.countingEnabled=state.pPool->hasActiveCounters();
+	}
+
+	/** @brief For a realloc where the block keeps the same weight. */
+	inline void modifyEnabledCounters( memcounter::ThreadState& state, const memcounter::BlockDetails& oldDetails, size_t oldUsableSize, const memcounter::BlockDetails& newDetails, size_t newUsableSize )
+	{
+		state.countingEnabled=false;
+		state.pPool->modifyAllEnabledCounters( oldDetails.size, oldUsableSize, newDetails.size, newUsableSize, newDetails.weight, releasedCallSite( state, oldDetails ), newDetails.callSite );
+		if( recordLifetimes ) state.pPool->recordLifetime( oldDetails.size, oldDetails.weight, newDetails.allocationTime-oldDetails.allocationTime );
+		state.countingEnabled=state.pPool->hasActiveCounters();
+	}
+
+	inline void removeFromEnabledCounters( memcounter::ThreadState& state, const memcounter::BlockDetails& details, size_t usableSize )
+	{
+		state.countingEnabled=false;
+		state.pPool->removeFromAllEnabledCounters( details.size, usableSize, details.weight, releasedCallSite( state, details ) );
+		if( recordLifetimes ) state.pPool->recordLifetime( details.size, details.weight, memcounter::cycleCount()-details.allocationTime );
+		state.countingEnabled=state.pPool->hasActiveCounters();
+	}
+
+	/** @brief Returns true if the block was allocated by another thread, so it has to come off that thread's counters. */
+	inline bool isRemoteBlock( const memcounter::ThreadState& state, const memcounter::BlockDetails& details )
+	{
+		return trackOwnership && details.allocatingPool!=0 && ( state.pPool==NULL || details.allocatingPool!=state.pPool->index() );
+	}
+
+	/** @brief Takes a block that is being freed, or the old block in a realloc, off the counters of the thread that allocated it.
+	 *
+	 * If that's this thread it's only done if counting, the same as always. Otherwise the block is put on
+	 * the other thread's remote free queue whether this thread is counting or not.
+	 */
+	inline void releaseBlock( memcounter::ThreadState& state, bool counting, const memcounter::BlockDetails& details, size_t usableSize )
+	{
+		if( isRemoteBlock( state, details ) )
+		{
+			memcounter::ThreadMemoryCounterPool* pOwner=memcounter::ThreadMemoryCounterPool::poolWithIndex( details.allocatingPool );
+			if( pOwner )
+			{
+				memcounter::RemoteFreeQueue::Entry entry={ details.size, usableSize, details.weight, details.callSite,
+						recordLifetimes ? memcounter::cycleCount()-details.allocationTime : memcounter::RemoteFreeQueue::noLifetime };
+				if( pOwner->pushRemoteFree( entry, details.allocatingPool ) ) return;
+			}
+
+			// The allocating thread has exited, so its own counters have gone
+			memcounter::ThreadMemoryCounterPool::releaseRetiredBlock( state.pPool, details.allocatingPool, details.size, usableSize, details.weight );
+			return;
+		}
+		if( counting ) removeFromEnabledCounters( state, details, usableSize );
+	}
+
+	/** @brief Adds an event to the thread's part of the allocation trace if tracing.
+	 *
+	 * Only blocks the counters know about are traced. The thread's counters at the time are recorded so
+	 * that the trace can be split up by counter afterwards. Threads without a pool have nowhere to put
+	 * the event, so anything they do is missing from the trace.
+	 */
+	inline void traceEvent( memcounter::ThreadState& state, memcounter::TraceEvent::Type type, const void* pOldBlock, const void* pBlock, size_t size, uint32_t weight )
+	{
+		if( LIKELY(!tracing) || state.pPool==NULL ) return;
+		memcounter::ThreadMemoryCounterPool& pool=*state.pPool;
+		pool.traceBuffer().record( traceWriter, pool.index(), type, memcounter::cycleCount(), reinterpret_cast<uintptr_t>(pOldBlock), reinterpret_cast<uintptr_t>(pBlock),
+				size, weight, pool.activeSlots(), pool.enabledGlobalCounters() );
+	}
+
+	//
+	// These are for the size tracking modes that pass blocks through untouched.
+	//
+	/** @brief Remembers the details of a new block if required and adds it to the counters. */
+	inline void countNewUntouchedBlock( memcounter::ThreadState& state, memcounter::TraceEvent::Type type, void* pBlock, size_t size, uint32_t weight )
+	{
+		if( pBlock==NULL ) return;
+		size_t usableSize=malloc_usable_size( pBlock );
+		// The requested size isn't known in usable mode when the block is freed, so report usable
+		// for both to keep currentSize consistent.
+		memcounter::BlockDetails details=newBlockDetails( state, sizeTracking==UsableSizeTracking ? usableSize : size, weight );
+
+		// If the side table is full the block isn't tracked, so it mustn't be counted either
+		if( sizeTracking==SideTableSizeTracking && !sideTable.insert( pBlock, details ) ) return;
+
+		addToEnabledCounters( state, details, usableSize );
+		traceEvent( state, type, NULL, pBlock, details.size, weight );
+	}
+
+	/** @brief Gets the details of a block that is about to be released and forgets it. Returns false if the block wasn't tracked.
+	 *
+	 * In usable mode there's nowhere to remember which blocks were counted, so every block counts as
+	 * tracked, including ones allocated before the counters were enabled. See the README.
+	 */
+	inline bool forgetUntouchedBlock( void* pBlock, memcounter::BlockDetails& details, size_t& usableSize )
+	{
+		usableSize=malloc_usable_size( pBlock );
+		if( sizeTracking==UsableSizeTracking )
+		{
+			memcounter::BlockDetails usableDetails={ usableSize, 1, 0, 0, 0 };
+			details=usableDetails;
+			return true;
+		}
+		return sideTable.erase( pBlock, details );
+	}
+
+
+	/** @brief Writes the report of every thread's counters to MEMCOUNTER_REPORT_FILE, if set and not already done.
+	 *
+	 * This is called from the exit and kill hooks and the fatal signal handler, so everything in it has
+	 * to be async signal safe. The file is opened for appending, or "stderr" writes to standard error.
+	 */
+	void writeCounterReport( const char* event, long int number )
+	{
+		if( reportFile[0]==0 || __atomic_test_and_set( &reportWritten, __ATOMIC_ACQ_REL ) ) return;
+
+		bool toStandardError=( strcmp( reportFile, "stderr" )==0 );
+		int fileDescriptor=( toStandardError ? STDERR_FILENO : open( reportFile, O_WRONLY | O_CREAT | O_APPEND, 0644 ) );
+		if( fileDescriptor<0 ) return;
+
+		reportWriter.start( fileDescriptor );
+		reportWriter << "memcounter - report for process " << long(getpid()) << " on " << event << " " << number << "\n";
+		memcounter::ThreadMemoryCounterPool::writeReport( reportWriter );
+		reportWriter.flush();
+		if( !toStandardError ) close( fileDescriptor );
+	}
+
+	/** @brief Writes the report then lets the signal do whatever it would have done without the library. */
+	void fatalSignalHandler( int signalNumber )
+	{
+		writeCounterReport( "signal", signalNumber );
+		memcounter::LiveExport::stop();
+		// The signal is blocked until the handler returns, so it's delivered again then with the old action
+		sigaction( signalNumber, &previousActions[signalNumber], NULL );
+		raise( signalNumber );
+	}
+
+	/** @brief True for the signals that end the program if it doesn't handle them, which includes SIGKILL even though that can't be handled. */
+	bool isFatalSignal( int signalNumber )
+	{
+		if( signalNumber==SIGKILL || signalNumber==SIGQUIT ) return true;
+		for( size_t index=0; index<sizeof(fatalSignals)/sizeof(fatalSignals[0]); ++index )
+		{
+			if( fatalSignals[index]==signalNumber ) return true;
+		}
+		return false;
+	}
+
+	void installFatalSignalHandlers()
+	{
+		struct sigaction action;
+		memset( &action, 0, sizeof(action) );
+		action.sa_handler=&fatalSignalHandler;
+		sigemptyset( &action.sa_mask );
+		for( size_t index=0; index<sizeof(fatalSignals)/sizeof(fatalSignals[0]); ++index )
+		{
+			int signalNumber=fatalSignals[index];
+			// Leave signals the program has already ignored or handled alone
+			if( sigaction( signalNumber, NULL, &previousActions[signalNumber] )!=0 || previousActions[signalNumber].sa_handler!=SIG_DFL ) continue;
+			sigaction( signalNumber, &action, NULL );
+		}
+	}
 
 	/** @brief Implementation of the IntrusiveMemoryCounterManager.
 	 *
@@ -141,20 +840,38 @@ namespace // Use the unnamed namespace
 	class IntrusiveMemoryCounterManagerImplementation : public memcounter::IntrusiveMemoryCounterManager
 	{
 		friend void* proxyThreadStartRoutine( void *pThreadCreationArguments );;
+		friend void retireThreadMemoryCounterPool( void* pThreadPool );
 	public:
 		IntrusiveMemoryCounterManagerImplementation();
 		~IntrusiveMemoryCounterManagerImplementation();
 		memcounter::IMemoryCounter* createNewMemoryCounter();
-		virtual void addToAllEnabledCountersForCurrentThread( size_t size );
-		virtual void modifyAllEnabledCountersForCurrentThread( size_t oldSize, size_t newSize );
-		virtual void removeFromAllEnabledCountersForCurrentThread( size_t size );
+		memcounter::IMemoryCounter* createNewGlobalMemoryCounter();
+		memcounter::IMemoryCounter* createNewPausedMemoryCounter( uint32_t& slotBit );
+		virtual uint32_t memoryCounterNameId( const char* name );
+		virtual memcounter::IMemoryCounter* namedMemoryCounter( uint32_t nameId );
+		virtual const char* counterName( const memcounter::IMemoryCounter* pCounter );
+		virtual size_t namedCounterTotals( MemcounterNamedTotals* pTotals, size_t maximumNumber, size_t totalsSize );
+		virtual void dumpNamedCounters( std::ostream& stream );
+		virtual uint32_t createCounterHandle( bool global );
+		virtual int counterForHandle( uint32_t handle, memcounter::IMemoryCounter*& pCounter, bool& isGlobal ) const;
+		virtual int snapshotCounters( const uint32_t* handles, size_t numberOfHandles, MemcounterSnapshot* pSnapshots, size_t snapshotSize );
+		virtual void addToAllEnabledCountersForCurrentThread( size_t size, size_t usableSize );
+		virtual void modifyAllEnabledCountersForCurrentThread( size_t oldSize, size_t oldUsableSize, size_t newSize, size_t newUsableSize );
+		virtual void removeFromAllEnabledCountersForCurrentThread( size_t size, size_t usableSize );
+		virtual void dumpSideTableStatistics( std::ostream& stream ) const;
+		virtual bool setSamplingInterval( size_t averageBytes );
+		virtual bool writeHeapProfile( const memcounter::IMemoryCounter* pOnlyCounter, int fileDescriptor );
 	protected:
 		inline memcounter::ThreadMemoryCounterPool* getThreadMemoryCounterPool();
 		memcounter::ThreadMemoryCounterPool* createThreadMemoryCounterPool();
 
+		/// Only used so that retireThreadMemoryCounterPool gets called when a thread exits, the pool itself is found through memcounter::threadState
 		pthread_key_t keyThreadMemoryCounterPool_;
-		pthread_mutex_t mutex_;
-		std::vector<memcounter::ThreadMemoryCounterPool*> threadPools_; //< @Keep track of the allocated pools so that I can delete them at the end
+		size_t batchSize_; ///< How many changes the pools batch up before applying them to the counters, zero to apply straight away
+		memcounter::CounterHandleTable counterHandles_; ///< The counters that have been handed out through the C interface
+		memcounter::CounterNameTable counterNames_; ///< The names given to createNamedMemoryCounter, and the totals for them from exited threads
+		memcounter::TelemetryWriter telemetry_; ///< Only started if MEMCOUNTER_TELEMETRY_FILE is set
+		memcounter::SnapshotWriter snapshots_; ///< Only started if MEMCOUNTER_SNAPSHOT_FILE is set
 	}; // end of the IntrusiveMemoryCounterManagerImplementation class
 
 	/*
@@ -164,6 +881,24 @@ namespace // Use the unnamed namespace
 	 */
 	IntrusiveMemoryCounterManagerImplementation onlyInstance;
 
+	/** @brief Destructor for keyThreadMemoryCounterPool_, so that a thread's pool is retired when the thread exits.
+	 *
+	 * Counting is switched off for good first, and the thread is left without a pool, so anything the thread
+	 * frees after this is treated the same as a free of a block from any other exited thread. The named
+	 * counters are added to the totals for their names before the pool deletes them, and the thread's
+	 * unfinished part of the allocation trace is handed to the writer.
+	 */
+	void retireThreadMemoryCounterPool( void* pThreadPool )
+	{
+		memcounter::threadState.countingEnabled=false;
+		memcounter::threadState.pPool=NULL;
+		memcounter::ThreadMemoryCounterPool* pPool=static_cast<memcounter::ThreadMemoryCounterPool*>( pThreadPool );
+
+		if( tracing ) pPool->traceBuffer().flush( traceWriter );
+
+		pPool->retire( onlyInstance.counterNames_ );
+	}
+
 	/** @brief Struct to wrap thread creation function pointer and arguments in.
 	 * @author Mark Grimes
 	 * @date 01/Sep/2011
@@ -173,8 +908,9 @@ namespace // Use the unnamed namespace
 		void* (*pFunction_)(void *);
 		void* pArguments_;
 		bool createPool_;
-		ThreadCreationArguments( void* (*pFunction)(void *), void* pArguments, bool createMemoryCounterPool=true )
-			: pFunction_(pFunction), pArguments_(pArguments), createPool_(createMemoryCounterPool) { /* No operation except the initialiser list*/ }
+		uint32_t inheritedGlobalCounters_; ///< Bit mask of the global counters the new thread should start with enabled
+		ThreadCreationArguments( void* (*pFunction)(void *), void* pArguments, bool createMemoryCounterPool=true, uint32_t inheritedGlobalCounters=0 )
+			: pFunction_(pFunction), pArguments_(pArguments), createPool_(createMemoryCounterPool), inheritedGlobalCounters_(inheritedGlobalCounters) { /* No operation except the initialiser list*/ }
 	};
 
 	/** @brief Function that will be passed as the creation function for all threads. It will do my stuff then pass on to the original function.
@@ -184,28 +920,37 @@ namespace // Use the unnamed namespace
 	void* proxyThreadStartRoutine( void *pThreadCreationArguments )
 	{
 		std::cerr << "proxyThreadStartRoutine starting" << std::endl;
-		// First disable memory counting for this thread while I set stuff up. I want it set to any non
-		// zero value, I'll use the address of memcounter_globallyDisabled purely for convenience.
-		pthread_setspecific( memcounter_threadDisabled, &memcounter_globallyDisabled );
+		// Memory counting for this thread starts off disabled because thread locals are zero
+		// initialised, so I can set stuff up without it being counted.
 
 		// Copy out the required info before I delete the ThreadCreationArguments object that was 'new'ed
 		// in the creating thread.
 		ThreadCreationArguments* pCreationArguments=static_cast<ThreadCreationArguments*>(pThreadCreationArguments);
 		bool createPool=pCreationArguments->createPool_;
+		uint32_t inheritedGlobalCounters=pCreationArguments->inheritedGlobalCounters_;
 		void* pArguments=pCreationArguments->pArguments_;
 		void* (&start_routine)(void *)=*pCreationArguments->pFunction_;
 		delete pCreationArguments;
 
-		// Create a memory counter pool if required
+		// Create a memory counter pool if required. Counting is left disabled, it gets switched
+		// on when one of the counters in the new pool is enabled. Enabling it without a pool
+		// would make any memory allocation in this thread call a non-existent pool and segfault.
 		if( createPool ) onlyInstance.createThreadMemoryCounterPool();
 
-		// I only want memory counting enabled for this thread if a pool has been created.
-		// Otherwise any memory allocation in this thread would try and call a non-existent
-		// pool and cause a segfault.
-		if( createPool ) pthread_setspecific( memcounter_threadDisabled, 0 );
-
 		std::cerr << "proxyThreadStartRoutine passing to start_routine" << std::endl;
 
+		// Switch on the counters inherited from the creating thread last, so that none of the set up
+		// above gets counted. Doing it through the pool means that threads this one starts inherit them too.
+		if( inheritedGlobalCounters && memcounter::threadState.pPool )
+		{
+			for( size_t index=0; index<memcounter::GlobalMemoryCounter::maximumNumberOfCounters; ++index )
+			{
+				if( inheritedGlobalCounters & (1u<<index) ) memcounter::threadState.pPool->informGlobalEnabled( index );
+			}
+		}
+		// The creating thread took references so the counters couldn't be reused before this thread got here
+		memcounter::GlobalMemoryCounter::releaseReferences( inheritedGlobalCounters );
+
 		// Now pass on to the function that the caller originally wanted
 		return start_routine(pArguments);
 	}
@@ -228,28 +973,77 @@ memcounter::IntrusiveMemoryCounterManager::~IntrusiveMemoryCounterManager()
 }
 
 ::IntrusiveMemoryCounterManagerImplementation::IntrusiveMemoryCounterManagerImplementation()
+	: batchSize_(0)
 {
 	if(true) std::cerr << "Creating memcounter::IntrusiveMemoryCounterManagerImplementation" << std::endl;
 
-	if( !( pthread_key_create(&keyThreadMemoryCounterPool_,NULL)==0 ) )
+	if( !( pthread_key_create(&keyThreadMemoryCounterPool_,&retireThreadMemoryCounterPool)==0 ) )
 	{
 		std::cerr << "Oh dear, couldn't create a key for some reason" << std::endl;
 	}
 
-	if( !( pthread_key_create(&memcounter_threadDisabled,NULL)==0 ) )
+	// See if the user wants something other than the default of storing the size in a header
+	// in front of each block. This has to be decided before the hooks are installed.
+	if( const char* sizeTrackingOption=getenv("MEMCOUNTER_SIZE_TRACKING") )
 	{
-		std::cerr << "Oh dear, couldn't create a key for some reason" << std::endl;
+		if( strcmp(sizeTrackingOption,"usable")==0 ) sizeTracking=UsableSizeTracking;
+		else if( strcmp(sizeTrackingOption,"sidetable")==0 ) sizeTracking=SideTableSizeTracking;
+		else if( strcmp(sizeTrackingOption,"header")!=0 ) std::cerr << "memcounter - unknown MEMCOUNTER_SIZE_TRACKING \"" << sizeTrackingOption << "\", using \"header\"" << std::endl;
+	}
+
+	if( sizeTracking==SideTableSizeTracking )
+	{
+		size_t capacity=size_t(1)<<22;
+		if( const char* capacityOption=getenv("MEMCOUNTER_SIDETABLE_CAPACITY") ) capacity=strtoul( capacityOption, NULL, 0 );
+		if( !sideTable.initialise(capacity) )
+		{
+			std::cerr << "memcounter - couldn't allocate the side table, using headers instead" << std::endl;
+			sizeTracking=HeaderSizeTracking;
+		}
+	}
+
+	// The time stamps go in the headers, so like the size tracking method this can't be changed once hooks are installed
+	if( const char* lifetimesOption=getenv("MEMCOUNTER_LIFETIMES") ) recordLifetimes=( strcmp(lifetimesOption,"0")!=0 );
+	if( recordLifetimes && sizeTracking==UsableSizeTracking )
+	{
+		std::cerr << "memcounter - block lifetimes can't be recorded with MEMCOUNTER_SIZE_TRACKING=usable" << std::endl;
+		recordLifetimes=false;
 	}
 
-	if( !( pthread_mutex_init(&mutex_,NULL)==0 ) )
+	// Call sites go in the headers too
+	if( const char* depthOption=getenv("MEMCOUNTER_CALLSITE_DEPTH") ) callSiteDepth=std::min( strtoul( depthOption, NULL, 0 ), 64ul );
+	if( callSiteDepth && sizeTracking==UsableSizeTracking )
 	{
-		std::cerr << "Oh dear, couldn't create the mutex for some reason" << std::endl;
+		std::cerr << "memcounter - call sites can't be recorded with MEMCOUNTER_SIZE_TRACKING=usable" << std::endl;
+		callSiteDepth=0;
 	}
+	if( const char* crossThreadOption=getenv("MEMCOUNTER_CROSS_THREAD_FREES") ) trackOwnership=( strcmp(crossThreadOption,"0")!=0 );
+	if( sizeTracking==UsableSizeTracking ) trackOwnership=false; // Nowhere to store the owner
+	if( const char* inheritOption=getenv("MEMCOUNTER_INHERIT_COUNTERS") ) inheritCounters=( strcmp(inheritOption,"0")!=0 );
+
+	if( const char* unwinderOption=getenv("MEMCOUNTER_CALLSITE_UNWINDER") )
+	{
+		if( strcmp(unwinderOption,"unwind")==0 ) useFramePointers=false;
+		else if( strcmp(unwinderOption,"framepointer")!=0 ) std::cerr << "memcounter - unknown MEMCOUNTER_CALLSITE_UNWINDER \"" << unwinderOption << "\", using \"framepointer\"" << std::endl;
+	}
+
+	if( const char* batchSizeOption=getenv("MEMCOUNTER_BATCH_SIZE") ) batchSize_=strtoul( batchSizeOption, NULL, 0 );
+
+	if( const char* samplingOption=getenv("MEMCOUNTER_SAMPLING_INTERVAL") ) setSamplingInterval( strtoul( samplingOption, NULL, 0 ) );
 
 	// Turn off memory counting for this thread until the user enables it by explicitly enabling one of
-	// the IMemoryCounter interfaces. Note that I want it to be any non-zero value, I'm only using
-	// the address of memcounter_globallyDisabled to save ugly casts.
-	pthread_setspecific( memcounter_threadDisabled, &memcounter_globallyDisabled );
+	// the IMemoryCounter interfaces.
+	memcounter::disableThisThread();
+
+	// The counters are kept in the shared memory segment, so it has to exist before the first pool
+	bool liveExport=true;
+	if( const char* liveOption=getenv("MEMCOUNTER_LIVE") ) liveExport=( strcmp(liveOption,"0")!=0 );
+	if( liveExport )
+	{
+		size_t maximumNumberOfThreads=1024;
+		if( const char* threadsOption=getenv("MEMCOUNTER_LIVE_THREADS") ) maximumNumberOfThreads=strtoul( threadsOption, NULL, 0 );
+		memcounter::LiveExport::start( maximumNumberOfThreads );
+	}
 
 	// I'm creating the ThreadMemoryCounterPools for each thread when it starts up.  I never get the chance
 	// for the main thread however, so I'll do it here since
@@ -257,6 +1051,49 @@ memcounter::IntrusiveMemoryCounterManager::~IntrusiveMemoryCounterManager()
 
 	std::cerr << __LINE__ << " - " << __FILE__ << " pthread_self=" << pthread_self() << std::endl;
 
+	// The telemetry thread has to be started before pthread_create is hooked, so that it doesn't get a
+	// counter pool and nothing it does is counted.
+	if( const char* telemetryFile=getenv("MEMCOUNTER_TELEMETRY_FILE") )
+	{
+		uint64_t intervalMilliseconds=1000;
+		if( const char* intervalOption=getenv("MEMCOUNTER_TELEMETRY_INTERVAL") ) intervalMilliseconds=strtoul( intervalOption, NULL, 0 );
+		size_t capacity=size_t(1)<<16;
+		if( const char* capacityOption=getenv("MEMCOUNTER_TELEMETRY_CAPACITY") ) capacity=strtoul( capacityOption, NULL, 0 );
+		telemetry_.start( telemetryFile, intervalMilliseconds*1000000ull, capacity, counterNames_ );
+	}
+
+	// Likewise for the trace writer thread
+	if( const char* traceFile=getenv("MEMCOUNTER_TRACE_FILE") )
+	{
+		size_t numberOfBuffers=256;
+		if( const char* buffersOption=getenv("MEMCOUNTER_TRACE_BUFFERS") ) numberOfBuffers=strtoul( buffersOption, NULL, 0 );
+		uint64_t maximumFileSize=0;
+		if( const char* limitOption=getenv("MEMCOUNTER_TRACE_LIMIT") ) maximumFileSize=strtoull( limitOption, NULL, 0 );
+		tracing=traceWriter.start( traceFile, numberOfBuffers, maximumFileSize );
+	}
+
+	// Snapshots on demand, from a thread that also has to be started before the hooks
+	if( const char* snapshotFile=getenv("MEMCOUNTER_SNAPSHOT_FILE") )
+	{
+		int signalNumber=SIGUSR2;
+		if( const char* signalOption=getenv("MEMCOUNTER_SNAPSHOT_SIGNAL") ) signalNumber=strtol( signalOption, NULL, 0 );
+		snapshots_.start( snapshotFile, signalNumber );
+	}
+
+	if( const char* reportOption=getenv("MEMCOUNTER_REPORT_FILE") )
+	{
+		strncpy( reportFile, reportOption, sizeof(reportFile)-1 );
+		installFatalSignalHandlers();
+	}
+
+	// The pools write the heap profiles themselves, as counters are disabled and as threads exit
+	if( const char* profileFile=getenv("MEMCOUNTER_PPROF_FILE") )
+	{
+		bool onDisable=false;
+		if( const char* onDisableOption=getenv("MEMCOUNTER_PPROF_ON_DISABLE") ) onDisable=( strcmp(onDisableOption,"0")!=0 );
+		memcounter::ThreadMemoryCounterPool::setProfileFile( profileFile, onDisable, &counterNames_ );
+	}
+
 	if( memcounter_globallyDisabled )
 	{
 		IgHook::hook( domalloc_hook_main.raw );
@@ -267,94 +1104,405 @@ memcounter::IntrusiveMemoryCounterManager::~IntrusiveMemoryCounterManager()
 		IgHook::hook( dovalloc_hook_main.raw );
 		IgHook::hook( dofree_hook_main.raw );
 
-		IgHook::hook( doexit_hook_main.raw );
-		IgHook::hook( dokill_hook_main.raw );
-		IgHook::hook( dopthread_create_hook_main.raw );
-		IgHook::hook( dopthread_create_hook_pthread20.raw );
-		IgHook::hook( dopthread_create_hook_pthread21.raw );
+		IgHook::hook( doexit_hook_main.raw );
+		IgHook::hook( dokill_hook_main.raw );
+		IgHook::hook( dopthread_create_hook_main.raw );
+		IgHook::hook( dopthread_create_hook_pthread20.raw );
+		IgHook::hook( dopthread_create_hook_pthread21.raw );
+	}
+	else std::cerr << " *** Oh dear *** " << std::endl;
+
+	std::cerr << " *** memcounteractive ***" << std::endl;
+//	std::cerr << " *** sizes *** HeaderIdentifier=" << sizeof(::HeaderIdentifier) << " FixedMemoryBlockHeader=" << sizeof(::FixedMemoryBlockHeader)
+//			<< " VariableMemoryBlockHeader=" << sizeof(::VariableMemoryBlockHeader)
+//			<< " void*=" << sizeof(void*) << " char=" << sizeof(char) << " size_t=" << sizeof(size_t)
+//			 << " Test=" << sizeof(::Test)<< std::endl;
+	// Now that everything is setup, enable the hooks
+	memcounter_globallyDisabled=false;
+}
+
+::IntrusiveMemoryCounterManagerImplementation::~IntrusiveMemoryCounterManagerImplementation()
+{
+	if(true) std::cerr << "Destroying memcounter::IntrusiveMemoryCounterManagerImplementation" << std::endl;
+	// Get the values right at the end in the telemetry before anything is torn down
+	telemetry_.stop();
+	// Only this thread's unfinished part of the trace can be handed over, other threads still running lose theirs
+	if( tracing )
+	{
+		tracing=false;
+		if( memcounter::threadState.pPool ) memcounter::threadState.pPool->traceBuffer().flush( traceWriter );
+		traceWriter.stop();
+	}
+	if( sizeTracking==SideTableSizeTracking ) sideTable.dumpStatistics( std::cerr );
+
+	memcounter::RetiredPoolSummary retired=memcounter::ThreadMemoryCounterPool::retiredSummary();
+	if( retired.numberOfPools!=0 )
+	{
+		std::cerr << "memcounter - " << retired.numberOfPools << " threads exited before the end of the program. The counters still enabled in them when they exited had a total current size="
+				<< retired.values.current[memcounter::CounterValues::size] << ", maximum size=" << retired.values.maximum[memcounter::CounterValues::size]
+				<< ", current allocations=" << retired.values.current[memcounter::CounterValues::numberOfAllocations] << std::endl;
+	}
+
+	dumpNamedCounters( std::cerr );
+
+	// Threads that are still running never get to write their heap profiles, but this one can
+	if( memcounter::threadState.pPool ) memcounter::threadState.pPool->writeProfileFile();
+
+	// Delete all of the ThreadMemoryCounterPool objects I've created. This destructor should
+	// only be called at the end of program execution but I might as well tidy up in case I
+	// later put some code in the ThreadMemoryCounterPool destructors.
+	memcounter::ThreadMemoryCounterPool::deleteAllPools();
+	memcounter::LiveExport::stop();
+}
+
+memcounter::IMemoryCounter* ::IntrusiveMemoryCounterManagerImplementation::createNewMemoryCounter()
+{
+	if(false) std::cerr << "IntrusiveMemoryCounterManagerImplementation::createNewMemoryCounter() called" << std::endl;
+
+	// Disable memory counting while I do this in case any of my calls create a
+	// recursive loop.
+	bool countingWasEnabled=memcounter::threadState.countingEnabled;
+	memcounter::threadState.countingEnabled=false;
+
+	memcounter::IMemoryCounter* result=getThreadMemoryCounterPool()->createNewMemoryCounter();
+
+	// Put memory counting back to how it was
+	memcounter::threadState.countingEnabled=countingWasEnabled;
+
+	return result;
+}
+
+memcounter::IMemoryCounter* ::IntrusiveMemoryCounterManagerImplementation::createNewGlobalMemoryCounter()
+{
+	// Disable memory counting while I do this in case any of my calls create a
+	// recursive loop.
+	bool countingWasEnabled=memcounter::threadState.countingEnabled;
+	memcounter::threadState.countingEnabled=false;
+
+	memcounter::IMemoryCounter* result=memcounter::GlobalMemoryCounter::create();
+
+	// Put memory counting back to how it was
+	memcounter::threadState.countingEnabled=countingWasEnabled;
+
+	return result;
+}
+
+memcounter::IMemoryCounter* ::IntrusiveMemoryCounterManagerImplementation::createNewPausedMemoryCounter( uint32_t& slotBit )
+{
+	memcounter::ThreadMemoryCounterPool* pPool=getThreadMemoryCounterPool();
+	slotBit=0;
+	if( pPool==NULL ) return NULL;
+
+	// Disable memory counting while I do this in case any of my calls create a
+	// recursive loop.
+	bool countingWasEnabled=memcounter::threadState.countingEnabled;
+	memcounter::threadState.countingEnabled=false;
+
+	memcounter::MemoryCounterImplementation* pCounter=static_cast<memcounter::MemoryCounterImplementation*>( pPool->createNewMemoryCounter() );
+	// Enabling gives the counter its slot, then it's paused straight away
+	pCounter->enable();
+	if( pCounter->enabledSlot()>=0 )
+	{
+		slotBit=( 1u<<pCounter->enabledSlot() );
+		pCounter->setClientSlotBit( &slotBit );
+		memcounter::threadState.pausedSlots|=slotBit;
+		pPool->syncActiveSlots();
+	}
+
+	// Put memory counting back to how it was
+	memcounter::threadState.countingEnabled=countingWasEnabled;
+
+	return pCounter;
+}
+
+uint32_t ::IntrusiveMemoryCounterManagerImplementation::memoryCounterNameId( const char* name )
+{
+	// Adding a new name allocates the record for it
+	bool countingWasEnabled=memcounter::threadState.countingEnabled;
+	memcounter::threadState.countingEnabled=false;
+
+	uint32_t nameId=counterNames_.intern( name );
+	if( nameId==0 && name!=NULL ) std::cerr << " *MEMCOUNTER* - can't have more than " << memcounter::CounterNameTable::capacity << " counter names, so \"" << name << "\" has no counter" << std::endl;
+	else memcounter::LiveExport::publishName( nameId, counterNames_.name( nameId ) );
+
+	memcounter::threadState.countingEnabled=countingWasEnabled;
+	return nameId;
+}
+
+memcounter::IMemoryCounter* ::IntrusiveMemoryCounterManagerImplementation::namedMemoryCounter( uint32_t nameId )
+{
+	memcounter::ThreadMemoryCounterPool* pPool=getThreadMemoryCounterPool();
+	if( pPool==NULL ) return NULL;
+
+	// This is the path that matters, when the thread already has the counter
+	memcounter::IMemoryCounter* const* namedCounters=pPool->namedCounters();
+	if( namedCounters && nameId<=memcounter::CounterNameTable::capacity && namedCounters[nameId]!=NULL ) return namedCounters[nameId];
+
+	if( counterNames_.name( nameId )==NULL ) return NULL;
+
+	// Disable memory counting while I do this in case any of my calls create a
+	// recursive loop.
+	bool countingWasEnabled=memcounter::threadState.countingEnabled;
+	memcounter::threadState.countingEnabled=false;
+
+	memcounter::IMemoryCounter* result=pPool->namedCounter( nameId );
+
+	// Put memory counting back to how it was
+	memcounter::threadState.countingEnabled=countingWasEnabled;
+
+	return result;
+}
+
+const char* ::IntrusiveMemoryCounterManagerImplementation::counterName( const memcounter::IMemoryCounter* pCounter )
+{
+	memcounter::ThreadMemoryCounterPool* pPool=getThreadMemoryCounterPool();
+	uint32_t nameId=( pPool ? pPool->nameIdOf( pCounter ) : 0 );
+	return nameId!=0 ? counterNames_.name( nameId ) : NULL;
+}
+
+size_t ::IntrusiveMemoryCounterManagerImplementation::namedCounterTotals( MemcounterNamedTotals* pTotals, size_t maximumNumber, size_t totalsSize )
+{
+	// Only copy as much of each entry as the caller knows about, so that fields can be added later
+	if( totalsSize>sizeof(MemcounterNamedTotals) ) totalsSize=sizeof(MemcounterNamedTotals);
+	char* pOutput=reinterpret_cast<char*>( pTotals );
+	size_t numberOfNames=0;
+
+	memcounter::ThreadMemoryCounterPool* pPool=getThreadMemoryCounterPool();
+	for( uint32_t nameId=1; nameId<=memcounter::CounterNameTable::capacity; ++nameId )
+	{
+		const char* name=counterNames_.name( nameId );
+		if( name==NULL ) continue;
+		if( numberOfNames++>=maximumNumber ) continue; // Keep going to count them all
+
+		long int current[memcounter::CounterValues::numberOfQuantities]={ 0, 0, 0, 0 };
+		long int maximum[memcounter::CounterValues::numberOfQuantities]={ 0, 0, 0, 0 };
+		MemcounterNamedTotals totals;
+		memset( &totals, 0, sizeof(totals) );
+		totals.name=name;
+		totals.nameId=nameId;
+		totals.numberOfThreads=memcounter::ThreadMemoryCounterPool::addNamedCounterTotals( counterNames_, nameId, pPool, current, maximum );
+		if( pPool && pPool->namedCounters() && pPool->namedCounters()[nameId]!=NULL )
+		{
+			static_cast<memcounter::MemoryCounterImplementation*>( pPool->namedCounters()[nameId] )->addTotals( current, maximum );
+			++totals.numberOfThreads;
+		}
+
+		totals.currentSize=current[memcounter::CounterValues::size];
+		totals.maximumSize=maximum[memcounter::CounterValues::size];
+		totals.currentUsableSize=current[memcounter::CounterValues::usableSize];
+		totals.maximumUsableSize=maximum[memcounter::CounterValues::usableSize];
+		totals.currentNumberOfAllocations=current[memcounter::CounterValues::numberOfAllocations];
+		totals.maximumNumberOfAllocations=maximum[memcounter::CounterValues::numberOfAllocations];
+
+		memcpy( pOutput, &totals, totalsSize );
+		pOutput+=totalsSize;
 	}
-	else std::cerr << " *** Oh dear *** " << std::endl;
 
-	std::cerr << " *** memcounteractive ***" << std::endl;
-//	std::cerr << " *** sizes *** HeaderIdentifier=" << sizeof(::HeaderIdentifier) << " FixedMemoryBlockHeader=" << sizeof(::FixedMemoryBlockHeader)
-//			<< " VariableMemoryBlockHeader=" << sizeof(::VariableMemoryBlockHeader)
-//			<< " void*=" << sizeof(void*) << " char=" << sizeof(char) << " size_t=" << sizeof(size_t)
-//			 << " Test=" << sizeof(::Test)<< std::endl;
-	// Now that everything is setup, enable the hooks
-	memcounter_globallyDisabled=false;
+	return numberOfNames;
 }
 
-::IntrusiveMemoryCounterManagerImplementation::~IntrusiveMemoryCounterManagerImplementation()
+void ::IntrusiveMemoryCounterManagerImplementation::dumpNamedCounters( std::ostream& stream )
 {
-	if(true) std::cerr << "Destroying memcounter::IntrusiveMemoryCounterManagerImplementation" << std::endl;
+	bool countingWasEnabled=memcounter::threadState.countingEnabled;
+	memcounter::threadState.countingEnabled=false;
 
-	// Delete all of the ThreadMemoryCounterPool objects I've created. This destructor should
-	// only be called at the end of program execution but I might as well tidy up in case I
-	// later put some code in the ThreadMemoryCounterPool destructors.
-	for( std::vector<memcounter::ThreadMemoryCounterPool*>::iterator iPool=threadPools_.begin(); iPool!=threadPools_.end(); ++iPool )
+	std::vector<MemcounterNamedTotals> allTotals( namedCounterTotals( NULL, 0, sizeof(MemcounterNamedTotals) ) );
+	if( !allTotals.empty() )
 	{
-		delete *iPool;
+		// Names added since the first call aren't filled in, so aren't printed
+		size_t numberOfNames=namedCounterTotals( &allTotals[0], allTotals.size(), sizeof(MemcounterNamedTotals) );
+		if( numberOfNames<allTotals.size() ) allTotals.resize( numberOfNames );
+		stream << "memcounter - named counters, for every thread:" << std::endl;
+		for( std::vector<MemcounterNamedTotals>::const_iterator iTotals=allTotals.begin(); iTotals!=allTotals.end(); ++iTotals )
+		{
+			stream << "   " << iTotals->name << " (" << iTotals->numberOfThreads << " threads): current size=" << iTotals->currentSize
+					<< ", maximum size=" << iTotals->maximumSize << ", current allocations=" << iTotals->currentNumberOfAllocations << std::endl;
+		}
 	}
+
+	memcounter::threadState.countingEnabled=countingWasEnabled;
 }
 
-memcounter::IMemoryCounter* ::IntrusiveMemoryCounterManagerImplementation::createNewMemoryCounter()
+uint32_t ::IntrusiveMemoryCounterManagerImplementation::createCounterHandle( bool global )
 {
-	if(false) std::cerr << "IntrusiveMemoryCounterManagerImplementation::createNewMemoryCounter() called" << std::endl;
+	memcounter::ThreadMemoryCounterPool* pPool=getThreadMemoryCounterPool();
+	// A per thread handle is tied to the pool's index, so a pool that couldn't get one can't have them
+	if( !global && ( pPool==NULL || pPool->index()==0 ) ) return 0;
 
-	// Disable memory counting while I do this in case any of my calls create a
-	// recursive loop.
-	pthread_setspecific( memcounter_threadDisabled, &memcounter_globallyDisabled );
+	memcounter::IMemoryCounter* pCounter=( global ? createNewGlobalMemoryCounter() : createNewMemoryCounter() );
 
-	memcounter::IMemoryCounter* result=getThreadMemoryCounterPool()->createNewMemoryCounter();
+	// The table takes a lock, so make sure nothing it does gets counted
+	bool countingWasEnabled=memcounter::threadState.countingEnabled;
+	memcounter::threadState.countingEnabled=false;
 
-	// Put memory counting back on
-	pthread_setspecific( memcounter_threadDisabled, 0 );
+	uint32_t handle=counterHandles_.add( pCounter, global ? 0 : pPool->index(), global );
+	if( pCounter && handle==0 ) std::cerr << " *MEMCOUNTER* - can't have more than " << memcounter::CounterHandleTable::capacity << " counter handles" << std::endl;
 
-	return result;
+	memcounter::threadState.countingEnabled=countingWasEnabled;
+	return handle;
+}
+
+int ::IntrusiveMemoryCounterManagerImplementation::counterForHandle( uint32_t handle, memcounter::IMemoryCounter*& pCounter, bool& isGlobal ) const
+{
+	memcounter::ThreadMemoryCounterPool* pPool=memcounter::threadState.pPool;
+	return counterHandles_.lookup( handle, pPool ? pPool->index() : 0, pCounter, isGlobal );
 }
 
-void ::IntrusiveMemoryCounterManagerImplementation::addToAllEnabledCountersForCurrentThread( size_t size )
+int ::IntrusiveMemoryCounterManagerImplementation::snapshotCounters( const uint32_t* handles, size_t numberOfHandles, MemcounterSnapshot* pSnapshots, size_t snapshotSize )
 {
-	getThreadMemoryCounterPool()->addToAllEnabledCounters( size );
+	// Only copy as much of each snapshot as the caller knows about, so that fields can be added later
+	if( snapshotSize>sizeof(MemcounterSnapshot) ) snapshotSize=sizeof(MemcounterSnapshot);
+	char* pOutput=reinterpret_cast<char*>( pSnapshots );
+	int numberValid=0;
+
+	for( size_t handleIndex=0; handleIndex<numberOfHandles; ++handleIndex, pOutput+=snapshotSize )
+	{
+		MemcounterSnapshot snapshot;
+		memset( &snapshot, 0, sizeof(snapshot) );
+		snapshot.handle=handles[handleIndex];
+
+		memcounter::IMemoryCounter* pCounter;
+		bool isGlobal;
+		uint32_t ownerPool;
+		memcounter::ThreadMemoryCounterPool* pPool=memcounter::threadState.pPool;
+		if( counterHandles_.lookup( handles[handleIndex], pPool ? pPool->index() : 0, pCounter, isGlobal, &ownerPool )==MEMCOUNTER_SUCCESS )
+		{
+			long int current[memcounter::CounterValues::numberOfQuantities]={ 0, 0, 0, 0 };
+			long int maximum[memcounter::CounterValues::numberOfQuantities]={ 0, 0, 0, 0 };
+			memcounter::GlobalMemoryCounter* pGlobalCounter=NULL;
+			bool isEnabled;
+			// These all give the quantities in one go, rather than a virtual call for each
+			if( isGlobal )
+			{
+				pGlobalCounter=static_cast<memcounter::GlobalMemoryCounter*>( pCounter );
+				isEnabled=pCounter->isEnabled();
+			}
+			else if( ownerPool==0 )
+			{
+				static_cast<memcounter::MemoryCounterImplementation*>( pCounter )->addTotals( current, maximum );
+				isEnabled=pCounter->isEnabled();
+			}
+			else
+			{
+				// Another thread's counter, which can only be read through its pool's sequence number
+				memcounter::CounterValues values;
+				if( !memcounter::ThreadMemoryCounterPool::readCounterValues( ownerPool, static_cast<memcounter::MemoryCounterImplementation*>( pCounter ), values, isEnabled, pGlobalCounter ) )
+				{
+					memcpy( pOutput, &snapshot, snapshotSize );
+					continue; // The thread exited in the meantime
+				}
+				for( int index=0; index<memcounter::CounterValues::numberOfQuantities; ++index )
+				{
+					current[index]=values.current[index];
+					maximum[index]=values.maximum[index];
+				}
+			}
+
+			// For a per thread counter this is what its spawned threads counted
+			if( pGlobalCounter )
+			{
+				long int globalCurrent[memcounter::GlobalCounterShard::numberOfQuantities];
+				long int globalMaximum[memcounter::GlobalCounterShard::numberOfQuantities];
+				pGlobalCounter->totals( globalCurrent, globalMaximum );
+				for( int index=0; index<memcounter::GlobalCounterShard::numberOfQuantities; ++index )
+				{
+					current[index]+=globalCurrent[index];
+					maximum[index]+=globalMaximum[index];
+				}
+			}
+
+			snapshot.flags=MEMCOUNTER_SNAPSHOT_VALID | ( isEnabled ? MEMCOUNTER_SNAPSHOT_ENABLED : 0 ) | ( isGlobal ? MEMCOUNTER_SNAPSHOT_GLOBAL : 0 );
+			snapshot.currentSize=current[memcounter::CounterValues::size];
+			snapshot.maximumSize=maximum[memcounter::CounterValues::size];
+			snapshot.currentUsableSize=current[memcounter::CounterValues::usableSize];
+			snapshot.maximumUsableSize=maximum[memcounter::CounterValues::usableSize];
+			snapshot.currentNumberOfAllocations=current[memcounter::CounterValues::numberOfAllocations];
+			snapshot.maximumNumberOfAllocations=maximum[memcounter::CounterValues::numberOfAllocations];
+			++numberValid;
+		}
+
+		memcpy( pOutput, &snapshot, snapshotSize );
+	}
+
+	return numberValid;
+}
+
+void ::IntrusiveMemoryCounterManagerImplementation::addToAllEnabledCountersForCurrentThread( size_t size, size_t usableSize )
+{
+	getThreadMemoryCounterPool()->addToAllEnabledCounters( size, usableSize );
+}
+
+void ::IntrusiveMemoryCounterManagerImplementation::modifyAllEnabledCountersForCurrentThread( size_t oldSize, size_t oldUsableSize, size_t newSize, size_t newUsableSize )
+{
+	getThreadMemoryCounterPool()->modifyAllEnabledCounters( oldSize, oldUsableSize, newSize, newUsableSize );
 }
 
-void ::IntrusiveMemoryCounterManagerImplementation::modifyAllEnabledCountersForCurrentThread( size_t oldSize, size_t newSize )
+void ::IntrusiveMemoryCounterManagerImplementation::removeFromAllEnabledCountersForCurrentThread( size_t size, size_t usableSize )
 {
-	getThreadMemoryCounterPool()->modifyAllEnabledCounters( oldSize, newSize );
+	getThreadMemoryCounterPool()->removeFromAllEnabledCounters( size, usableSize );
+}
+
+void ::IntrusiveMemoryCounterManagerImplementation::dumpSideTableStatistics( std::ostream& stream ) const
+{
+	if( sizeTracking==SideTableSizeTracking ) sideTable.dumpStatistics( stream );
+	else stream << "memcounter - the side table isn't being used, set MEMCOUNTER_SIZE_TRACKING=sidetable" << std::endl;
+}
+
+bool ::IntrusiveMemoryCounterManagerImplementation::setSamplingInterval( size_t averageBytes )
+{
+	// Whether a block was sampled has to be remembered so that the free can be scaled the same way,
+	// and in usable mode there's nowhere to put that.
+	if( averageBytes!=0 && sizeTracking==UsableSizeTracking )
+	{
+		std::cerr << "memcounter - sampling can't be used with MEMCOUNTER_SIZE_TRACKING=usable" << std::endl;
+		return false;
+	}
+
+	__atomic_store_n( &samplingInterval, averageBytes, __ATOMIC_RELAXED );
+	// Run out this thread's countdown so that its next allocation notices the change. Other threads
+	// only look when their own countdowns run out, so that the hooks don't have to load the interval.
+	if( memcounter::threadState.samplingInterval!=averageBytes ) memcounter::threadState.bytesUntilSample=0;
+	return true;
 }
 
-void ::IntrusiveMemoryCounterManagerImplementation::removeFromAllEnabledCountersForCurrentThread( size_t size )
+bool ::IntrusiveMemoryCounterManagerImplementation::writeHeapProfile( const memcounter::IMemoryCounter* pOnlyCounter, int fileDescriptor )
 {
-	getThreadMemoryCounterPool()->removeFromAllEnabledCounters( size );
+	memcounter::ThreadMemoryCounterPool* pPool=getThreadMemoryCounterPool();
+	if( pPool==NULL ) return false;
+
+	bool countingWasEnabled=memcounter::threadState.countingEnabled;
+	memcounter::threadState.countingEnabled=false;
+
+	memcounter::HeapProfile profile;
+	pPool->addToProfile( profile, pOnlyCounter, &counterNames_ );
+	bool result=profile.write( fileDescriptor );
+
+	memcounter::threadState.countingEnabled=countingWasEnabled;
+	return result;
 }
 
 inline memcounter::ThreadMemoryCounterPool* ::IntrusiveMemoryCounterManagerImplementation::getThreadMemoryCounterPool()
 {
 //	return createThreadMemoryCounterPool();
-	return static_cast<memcounter::ThreadMemoryCounterPool*>( pthread_getspecific(keyThreadMemoryCounterPool_) );
+	return memcounter::threadState.pPool;
 }
 
 memcounter::ThreadMemoryCounterPool* ::IntrusiveMemoryCounterManagerImplementation::createThreadMemoryCounterPool()
 {
-	// I'm fairly sure I don't need a lock here, because I'm using all local variables which will be on the
-	// stack, and each thread has it's own stack. The only shared variable is keyThreadMemoryCounterPool_,
-	// and I'm assuming the pthread routines are themselves thread safe.
+	// I don't need a lock here. The pools keep track of themselves without locking, and the only other
+	// shared variable is keyThreadMemoryCounterPool_, which the pthread routines look after.
 
 	// Make sure this thread doesn't already have a pool
-	memcounter::ThreadMemoryCounterPool* pThreadPool=static_cast<memcounter::ThreadMemoryCounterPool*>( pthread_getspecific(keyThreadMemoryCounterPool_) );
+	memcounter::ThreadMemoryCounterPool* pThreadPool=memcounter::threadState.pPool;
 	if( !pThreadPool )
 	{
 		std::cerr << __LINE__ << " - " << __FILE__ << " pthread_self=" << pthread_self() << std::endl;
 		// The ThreadMemoryCounterPool for this thread hasn't been created yet
-		pThreadPool=new memcounter::ThreadMemoryCounterPool;
+		pThreadPool=memcounter::ThreadMemoryCounterPool::createForCurrentThread( batchSize_ );
+		memcounter::threadState.pPool=pThreadPool;
+		// The key is only set so that the pool is retired when the thread exits. All other access is
+		// done through the thread local memcounter::threadState.
 		pthread_setspecific(keyThreadMemoryCounterPool_,pThreadPool);
-		// I'll keep track of all of these pools so that I can delete them later. All other access is
-		// done using pthread_getspecific() so that's all this vector is used for.
-		{
-			// I think I do need a lock here though
-			memcounter::MutexSentry mutexSentry( mutex_ );
-			threadPools_.push_back(pThreadPool);
-		}
 		std::cerr << __LINE__ << " - " << __FILE__ << " pthread_self=" << pthread_self() << std::endl;
 	}
 
@@ -363,12 +1511,22 @@ memcounter::ThreadMemoryCounterPool* ::IntrusiveMemoryCounterManagerImplementati
 
 static void* domalloc( IgHook::SafeData<igprof_domalloc_t> &hook, size_t n )
 {
-	if( memcounter_globallyDisabled || pthread_getspecific(memcounter_threadDisabled) ) return ( *hook.chain )( n );
+	memcounter::ThreadState& state=memcounter::threadState;
+	if( LIKELY(!state.countingEnabled) || memcounter_globallyDisabled ) return ( *hook.chain )( n );
+
+	uint32_t weight=sampleWeight( state, n );
+	if( weight==0 ) return ( *hook.chain )( n );
+	else if( sizeTracking!=HeaderSizeTracking )
+	{
+		void* result=( *hook.chain )( n );
+		countNewUntouchedBlock( state, memcounter::TraceEvent::malloc, result, n, weight );
+		return result;
+	}
 	else
 	{
 
 		// Actually request slightly larger amount of memory
-		void *originalResult=( *hook.chain )( n+sizeof(::FixedMemoryBlockHeader) );
+		void *originalResult=( *hook.chain )( n+fixedHeaderSize() );
 		if( originalResult==NULL )
 		{
 			std::cerr << "##### Arghh! Couldn't allocate memory with malloc! #####" << std::endl;
@@ -376,25 +1534,12 @@ static void* domalloc( IgHook::SafeData<igprof_domalloc_t> &hook, size_t n )
 		}
 
 		// Store the size data and an identifier so that free knows there's extra data
-		::FixedMemoryBlockHeader* pHeader=(::FixedMemoryBlockHeader*) originalResult;
-		void* result=(void*)(pHeader+1);
-		::HeaderIdentifier* pIdentifier=((::HeaderIdentifier*)result)-1;
-
-		pHeader->size=n;
-		*pIdentifier=sizeHasBeenStored;
-
-
-		if( !memcounter_globallyDisabled && !pthread_getspecific(memcounter_threadDisabled) )
-		{
-			// Disable memory counting while I do this in case any of my calls create a
-			// recursive loop. Any non-zero value will do, using this one to avoid casting.
-			pthread_setspecific( memcounter_threadDisabled, &memcounter_globallyDisabled );
-
-			memcounter::IntrusiveMemoryCounterManager::instance().addToAllEnabledCountersForCurrentThread( n );
+		void* result=(void*)( ((char*)originalResult)+fixedHeaderSize() );
+		memcounter::BlockDetails details=newBlockDetails( state, n, weight );
+		writeHeader( originalResult, result, true, details );
 
-			// Put memory counting back on
-			pthread_setspecific( memcounter_threadDisabled, 0 );
-		}
+		addToEnabledCounters( state, details, usableSizeAfterHeader(originalResult,result) );
+		traceEvent( state, memcounter::TraceEvent::malloc, NULL, result, n, weight );
 
 		return result;
 	}
@@ -402,36 +1547,31 @@ static void* domalloc( IgHook::SafeData<igprof_domalloc_t> &hook, size_t n )
 
 static void* docalloc( IgHook::SafeData<igprof_docalloc_t> &hook, size_t num, size_t size )
 {
-	if( memcounter_globallyDisabled || pthread_getspecific(memcounter_threadDisabled) ) return ( *hook.chain )( num, size );
+	memcounter::ThreadState& state=memcounter::threadState;
+	if( LIKELY(!state.countingEnabled) || memcounter_globallyDisabled ) return ( *hook.chain )( num, size );
+
+	uint32_t weight=sampleWeight( state, num*size );
+	if( weight==0 ) return ( *hook.chain )( num, size );
+	else if( sizeTracking!=HeaderSizeTracking )
+	{
+		void* result=( *hook.chain )( num, size );
+		countNewUntouchedBlock( state, memcounter::TraceEvent::calloc, result, num*size, weight );
+		return result;
+	}
 	else
 	{
 
+		// calloc( num, 0 ) asks for nothing the same as calloc( 0, 1 ), but the element size is needed to fit the header in
+		if( size==0 )
+		{
+			num=0;
+			size=1;
+		}
+
 		// I first need to figure out how many more elements I need to allocate to fit
 		// a MemoryBlockHeader struct in.
-		size_t extraHeaderElements;
 		bool useFixedHeader;
-
-		if( size>sizeof(::VariableMemoryBlockHeader) )
-		{
-			extraHeaderElements=1;
-			useFixedHeader=false;
-		}
-		else
-		{
-			// FixedMemoryBlockHeader is smaller than VariableMemoryBlockHeader, so if a fixed header
-			// can fit I'll use that. It will only work if it fits exactly though.
-			if( size<=sizeof(::FixedMemoryBlockHeader) && sizeof(::FixedMemoryBlockHeader)%size==0 )
-			{
-				extraHeaderElements=sizeof(::FixedMemoryBlockHeader)/size;
-				useFixedHeader=true;
-			}
-			else
-			{
-				extraHeaderElements=sizeof(::VariableMemoryBlockHeader)/size;
-				if( sizeof(::VariableMemoryBlockHeader)%size != 0 ) ++extraHeaderElements; // Always round up
-				useFixedHeader=false;
-			}
-		}
+		size_t extraHeaderElements=headerOffset( size, useFixedHeader )/size;
 
 		void* originalResult=( *hook.chain )( num+extraHeaderElements, size );
 		if( originalResult==NULL )
@@ -440,39 +1580,14 @@ static void* docalloc( IgHook::SafeData<igprof_docalloc_t> &hook, size_t num, si
 			return NULL;
 		}
 
-		// Get a pointer to where the memory after the header elements is
+		// Get a pointer to where the memory after the header elements is. Any spare space will be at
+		// the beginning and the header is right in front of the memory location I pass back to the caller.
 		void* result=(void*)( ((char*)originalResult) + extraHeaderElements*size );
-		// Now that I have that, take off the size of the header struct so that any
-		// spare space will be at the beginning and the header is right in front of
-		// the memory location I pass back to the caller.
-		if( useFixedHeader )
-		{
-			::HeaderIdentifier* pIdentifier=((::HeaderIdentifier*)result)-1;
-			::FixedMemoryBlockHeader* pHeader=((::FixedMemoryBlockHeader*)result)-1;
-			*pIdentifier=sizeHasBeenStored;
-			pHeader->size=num*size;
-		}
-		else
-		{
-			::HeaderIdentifier* pIdentifier=((::HeaderIdentifier*)result)-1;
-			::VariableMemoryBlockHeader* pHeader=((::VariableMemoryBlockHeader*)result)-1;
-			*pIdentifier=variableSizeHasBeenStored;
-			pHeader->size=num*size;
-			pHeader->pOriginalPtr=originalResult;
-		}
-
+		memcounter::BlockDetails details=newBlockDetails( state, num*size, weight );
+		writeHeader( originalResult, result, useFixedHeader, details );
 
-		if( !memcounter_globallyDisabled && !pthread_getspecific(memcounter_threadDisabled) )
-		{
-			// Disable memory counting while I do this in case any of my calls create a
-			// recursive loop. Any non-zero value will do, using this one to avoid casting.
-			pthread_setspecific( memcounter_threadDisabled, &memcounter_globallyDisabled );
-
-			memcounter::IntrusiveMemoryCounterManager::instance().addToAllEnabledCountersForCurrentThread( num*size );
-
-			// Put memory counting back on
-			pthread_setspecific( memcounter_threadDisabled, 0 );
-		}
+		addToEnabledCounters( state, details, usableSizeAfterHeader(originalResult,result) );
+		traceEvent( state, memcounter::TraceEvent::calloc, NULL, result, num*size, weight );
 
 		return result;
 	}
@@ -480,72 +1595,120 @@ static void* docalloc( IgHook::SafeData<igprof_docalloc_t> &hook, size_t num, si
 
 static void* dorealloc( IgHook::SafeData<igprof_dorealloc_t> &hook, void *ptr, size_t n )
 {
-	if( memcounter_globallyDisabled || pthread_getspecific(memcounter_threadDisabled) ) return ( *hook.chain )( ptr, n );
-	else
+	// If ptr is NULL this delegates to malloc, which my hook will already have counted
+	if( ptr==NULL ) return ( *hook.chain )( ptr, n );
+
+	// Unlike the other allocation hooks this can't pass straight through when the thread isn't counting,
+	// because the block might have been tracked. If so it's left untracked afterwards, the same as if it
+	// had been freed and allocated again while not counting.
+	memcounter::ThreadState& state=memcounter::threadState;
+	bool counting=state.countingEnabled && !memcounter_globallyDisabled;
+	memcounter::BlockDetails details;
+
+	if( sizeTracking!=HeaderSizeTracking )
 	{
-		void* result; // the return value
+		// Blocks are untouched in usable mode, so there's only anything to do if the thread is counting
+		if( sizeTracking==UsableSizeTracking && LIKELY(!counting) ) return ( *hook.chain )( ptr, n );
 
-		if( ptr==NULL )
-		{
-			// If the original ptr is NULL, realloc delegates to malloc which will be
-			// caught by my hook and already have the details put at the start of
-			// the block. My malloc hook will also have already reported the memory
-			// allocation to any active counters, so I can return straight from here.
-			result=( *hook.chain )( ptr, n );
-		}
-		else
-		{
-			void* originalPtr;
-			size_t originalSize;
+		size_t originalUsableSize;
+		bool wasTracked=forgetUntouchedBlock( ptr, details, originalUsableSize );
 
-			// Only change the pointer if it's not null.
-			::HeaderIdentifier* pIdentifier=((HeaderIdentifier*)ptr)-1;
-			if( *pIdentifier==sizeHasBeenStored )
-			{
-				::FixedMemoryBlockHeader* pHeader=((FixedMemoryBlockHeader*)ptr)-1;
-				originalSize=pHeader->size;
-				originalPtr=(void*)pHeader;
-			}
-			else if( *pIdentifier==variableSizeHasBeenStored )
+		void* result=( *hook.chain )( ptr, n );
+		if( result==NULL )
+		{
+			// realloc( ptr, 0 ) frees the block and returns NULL. Otherwise NULL means the original
+			// block is still intact, so it needs to be remembered again.
+			if( n!=0 && wasTracked && sizeTracking==SideTableSizeTracking ) sideTable.insert( ptr, details );
+			else if( n==0 && wasTracked )
 			{
-				::VariableMemoryBlockHeader* pHeader=((VariableMemoryBlockHeader*)ptr)-1;
-				originalSize=pHeader->size;
-				originalPtr=pHeader->pOriginalPtr;
+				releaseBlock( state, counting, details, originalUsableSize );
+				traceEvent( state, memcounter::TraceEvent::free, NULL, ptr, 0, 1 );
 			}
-			else
+			return result;
+		}
+		if( !counting )
+		{
+			if( wasTracked )
 			{
-				originalPtr=ptr;
-				originalSize=0;
+				releaseBlock( state, counting, details, originalUsableSize );
+				traceEvent( state, memcounter::TraceEvent::realloc, ptr, NULL, n, 1 );
 			}
+			return result;
+		}
 
-			// Request extra memory to store the header at the start of the block
-			void* originalResult=( *hook.chain )( originalPtr, n+sizeof(::FixedMemoryBlockHeader) );
-			if( originalResult==NULL )
-			{
-				std::cerr << "##### Arghh! Couldn't allocate memory with realloc! #####" << std::endl;
-				return NULL;
-			}
+		// For sampling this is treated as a free and a new allocation, so the new block takes its chance
+		// the same as any other. Otherwise blocks that weren't sampled would be counted when reallocated.
+		size_t usableSize=malloc_usable_size( result );
+		memcounter::BlockDetails newDetails=newBlockDetails( state, sizeTracking==UsableSizeTracking ? usableSize : n, sampleWeight( state, n ) );
+		// If there's no room to track the new block then as far as the counters are concerned it's been freed
+		if( newDetails.weight!=0 && sizeTracking==SideTableSizeTracking && !sideTable.insert( result, newDetails ) ) newDetails.weight=0;
 
-			// Store the size data and an identifier so that free knows there's extra data
-			::FixedMemoryBlockHeader* pHeader=(FixedMemoryBlockHeader*)originalResult;
-			result=(void*)(((FixedMemoryBlockHeader*)originalResult)+1);
-			pIdentifier=((HeaderIdentifier*)result)-1;
+		if( wasTracked && newDetails.weight==details.weight && !isRemoteBlock( state, details ) ) modifyEnabledCounters( state, details, originalUsableSize, newDetails, usableSize );
+		else
+		{
+			if( wasTracked ) releaseBlock( state, counting, details, originalUsableSize );
+			if( newDetails.weight!=0 ) addToEnabledCounters( state, newDetails, usableSize );
+		}
+		if( wasTracked || newDetails.weight!=0 )
+		{
+			// One event for both blocks, with the address of whichever isn't tracked left as zero
+			traceEvent( state, memcounter::TraceEvent::realloc, wasTracked ? ptr : NULL, newDetails.weight!=0 ? result : NULL, newDetails.size, std::max( newDetails.weight, 1u ) );
+		}
+		return result;
+	}
+	else
+	{
+		void* originalPtr;
+		bool wasTracked=readHeader( ptr, originalPtr, details );
+		if( !wasTracked && LIKELY(!counting) ) return ( *hook.chain )( ptr, n );
 
-			pHeader->size=n;
-			*pIdentifier=sizeHasBeenStored;
+		// For sampling this is treated as a free and a new allocation, see above
+		uint32_t weight=( counting ? sampleWeight( state, n ) : 0 );
+		if( !wasTracked && weight==0 ) return ( *hook.chain )( ptr, n );
 
-			if( !memcounter_globallyDisabled && !pthread_getspecific(memcounter_threadDisabled) )
-			{
-				// Disable memory counting while I do this in case any of my calls create a
-				// recursive loop. Any non-zero value will do, using this one to avoid casting.
-				pthread_setspecific( memcounter_threadDisabled, &memcounter_globallyDisabled );
+		// Where the program's data currently starts in the block, and how much of it there can be
+		size_t originalOffset=(char*)ptr-(char*)originalPtr;
+		size_t originalUsableSize=malloc_usable_size( originalPtr )-originalOffset;
+		size_t bytesToKeep=std::min( originalUsableSize, n );
 
-				memcounter::IntrusiveMemoryCounterManager::instance().modifyAllEnabledCountersForCurrentThread( originalSize, n );
+		if( weight==0 )
+		{
+			// The new block isn't being tracked so take the header off. Make sure the data isn't
+			// truncated before I get the chance to move it.
+			void* result=( *hook.chain )( originalPtr, n+originalOffset );
+			if( result==NULL ) return NULL;
+			memmove( result, ((char*)result)+originalOffset, bytesToKeep );
+			releaseBlock( state, counting, details, originalUsableSize );
+			traceEvent( state, memcounter::TraceEvent::realloc, ptr, NULL, n, 1 );
+			return result;
+		}
 
-				// Put memory counting back on
-				pthread_setspecific( memcounter_threadDisabled, 0 );
-			}
+		// Request extra memory to store the header at the start of the block. If the old header was bigger
+		// (from memalign or calloc) keep that much extra so nothing is truncated before it's moved.
+		void* originalResult=( *hook.chain )( originalPtr, n+std::max(originalOffset,fixedHeaderSize()) );
+		if( originalResult==NULL )
+		{
+			std::cerr << "##### Arghh! Couldn't allocate memory with realloc! #####" << std::endl;
+			return NULL;
+		}
+
+		// The data needs shifting if it wasn't already just after a fixed header. This has to happen
+		// before the header is written, since for a block that didn't have one the header goes over
+		// the start of the data.
+		void* result=(void*)( ((char*)originalResult)+fixedHeaderSize() );
+		if( originalOffset!=fixedHeaderSize() ) memmove( result, ((char*)originalResult)+originalOffset, bytesToKeep );
+
+		memcounter::BlockDetails newDetails=newBlockDetails( state, n, weight );
+		writeHeader( originalResult, result, true, newDetails );
+
+		size_t usableSize=usableSizeAfterHeader( originalResult, result );
+		if( wasTracked && weight==details.weight && !isRemoteBlock( state, details ) ) modifyEnabledCounters( state, details, originalUsableSize, newDetails, usableSize );
+		else
+		{
+			if( wasTracked ) releaseBlock( state, counting, details, originalUsableSize );
+			addToEnabledCounters( state, newDetails, usableSize );
 		}
+		traceEvent( state, memcounter::TraceEvent::realloc, wasTracked ? ptr : NULL, result, n, weight );
 
 		return result;
 	}
@@ -553,77 +1716,39 @@ static void* dorealloc( IgHook::SafeData<igprof_dorealloc_t> &hook, void *ptr, s
 
 static void* domemalign( IgHook::SafeData<igprof_domemalign_t> &hook, size_t alignment, size_t size )
 {
-	if( memcounter_globallyDisabled || pthread_getspecific(memcounter_threadDisabled) ) return ( *hook.chain )( alignment, size );
+	memcounter::ThreadState& state=memcounter::threadState;
+	if( LIKELY(!state.countingEnabled) || memcounter_globallyDisabled ) return ( *hook.chain )( alignment, size );
+
+	uint32_t weight=sampleWeight( state, size );
+	if( weight==0 ) return ( *hook.chain )( alignment, size );
+	else if( sizeTracking!=HeaderSizeTracking )
+	{
+		void* result=( *hook.chain )( alignment, size );
+		countNewUntouchedBlock( state, memcounter::TraceEvent::memalign, result, size, weight );
+		return result;
+	}
 	else
 	{
 		// I don't have any programs that use memalign to test with, so I'll warn the user
 		std::cerr << " memcounter warning - your program uses memalign which should work but hasn't been tested" << "\n";
 
-		size_t alignedHeaderSize; // This is how many multiples of the alignment, not the actual size
 		bool useFixedHeader;
+		size_t offset=headerOffset( alignment, useFixedHeader );
 
-		if( alignment>sizeof(::VariableMemoryBlockHeader) )
-		{
-			alignedHeaderSize=1;
-			useFixedHeader=false;
-		}
-		else
-		{
-			// FixedMemoryBlockHeader is smaller than VariableMemoryBlockHeader, so if a fixed header
-			// can fit I'll use that. It will only work if it fits exactly though.
-			if( alignment<=sizeof(::FixedMemoryBlockHeader) && sizeof(::FixedMemoryBlockHeader)%alignment==0 )
-			{
-				alignedHeaderSize=sizeof(::FixedMemoryBlockHeader)/alignment;
-				useFixedHeader=true;
-			}
-			else
-			{
-				alignedHeaderSize=sizeof(::VariableMemoryBlockHeader)/alignment;
-				if( sizeof(::VariableMemoryBlockHeader)%alignment != 0 ) ++alignedHeaderSize; // Always round up
-				useFixedHeader=false;
-			}
-		}
-
-		void* originalResult=( *hook.chain )( alignment, size+alignment*alignedHeaderSize );
+		void* originalResult=( *hook.chain )( alignment, size+offset );
 		if( originalResult==NULL )
 		{
-			std::cerr << "##### Arghh! Couldn't allocate memory with calloc! #####" << std::endl;
+			std::cerr << "##### Arghh! Couldn't allocate memory with memalign! #####" << std::endl;
 			return NULL;
 		}
 
-		// Get a pointer to where the memory after the header elements is
-		void* result=(void*)( ((char*)originalResult) + alignment*alignedHeaderSize );
-		// Now that I have that, take off the size of the header struct so that any
-		// spare space will be at the beginning and the header is right in front of
-		// the memory location I pass back to the caller.
-		if( useFixedHeader )
-		{
-			::HeaderIdentifier* pIdentifier=((::HeaderIdentifier*)result)-1;
-			::FixedMemoryBlockHeader* pHeader=((::FixedMemoryBlockHeader*)result)-1;
-			*pIdentifier=sizeHasBeenStored;
-			pHeader->size=size;
-		}
-		else
-		{
-			::HeaderIdentifier* pIdentifier=((::HeaderIdentifier*)result)-1;
-			::VariableMemoryBlockHeader* pHeader=((::VariableMemoryBlockHeader*)result)-1;
-			*pIdentifier=variableSizeHasBeenStored;
-			pHeader->size=size;
-			pHeader->pOriginalPtr=originalResult;
-		}
-
+		// Get a pointer to where the memory after the header is
+		void* result=(void*)( ((char*)originalResult) + offset );
+		memcounter::BlockDetails details=newBlockDetails( state, size, weight );
+		writeHeader( originalResult, result, useFixedHeader, details );
 
-		if( !memcounter_globallyDisabled && !pthread_getspecific(memcounter_threadDisabled) )
-		{
-			// Disable memory counting while I do this in case any of my calls create a
-			// recursive loop. Any non-zero value will do, using this one to avoid casting.
-			pthread_setspecific( memcounter_threadDisabled, &memcounter_globallyDisabled );
-
-			memcounter::IntrusiveMemoryCounterManager::instance().addToAllEnabledCountersForCurrentThread( size );
-
-			// Put memory counting back on
-			pthread_setspecific( memcounter_threadDisabled, 0 );
-		}
+		addToEnabledCounters( state, details, usableSizeAfterHeader(originalResult,result) );
+		traceEvent( state, memcounter::TraceEvent::memalign, NULL, result, size, weight );
 
 		return result;
 	}
@@ -632,78 +1757,39 @@ static void* domemalign( IgHook::SafeData<igprof_domemalign_t> &hook, size_t ali
 
 static void* dovalloc( IgHook::SafeData<igprof_dovalloc_t> &hook, size_t size )
 {
-	if( memcounter_globallyDisabled || pthread_getspecific(memcounter_threadDisabled) ) return ( *hook.chain )( size );
+	memcounter::ThreadState& state=memcounter::threadState;
+	if( LIKELY(!state.countingEnabled) || memcounter_globallyDisabled ) return ( *hook.chain )( size );
+
+	uint32_t weight=sampleWeight( state, size );
+	if( weight==0 ) return ( *hook.chain )( size );
+	else if( sizeTracking!=HeaderSizeTracking )
+	{
+		void* result=( *hook.chain )( size );
+		countNewUntouchedBlock( state, memcounter::TraceEvent::valloc, result, size, weight );
+		return result;
+	}
 	else
 	{
 		// I don't have any programs that use valloc to test with, so I'll warn the user
 		std::cerr << " memcounter warning - your program uses valloc which should work but hasn't been tested" << "\n";
 
-		long alignment=sysconf(_SC_PAGESIZE);
-		size_t alignedHeaderSize; // This is how many multiples of the alignment, not the actual size
 		bool useFixedHeader;
+		size_t offset=headerOffset( sysconf(_SC_PAGESIZE), useFixedHeader );
 
-		if( alignment>sizeof(::VariableMemoryBlockHeader) )
-		{
-			alignedHeaderSize=1;
-			useFixedHeader=false;
-		}
-		else
-		{
-			// FixedMemoryBlockHeader is smaller than VariableMemoryBlockHeader, so if a fixed header
-			// can fit I'll use that. It will only work if it fits exactly though.
-			if( alignment<=sizeof(::FixedMemoryBlockHeader) && sizeof(::FixedMemoryBlockHeader)%alignment==0 )
-			{
-				alignedHeaderSize=sizeof(::FixedMemoryBlockHeader)/alignment;
-				useFixedHeader=true;
-			}
-			else
-			{
-				alignedHeaderSize=sizeof(::VariableMemoryBlockHeader)/alignment;
-				if( sizeof(::VariableMemoryBlockHeader)%alignment != 0 ) ++alignedHeaderSize; // Always round up
-				useFixedHeader=false;
-			}
-		}
-
-		void* originalResult=( *hook.chain )( size+alignment*alignedHeaderSize );
+		void* originalResult=( *hook.chain )( size+offset );
 		if( originalResult==NULL )
 		{
-			std::cerr << "##### Arghh! Couldn't allocate memory with calloc! #####" << std::endl;
+			std::cerr << "##### Arghh! Couldn't allocate memory with valloc! #####" << std::endl;
 			return NULL;
 		}
 
-		// Get a pointer to where the memory after the header elements is
-		void* result=(void*)( ((char*)originalResult) + alignment*alignedHeaderSize );
-		// Now that I have that, take off the size of the header struct so that any
-		// spare space will be at the beginning and the header is right in front of
-		// the memory location I pass back to the caller.
-		if( useFixedHeader )
-		{
-			::HeaderIdentifier* pIdentifier=((::HeaderIdentifier*)result)-1;
-			::FixedMemoryBlockHeader* pHeader=((::FixedMemoryBlockHeader*)result)-1;
-			*pIdentifier=sizeHasBeenStored;
-			pHeader->size=size;
-		}
-		else
-		{
-			::HeaderIdentifier* pIdentifier=((::HeaderIdentifier*)result)-1;
-			::VariableMemoryBlockHeader* pHeader=((::VariableMemoryBlockHeader*)result)-1;
-			*pIdentifier=variableSizeHasBeenStored;
-			pHeader->size=size;
-			pHeader->pOriginalPtr=originalResult;
-		}
-
-
-		if( !memcounter_globallyDisabled && !pthread_getspecific(memcounter_threadDisabled) )
-		{
-			// Disable memory counting while I do this in case any of my calls create a
-			// recursive loop. Any non-zero value will do, using this one to avoid casting.
-			pthread_setspecific( memcounter_threadDisabled, &memcounter_globallyDisabled );
-
-			memcounter::IntrusiveMemoryCounterManager::instance().addToAllEnabledCountersForCurrentThread( size );
+		// Get a pointer to where the memory after the header is
+		void* result=(void*)( ((char*)originalResult) + offset );
+		memcounter::BlockDetails details=newBlockDetails( state, size, weight );
+		writeHeader( originalResult, result, useFixedHeader, details );
 
-			// Put memory counting back on
-			pthread_setspecific( memcounter_threadDisabled, 0 );
-		}
+		addToEnabledCounters( state, details, usableSizeAfterHeader(originalResult,result) );
+		traceEvent( state, memcounter::TraceEvent::valloc, NULL, result, size, weight );
 
 		return result;
 	}
@@ -711,79 +1797,40 @@ static void* dovalloc( IgHook::SafeData<igprof_dovalloc_t> &hook, size_t size )
 
 static int dopmemalign( IgHook::SafeData<igprof_dopmemalign_t> &hook, void **ptr, size_t alignment, size_t size )
 {
-	if( memcounter_globallyDisabled || pthread_getspecific(memcounter_threadDisabled) ) return ( *hook.chain )( ptr, alignment, size );
+	memcounter::ThreadState& state=memcounter::threadState;
+	if( LIKELY(!state.countingEnabled) || memcounter_globallyDisabled ) return ( *hook.chain )( ptr, alignment, size );
+
+	uint32_t weight=sampleWeight( state, size );
+	if( weight==0 ) return ( *hook.chain )( ptr, alignment, size );
+	else if( sizeTracking!=HeaderSizeTracking )
+	{
+		int returnValue=( *hook.chain )( ptr, alignment, size );
+		if( returnValue==0 ) countNewUntouchedBlock( state, memcounter::TraceEvent::posixMemalign, *ptr, size, weight );
+		return returnValue;
+	}
 	else
 	{
 		// I don't have any programs that use posix_memalign to test with, so I'll warn the user
 		std::cerr << " memcounter warning - your program uses posix_memalign which should work but hasn't been tested" << "\n";
 
-		size_t alignedHeaderSize; // This is how many multiples of the alignment, not the actual size
 		bool useFixedHeader;
+		size_t offset=headerOffset( alignment, useFixedHeader );
 
-		if( alignment>sizeof(::VariableMemoryBlockHeader) )
-		{
-			alignedHeaderSize=1;
-			useFixedHeader=false;
-		}
-		else
-		{
-			// FixedMemoryBlockHeader is smaller than VariableMemoryBlockHeader, so if a fixed header
-			// can fit I'll use that. It will only work if it fits exactly though.
-			if( alignment<=sizeof(::FixedMemoryBlockHeader) && sizeof(::FixedMemoryBlockHeader)%alignment==0 )
-			{
-				alignedHeaderSize=sizeof(::FixedMemoryBlockHeader)/alignment;
-				useFixedHeader=true;
-			}
-			else
-			{
-				alignedHeaderSize=sizeof(::VariableMemoryBlockHeader)/alignment;
-				if( sizeof(::VariableMemoryBlockHeader)%alignment != 0 ) ++alignedHeaderSize; // Always round up
-				useFixedHeader=false;
-			}
-		}
-
-		void* originalResult;
-		int returnValue=( *hook.chain )( &originalResult, alignment, size+alignment*alignedHeaderSize );
-		if( originalResult==NULL )
+		void* originalResult=NULL;
+		int returnValue=( *hook.chain )( &originalResult, alignment, size+offset );
+		if( returnValue!=0 || originalResult==NULL )
 		{
-			std::cerr << "##### Arghh! Couldn't allocate memory with calloc! #####" << std::endl;
-			*ptr=NULL;
+			std::cerr << "##### Arghh! Couldn't allocate memory with posix_memalign! #####" << std::endl;
 			return returnValue;
 		}
 
-		// Get a pointer to where the memory after the header elements is
-		void* result=(void*)( ((char*)originalResult) + alignment*alignedHeaderSize );
-		// Now that I have that, take off the size of the header struct so that any
-		// spare space will be at the beginning and the header is right in front of
-		// the memory location I pass back to the caller.
-		if( useFixedHeader )
-		{
-			::HeaderIdentifier* pIdentifier=((::HeaderIdentifier*)result)-1;
-			::FixedMemoryBlockHeader* pHeader=((::FixedMemoryBlockHeader*)result)-1;
-			*pIdentifier=sizeHasBeenStored;
-			pHeader->size=size;
-		}
-		else
-		{
-			::HeaderIdentifier* pIdentifier=((::HeaderIdentifier*)result)-1;
-			::VariableMemoryBlockHeader* pHeader=((::VariableMemoryBlockHeader*)result)-1;
-			*pIdentifier=variableSizeHasBeenStored;
-			pHeader->size=size;
-			pHeader->pOriginalPtr=originalResult;
-		}
-
-
-		if( !memcounter_globallyDisabled && !pthread_getspecific(memcounter_threadDisabled) )
-		{
-			// Disable memory counting while I do this in case any of my calls create a
-			// recursive loop. Any non-zero value will do, using this one to avoid casting.
-			pthread_setspecific( memcounter_threadDisabled, &memcounter_globallyDisabled );
-
-			memcounter::IntrusiveMemoryCounterManager::instance().addToAllEnabledCountersForCurrentThread( size );
+		// Get a pointer to where the memory after the header is
+		void* result=(void*)( ((char*)originalResult) + offset );
+		memcounter::BlockDetails details=newBlockDetails( state, size, weight );
+		writeHeader( originalResult, result, useFixedHeader, details );
 
-			// Put memory counting back on
-			pthread_setspecific( memcounter_threadDisabled, 0 );
-		}
+		addToEnabledCounters( state, details, usableSizeAfterHeader(originalResult,result) );
+		traceEvent( state, memcounter::TraceEvent::posixMemalign, NULL, result, size, weight );
 
 		*ptr=result;
 		return returnValue;
@@ -794,50 +1841,49 @@ static void dofree( IgHook::SafeData<igprof_dofree_t> &hook, void *ptr )
 {
 	if( ptr==NULL ) return;
 
-	// Get what the original pointer was before my malloc hook changed it
-	void* originalPtr;
-	size_t originalSize;
+	memcounter::ThreadState& state=memcounter::threadState;
+	bool counting=state.countingEnabled && !memcounter_globallyDisabled;
+	memcounter::BlockDetails details;
 
-	::HeaderIdentifier* pIdentifier=((::HeaderIdentifier*)ptr)-1;
-	if( *pIdentifier==sizeHasBeenStored )
+	if( sizeTracking!=HeaderSizeTracking )
 	{
-		::FixedMemoryBlockHeader* pHeader=((::FixedMemoryBlockHeader*)ptr)-1;
-		originalSize=pHeader->size;
-		originalPtr=(void*)pHeader;
-	}
-	else if( *pIdentifier==variableSizeHasBeenStored )
-	{
-		::VariableMemoryBlockHeader* pHeader=((::VariableMemoryBlockHeader*)ptr)-1;
-		originalSize=pHeader->size;
-		originalPtr=pHeader->pOriginalPtr;
-	}
-	else // No identifier found, so this allocation wasn't caught by my malloc hooks
-	{
-		originalPtr=ptr;
-		originalSize=0;
+		// Blocks are untouched in usable mode, so there's only anything to do if the thread is counting.
+		// The side table has to be kept up to date whether counting or not though.
+		if( sizeTracking==UsableSizeTracking && LIKELY(!counting) ) return ( *hook.chain )( ptr );
+
+		size_t usableSize;
+		bool wasTracked=forgetUntouchedBlock( ptr, details, usableSize );
+		( *hook.chain )( ptr );
+		if( wasTracked )
+		{
+			releaseBlock( state, counting, details, usableSize );
+			traceEvent( state, memcounter::TraceEvent::free, NULL, ptr, 0, 1 );
+		}
+		return;
 	}
 
-	// Pass on to the proper free function
-	( *hook.chain )( originalPtr );
+	// Get what the original pointer was before my malloc hook changed it. If there's no header the
+	// allocation wasn't caught by my hooks (or wasn't sampled) so there's nothing to record.
+	void* originalPtr;
+	if( !readHeader( ptr, originalPtr, details ) ) return ( *hook.chain )( ptr );
 
-	// Record the free in any active counters
-	if( !memcounter_globallyDisabled && !pthread_getspecific(memcounter_threadDisabled) )
-	{
-		// Disable memory counting while I do this in case any of my calls create a
-		// recursive loop. Any non-zero value will do, using this one to avoid casting.
-		pthread_setspecific( memcounter_threadDisabled, &memcounter_globallyDisabled );
+	size_t usableSize=( counting || isRemoteBlock( state, details ) ? usableSizeAfterHeader( originalPtr, ptr ) : 0 );
 
-		memcounter::IntrusiveMemoryCounterManager::instance().removeFromAllEnabledCountersForCurrentThread( originalSize );
+	// Pass on to the proper free function
+	( *hook.chain )( originalPtr );
 
-		// Put memory counting back on
-		pthread_setspecific( memcounter_threadDisabled, 0 );
-	}
+	// Record the free in the counters of whichever thread allocated the block
+	releaseBlock( state, counting, details, usableSize );
+	traceEvent( state, memcounter::TraceEvent::free, NULL, ptr, 0, 1 );
 }
 
 /** Trapped calls to exit() and _exit().  */
 static void doexit( IgHook::SafeData<igprof_doexit_t> &hook, int code )
 {
-	std::cerr << "*** Custom doexit called ***" << std::endl;
+	// _exit can be called from a signal handler, so the report has to be written the same way as for a signal
+	writeCounterReport( "exit with status", code );
+	// The destructors don't run after _exit, so the segment has to be removed here
+	memcounter::LiveExport::stop();
 //	memcounter_globallyDisabled=true;
 	hook.chain( code );
 }
@@ -846,7 +1892,11 @@ static void doexit( IgHook::SafeData<igprof_doexit_t> &hook, int code )
  looks dangerous.  Mostly really to trap calls to abort().  */
 static int dokill( IgHook::SafeData<igprof_dokill_t> &hook, pid_t pid, int sig )
 {
-	std::cerr << "*** Custom dokill called ***" << std::endl;
+	if( ( pid==0 || pid==getpid() ) && isFatalSignal( sig ) )
+	{
+		writeCounterReport( "kill with signal", sig );
+		memcounter::LiveExport::stop();
+	}
 //	memcounter_globallyDisabled=true;
 	return hook.chain( pid, sig );
 }
@@ -857,18 +1907,27 @@ static int dopthread_create( IgHook::SafeData<igprof_dopthread_create_t> &hook,
 	std::cerr << "*** Custom dopthread_create called ***" << std::endl;
 	// Disable memory counting while I do this in case any of my calls create a
 	// recursive loop.
-	pthread_setspecific( memcounter_threadDisabled, &memcounter_globallyDisabled );
+	bool countingWasEnabled=memcounter::threadState.countingEnabled;
+	memcounter::threadState.countingEnabled=false;
 
 	// I have no guarantee the object will persist until the new thread actually starts to run, so
 	// I'll "new" it here and delete it in my proxy start routine. I don't care about the arg variable
 	// I've been passed, because that's the responsibility of the code that originally creates the
 	// thread.
-	ThreadCreationArguments* pThreadArgs=new ThreadCreationArguments( start_routine, arg );
+	// If counters are to be inherited, work out which global counters the new thread should feed. This
+	// has to be done in this thread because the enabled counters belong to this thread's pool.
+	uint32_t inheritedGlobalCounters=0;
+	if( inheritCounters && countingWasEnabled && memcounter::threadState.pPool ) inheritedGlobalCounters=memcounter::threadState.pPool->globalCountersForSpawnedThread();
+	// Held until the new thread has enabled them, in case the counters' owners go in the meantime
+	memcounter::GlobalMemoryCounter::addReferences( inheritedGlobalCounters );
+
+	ThreadCreationArguments* pThreadArgs=new ThreadCreationArguments( start_routine, arg, true, inheritedGlobalCounters );
 
 	int result=hook.chain( thread, attr, &proxyThreadStartRoutine, pThreadArgs );
+	if( result!=0 ) memcounter::GlobalMemoryCounter::releaseReferences( inheritedGlobalCounters );
 
-	// Put memory counting back on
-	pthread_setspecific( memcounter_threadDisabled, 0 );
+	// Put memory counting back to how it was
+	memcounter::threadState.countingEnabled=countingWasEnabled;
 
 	return result;
 }
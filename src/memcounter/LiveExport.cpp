@@ -0,0 +1,169 @@
+#include "memcounter/LiveExport.h"
+
+#include <iostream>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "memcounter/CounterNameTable.h"
+
+namespace // Use the unnamed namespace
+{
+	/// Used when not exporting. It's zero initialised, so it can be used before any constructors have run.
+	memcounter::LiveGlobalBlock privateGlobals;
+	char segmentName[64];
+	bool warnedAboutThreads=false;
+
+	inline memcounter::LiveFileHeader& header( char* pSegment )
+	{
+		return *reinterpret_cast<memcounter::LiveFileHeader*>( pSegment );
+	}
+
+	/// Rounds up to a whole number of cache lines, so that every block starts on one
+	inline size_t roundUp( size_t size )
+	{
+		return ( size+63 ) & ~size_t(63);
+	}
+}
+
+memcounter::LiveGlobalBlock* memcounter::LiveExport::pGlobals_=&privateGlobals;
+char* memcounter::LiveExport::pSegment_=NULL;
+size_t memcounter::LiveExport::segmentSize_=0;
+
+bool memcounter::LiveExport::start( size_t maximumNumberOfThreads )
+{
+	if( pSegment_!=NULL || maximumNumberOfThreads==0 ) return false;
+
+	const size_t maximumNumberOfNames=memcounter::CounterNameTable::capacity;
+	size_t namesOffset=roundUp( sizeof(memcounter::LiveFileHeader) );
+	size_t globalsOffset=roundUp( namesOffset+maximumNumberOfNames*sizeof(memcounter::LiveName) );
+	size_t threadsOffset=roundUp( globalsOffset+sizeof(memcounter::LiveGlobalBlock) );
+	size_t segmentSize=threadsOffset+maximumNumberOfThreads*sizeof(memcounter::LiveThreadBlock);
+
+	snprintf( segmentName, sizeof(segmentName), "/memcounter.%ld", long(getpid()) );
+	// A segment with the same name can only be left over from a process that had the same id and crashed
+	int fileDescriptor=shm_open( segmentName, O_RDWR | O_CREAT | O_EXCL, 0600 );
+	if( fileDescriptor<0 && errno==EEXIST && shm_unlink( segmentName )==0 ) fileDescriptor=shm_open( segmentName, O_RDWR | O_CREAT | O_EXCL, 0600 );
+	if( fileDescriptor<0 )
+	{
+		std::cerr << "memcounter - couldn't create the shared memory segment \"" << segmentName << "\": " << strerror(errno) << std::endl;
+		return false;
+	}
+	// The segment is sparse, memory is only used for the parts that get written
+	if( ftruncate( fileDescriptor, segmentSize )!=0 )
+	{
+		std::cerr << "memcounter - couldn't size the shared memory segment \"" << segmentName << "\": " << strerror(errno) << std::endl;
+		close( fileDescriptor );
+		shm_unlink( segmentName );
+		return false;
+	}
+	void* pMemory=mmap( NULL, segmentSize, PROT_READ | PROT_WRITE, MAP_SHARED, fileDescriptor, 0 );
+	close( fileDescriptor );
+	if( pMemory==MAP_FAILED )
+	{
+		std::cerr << "memcounter - couldn't map the shared memory segment \"" << segmentName << "\": " << strerror(errno) << std::endl;
+		shm_unlink( segmentName );
+		return false;
+	}
+
+	pSegment_=static_cast<char*>( pMemory );
+	segmentSize_=segmentSize;
+	memcounter::LiveFileHeader& fileHeader=header( pSegment_ );
+	timespec now;
+	clock_gettime( CLOCK_REALTIME, &now );
+	fileHeader.version=memcounter::liveVersion;
+	fileHeader.processId=getpid();
+	fileHeader.startTimeNanoseconds=uint64_t(now.tv_sec)*1000000000ull+now.tv_nsec;
+	fileHeader.headerSize=sizeof(memcounter::LiveFileHeader);
+	fileHeader.nameSize=sizeof(memcounter::LiveName);
+	fileHeader.globalBlockSize=sizeof(memcounter::LiveGlobalBlock);
+	fileHeader.threadBlockSize=sizeof(memcounter::LiveThreadBlock);
+	fileHeader.namesOffset=namesOffset;
+	fileHeader.globalsOffset=globalsOffset;
+	fileHeader.threadsOffset=threadsOffset;
+	fileHeader.maximumNumberOfNames=maximumNumberOfNames;
+	fileHeader.maximumNumberOfThreads=maximumNumberOfThreads;
+	fileHeader.numberOfThreadBlocksUsed=0;
+
+	// Anything already in the private block, i.e. global counters created before now, carries on in the segment
+	memcounter::LiveGlobalBlock* pSharedGlobals=reinterpret_cast<memcounter::LiveGlobalBlock*>( pSegment_+globalsOffset );
+	*pSharedGlobals=privateGlobals;
+	pGlobals_=pSharedGlobals;
+
+	// The magic goes in last so that a reader never sees a half written header
+	__atomic_thread_fence( __ATOMIC_RELEASE );
+	memcpy( fileHeader.magic, memcounter::liveMagic, sizeof(fileHeader.magic) );
+
+	pthread_atfork( NULL, NULL, &afterForkInChild );
+	return true;
+}
+
+void memcounter::LiveExport::stop()
+{
+	if( pSegment_==NULL ) return;
+	// The mapping is left, other threads could still be counting into it as the program exits. This
+	// gets called from signal handlers, and shm_unlink is just an unlink of a file in /dev/shm.
+	shm_unlink( segmentName );
+}
+
+memcounter::LiveThreadBlock* memcounter::LiveExport::threadBlock( uint32_t poolNumber )
+{
+	if( pSegment_==NULL || poolNumber==0 ) return NULL;
+
+	memcounter::LiveFileHeader& fileHeader=header( pSegment_ );
+	if( poolNumber>fileHeader.maximumNumberOfThreads )
+	{
+		if( !__atomic_test_and_set( &warnedAboutThreads, __ATOMIC_RELAXED ) )
+		{
+			std::cerr << "memcounter - more than " << fileHeader.maximumNumberOfThreads << " threads have been running at once, so some can't be watched. Set MEMCOUNTER_LIVE_THREADS higher." << std::endl;
+		}
+		return NULL;
+	}
+
+	// Pool numbers only go up, but the blocks can be asked for in any order by different threads
+	uint32_t used=__atomic_load_n( &fileHeader.numberOfThreadBlocksUsed, __ATOMIC_RELAXED );
+	while( used<poolNumber && !__atomic_compare_exchange_n( &fileHeader.numberOfThreadBlocksUsed, &used, poolNumber, false, __ATOMIC_RELEASE, __ATOMIC_RELAXED ) ) {}
+
+	return reinterpret_cast<memcounter::LiveThreadBlock*>( pSegment_+fileHeader.threadsOffset )+( poolNumber-1 );
+}
+
+void memcounter::LiveExport::publishName( uint32_t nameId, const char* name )
+{
+	if( pSegment_==NULL || nameId==0 || name==NULL ) return;
+
+	memcounter::LiveFileHeader& fileHeader=header( pSegment_ );
+	if( nameId>fileHeader.maximumNumberOfNames ) return;
+	memcounter::LiveName& liveName=reinterpret_cast<memcounter::LiveName*>( pSegment_+fileHeader.namesOffset )[nameId-1];
+	if( __atomic_load_n( &liveName.length, __ATOMIC_ACQUIRE )!=0 ) return;
+
+	// Two threads could both get here for the same name, but they'd write the same thing
+	size_t length=strlen( name );
+	if( length>sizeof(liveName.text) ) length=sizeof(liveName.text);
+	if( length==0 ) return;
+	memcpy( liveName.text, name, length );
+	__atomic_store_n( &liveName.length, uint32_t(length), __ATOMIC_RELEASE );
+}
+
+void memcounter::LiveExport::afterForkInChild()
+{
+	if( pSegment_==NULL ) return;
+
+	// Only the part that's been used needs copying, the rest is still zero
+	memcounter::LiveFileHeader& fileHeader=header( pSegment_ );
+	size_t usedSize=fileHeader.threadsOffset+size_t(fileHeader.numberOfThreadBlocksUsed)*sizeof(memcounter::LiveThreadBlock);
+	void* pCopy=mmap( NULL, usedSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+	if( pCopy!=MAP_FAILED )
+	{
+		memcpy( pCopy, pSegment_, usedSize );
+		// Replacing the mapping in place means every pointer into it stays valid
+		if( mmap( pSegment_, segmentSize_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0 )!=MAP_FAILED ) memcpy( pSegment_, pCopy, usedSize );
+		munmap( pCopy, usedSize );
+	}
+	// The segment is the parent's, so the child mustn't remove it or put any more names in it
+	pSegment_=NULL;
+}
@@ -1,53 +1,61 @@
 #include "memcounter/MemoryCounterImplementation.h"
 
 #include <algorithm>
+#include <dlfcn.h>
 
 #include "memcounter/ThreadMemoryCounterPool.h"
+#include "memcounter/CycleClock.h"
+#include "memcounter/DisablingFunctions.h"
 
 
 memcounter::MemoryCounterImplementation::MemoryCounterImplementation( memcounter::ThreadMemoryCounterPool& parentPool )
-	: enabled_(false), currentSize_(0), maximumSize_(0), currentNumberOfAllocations_(0),
-	  maximumNumberOfAllocations_(0), verbose_(false), pParentPool_(&parentPool), pParentCounter_(NULL)
+	: enabled_(false), enabledSlot_(-1), nameId_(0), pClientSlotBit_(NULL), pInheritedCounter_(NULL), verbose_(false),
+	  pCurrentlyActiveSubCounter_(NULL), pParentPool_(&parentPool), pParentCounter_(NULL)
 {
+	values_.reset();
+	histogram_.reset();
+	lifetimes_.reset();
 }
 
 memcounter::MemoryCounterImplementation::MemoryCounterImplementation( memcounter::MemoryCounterImplementation* pParentCounter )
-	: enabled_(false), currentSize_(0), maximumSize_(0), currentNumberOfAllocations_(0),
-	  maximumNumberOfAllocations_(0), verbose_(false), pParentPool_(NULL), pParentCounter_(pParentCounter)
+	: enabled_(false), enabledSlot_(-1), nameId_(0), pClientSlotBit_(NULL), pInheritedCounter_(NULL), verbose_(false),
+	  pCurrentlyActiveSubCounter_(NULL), pParentPool_(NULL), pParentCounter_(pParentCounter)
 {
+	values_.reset();
+	histogram_.reset();
+	lifetimes_.reset();
 }
 
 memcounter::MemoryCounterImplementation::~MemoryCounterImplementation()
 {
+	// What the spawned threads counted has gone into the retired shards and any named totals by now,
+	// so the global counter can go to whichever counter next starts a thread
+	if( pInheritedCounter_ ) memcounter::GlobalMemoryCounter::releaseReferences( 1u<<pInheritedCounter_->index() );
 }
 
 bool memcounter::MemoryCounterImplementation::setEnabled( bool enable )
 {
 	bool oldEnabled=enabled_;
-	enabled_=enable;
-	if( enable )
-	{
-		if( pParentPool_) pParentPool_->informEnabled( this );
-		else pParentCounter_->childEnabled( this );
-	}
-	else
-	{
-		if( pParentPool_) pParentPool_->informDisabled( this );
-		else pParentCounter_->childDisabled( this );
-	}
+	if( enable ) this->enable();
+	else disable();
 	return oldEnabled;
 }
 
 bool memcounter::MemoryCounterImplementation::isEnabled() const
 {
+	// It might have been paused through the client API
+	if( enabledSlot_>=0 && ( memcounter::threadState.pausedSlots & (1u<<enabledSlot_) ) ) return false;
 	return enabled_;
 }
 
 void memcounter::MemoryCounterImplementation::enable()
 {
-	if( pParentPool_) pParentPool_->informEnabled( this );
-	else pParentCounter_->childEnabled( this );
-	enabled_=true;
+	if( pParentPool_) enabled_=pParentPool_->informEnabled( this ); // Can fail if the pool has no free slots
+	else
+	{
+		pParentCounter_->childEnabled( this );
+		enabled_=true;
+	}
 }
 
 void memcounter::MemoryCounterImplementation::disable()
@@ -59,88 +67,351 @@ void memcounter::MemoryCounterImplementation::disable()
 
 void memcounter::MemoryCounterImplementation::reset()
 {
-	currentSize_=0;
-	maximumSize_=0;
-	currentNumberOfAllocations_=0;
-	maximumNumberOfAllocations_=0;
+	memcounter::CounterValues& counterValues=values();
+	if( pParentPool_ ) pParentPool_->beginValuesChange();
+	counterValues.reset();
+	if( pParentPool_ ) pParentPool_->endValuesChange();
+	histogram().reset();
+	lifetimes().reset();
+	callSites_.clear();
+	if( pInheritedCounter_ ) pInheritedCounter_->reset();
 	for( std::vector<IMemoryCounter*>::iterator iSubCounter=subCounters_.begin(); iSubCounter!=subCounters_.end(); ++iSubCounter ) (*iSubCounter)->reset();
 }
 
 void memcounter::MemoryCounterImplementation::resetMaximum()
 {
-	maximumSize_=currentSize_;
-	maximumNumberOfAllocations_=currentNumberOfAllocations_;
+	memcounter::CounterValues& counterValues=values();
+	if( pParentPool_ ) pParentPool_->beginValuesChange();
+	counterValues.resetMaximum();
+	if( pParentPool_ ) pParentPool_->endValuesChange();
+	if( pInheritedCounter_ ) pInheritedCounter_->resetMaximum();
 	for( std::vector<IMemoryCounter*>::iterator iSubCounter=subCounters_.begin(); iSubCounter!=subCounters_.end(); ++iSubCounter ) (*iSubCounter)->resetMaximum();
 }
 
 void memcounter::MemoryCounterImplementation::dumpContents( std::ostream& stream, const std::string& prefix ) const
 {
-	stream << prefix << "Running total of current size=" << currentSize_ << ", maximum size=" << maximumSize_ << std::endl;
+	const memcounter::CounterValues& currentValues=values();
+	stream << prefix << "Running total of current size=" << currentValues.current[CounterValues::size] << ", maximum size=" << currentValues.maximum[CounterValues::size]
+			<< " (usable current size=" << currentValues.current[CounterValues::usableSize] << ", maximum size=" << currentValues.maximum[CounterValues::usableSize] << ")" << std::endl;
+	if( pInheritedCounter_ ) pInheritedCounter_->dumpContents( stream, prefix+"   spawned threads: " );
+
+	const memcounter::SizeHistogram& currentHistogram=histogram();
+	for( size_t sizeClass=0; sizeClass<SizeHistogram::numberOfClasses; ++sizeClass )
+	{
+		const long int* pCounts=currentHistogram.counts[sizeClass];
+		if( pCounts[SizeHistogram::allocations]==0 && pCounts[SizeHistogram::liveAllocations]==0 ) continue;
+
+		stream << prefix << "   size " << SizeHistogram::lowestSize(sizeClass) << "-" << SizeHistogram::highestSize(sizeClass)
+				<< ": allocations=" << pCounts[SizeHistogram::allocations] << " (" << pCounts[SizeHistogram::bytes] << " bytes)"
+				<< ", current=" << pCounts[SizeHistogram::liveAllocations] << " (" << pCounts[SizeHistogram::liveBytes] << " bytes)" << std::endl;
+	}
+
+	std::vector<memcounter::LifetimeBinCounts> lifetimeBins=lifetimeHistogram();
+	for( std::vector<memcounter::LifetimeBinCounts>::const_iterator iBin=lifetimeBins.begin(); iBin!=lifetimeBins.end(); ++iBin )
+	{
+		if( iBin->allocations==0 ) continue;
+		stream << prefix << "   lifetime " << iBin->shortestNanoseconds << "-" << iBin->longestNanoseconds << "ns: freed=" << iBin->allocations << " (" << iBin->bytes << " bytes)" << std::endl;
+	}
+
+	std::vector<memcounter::CallSiteCounts> sites=callSites();
+	const size_t maximumSitesToDump=10;
+	if( sites.size()>maximumSitesToDump ) sites.resize( maximumSitesToDump );
+	for( std::vector<memcounter::CallSiteCounts>::const_iterator iSite=sites.begin(); iSite!=sites.end(); ++iSite )
+	{
+		stream << prefix << "   call site current=" << iSite->currentBytes << " bytes in " << iSite->currentAllocations << " blocks, maximum=" << iSite->maximumBytes
+				<< " bytes, allocations=" << iSite->totalAllocations << std::endl;
+		for( std::vector<void*>::const_iterator iFrame=iSite->stack.begin(); iFrame!=iSite->stack.end(); ++iFrame )
+		{
+			Dl_info info;
+			stream << prefix << "      " << *iFrame;
+			if( dladdr( *iFrame, &info ) && info.dli_sname ) stream << " " << info.dli_sname << "+" << ( static_cast<char*>(*iFrame)-static_cast<char*>(info.dli_saddr) );
+			else if( dladdr( *iFrame, &info ) && info.dli_fname ) stream << " in " << info.dli_fname;
+			stream << std::endl;
+		}
+	}
 }
 
 long int memcounter::MemoryCounterImplementation::currentSize() const
 {
-	long int currentSize=currentSize_;
+	long int currentSize=values().current[CounterValues::size];
 	for( std::vector<IMemoryCounter*>::const_iterator iSubCounter=subCounters_.begin(); iSubCounter!=subCounters_.end(); ++iSubCounter ) currentSize+=(*iSubCounter)->currentSize();
+	if( pInheritedCounter_ ) currentSize+=pInheritedCounter_->currentSize();
 	return currentSize;
 }
 
 long int memcounter::MemoryCounterImplementation::maximumSize() const
 {
-	long int maximumSize=maximumSize_;
+	long int maximumSize=values().maximum[CounterValues::size];
 	for( std::vector<IMemoryCounter*>::const_iterator iSubCounter=subCounters_.begin(); iSubCounter!=subCounters_.end(); ++iSubCounter ) maximumSize+=(*iSubCounter)->maximumSize();
+	if( pInheritedCounter_ ) maximumSize+=pInheritedCounter_->maximumSize();
 	return maximumSize;
 }
 
-int memcounter::MemoryCounterImplementation::currentNumberOfAllocations() const
+long int memcounter::MemoryCounterImplementation::currentNumberOfAllocations() const
 {
-	int currentNumberOfAllocations=currentNumberOfAllocations_;
+	long int currentNumberOfAllocations=values().current[CounterValues::numberOfAllocations];
 	for( std::vector<IMemoryCounter*>::const_iterator iSubCounter=subCounters_.begin(); iSubCounter!=subCounters_.end(); ++iSubCounter ) currentNumberOfAllocations+=(*iSubCounter)->currentNumberOfAllocations();
+	if( pInheritedCounter_ ) currentNumberOfAllocations+=pInheritedCounter_->currentNumberOfAllocations();
 	return currentNumberOfAllocations;
 }
 
-int memcounter::MemoryCounterImplementation::maximumNumberOfAllocations() const
+long int memcounter::MemoryCounterImplementation::maximumNumberOfAllocations() const
 {
-	int maximumNumberOfAllocations=maximumNumberOfAllocations_;
+	long int maximumNumberOfAllocations=values().maximum[CounterValues::numberOfAllocations];
 	for( std::vector<IMemoryCounter*>::const_iterator iSubCounter=subCounters_.begin(); iSubCounter!=subCounters_.end(); ++iSubCounter ) maximumNumberOfAllocations+=(*iSubCounter)->maximumNumberOfAllocations();
+	if( pInheritedCounter_ ) maximumNumberOfAllocations+=pInheritedCounter_->maximumNumberOfAllocations();
 	return maximumNumberOfAllocations;
 }
 
+void memcounter::MemoryCounterImplementation::addTotals( long int (&current)[CounterValues::numberOfQuantities], long int (&maximum)[CounterValues::numberOfQuantities] ) const
+{
+	const memcounter::CounterValues& counterValues=values();
+	for( int index=0; index<CounterValues::numberOfQuantities; ++index )
+	{
+		current[index]+=counterValues.current[index];
+		maximum[index]+=counterValues.maximum[index];
+	}
+	// Sub-counters are only ever created by this class
+	for( std::vector<IMemoryCounter*>::const_iterator iSubCounter=subCounters_.begin(); iSubCounter!=subCounters_.end(); ++iSubCounter ) static_cast<const memcounter::MemoryCounterImplementation*>(*iSubCounter)->addTotals( current, maximum );
+	if( pInheritedCounter_ )
+	{
+		long int inheritedCurrent[GlobalCounterShard::numberOfQuantities];
+		long int inheritedMaximum[GlobalCounterShard::numberOfQuantities];
+		pInheritedCounter_->totals( inheritedCurrent, inheritedMaximum );
+		for( int index=0; index<GlobalCounterShard::numberOfQuantities; ++index )
+		{
+			current[index]+=inheritedCurrent[index];
+			maximum[index]+=inheritedMaximum[index];
+		}
+	}
+}
+
 const std::vector<memcounter::IMemoryCounter*>& memcounter::MemoryCounterImplementation::subCounters() const
 {
 	return subCounters_;
 }
 
-void memcounter::MemoryCounterImplementation::add( size_t size )
+long int memcounter::MemoryCounterImplementation::currentUsableSize() const
 {
-	if( !enabled_ ) return;
+	long int currentUsableSize=values().current[CounterValues::usableSize];
+	for( std::vector<IMemoryCounter*>::const_iterator iSubCounter=subCounters_.begin(); iSubCounter!=subCounters_.end(); ++iSubCounter ) currentUsableSize+=(*iSubCounter)->currentUsableSize();
+	if( pInheritedCounter_ ) currentUsableSize+=pInheritedCounter_->currentUsableSize();
+	return currentUsableSize;
+}
+
+long int memcounter::MemoryCounterImplementation::maximumUsableSize() const
+{
+	long int maximumUsableSize=values().maximum[CounterValues::usableSize];
+	for( std::vector<IMemoryCounter*>::const_iterator iSubCounter=subCounters_.begin(); iSubCounter!=subCounters_.end(); ++iSubCounter ) maximumUsableSize+=(*iSubCounter)->maximumUsableSize();
+	if( pInheritedCounter_ ) maximumUsableSize+=pInheritedCounter_->maximumUsableSize();
+	return maximumUsableSize;
+}
+
+std::vector<memcounter::SizeClassCounts> memcounter::MemoryCounterImplementation::sizeHistogram() const
+{
+	// Copy out the counts first in case creating the vector changes them
+	memcounter::SizeHistogram currentHistogram=histogram();
+
+	size_t numberOfClasses=0;
+	for( size_t sizeClass=0; sizeClass<SizeHistogram::numberOfClasses; ++sizeClass )
+	{
+		if( currentHistogram.counts[sizeClass][SizeHistogram::allocations]!=0 || currentHistogram.counts[sizeClass][SizeHistogram::liveAllocations]!=0 ) numberOfClasses=sizeClass+1;
+	}
 
-	currentSize_+=size;
-	if( currentSize_>maximumSize_ ) maximumSize_=currentSize_;
+	std::vector<memcounter::SizeClassCounts> result( numberOfClasses );
+	for( size_t sizeClass=0; sizeClass<numberOfClasses; ++sizeClass )
+	{
+		memcounter::SizeClassCounts& counts=result[sizeClass];
+		counts.lowestSize=SizeHistogram::lowestSize( sizeClass );
+		counts.highestSize=SizeHistogram::highestSize( sizeClass );
+		counts.totalAllocations=currentHistogram.counts[sizeClass][SizeHistogram::allocations];
+		counts.totalBytes=currentHistogram.counts[sizeClass][SizeHistogram::bytes];
+		counts.currentAllocations=currentHistogram.counts[sizeClass][SizeHistogram::liveAllocations];
+		counts.currentBytes=currentHistogram.counts[sizeClass][SizeHistogram::liveBytes];
+	}
 
-	++currentNumberOfAllocations_;
-	if( currentNumberOfAllocations_>maximumNumberOfAllocations_ ) maximumNumberOfAllocations_=currentNumberOfAllocations_;
+	// Add on the sub-counters, which might have more classes
+	for( std::vector<IMemoryCounter*>::const_iterator iSubCounter=subCounters_.begin(); iSubCounter!=subCounters_.end(); ++iSubCounter )
+	{
+		std::vector<memcounter::SizeClassCounts> subHistogram=(*iSubCounter)->sizeHistogram();
+		if( subHistogram.size()>result.size() ) result.resize( subHistogram.size() ); // New elements are zeroed
+		for( size_t sizeClass=0; sizeClass<subHistogram.size(); ++sizeClass )
+		{
+			memcounter::SizeClassCounts& counts=result[sizeClass];
+			counts.lowestSize=subHistogram[sizeClass].lowestSize;
+			counts.highestSize=subHistogram[sizeClass].highestSize;
+			counts.totalAllocations+=subHistogram[sizeClass].totalAllocations;
+			counts.totalBytes+=subHistogram[sizeClass].totalBytes;
+			counts.currentAllocations+=subHistogram[sizeClass].currentAllocations;
+			counts.currentBytes+=subHistogram[sizeClass].currentBytes;
+		}
+	}
+
+	return result;
 }
 
-void memcounter::MemoryCounterImplementation::modify( size_t oldSize, size_t newSize )
+std::vector<memcounter::LifetimeBinCounts> memcounter::MemoryCounterImplementation::lifetimeHistogram() const
 {
-	if( !enabled_ ) return;
+	// Copy out the counts first in case creating the vector changes them, and add on the sub-counters
+	memcounter::LifetimeHistogram currentLifetimes=lifetimes();
+	for( std::vector<IMemoryCounter*>::const_iterator iSubCounter=subCounters_.begin(); iSubCounter!=subCounters_.end(); ++iSubCounter )
+	{
+		const memcounter::MemoryCounterImplementation* pSubCounter=static_cast<const memcounter::MemoryCounterImplementation*>(*iSubCounter);
+		currentLifetimes.add( pSubCounter->lifetimes() );
+	}
+
+	size_t firstBin=LifetimeHistogram::numberOfBins;
+	size_t lastBin=0;
+	for( size_t bin=0; bin<LifetimeHistogram::numberOfBins; ++bin )
+	{
+		if( currentLifetimes.counts[bin][LifetimeHistogram::allocations]==0 ) continue;
+		if( bin<firstBin ) firstBin=bin;
+		lastBin=bin;
+	}
+
+	std::vector<memcounter::LifetimeBinCounts> result;
+	if( firstBin>lastBin ) return result;
+
+	double nanosecondsPerCycle=memcounter::nanosecondsPerCycle();
+	result.resize( lastBin-firstBin+1 );
+	for( size_t bin=firstBin; bin<=lastBin; ++bin )
+	{
+		memcounter::LifetimeBinCounts& counts=result[bin-firstBin];
+		counts.shortestNanoseconds=( bin==0 ? 0 : double(uint64_t(1)<<bin)*nanosecondsPerCycle );
+		counts.longestNanoseconds=2.0*double(uint64_t(1)<<bin)*nanosecondsPerCycle;
+		counts.allocations=currentLifetimes.counts[bin][LifetimeHistogram::allocations];
+		counts.bytes=currentLifetimes.counts[bin][LifetimeHistogram::bytes];
+	}
+
+	return result;
+}
+
+namespace // Use the unnamed namespace
+{
+	bool moreCurrentBytes( const memcounter::CallSiteCounts& first, const memcounter::CallSiteCounts& second )
+	{
+		return first.currentBytes>second.currentBytes;
+	}
+}
+
+std::vector<memcounter::CallSiteCounts> memcounter::MemoryCounterImplementation::callSites() const
+{
+	if( enabledSlot_>=0 ) pParentPool_->drainRemoteFrees();
+
+	// Counting an allocation can grow callSites_, so it has to be disabled while it's being copied. It
+	// stays disabled for the rest so that the returned vectors aren't counted either.
+	bool countingWasEnabled=memcounter::threadState.countingEnabled;
+	memcounter::threadState.countingEnabled=false;
+
+	std::vector<memcounter::CallSiteStatistics> currentSites;
+	addCallSites( currentSites );
+
+	std::vector<memcounter::CallSiteCounts> result;
+	for( size_t node=1; node<currentSites.size(); ++node )
+	{
+		const memcounter::CallSiteStatistics& statistics=currentSites[node];
+		if( statistics.totalAllocations==0 && statistics.currentAllocations==0 ) continue;
+
+		result.push_back( memcounter::CallSiteCounts() );
+		memcounter::CallSiteCounts& counts=result.back();
+		pool().callSiteTrie().stack( node, counts.stack );
+		counts.currentBytes=statistics.currentBytes;
+		counts.maximumBytes=statistics.maximumBytes;
+		counts.currentAllocations=statistics.currentAllocations;
+		counts.totalAllocations=statistics.totalAllocations;
+	}
+
+	std::stable_sort( result.begin(), result.end(), &moreCurrentBytes );
+
+	memcounter::threadState.countingEnabled=countingWasEnabled;
+	return result;
+}
+
+void memcounter::MemoryCounterImplementation::addCallSites( std::vector<memcounter::CallSiteStatistics>& sites ) const
+{
+	if( callSites_.size()>sites.size() )
+	{
+		memcounter::CallSiteStatistics empty={ 0, 0, 0, 0, 0 };
+		sites.resize( callSites_.size(), empty );
+	}
+	for( size_t node=0; node<callSites_.size(); ++node )
+	{
+		sites[node].currentBytes+=callSites_[node].currentBytes;
+		sites[node].maximumBytes+=callSites_[node].maximumBytes;
+		sites[node].currentAllocations+=callSites_[node].currentAllocations;
+		sites[node].totalAllocations+=callSites_[node].totalAllocations;
+		sites[node].totalBytes+=callSites_[node].totalBytes;
+	}
+	for( std::vector<IMemoryCounter*>::const_iterator iSubCounter=subCounters_.begin(); iSubCounter!=subCounters_.end(); ++iSubCounter )
+	{
+		static_cast<const memcounter::MemoryCounterImplementation*>(*iSubCounter)->addCallSites( sites );
+	}
+}
+
+void memcounter::MemoryCounterImplementation::addToProfile( memcounter::HeapProfile& profile, const char* counterName, uint32_t threadIndex ) const
+{
+	if( enabledSlot_>=0 ) pParentPool_->drainRemoteFrees();
+
+	std::vector<memcounter::CallSiteStatistics> sites;
+	addCallSites( sites );
+
+	std::vector<void*> stack;
+	size_t numberOfSites=0;
+	for( size_t node=1; node<sites.size(); ++node )
+	{
+		const memcounter::CallSiteStatistics& statistics=sites[node];
+		if( statistics.totalAllocations==0 && statistics.currentAllocations==0 ) continue;
+
+		pool().callSiteTrie().stack( node, stack );
+		const long int values[memcounter::HeapProfile::numberOfSampleTypes]={ statistics.currentBytes, statistics.currentAllocations, statistics.totalBytes, statistics.totalAllocations };
+		profile.addSample( stack, values, counterName, threadIndex );
+		++numberOfSites;
+	}
+	if( numberOfSites!=0 ) return;
 
-//	if( newSize<oldSize && currentSize_<oldSize-newSize ) std::cerr << " *MEMCOUNTER* - Argh! underflow in modify" << std::endl;
+	// Without call sites the whole counter is one sample with no stack. The size histogram has all four
+	// numbers, and unlike the counter's values it doesn't include threads spawned while it was enabled.
+	std::vector<memcounter::SizeClassCounts> sizeClasses=sizeHistogram();
+	long int values[memcounter::HeapProfile::numberOfSampleTypes]={ 0, 0, 0, 0 };
+	for( std::vector<memcounter::SizeClassCounts>::const_iterator iSizeClass=sizeClasses.begin(); iSizeClass!=sizeClasses.end(); ++iSizeClass )
+	{
+		values[memcounter::HeapProfile::inuseSpace]+=iSizeClass->currentBytes;
+		values[memcounter::HeapProfile::inuseObjects]+=iSizeClass->currentAllocations;
+		values[memcounter::HeapProfile::allocSpace]+=iSizeClass->totalBytes;
+		values[memcounter::HeapProfile::allocObjects]+=iSizeClass->totalAllocations;
+	}
+	if( values[memcounter::HeapProfile::inuseObjects]==0 && values[memcounter::HeapProfile::allocObjects]==0 ) return;
 
-	currentSize_-=oldSize;
-	currentSize_+=newSize;
-	if( currentSize_>maximumSize_ ) maximumSize_=currentSize_;
+	stack.clear();
+	profile.addSample( stack, values, counterName, threadIndex );
 }
 
-void memcounter::MemoryCounterImplementation::remove( size_t size )
+void memcounter::MemoryCounterImplementation::add( size_t size, size_t usableSize )
 {
 	if( !enabled_ ) return;
 
-//	if( currentSize_<size ) std::cerr << " *MEMCOUNTER* - Argh! underflow in remove" << std::endl;
+	const long int delta[CounterValues::numberOfQuantities]={ long(size), long(usableSize), 1, 1 };
+	values().applyDelta( delta );
+	histogram().recordAllocation( SizeHistogram::sizeClass(size), size, 1 );
+}
 
-	currentSize_-=size;
-	--currentNumberOfAllocations_;
+void memcounter::MemoryCounterImplementation::modify( size_t oldSize, size_t oldUsableSize, size_t newSize, size_t newUsableSize )
+{
+	if( !enabled_ ) return;
+
+	const long int delta[CounterValues::numberOfQuantities]={ long(newSize)-long(oldSize), long(newUsableSize)-long(oldUsableSize), 0, 0 };
+	values().applyDelta( delta );
+	histogram().recordFree( SizeHistogram::sizeClass(oldSize), oldSize, 1 );
+	histogram().recordAllocation( SizeHistogram::sizeClass(newSize), newSize, 1 );
+}
+
+void memcounter::MemoryCounterImplementation::remove( size_t size, size_t usableSize )
+{
+	if( !enabled_ ) return;
+
+	const long int delta[CounterValues::numberOfQuantities]={ -long(size), -long(usableSize), -1, 0 };
+	values().applyDelta( delta );
+	histogram().recordFree( SizeHistogram::sizeClass(size), size, 1 );
 }
 
 void memcounter::MemoryCounterImplementation::childEnabled( memcounter::MemoryCounterImplementation* pEnabledSubCounter )
@@ -160,3 +431,92 @@ void memcounter::MemoryCounterImplementation::rawSetEnabled( bool enable )
 {
 	enabled_=enable;
 }
+
+memcounter::GlobalMemoryCounter* memcounter::MemoryCounterImplementation::inheritedCounter()
+{
+	if( pInheritedCounter_ ) return pInheritedCounter_;
+
+	// Other threads can read the pointer through ThreadMemoryCounterPool::readCounterValues. If there are
+	// none left this is tried again on the next spawn, since other counters might have given theirs back.
+	memcounter::GlobalMemoryCounter* pCounter=memcounter::GlobalMemoryCounter::create( false );
+	if( pCounter ) __atomic_store_n( &pInheritedCounter_, pCounter, __ATOMIC_RELEASE );
+	else
+	{
+		static bool warned=false;
+		if( !__atomic_test_and_set( &warned, __ATOMIC_RELAXED ) )
+		{
+			std::cerr << " *MEMCOUNTER* - all " << memcounter::GlobalMemoryCounter::maximumNumberOfCounters
+					<< " global counters are in use, so threads started from some counted code won't be counted" << std::endl;
+		}
+	}
+	return pCounter;
+}
+
+const memcounter::ThreadMemoryCounterPool& memcounter::MemoryCounterImplementation::pool() const
+{
+	const memcounter::MemoryCounterImplementation* pCounter=this;
+	while( pCounter->pParentCounter_ ) pCounter=pCounter->pParentCounter_;
+	return *pCounter->pParentPool_;
+}
+
+inline memcounter::CounterValues& memcounter::MemoryCounterImplementation::values()
+{
+	if( enabledSlot_>=0 )
+	{
+		pParentPool_->drainRemoteFrees();
+		pParentPool_->flushPendingChanges();
+		return pParentPool_->enabledCounterValues( enabledSlot_ );
+	}
+	else return values_;
+}
+
+inline const memcounter::CounterValues& memcounter::MemoryCounterImplementation::values() const
+{
+	if( enabledSlot_>=0 )
+	{
+		pParentPool_->drainRemoteFrees();
+		pParentPool_->flushPendingChanges();
+		return pParentPool_->enabledCounterValues( enabledSlot_ );
+	}
+	else return values_;
+}
+
+inline memcounter::SizeHistogram& memcounter::MemoryCounterImplementation::histogram()
+{
+	if( enabledSlot_>=0 )
+	{
+		pParentPool_->drainRemoteFrees();
+		pParentPool_->flushPendingHistogram();
+	}
+	return histogram_;
+}
+
+inline const memcounter::SizeHistogram& memcounter::MemoryCounterImplementation::histogram() const
+{
+	if( enabledSlot_>=0 )
+	{
+		pParentPool_->drainRemoteFrees();
+		pParentPool_->flushPendingHistogram();
+	}
+	return histogram_;
+}
+
+inline memcounter::LifetimeHistogram& memcounter::MemoryCounterImplementation::lifetimes()
+{
+	if( enabledSlot_>=0 )
+	{
+		pParentPool_->drainRemoteFrees();
+		pParentPool_->flushPendingHistogram();
+	}
+	return lifetimes_;
+}
+
+inline const memcounter::LifetimeHistogram& memcounter::MemoryCounterImplementation::lifetimes() const
+{
+	if( enabledSlot_>=0 )
+	{
+		pParentPool_->drainRemoteFrees();
+		pParentPool_->flushPendingHistogram();
+	}
+	return lifetimes_;
+}
@@ -0,0 +1,47 @@
+#include "memcounter/ProtobufWriter.h"
+
+#include <cstring>
+
+void memcounter::ProtobufWriter::appendVarint( uint64_t value )
+{
+	// Seven bits at a time, lowest first, with the top bit set on every byte except the last
+	while( value>=0x80 )
+	{
+		buffer_.push_back( static_cast<unsigned char>( value | 0x80 ) );
+		value>>=7;
+	}
+	buffer_.push_back( static_cast<unsigned char>(value) );
+}
+
+void memcounter::ProtobufWriter::writeVarint( uint32_t field, uint64_t value )
+{
+	appendTag( field, varint );
+	appendVarint( value );
+}
+
+void memcounter::ProtobufWriter::writeBytes( uint32_t field, const void* pData, size_t size )
+{
+	appendTag( field, lengthDelimited );
+	appendVarint( size );
+	const unsigned char* pBytes=static_cast<const unsigned char*>( pData );
+	buffer_.insert( buffer_.end(), pBytes, pBytes+size );
+}
+
+void memcounter::ProtobufWriter::writeString( uint32_t field, const char* text )
+{
+	writeBytes( field, text, strlen( text ) );
+}
+
+void memcounter::ProtobufWriter::writeMessage( uint32_t field, const memcounter::ProtobufWriter& message )
+{
+	writeBytes( field, message.data(), message.size() );
+}
+
+void memcounter::ProtobufWriter::writePackedVarints( uint32_t field, const std::vector<uint64_t>& values )
+{
+	if( values.empty() ) return;
+
+	memcounter::ProtobufWriter packed;
+	for( std::vector<uint64_t>::const_iterator iValue=values.begin(); iValue!=values.end(); ++iValue ) packed.appendVarint( *iValue );
+	writeMessage( field, packed );
+}
@@ -0,0 +1,85 @@
+#include "memcounter/RemoteFreeQueue.h"
+
+#include <sys/mman.h>
+#include <cstring>
+
+memcounter::RemoteFreeQueue::RemoteFreeQueue()
+	: pCells_(NULL), mask_(0), enqueuePosition_(0), dequeuePosition_(0)
+{
+	memset( &overflow_, 0, sizeof(overflow_) );
+}
+
+bool memcounter::RemoteFreeQueue::initialise( size_t capacity )
+{
+	// Round up to a power of two so that the position can be masked to get the cell
+	size_t roundedCapacity=2;
+	while( roundedCapacity<capacity ) roundedCapacity*=2;
+
+	void* pMemory=mmap( NULL, roundedCapacity*sizeof(Cell), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0 );
+	if( pMemory==MAP_FAILED ) return false;
+
+	// Every cell starts with a sequence number of its index, which is a zero sequenceOffset, so the
+	// memory is ready as it is and none of it is committed until it's used
+	mask_=roundedCapacity-1;
+	__atomic_store_n( &pCells_, static_cast<Cell*>( pMemory ), __ATOMIC_RELEASE );
+	return true;
+}
+
+void memcounter::RemoteFreeQueue::push( const Entry& entry )
+{
+	Cell* pCells=__atomic_load_n( &pCells_, __ATOMIC_ACQUIRE );
+	size_t position=__atomic_load_n( &enqueuePosition_, __ATOMIC_RELAXED );
+	while( pCells )
+	{
+		size_t cellIndex=position & mask_;
+		Cell& cell=pCells[cellIndex];
+		size_t sequence=__atomic_load_n( &cell.sequenceOffset, __ATOMIC_ACQUIRE )+cellIndex;
+		long int difference=long(sequence)-long(position);
+		if( difference==0 )
+		{
+			// The cell is free, try to claim it. On failure position is updated to the current value.
+			if( __atomic_compare_exchange_n( &enqueuePosition_, &position, position+1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED ) )
+			{
+				cell.entry=entry;
+				__atomic_store_n( &cell.sequenceOffset, position+1-cellIndex, __ATOMIC_RELEASE );
+				return;
+			}
+		}
+		else if( difference<0 ) break; // Full, the consumer hasn't got round to this cell yet
+		else position=__atomic_load_n( &enqueuePosition_, __ATOMIC_RELAXED );
+	}
+
+	__atomic_fetch_add( &overflow_.bytes, long(entry.size*entry.weight), __ATOMIC_RELAXED );
+	__atomic_fetch_add( &overflow_.usableBytes, long(entry.usableSize*entry.weight), __ATOMIC_RELAXED );
+	__atomic_fetch_add( &overflow_.allocations, long(entry.weight), __ATOMIC_RELAXED );
+	// This is what the consumer checks, so it goes last
+	__atomic_fetch_add( &overflow_.numberOfEntries, 1, __ATOMIC_RELEASE );
+}
+
+bool memcounter::RemoteFreeQueue::pop( Entry& entry )
+{
+	if( pCells_==NULL ) return false;
+
+	size_t cellIndex=dequeuePosition_ & mask_;
+	Cell& cell=pCells_[cellIndex];
+	size_t sequence=__atomic_load_n( &cell.sequenceOffset, __ATOMIC_ACQUIRE )+cellIndex;
+	if( sequence!=dequeuePosition_+1 ) return false; // Empty, or a producer has claimed the cell but not finished writing
+
+	entry=cell.entry;
+	__atomic_store_n( &cell.sequenceOffset, dequeuePosition_+mask_+1-cellIndex, __ATOMIC_RELEASE );
+	++dequeuePosition_;
+	return true;
+}
+
+bool memcounter::RemoteFreeQueue::popOverflow( long int& bytes, long int& usableBytes, long int& allocations )
+{
+	if( __atomic_load_n( &overflow_.numberOfEntries, __ATOMIC_ACQUIRE )==0 ) return false;
+
+	// A producer could be between its adds, so the totals might not match the number of entries for
+	// a moment. Anything taken off here that belongs to an entry not yet counted just comes off earlier.
+	size_t numberOfEntries=__atomic_exchange_n( &overflow_.numberOfEntries, 0, __ATOMIC_ACQUIRE );
+	bytes=__atomic_exchange_n( &overflow_.bytes, 0, __ATOMIC_RELAXED );
+	usableBytes=__atomic_exchange_n( &overflow_.usableBytes, 0, __ATOMIC_RELAXED );
+	allocations=__atomic_exchange_n( &overflow_.allocations, 0, __ATOMIC_RELAXED );
+	return numberOfEntries!=0;
+}
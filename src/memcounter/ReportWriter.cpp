@@ -0,0 +1,70 @@
+#include "memcounter/ReportWriter.h"
+
+#include <cerrno>
+#include <unistd.h>
+
+memcounter::ReportWriter::ReportWriter()
+	: used_(0), fileDescriptor_(-1)
+{
+}
+
+void memcounter::ReportWriter::start( int fileDescriptor )
+{
+	fileDescriptor_=fileDescriptor;
+	used_=0;
+}
+
+void memcounter::ReportWriter::flush()
+{
+	// write(2) can change errno, which the interrupted code might be about to look at
+	int savedErrno=errno;
+	const char* pPosition=buffer_;
+	while( used_>0 && fileDescriptor_>=0 )
+	{
+		ssize_t result=write( fileDescriptor_, pPosition, used_ );
+		if( result<0 && errno==EINTR ) continue;
+		if( result<=0 ) break;
+		pPosition+=result;
+		used_-=result;
+	}
+	used_=0;
+	errno=savedErrno;
+}
+
+memcounter::ReportWriter& memcounter::ReportWriter::operator<<( const char* text )
+{
+	for( ; *text!=0; ++text )
+	{
+		if( used_==bufferSize ) flush();
+		buffer_[used_++]=*text;
+	}
+	return *this;
+}
+
+memcounter::ReportWriter& memcounter::ReportWriter::operator<<( char character )
+{
+	if( used_==bufferSize ) flush();
+	buffer_[used_++]=character;
+	return *this;
+}
+
+memcounter::ReportWriter& memcounter::ReportWriter::operator<<( long int number )
+{
+	// Go through unsigned so that the most negative number doesn't overflow
+	if( number<0 ) return *this << '-' << static_cast<unsigned long int>( -(number+1) )+1;
+	return *this << static_cast<unsigned long int>(number);
+}
+
+memcounter::ReportWriter& memcounter::ReportWriter::operator<<( unsigned long int number )
+{
+	char digits[20];
+	size_t numberOfDigits=0;
+	do
+	{
+		digits[numberOfDigits++]='0'+number%10;
+		number/=10;
+	} while( number!=0 );
+
+	while( numberOfDigits>0 ) *this << digits[--numberOfDigits];
+	return *this;
+}
@@ -0,0 +1,111 @@
+#include "memcounter/SnapshotWriter.h"
+
+#include <iostream>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "memcounter/ThreadMemoryCounterPool.h"
+
+memcounter::SnapshotWriter* memcounter::SnapshotWriter::pRunningWriter_=NULL;
+
+memcounter::SnapshotWriter::SnapshotWriter()
+	: numberOfSnapshots_(0)
+{
+	filePrefix_[0]=0;
+}
+
+bool memcounter::SnapshotWriter::start( const char* filePrefix, int signalNumber )
+{
+	if( pRunningWriter_!=NULL ) return false;
+
+	struct sigaction previousAction;
+	if( signalNumber<=0 || signalNumber>=NSIG || sigaction( signalNumber, NULL, &previousAction )!=0 )
+	{
+		std::cerr << "memcounter - can't take snapshots on signal " << signalNumber << ", it isn't a valid signal" << std::endl;
+		return false;
+	}
+	if( previousAction.sa_handler!=SIG_DFL )
+	{
+		std::cerr << "memcounter - not taking snapshots on signal " << signalNumber << " because the program already handles or ignores it" << std::endl;
+		return false;
+	}
+	if( sem_init( &requests_, 0, 0 )!=0 )
+	{
+		std::cerr << "memcounter - couldn't create the snapshot semaphore: " << strerror(errno) << std::endl;
+		return false;
+	}
+	strncpy( filePrefix_, filePrefix, sizeof(filePrefix_)-1 );
+	filePrefix_[sizeof(filePrefix_)-1]=0;
+
+	// Keep signals away from the thread, they're the program's business
+	sigset_t allSignals, oldSignals;
+	sigfillset( &allSignals );
+	pthread_sigmask( SIG_SETMASK, &allSignals, &oldSignals );
+	int result=pthread_create( &thread_, NULL, &threadFunction, this );
+	pthread_sigmask( SIG_SETMASK, &oldSignals, NULL );
+	if( result!=0 )
+	{
+		std::cerr << "memcounter - couldn't start the snapshot thread: " << strerror(result) << std::endl;
+		sem_destroy( &requests_ );
+		return false;
+	}
+	pthread_detach( thread_ );
+
+	pRunningWriter_=this;
+	struct sigaction action;
+	memset( &action, 0, sizeof(action) );
+	action.sa_handler=&signalHandler;
+	action.sa_flags=SA_RESTART; // So that the program's system calls don't fail because of a snapshot
+	sigemptyset( &action.sa_mask );
+	sigaction( signalNumber, &action, NULL );
+	return true;
+}
+
+void memcounter::SnapshotWriter::signalHandler( int /*signalNumber*/ )
+{
+	int savedErrno=errno;
+	if( pRunningWriter_ ) sem_post( &pRunningWriter_->requests_ );
+	errno=savedErrno;
+}
+
+void* memcounter::SnapshotWriter::threadFunction( void* pWriter )
+{
+	memcounter::SnapshotWriter& writer=*static_cast<memcounter::SnapshotWriter*>( pWriter );
+
+	while( true )
+	{
+		if( sem_wait( &writer.requests_ )!=0 ) continue; // Only fails if interrupted
+		// Any more requests that came in before this one was started are covered by it
+		while( sem_trywait( &writer.requests_ )==0 ) {}
+		writer.writeSnapshot();
+	}
+	return NULL;
+}
+
+void memcounter::SnapshotWriter::writeSnapshot()
+{
+	// The process id is worked out each time rather than once at the start, in case the process has forked
+	char filename[sizeof(filePrefix_)+32];
+	snprintf( filename, sizeof(filename), "%s.%ld", filePrefix_, long(getpid()) );
+	int fileDescriptor=open( filename, O_WRONLY | O_CREAT | O_APPEND, 0644 );
+	if( fileDescriptor<0 )
+	{
+		std::cerr << "memcounter - couldn't open the snapshot file \"" << filename << "\": " << strerror(errno) << std::endl;
+		return;
+	}
+
+	timespec now;
+	clock_gettime( CLOCK_REALTIME, &now );
+	writer_.start( fileDescriptor );
+	writer_ << "memcounter - snapshot " << ++numberOfSnapshots_ << " of process " << long(getpid()) << " at unix time " << long(now.tv_sec) << "."
+			<< char( '0'+now.tv_nsec/100000000 ) << char( '0'+now.tv_nsec/10000000%10 ) << char( '0'+now.tv_nsec/1000000%10 ) << "\n";
+	memcounter::ThreadMemoryCounterPool::writeReport( writer_ );
+	writer_ << "\n";
+	writer_.flush();
+	close( fileDescriptor );
+}
@@ -0,0 +1,116 @@
+#include "memcounter/StackCapture.h"
+
+#include <link.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <unwind.h>
+
+namespace // Use the unnamed namespace
+{
+	/** @brief The address range of this library's code, so that frames in the hooks can be skipped
+	 * whatever the compiler decided to inline. */
+	struct LibraryText
+	{
+		uintptr_t start;
+		uintptr_t end;
+	} libraryText={ 0, 0 };
+
+	int findLibraryText( dl_phdr_info* pInfo, size_t, void* pData )
+	{
+		uintptr_t address=*static_cast<uintptr_t*>( pData );
+		for( int index=0; index<pInfo->dlpi_phnum; ++index )
+		{
+			const ElfW(Phdr)& header=pInfo->dlpi_phdr[index];
+			if( header.p_type!=PT_LOAD || !(header.p_flags & PF_X) ) continue;
+
+			uintptr_t start=pInfo->dlpi_addr+header.p_vaddr;
+			if( address>=start && address<start+header.p_memsz )
+			{
+				libraryText.end=start+header.p_memsz;
+				__atomic_store_n( &libraryText.start, start, __ATOMIC_RELEASE );
+				return 1;
+			}
+		}
+		return 0;
+	}
+
+	inline bool isInLibrary( uintptr_t address )
+	{
+		if( __atomic_load_n( &libraryText.start, __ATOMIC_ACQUIRE )==0 )
+		{
+			// dl_iterate_phdr doesn't allocate. If two threads get here at once they both write the same thing.
+			uintptr_t myAddress=reinterpret_cast<uintptr_t>( &findLibraryText );
+			dl_iterate_phdr( &findLibraryText, &myAddress );
+		}
+		return address>=libraryText.start && address<libraryText.end;
+	}
+
+	struct UnwindState
+	{
+		void** pFrames;
+		size_t maximumDepth;
+		size_t depth;
+	};
+
+	_Unwind_Reason_Code unwindCallback( _Unwind_Context* pContext, void* pData )
+	{
+		UnwindState& state=*static_cast<UnwindState*>( pData );
+		uintptr_t address=_Unwind_GetIP( pContext );
+		if( address==0 ) return _URC_END_OF_STACK;
+		if( state.depth==0 && isInLibrary( address ) ) return _URC_NO_REASON;
+
+		state.pFrames[state.depth++]=reinterpret_cast<void*>( address );
+		return state.depth<state.maximumDepth ? _URC_NO_REASON : _URC_END_OF_STACK;
+	}
+
+} // end of the unnamed namespace
+
+const void* memcounter::currentThreadStackTop()
+{
+	pthread_attr_t attributes;
+	if( pthread_getattr_np( pthread_self(), &attributes )!=0 ) return NULL;
+
+	void* pStackBase=NULL;
+	size_t stackSize=0;
+	int result=pthread_attr_getstack( &attributes, &pStackBase, &stackSize );
+	pthread_attr_destroy( &attributes );
+	if( result!=0 ) return NULL;
+
+	return static_cast<char*>( pStackBase )+stackSize;
+}
+
+size_t __attribute__((noinline)) memcounter::captureStack( void** pFrames, size_t maximumDepth, const void* pStackTop, bool useFramePointers )
+{
+	size_t depth=0;
+
+	if( useFramePointers && pStackTop!=NULL )
+	{
+		// On x86-64 and most other platforms with frame pointers, each frame starts with the
+		// caller's frame pointer followed by the return address.
+		const uintptr_t stackTop=reinterpret_cast<uintptr_t>( pStackTop );
+		void** pFrame=static_cast<void**>( __builtin_frame_address(0) );
+		bool leftLibrary=false;
+		while( depth<maximumDepth )
+		{
+			uintptr_t returnAddress=reinterpret_cast<uintptr_t>( pFrame[1] );
+			if( returnAddress==0 ) break;
+			if( leftLibrary || !isInLibrary( returnAddress ) )
+			{
+				leftLibrary=true;
+				pFrames[depth++]=reinterpret_cast<void*>( returnAddress );
+			}
+
+			void** pNextFrame=static_cast<void**>( pFrame[0] );
+			uintptr_t next=reinterpret_cast<uintptr_t>( pNextFrame );
+			uintptr_t current=reinterpret_cast<uintptr_t>( pFrame );
+			if( next<=current || next+2*sizeof(void*)>stackTop || (next & (sizeof(void*)-1)) ) break;
+			pFrame=pNextFrame;
+		}
+		if( depth>1 || depth==maximumDepth ) return depth;
+	}
+
+	// Either asked not to use frame pointers, or the chain was broken before it got anywhere
+	UnwindState state={ pFrames, maximumDepth, 0 };
+	_Unwind_Backtrace( &unwindCallback, &state );
+	return state.depth;
+}
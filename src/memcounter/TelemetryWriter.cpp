@@ -0,0 +1,237 @@
+#include "memcounter/TelemetryWriter.h"
+
+#include <iostream>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <signal.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "memcounter/CounterNameTable.h"
+#include "memcounter/GlobalMemoryCounter.h"
+#include "memcounter/ThreadMemoryCounterPool.h"
+
+namespace // Use the unnamed namespace
+{
+	inline uint64_t nanosecondsNow( clockid_t clock )
+	{
+		timespec now;
+		clock_gettime( clock, &now );
+		return uint64_t(now.tv_sec)*1000000000ull+now.tv_nsec;
+	}
+}
+
+memcounter::TelemetryWriter::TelemetryWriter()
+	: pHeader_(NULL), pNames_(NULL), pRecords_(NULL), pCounterNames_(NULL), intervalNanoseconds_(0), startTime_(0), running_(false), stopping_(false), sampleLock_(false)
+{
+}
+
+memcounter::TelemetryWriter::~TelemetryWriter()
+{
+	// The mapping is deliberately left, the thread might still be using it as the program exits
+}
+
+bool memcounter::TelemetryWriter::start( const char* filename, uint64_t intervalNanoseconds, size_t capacity, const memcounter::CounterNameTable& counterNames )
+{
+	if( running_ || capacity==0 || intervalNanoseconds==0 ) return false;
+
+	size_t recordsOffset=sizeof(memcounter::TelemetryFileHeader)+memcounter::CounterNameTable::capacity*sizeof(memcounter::LiveName);
+	size_t fileSize=recordsOffset+capacity*sizeof(memcounter::TelemetryRecord);
+	int fileDescriptor=open( filename, O_RDWR | O_CREAT | O_TRUNC, 0644 );
+	if( fileDescriptor<0 )
+	{
+		std::cerr << "memcounter - couldn't open the telemetry file \"" << filename << "\": " << strerror(errno) << std::endl;
+		return false;
+	}
+	if( ftruncate( fileDescriptor, fileSize )!=0 )
+	{
+		std::cerr << "memcounter - couldn't size the telemetry file \"" << filename << "\": " << strerror(errno) << std::endl;
+		close( fileDescriptor );
+		return false;
+	}
+	void* pMemory=mmap( NULL, fileSize, PROT_READ | PROT_WRITE, MAP_SHARED, fileDescriptor, 0 );
+	close( fileDescriptor );
+	if( pMemory==MAP_FAILED )
+	{
+		std::cerr << "memcounter - couldn't map the telemetry file \"" << filename << "\": " << strerror(errno) << std::endl;
+		return false;
+	}
+
+	pHeader_=static_cast<memcounter::TelemetryFileHeader*>( pMemory );
+	pNames_=reinterpret_cast<memcounter::LiveName*>( pHeader_+1 );
+	pRecords_=reinterpret_cast<memcounter::TelemetryRecord*>( static_cast<char*>( pMemory )+recordsOffset );
+	pCounterNames_=&counterNames;
+	intervalNanoseconds_=intervalNanoseconds;
+	startTime_=nanosecondsNow( CLOCK_MONOTONIC );
+
+	pHeader_->version=memcounter::telemetryVersion;
+	pHeader_->recordSize=sizeof(memcounter::TelemetryRecord);
+	pHeader_->capacity=capacity;
+	pHeader_->numberOfRecordsWritten=0;
+	pHeader_->intervalNanoseconds=intervalNanoseconds;
+	pHeader_->startTimeNanoseconds=nanosecondsNow( CLOCK_REALTIME );
+	pHeader_->nameSize=sizeof(memcounter::LiveName);
+	pHeader_->maximumNumberOfNames=memcounter::CounterNameTable::capacity;
+	pHeader_->recordsOffset=recordsOffset;
+	// The magic goes in last so that a reader never sees a half written header
+	__atomic_thread_fence( __ATOMIC_RELEASE );
+	memcpy( pHeader_->magic, memcounter::telemetryMagic, sizeof(pHeader_->magic) );
+
+	// Keep signals away from the thread, they're the program's business
+	sigset_t allSignals, oldSignals;
+	sigfillset( &allSignals );
+	pthread_sigmask( SIG_SETMASK, &allSignals, &oldSignals );
+	int result=pthread_create( &thread_, NULL, &threadFunction, this );
+	pthread_sigmask( SIG_SETMASK, &oldSignals, NULL );
+	if( result!=0 )
+	{
+		std::cerr << "memcounter - couldn't start the telemetry thread: " << strerror(result) << std::endl;
+		return false;
+	}
+	pthread_detach( thread_ );
+
+	running_=true;
+	return true;
+}
+
+void memcounter::TelemetryWriter::stop()
+{
+	if( !running_ ) return;
+
+	while( __atomic_test_and_set( &sampleLock_, __ATOMIC_ACQUIRE ) ) sched_yield();
+	if( !stopping_ ) sample();
+	stopping_=true;
+	__atomic_clear( &sampleLock_, __ATOMIC_RELEASE );
+}
+
+void* memcounter::TelemetryWriter::threadFunction( void* pWriter )
+{
+	memcounter::TelemetryWriter& writer=*static_cast<memcounter::TelemetryWriter*>( pWriter );
+
+	// Sleep until absolute times rather than for the interval, so that the samples don't drift
+	uint64_t nextSample=writer.startTime_;
+	while( true )
+	{
+		while( __atomic_test_and_set( &writer.sampleLock_, __ATOMIC_ACQUIRE ) ) sched_yield();
+		bool stopping=writer.stopping_;
+		if( !stopping ) writer.sample();
+		__atomic_clear( &writer.sampleLock_, __ATOMIC_RELEASE );
+		if( stopping ) return NULL;
+
+		nextSample+=writer.intervalNanoseconds_;
+		// If the thread has fallen behind, skip the samples it missed rather than taking them all at once
+		uint64_t now=nanosecondsNow( CLOCK_MONOTONIC );
+		if( nextSample<now ) nextSample=now;
+
+		timespec wakeTime;
+		wakeTime.tv_sec=nextSample/1000000000ull;
+		wakeTime.tv_nsec=nextSample%1000000000ull;
+		while( clock_nanosleep( CLOCK_MONOTONIC, TIMER_ABSTIME, &wakeTime, NULL )==EINTR ) {}
+	}
+}
+
+void memcounter::TelemetryWriter::sample()
+{
+	memcounter::TelemetryRecord values;
+	memset( &values, 0, sizeof(values) );
+	values.nanoseconds=nanosecondsNow( CLOCK_MONOTONIC )-startTime_;
+	uint64_t recordNumber=pHeader_->numberOfRecordsWritten;
+
+	values.kind=memcounter::TelemetryRecord::globalCounter;
+	size_t numberOfCounters=memcounter::GlobalMemoryCounter::numberCreated();
+	for( size_t counter=0; counter<numberOfCounters; ++counter, ++recordNumber )
+	{
+		long int current[memcounter::GlobalCounterShard::numberOfQuantities]={ 0, 0, 0 };
+		long int maximum[memcounter::GlobalCounterShard::numberOfQuantities]={ 0, 0, 0 };
+		memcounter::ThreadMemoryCounterPool::addGlobalCounterTotals( counter, current, maximum );
+
+		values.counter=counter;
+		values.currentSize=current[memcounter::GlobalCounterShard::size];
+		values.maximumSize=maximum[memcounter::GlobalCounterShard::size];
+		values.currentNumberOfAllocations=current[memcounter::GlobalCounterShard::numberOfAllocations];
+		values.maximumNumberOfAllocations=maximum[memcounter::GlobalCounterShard::numberOfAllocations];
+		writeRecord( recordNumber, values );
+	}
+
+	values.kind=memcounter::TelemetryRecord::threadCounter;
+	size_t numberOfRegistrySlots=memcounter::ThreadMemoryCounterPool::numberOfRegistrySlots();
+	for( size_t registrySlot=0; registrySlot<numberOfRegistrySlots; ++registrySlot )
+	{
+		memcounter::ThreadMemoryCounterPool::EnabledCounterValues counters[memcounter::LiveThreadBlock::numberOfSlots];
+		uint32_t poolIndex;
+		size_t numberOfEnabled=memcounter::ThreadMemoryCounterPool::readEnabledCounters( registrySlot, poolIndex, counters );
+		for( size_t index=0; index<numberOfEnabled; ++index, ++recordNumber )
+		{
+			const memcounter::CounterValues& counterValues=counters[index].values;
+			values.counter=counters[index].slot;
+			values.thread=poolIndex;
+			values.nameId=counters[index].nameId;
+			values.currentSize=counterValues.current[memcounter::CounterValues::size];
+			values.maximumSize=counterValues.maximum[memcounter::CounterValues::size];
+			values.currentNumberOfAllocations=counterValues.current[memcounter::CounterValues::numberOfAllocations];
+			values.maximumNumberOfAllocations=counterValues.maximum[memcounter::CounterValues::numberOfAllocations];
+			writeName( values.nameId );
+			writeRecord( recordNumber, values );
+		}
+	}
+
+	values.kind=memcounter::TelemetryRecord::namedTotal;
+	for( uint32_t nameId=1; nameId<=memcounter::CounterNameTable::capacity; ++nameId )
+	{
+		if( pCounterNames_->name( nameId )==NULL ) continue;
+		long int current[memcounter::CounterValues::numberOfQuantities]={ 0, 0, 0, 0 };
+		long int maximum[memcounter::CounterValues::numberOfQuantities]={ 0, 0, 0, 0 };
+		uint32_t numberOfThreads=memcounter::ThreadMemoryCounterPool::addNamedCounterTotals( *pCounterNames_, nameId, NULL, current, maximum );
+		if( numberOfThreads==0 ) continue;
+
+		values.counter=nameId;
+		values.thread=numberOfThreads;
+		values.nameId=nameId;
+		values.currentSize=current[memcounter::CounterValues::size];
+		values.maximumSize=maximum[memcounter::CounterValues::size];
+		values.currentNumberOfAllocations=current[memcounter::CounterValues::numberOfAllocations];
+		values.maximumNumberOfAllocations=maximum[memcounter::CounterValues::numberOfAllocations];
+		writeName( nameId );
+		writeRecord( recordNumber, values );
+		++recordNumber;
+	}
+
+	__atomic_store_n( &pHeader_->numberOfRecordsWritten, recordNumber, __ATOMIC_RELEASE );
+}
+
+void memcounter::TelemetryWriter::writeRecord( uint64_t recordNumber, const memcounter::TelemetryRecord& values )
+{
+	memcounter::TelemetryRecord& record=pRecords_[recordNumber%pHeader_->capacity];
+	// Mark the record as being changed before writing it, see TelemetryRecord::sequence
+	__atomic_store_n( &record.sequence, 0, __ATOMIC_RELAXED );
+	__atomic_thread_fence( __ATOMIC_RELEASE );
+	record.counter=values.counter;
+	record.nanoseconds=values.nanoseconds;
+	record.kind=values.kind;
+	record.thread=values.thread;
+	record.nameId=values.nameId;
+	record.currentSize=values.currentSize;
+	record.maximumSize=values.maximumSize;
+	record.currentNumberOfAllocations=values.currentNumberOfAllocations;
+	record.maximumNumberOfAllocations=values.maximumNumberOfAllocations;
+	__atomic_store_n( &record.sequence, uint32_t(recordNumber+1), __ATOMIC_RELEASE );
+}
+
+void memcounter::TelemetryWriter::writeName( uint32_t nameId )
+{
+	if( nameId==0 || nameId>memcounter::CounterNameTable::capacity ) return;
+	memcounter::LiveName& fileName=pNames_[nameId-1];
+	if( fileName.length!=0 ) return;
+	const char* name=pCounterNames_->name( nameId );
+	if( name==NULL ) return;
+
+	// Longer names are cut short, the same as LiveExport::publishName
+	size_t length=strlen( name );
+	if( length>sizeof(fileName.text) ) length=sizeof(fileName.text);
+	if( length==0 ) return;
+	memcpy( fileName.text, name, length );
+	__atomic_store_n( &fileName.length, uint32_t(length), __ATOMIC_RELEASE );
+}
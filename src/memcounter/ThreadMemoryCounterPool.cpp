@@ -2,15 +2,253 @@
 
 #include "memcounter/MemoryCounterImplementation.h"
 #include "memcounter/DisablingFunctions.h"
+#include "memcounter/StackCapture.h"
+#include "memcounter/LiveExport.h"
+#include "memcounter/CounterNameTable.h"
 
+#include <cstdio>
 #include <iostream>
-#include <algorithm>
+#include <fcntl.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
 
-memcounter::ThreadMemoryCounterPool::ThreadMemoryCounterPool() //: pLastEnabledCounter_(NULL)
+namespace // Use the unnamed namespace
 {
+	const size_t maximumStackDepth=64;
+	const size_t remoteFreeQueueCapacity=65536;
+
+	/// Lets a thread freeing a block find the pool that allocated it. A pool goes in the slot given by the
+	/// bottom bits of its index, so indices keep going up but slots get reused once threads exit. Pool
+	/// objects are never deleted until the end of the program, so a pointer read from here can always
+	/// be dereferenced, but the pool might have been retired or reused by the time it is.
+	const size_t maximumNumberOfPools=65536;
+	memcounter::ThreadMemoryCounterPool* registeredPools[maximumNumberOfPools];
+	uint64_t nextPoolIndex=1; ///< Only the bottom 32 bits are used as the index. It's 64 bits so it's easy to tell if every slot has been used.
+
+	/// For each slot, the index of the last pool retired from it in the top 32 bits and the global counters
+	/// that were enabled in its thread in the bottom 32, for frees of blocks that thread allocated.
+	uint64_t retiredRecords[maximumNumberOfPools];
+
+	/// Every pool object by its poolNumber_, so that the free list can be a list of numbers
+	memcounter::ThreadMemoryCounterPool* allPools[maximumNumberOfPools];
+	uint32_t numberOfPoolObjects=0;
+	/// The poolNumber_ of the first pool on the free list in the bottom 32 bits. The top 32 bits are
+	/// bumped on every change so that a pop can't succeed on a list that changed and changed back.
+	uint64_t freePoolsHead=0;
+
+	/// Retiring a pool moves counts out of the pool's shards into the retired shards, and a reader adding
+	/// them up mustn't see them in both or neither. So retirements bump the retirement sequence number
+	/// before and after, the same as GlobalCounterShard does, and readers try again if it changed. Both
+	/// are kept in LiveExport::globals(), so that another process can add them up too.
+	bool retirementLock=false; ///< Spin lock so that only one thread retires a pool at a time
+	memcounter::RetiredPoolSummary retiredPools;
+
+	inline void lockRetirement()
+	{
+		while( __atomic_test_and_set( &retirementLock, __ATOMIC_ACQUIRE ) ) sched_yield();
+	}
+
+	inline void unlockRetirement()
+	{
+		__atomic_clear( &retirementLock, __ATOMIC_RELEASE );
+	}
+
+	/// Set once by ThreadMemoryCounterPool::setProfileFile before there are other threads
+	const char* profileFilePrefix=NULL;
+	bool profileOnDisable=false;
+	const memcounter::CounterNameTable* pProfileCounterNames=NULL;
+	uint32_t numberOfProfileFiles=0; ///< For the file names, so that every thread's files are different
+}
+
+memcounter::ThreadMemoryCounterPool* memcounter::ThreadMemoryCounterPool::createForCurrentThread( size_t batchSize )
+{
+	// Try the free list first. Pools are never deleted, so reading nextFreePool_ of a pool that has
+	// just been taken by another thread is harmless, the compare and swap will fail.
+	uint64_t head=__atomic_load_n( &freePoolsHead, __ATOMIC_ACQUIRE );
+	while( uint32_t poolNumber=uint32_t(head) )
+	{
+		memcounter::ThreadMemoryCounterPool* pPool=allPools[poolNumber];
+		uint64_t newHead=( ((head>>32)+1)<<32 ) | __atomic_load_n( &pPool->nextFreePool_, __ATOMIC_RELAXED );
+		if( __atomic_compare_exchange_n( &freePoolsHead, &head, newHead, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE ) )
+		{
+			// Every pool uses the same batch size, so that doesn't need changing
+			pPool->attachToCurrentThread();
+			return pPool;
+		}
+	}
+
+	return new memcounter::ThreadMemoryCounterPool( batchSize );
+}
+
+memcounter::ThreadMemoryCounterPool::ThreadMemoryCounterPool( size_t batchSize )
+	: pNamedCounters_(NULL), enabledSlots_(0), activeSlots_(0), pLive_(&privateLive_), batchSize_(batchSize), numberOfPendingChanges_(0),
+	  firstPendingClass_(memcounter::SizeHistogram::numberOfClasses), lastPendingClass_(0), lifetimesPending_(false),
+	  pStackTop_(NULL), index_(0), pushersInFlight_(0), readersInFlight_(0), poolNumber_(0), nextFreePool_(0)
+{
+	if( !remoteFrees_.initialise( remoteFreeQueueCapacity ) ) std::cerr << " *MEMCOUNTER* - couldn't allocate the remote free queue, frees from other threads will only change the totals" << std::endl;
+
+	uint32_t poolNumber=__atomic_add_fetch( &numberOfPoolObjects, 1, __ATOMIC_RELAXED );
+	if( poolNumber<maximumNumberOfPools )
+	{
+		poolNumber_=poolNumber;
+		__atomic_store_n( &allPools[poolNumber], this, __ATOMIC_RELEASE );
+	}
+
+	// The block stays with the pool object when it's reused, the same as the pool number
+	memset( &privateLive_, 0, sizeof(privateLive_) );
+	if( memcounter::LiveThreadBlock* pSharedBlock=memcounter::LiveExport::threadBlock( poolNumber_ ) ) pLive_=pSharedBlock;
+
+	attachToCurrentThread();
+
 	if(true) std::cout << "Constructing ThreadMemoryCounterPool" << std::endl;
 }
 
+void memcounter::ThreadMemoryCounterPool::attachToCurrentThread()
+{
+	pStackTop_=memcounter::currentThreadStackTop();
+	for( int index=0; index<memcounter::CounterValues::numberOfQuantities; ++index ) pendingDelta_[index]=pendingPeak_[index]=0;
+	numberOfPendingChanges_=0;
+	memset( pLive_->globalShards, 0, sizeof(pLive_->globalShards) );
+	__atomic_store_n( &pLive_->threadId, int32_t( syscall( SYS_gettid ) ), __ATOMIC_RELAXED );
+	enabledGlobalCounters_=0;
+	pendingHistogram_.reset();
+	firstPendingClass_=memcounter::SizeHistogram::numberOfClasses;
+	lastPendingClass_=0;
+	pendingLifetimes_.reset();
+	lifetimesPending_=false;
+
+	// Find a free slot in the registry. The index has to be set before the pool is published, because
+	// that's how poolWithIndex checks it has the right pool. Nothing has been allocated with any of the
+	// indices that don't get a slot, so it doesn't matter that index_ has them for a moment.
+	for( size_t attempt=0; attempt<maximumNumberOfPools; ++attempt )
+	{
+		uint32_t index=uint32_t( __atomic_fetch_add( &nextPoolIndex, 1, __ATOMIC_RELAXED ) );
+		if( index==0 ) continue; // Zero is left to mean the pool isn't known
+
+		__atomic_store_n( &index_, index, __ATOMIC_SEQ_CST );
+		memcounter::ThreadMemoryCounterPool* pEmpty=NULL;
+		if( __atomic_compare_exchange_n( &registeredPools[index & (maximumNumberOfPools-1)], &pEmpty, this, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED ) )
+		{
+			// Another process counts the block's shards from now on, the same as registeredPools
+			__atomic_store_n( &pLive_->threadIndex, index, __ATOMIC_RELEASE );
+			return;
+		}
+	}
+
+	__atomic_store_n( &index_, 0, __ATOMIC_SEQ_CST );
+	std::cerr << " *MEMCOUNTER* - more than " << maximumNumberOfPools << " threads running, frees from other threads won't come off this thread's counters" << std::endl;
+}
+
+void memcounter::ThreadMemoryCounterPool::retire( memcounter::CounterNameTable& counterNames )
+{
+	// This is the last chance for the call sites, which only this thread can read
+	writeProfileFile();
+
+	// Leave a record for frees of this thread's blocks first, since they'll need it as soon as index_
+	// changes. Nothing can enable or disable a global counter in this thread any more.
+	uint32_t oldIndex=index_;
+	size_t registrySlot=oldIndex & (maximumNumberOfPools-1);
+	if( oldIndex!=0 ) __atomic_store_n( &retiredRecords[registrySlot], ( uint64_t(oldIndex)<<32 ) | enabledGlobalCounters_, __ATOMIC_RELAXED );
+
+	// Stop any more remote frees being pushed, then wait for the ones already started. After that
+	// nothing else touches the queue, so whatever is on it can be applied for the last time. Readers
+	// are stopped the same way, since the counters they read are about to be deleted.
+	__atomic_store_n( &index_, 0, __ATOMIC_SEQ_CST );
+	while( __atomic_load_n( &pushersInFlight_, __ATOMIC_SEQ_CST )!=0 || __atomic_load_n( &readersInFlight_, __ATOMIC_SEQ_CST )!=0 ) sched_yield();
+	drainRemoteFrees();
+	flushPendingChanges();
+
+	// The named counters' totals go in one at a time before taking the lock, because the ones with
+	// spawned threads include a global counter, and adding that up waits for retirements to finish.
+	// addNamedCounterTotals starts again whenever it finds a registered pool with a zero index, so
+	// nothing sees them both here and in the retired totals until the pool leaves the registry.
+	for( uint32_t nameId=1; pNamedCounters_ && nameId<=memcounter::CounterNameTable::capacity; ++nameId )
+	{
+		if( pNamedCounters_[nameId]==NULL ) continue;
+		long int current[memcounter::CounterValues::numberOfQuantities]={ 0, 0, 0, 0 };
+		long int maximum[memcounter::CounterValues::numberOfQuantities]={ 0, 0, 0, 0 };
+		static_cast<memcounter::MemoryCounterImplementation*>( pNamedCounters_[nameId] )->addTotals( current, maximum );
+		counterNames.addRetired( nameId, current, maximum );
+	}
+
+	// Only one pool is folded into the retired totals at a time. It's a short spin lock rather than
+	// anything lock free, since readers never take it and it's only held for the copying below.
+	lockRetirement();
+	memcounter::LiveGlobalBlock& globals=memcounter::LiveExport::globals();
+	__atomic_store_n( &globals.retirementSequence, globals.retirementSequence+1, __ATOMIC_RELAXED );
+	__atomic_thread_fence( __ATOMIC_RELEASE );
+
+	for( uint32_t mask=enabledSlots_; mask; mask&=mask-1 )
+	{
+		size_t slot=__builtin_ctz( mask );
+		for( int index=0; index<memcounter::CounterValues::numberOfQuantities; ++index )
+		{
+			retiredPools.values.current[index]+=pLive_->values[slot].current[index];
+			retiredPools.values.maximum[index]+=pLive_->values[slot].maximum[index];
+		}
+	}
+	++retiredPools.numberOfPools;
+
+	for( size_t index=0; index<memcounter::GlobalMemoryCounter::maximumNumberOfCounters; ++index )
+	{
+		globals.retiredShards[index].fold( pLive_->globalShards[index], memcounter::GlobalMemoryCounter::generations(index) );
+	}
+
+	if( oldIndex!=0 ) __atomic_store_n( &registeredPools[registrySlot], (memcounter::ThreadMemoryCounterPool*)NULL, __ATOMIC_RELEASE );
+	__atomic_store_n( &pLive_->threadIndex, 0, __ATOMIC_RELAXED );
+
+	__atomic_store_n( &globals.retirementSequence, globals.retirementSequence+1, __ATOMIC_RELEASE );
+	unlockRetirement();
+
+	// The thread's shards are in the retired ones now, so it's finished with the global counters
+	uint32_t enabledGlobalCounters=enabledGlobalCounters_;
+	enabledGlobalCounters_=0;
+	memcounter::GlobalMemoryCounter::releaseReferences( enabledGlobalCounters );
+
+	// Everything else is only ever touched by the pool's own thread
+	for( std::vector<memcounter::ICountingInterface*>::iterator iCounter=createdCounters_.begin(); iCounter!=createdCounters_.end(); ++iCounter )
+	{
+		delete *iCounter;
+	}
+	std::vector<memcounter::ICountingInterface*>().swap( createdCounters_ );
+	// Readers have been stopped, and the next thread to use the pool republishes index_ after this
+	for( uint32_t nameId=1; pNamedCounters_ && nameId<=memcounter::CounterNameTable::capacity; ++nameId )
+	{
+		__atomic_store_n( &pNamedCounters_[nameId], (memcounter::IMemoryCounter*)NULL, __ATOMIC_RELAXED );
+	}
+	beginValuesChange();
+	enabledSlots_=activeSlots_=0;
+	publishSlots();
+	endValuesChange();
+	callSiteTrie_.clear();
+
+	// A pool that isn't in allPools can't go on the free list, so it's just left
+	if( poolNumber_==0 ) return;
+	uint64_t head=__atomic_load_n( &freePoolsHead, __ATOMIC_RELAXED );
+	do
+	{
+		__atomic_store_n( &nextFreePool_, uint32_t(head), __ATOMIC_RELAXED );
+	} while( !__atomic_compare_exchange_n( &freePoolsHead, &head, ( ((head>>32)+1)<<32 ) | poolNumber_, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED ) );
+}
+
+void memcounter::ThreadMemoryCounterPool::deleteAllPools()
+{
+	uint32_t numberOfPools=__atomic_load_n( &numberOfPoolObjects, __ATOMIC_ACQUIRE );
+	for( uint32_t poolNumber=1; poolNumber<=numberOfPools && poolNumber<maximumNumberOfPools; ++poolNumber )
+	{
+		delete __atomic_exchange_n( &allPools[poolNumber], (memcounter::ThreadMemoryCounterPool*)NULL, __ATOMIC_ACQ_REL );
+	}
+}
+
+memcounter::RetiredPoolSummary memcounter::ThreadMemoryCounterPool::retiredSummary()
+{
+	lockRetirement();
+	memcounter::RetiredPoolSummary result=retiredPools;
+	unlockRetirement();
+	return result;
+}
+
 memcounter::ThreadMemoryCounterPool::~ThreadMemoryCounterPool()
 {
 	if(true) std::cout << "Destructing ThreadMemoryCounterPool" << std::endl;
@@ -19,6 +257,7 @@ memcounter::ThreadMemoryCounterPool::~ThreadMemoryCounterPool()
 	{
 		delete *iCounter;
 	}
+	delete[] pNamedCounters_;
 }
 
 memcounter::IMemoryCounter* memcounter::ThreadMemoryCounterPool::createNewMemoryCounter()
@@ -32,47 +271,673 @@ memcounter::IMemoryCounter* memcounter::ThreadMemoryCounterPool::createNewMemory
 
 }
 
-void memcounter::ThreadMemoryCounterPool::addToAllEnabledCounters( size_t size )
+memcounter::IMemoryCounter* memcounter::ThreadMemoryCounterPool::namedCounter( uint32_t nameId )
+{
+	if( pNamedCounters_==NULL )
+	{
+		// Big enough for every name, so that it never has to move under another thread reading it
+		memcounter::IMemoryCounter** pNamedCounters=new memcounter::IMemoryCounter*[memcounter::CounterNameTable::capacity+1]();
+		__atomic_store_n( &pNamedCounters_, pNamedCounters, __ATOMIC_RELEASE );
+	}
+	if( pNamedCounters_[nameId]==NULL )
+	{
+		memcounter::IMemoryCounter* pCounter=createNewMemoryCounter();
+		// So that the counter's name can be shown next to its slot in the live block
+		static_cast<memcounter::MemoryCounterImplementation*>( pCounter )->nameId_=nameId;
+		__atomic_store_n( &pNamedCounters_[nameId], pCounter, __ATOMIC_RELEASE );
+	}
+	return pNamedCounters_[nameId];
+}
+
+uint32_t memcounter::ThreadMemoryCounterPool::nameIdOf( const memcounter::IMemoryCounter* pCounter ) const
+{
+	for( size_t index=0; index<createdCounters_.size(); ++index )
+	{
+		const memcounter::MemoryCounterImplementation* pCreatedCounter=static_cast<const memcounter::MemoryCounterImplementation*>( createdCounters_[index] );
+		if( pCreatedCounter==pCounter ) return pCreatedCounter->nameId_;
+	}
+	return 0;
+}
+
+inline void memcounter::ThreadMemoryCounterPool::applyToAllEnabledCounters( const long int (&delta)[memcounter::CounterValues::numberOfQuantities] )
+{
+	// Readers on other threads can't flush a batch, so the global shards are always up to date
+	for( uint32_t mask=enabledGlobalCounters_; mask; mask&=mask-1 )
+	{
+		size_t index=__builtin_ctz( mask );
+		pLive_->globalShards[index].apply( delta, memcounter::GlobalMemoryCounter::generations(index) );
+	}
+
+	if( batchSize_ )
+	{
+		for( int index=0; index<memcounter::CounterValues::numberOfQuantities; ++index )
+		{
+			pendingDelta_[index]+=delta[index];
+			pendingPeak_[index]=pendingDelta_[index]>pendingPeak_[index] ? pendingDelta_[index] : pendingPeak_[index];
+		}
+		if( ++numberOfPendingChanges_>=batchSize_ ) applyPendingChanges();
+	}
+	else
+	{
+		beginValuesChange();
+		for( uint32_t mask=activeSlots_; mask; mask&=mask-1 ) pLive_->values[__builtin_ctz( mask )].applyDelta( delta );
+		endValuesChange();
+	}
+}
+
+void memcounter::ThreadMemoryCounterPool::changeActiveSlots( uint32_t newActiveSlots )
+{
+	// Everything pending happened while the old set of slots was active
+	applyPendingChanges();
+	applyPendingHistogram();
+	beginValuesChange();
+	activeSlots_=newActiveSlots;
+	publishSlots();
+	endValuesChange();
+}
+
+void memcounter::ThreadMemoryCounterPool::flushPendingChanges()
+{
+	syncActiveSlots();
+	applyPendingChanges();
+}
+
+void memcounter::ThreadMemoryCounterPool::flushPendingHistogram()
+{
+	syncActiveSlots();
+	applyPendingHistogram();
+}
+
+void memcounter::ThreadMemoryCounterPool::applyPendingChanges()
+{
+	if( numberOfPendingChanges_==0 ) return;
+
+	beginValuesChange();
+	for( uint32_t mask=activeSlots_; mask; mask&=mask-1 )
+	{
+		memcounter::CounterValues& values=pLive_->values[__builtin_ctz( mask )];
+		for( int index=0; index<memcounter::CounterValues::numberOfQuantities; ++index )
+		{
+			long int peak=values.current[index]+pendingPeak_[index];
+			values.maximum[index]=peak>values.maximum[index] ? peak : values.maximum[index];
+			values.current[index]+=pendingDelta_[index];
+		}
+	}
+	endValuesChange();
+
+	for( int index=0; index<memcounter::CounterValues::numberOfQuantities; ++index ) pendingDelta_[index]=pendingPeak_[index]=0;
+	numberOfPendingChanges_=0;
+}
+
+inline void memcounter::ThreadMemoryCounterPool::pendingHistogramChanged( size_t sizeClass )
+{
+	firstPendingClass_=sizeClass<firstPendingClass_ ? sizeClass : firstPendingClass_;
+	lastPendingClass_=sizeClass>lastPendingClass_ ? sizeClass : lastPendingClass_;
+}
+
+void memcounter::ThreadMemoryCounterPool::applyPendingHistogram()
+{
+	if( firstPendingClass_<=lastPendingClass_ )
+	{
+		for( uint32_t mask=activeSlots_; mask; mask&=mask-1 ) enabledCounters_[__builtin_ctz( mask )]->histogram_.add( pendingHistogram_, firstPendingClass_, lastPendingClass_ );
+
+		pendingHistogram_.reset( firstPendingClass_, lastPendingClass_ );
+		firstPendingClass_=memcounter::SizeHistogram::numberOfClasses;
+		lastPendingClass_=0;
+	}
+
+	if( lifetimesPending_ )
+	{
+		for( uint32_t mask=activeSlots_; mask; mask&=mask-1 ) enabledCounters_[__builtin_ctz( mask )]->lifetimes_.add( pendingLifetimes_ );
+
+		pendingLifetimes_.reset();
+		lifetimesPending_=false;
+	}
+}
+
+inline void memcounter::ThreadMemoryCounterPool::applyToCallSite( uint32_t callSite, long int bytes, long int allocations )
+{
+	for( uint32_t mask=activeSlots_; mask; mask&=mask-1 )
+	{
+		std::vector<memcounter::CallSiteStatistics>& callSites=enabledCounters_[__builtin_ctz( mask )]->callSites_;
+		if( callSites.size()<=callSite )
+		{
+			memcounter::CallSiteStatistics empty={ 0, 0, 0, 0, 0 };
+			callSites.resize( callSiteTrie_.numberOfNodes(), empty );
+		}
+
+		if( bytes>=0 ) callSites[callSite].add( bytes, allocations );
+		else callSites[callSite].remove( -bytes, -allocations );
+	}
+}
+
+void memcounter::ThreadMemoryCounterPool::addToAllEnabledCounters( size_t size, size_t usableSize, size_t weight, uint32_t callSite )
+{
+	syncActiveSlots();
+	drainRemoteFrees();
+
+	const long int delta[memcounter::CounterValues::numberOfQuantities]={ long(size*weight), long(usableSize*weight), long(weight), long(weight) };
+	applyToAllEnabledCounters( delta );
+
+	size_t sizeClass=memcounter::SizeHistogram::sizeClass( size );
+	pendingHistogram_.recordAllocation( sizeClass, size, weight );
+	pendingHistogramChanged( sizeClass );
+
+	if( callSite ) applyToCallSite( callSite, long(size*weight), long(weight) );
+}
+
+void memcounter::ThreadMemoryCounterPool::modifyAllEnabledCounters( size_t oldSize, size_t oldUsableSize, size_t newSize, size_t newUsableSize, size_t weight, uint32_t oldCallSite, uint32_t newCallSite )
+{
+	syncActiveSlots();
+	drainRemoteFrees();
+
+	const long int delta[memcounter::CounterValues::numberOfQuantities]={ long(newSize*weight)-long(oldSize*weight), long(newUsableSize*weight)-long(oldUsableSize*weight), 0, 0 };
+	applyToAllEnabledCounters( delta );
+
+	// For the histogram a realloc counts as an allocation of the new size
+	size_t oldSizeClass=memcounter::SizeHistogram::sizeClass( oldSize );
+	size_t newSizeClass=memcounter::SizeHistogram::sizeClass( newSize );
+	pendingHistogram_.recordFree( oldSizeClass, oldSize, weight );
+	pendingHistogram_.recordAllocation( newSizeClass, newSize, weight );
+	pendingHistogramChanged( oldSizeClass );
+	pendingHistogramChanged( newSizeClass );
+
+	// Likewise the new block is counted against the call site of the realloc
+	if( oldCallSite ) applyToCallSite( oldCallSite, -long(oldSize*weight), -long(weight) );
+	if( newCallSite ) applyToCallSite( newCallSite, long(newSize*weight), long(weight) );
+}
+
+void memcounter::ThreadMemoryCounterPool::removeFromAllEnabledCounters( size_t size, size_t usableSize, size_t weight, uint32_t callSite )
+{
+	syncActiveSlots();
+	const long int delta[memcounter::CounterValues::numberOfQuantities]={ -long(size*weight), -long(usableSize*weight), -long(weight), 0 };
+	applyToAllEnabledCounters( delta );
+
+	size_t sizeClass=memcounter::SizeHistogram::sizeClass( size );
+	pendingHistogram_.recordFree( sizeClass, size, weight );
+	pendingHistogramChanged( sizeClass );
+
+	if( callSite ) applyToCallSite( callSite, -long(size*weight), -long(weight) );
+}
+
+void memcounter::ThreadMemoryCounterPool::recordLifetime( size_t size, size_t weight, uint64_t cycles )
+{
+	pendingLifetimes_.record( cycles, size, weight );
+	lifetimesPending_=true;
+}
+
+uint32_t memcounter::ThreadMemoryCounterPool::currentCallSite( size_t maximumDepth, bool useFramePointers )
+{
+	void* frames[maximumStackDepth];
+	if( maximumDepth>maximumStackDepth ) maximumDepth=maximumStackDepth;
+	size_t depth=memcounter::captureStack( frames, maximumDepth, pStackTop_, useFramePointers );
+	return callSiteTrie_.intern( frames, depth );
+}
+
+memcounter::ThreadMemoryCounterPool* memcounter::ThreadMemoryCounterPool::poolWithIndex( uint32_t index )
 {
-	for( std::list<memcounter::ICountingInterface*>::iterator iRecorder=enabledCounters_.begin(); iRecorder!=enabledCounters_.end(); ++iRecorder )
+	if( index==0 ) return NULL;
+	memcounter::ThreadMemoryCounterPool* pPool=__atomic_load_n( &registeredPools[index & (maximumNumberOfPools-1)], __ATOMIC_ACQUIRE );
+	if( pPool && __atomic_load_n( &pPool->index_, __ATOMIC_ACQUIRE )==index ) return pPool;
+	return NULL;
+}
+
+bool memcounter::ThreadMemoryCounterPool::readCounterValues( uint32_t poolIndex, const memcounter::MemoryCounterImplementation* pCounter, memcounter::CounterValues& values, bool& isActive, memcounter::GlobalMemoryCounter*& pInheritedCounter, unsigned maximumAttempts )
+{
+	memcounter::ThreadMemoryCounterPool* pPool=poolWithIndex( poolIndex );
+	if( pPool==NULL ) return false;
+
+	// The same as pushRemoteFree, so that retire() can't delete the counter while it's being read
+	__atomic_add_fetch( &pPool->readersInFlight_, 1, __ATOMIC_SEQ_CST );
+	if( __atomic_load_n( &pPool->index_, __ATOMIC_SEQ_CST )!=poolIndex )
 	{
-		(*iRecorder)->add( size );
+		__atomic_sub_fetch( &pPool->readersInFlight_, 1, __ATOMIC_RELEASE );
+		return false;
 	}
+
+	uint32_t before, after;
+	unsigned attempts=0;
+	do
+	{
+		before=__atomic_load_n( &pPool->pLive_->sequence, __ATOMIC_ACQUIRE );
+		// The counter moves between its own values and a slot when it's enabled or disabled
+		int slot=__atomic_load_n( &pCounter->enabledSlot_, __ATOMIC_RELAXED );
+		values.loadFrom( slot>=0 ? pPool->pLive_->values[slot] : pCounter->values_ );
+		isActive=( slot>=0 && ( __atomic_load_n( &pPool->activeSlots_, __ATOMIC_RELAXED ) & (1u<<slot) ) );
+		__atomic_thread_fence( __ATOMIC_ACQUIRE );
+		after=__atomic_load_n( &pPool->pLive_->sequence, __ATOMIC_RELAXED );
+	} while( ( (before & 1) || before!=after ) && ++attempts!=maximumAttempts );
+	pInheritedCounter=__atomic_load_n( &pCounter->pInheritedCounter_, __ATOMIC_ACQUIRE );
+
+	__atomic_sub_fetch( &pPool->readersInFlight_, 1, __ATOMIC_RELEASE );
+	return true;
 }
 
-void memcounter::ThreadMemoryCounterPool::modifyAllEnabledCounters( size_t oldSize, size_t newSize )
+size_t memcounter::ThreadMemoryCounterPool::numberOfRegistrySlots()
 {
-	for( std::list<memcounter::ICountingInterface*>::iterator iRecorder=enabledCounters_.begin(); iRecorder!=enabledCounters_.end(); ++iRecorder )
+	uint64_t slotsUsed=__atomic_load_n( &nextPoolIndex, __ATOMIC_ACQUIRE );
+	return slotsUsed<maximumNumberOfPools ? slotsUsed : maximumNumberOfPools;
+}
+
+size_t memcounter::ThreadMemoryCounterPool::readEnabledCounters( size_t registrySlot, uint32_t& poolIndex, EnabledCounterValues (&counters)[memcounter::LiveThreadBlock::numberOfSlots] )
+{
+	const memcounter::ThreadMemoryCounterPool* pPool=__atomic_load_n( &registeredPools[registrySlot], __ATOMIC_ACQUIRE );
+	if( pPool==NULL ) return 0;
+	poolIndex=__atomic_load_n( &pPool->index_, __ATOMIC_ACQUIRE );
+	if( poolIndex==0 ) return 0;
+
+	// Which counter is in each slot only changes between the sequence increments, the same as the values.
+	// The counters themselves might belong to a thread that has exited by the time they're used, but then
+	// readCounterValues sees the index has changed and doesn't touch them.
+	const memcounter::MemoryCounterImplementation* pCounters[memcounter::LiveThreadBlock::numberOfSlots];
+	uint32_t nameIds[memcounter::LiveThreadBlock::numberOfSlots];
+	uint32_t enabledSlots;
+	uint32_t before, after;
+	do
+	{
+		before=__atomic_load_n( &pPool->pLive_->sequence, __ATOMIC_ACQUIRE );
+		enabledSlots=__atomic_load_n( &pPool->pLive_->enabledSlots, __ATOMIC_RELAXED );
+		for( uint32_t bits=enabledSlots; bits!=0; bits&=bits-1 )
+		{
+			int slot=__builtin_ctz( bits );
+			pCounters[slot]=__atomic_load_n( &pPool->enabledCounters_[slot], __ATOMIC_RELAXED );
+			nameIds[slot]=__atomic_load_n( &pPool->pLive_->nameIds[slot], __ATOMIC_RELAXED );
+		}
+		__atomic_thread_fence( __ATOMIC_ACQUIRE );
+		after=__atomic_load_n( &pPool->pLive_->sequence, __ATOMIC_RELAXED );
+	} while( (before & 1) || before!=after );
+
+	size_t numberOfCounters=0;
+	for( uint32_t bits=enabledSlots; bits!=0; bits&=bits-1 )
+	{
+		int slot=__builtin_ctz( bits );
+		EnabledCounterValues& counter=counters[numberOfCounters];
+		memcounter::GlobalMemoryCounter* pInheritedCounter;
+		if( !readCounterValues( poolIndex, pCounters[slot], counter.values, counter.isActive, pInheritedCounter ) ) return 0;
+		counter.slot=slot;
+		counter.nameId=nameIds[slot];
+		++numberOfCounters;
+	}
+	return numberOfCounters;
+}
+
+bool memcounter::ThreadMemoryCounterPool::pushRemoteFree( const memcounter::RemoteFreeQueue::Entry& entry, uint32_t allocatingPool )
+{
+	// retire() clears index_ and then waits for pushersInFlight_ to be zero, so either it sees this
+	// push in flight and waits for it, or this sees the index has changed and doesn't push.
+	__atomic_add_fetch( &pushersInFlight_, 1, __ATOMIC_SEQ_CST );
+	bool stillAllocatingPool=( __atomic_load_n( &index_, __ATOMIC_SEQ_CST )==allocatingPool );
+	if( stillAllocatingPool ) remoteFrees_.push( entry );
+	__atomic_sub_fetch( &pushersInFlight_, 1, __ATOMIC_RELEASE );
+	return stillAllocatingPool;
+}
+
+void memcounter::ThreadMemoryCounterPool::releaseRetiredBlock( memcounter::ThreadMemoryCounterPool* pFreeingPool, uint32_t allocatingPool, size_t size, size_t usableSize, size_t weight )
+{
+	if( pFreeingPool==NULL || allocatingPool==0 ) return;
+
+	uint64_t record=__atomic_load_n( &retiredRecords[allocatingPool & (maximumNumberOfPools-1)], __ATOMIC_ACQUIRE );
+	if( uint32_t(record>>32)!=allocatingPool ) return;
+
+	const long int delta[memcounter::CounterValues::numberOfQuantities]={ -long(size*weight), -long(usableSize*weight), -long(weight), 0 };
+	for( uint32_t mask=uint32_t(record); mask; mask&=mask-1 )
 	{
-		(*iRecorder)->modify( oldSize, newSize );
+		size_t index=__builtin_ctz( mask );
+		pFreeingPool->pLive_->globalShards[index].apply( delta, memcounter::GlobalMemoryCounter::generations(index) );
 	}
 }
 
-void memcounter::ThreadMemoryCounterPool::removeFromAllEnabledCounters( size_t size )
+void memcounter::ThreadMemoryCounterPool::forgetRetiredGlobalCounter( size_t globalCounterIndex )
 {
-	for( std::list<memcounter::ICountingInterface*>::iterator iRecorder=enabledCounters_.begin(); iRecorder!=enabledCounters_.end(); ++iRecorder )
+	// Every thread that had the counter enabled when it exited has already written its record, since
+	// it gave its reference back after that. A block freed while this is going on might still come off
+	// the old counter, but no more can after.
+	const uint64_t bit=( uint64_t(1)<<globalCounterIndex );
+	for( size_t slot=0; slot<maximumNumberOfPools; ++slot )
 	{
-		(*iRecorder)->remove( size );
+		uint64_t record=__atomic_load_n( &retiredRecords[slot], __ATOMIC_RELAXED );
+		while( ( record & bit ) && !__atomic_compare_exchange_n( &retiredRecords[slot], &record, record & ~bit, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED ) ) {}
 	}
 }
 
-void memcounter::ThreadMemoryCounterPool::informEnabled( memcounter::ICountingInterface* pEnabledRecorder )
+void memcounter::ThreadMemoryCounterPool::addGlobalCounterTotals( size_t globalCounterIndex, long int (&current)[memcounter::GlobalCounterShard::numberOfQuantities], long int (&maximum)[memcounter::GlobalCounterShard::numberOfQuantities], unsigned maximumAttempts )
 {
-	// Make sure the recorder is not already in the list of enabled recorders
-	std::list<memcounter::ICountingInterface*>::iterator iFindResult=std::find( enabledCounters_.begin(), enabledCounters_.end(), pEnabledRecorder );
+	const memcounter::GlobalCounterGenerations& generations=memcounter::GlobalMemoryCounter::generations( globalCounterIndex );
+	uint64_t slotsUsed=__atomic_load_n( &nextPoolIndex, __ATOMIC_ACQUIRE );
+	size_t numberOfSlots=slotsUsed<maximumNumberOfPools ? slotsUsed : maximumNumberOfPools;
+
+	long int poolCurrent[memcounter::GlobalCounterShard::numberOfQuantities];
+	long int poolMaximum[memcounter::GlobalCounterShard::numberOfQuantities];
+	const memcounter::LiveGlobalBlock& globals=memcounter::LiveExport::globals();
+	uint32_t before, after;
+	unsigned attempts=0;
+	do
+	{
+		for( int index=0; index<memcounter::GlobalCounterShard::numberOfQuantities; ++index ) poolCurrent[index]=poolMaximum[index]=0;
+
+		before=__atomic_load_n( &globals.retirementSequence, __ATOMIC_ACQUIRE );
+		for( size_t slot=0; slot<numberOfSlots; ++slot )
+		{
+			const memcounter::ThreadMemoryCounterPool* pPool=__atomic_load_n( &registeredPools[slot], __ATOMIC_ACQUIRE );
+			if( pPool ) pPool->pLive_->globalShards[globalCounterIndex].addTo( poolCurrent, poolMaximum, generations, maximumAttempts );
+		}
+		globals.retiredShards[globalCounterIndex].addTo( poolCurrent, poolMaximum, generations, maximumAttempts );
+		__atomic_thread_fence( __ATOMIC_ACQUIRE );
+		after=__atomic_load_n( &globals.retirementSequence, __ATOMIC_RELAXED );
+	} while( ( (before & 1) || before!=after ) && ++attempts!=maximumAttempts );
+
+	for( int index=0; index<memcounter::GlobalCounterShard::numberOfQuantities; ++index )
+	{
+		current[index]+=poolCurrent[index];
+		maximum[index]+=poolMaximum[index];
+	}
+}
+
+uint32_t memcounter::ThreadMemoryCounterPool::addNamedCounterTotals( const memcounter::CounterNameTable& counterNames, uint32_t nameId, const memcounter::ThreadMemoryCounterPool* pCallingPool,
+		long int (&current)[memcounter::CounterValues::numberOfQuantities], long int (&maximum)[memcounter::CounterValues::numberOfQuantities] )
+{
+	uint64_t slotsUsed=__atomic_load_n( &nextPoolIndex, __ATOMIC_ACQUIRE );
+	size_t numberOfSlots=slotsUsed<maximumNumberOfPools ? slotsUsed : maximumNumberOfPools;
+
+	long int namedCurrent[memcounter::CounterValues::numberOfQuantities];
+	long int namedMaximum[memcounter::CounterValues::numberOfQuantities];
+	uint32_t numberOfThreads;
+	const memcounter::LiveGlobalBlock& globals=memcounter::LiveExport::globals();
+	uint32_t before, after;
+	bool sawRetiringPool;
+	do
+	{
+		for( int index=0; index<memcounter::CounterValues::numberOfQuantities; ++index ) namedCurrent[index]=namedMaximum[index]=0;
+		sawRetiringPool=false;
+
+		// The same as addGlobalCounterTotals, a thread that exits part way through is either still in its
+		// pool or in the retired totals, but if it moves from one to the other this has to start again
+		before=__atomic_load_n( &globals.retirementSequence, __ATOMIC_ACQUIRE );
+		numberOfThreads=counterNames.addRetiredTotals( nameId, namedCurrent, namedMaximum );
+		for( size_t slot=0; slot<numberOfSlots && !sawRetiringPool; ++slot )
+		{
+			const memcounter::ThreadMemoryCounterPool* pPool=__atomic_load_n( &registeredPools[slot], __ATOMIC_ACQUIRE );
+			if( pPool==NULL || pPool==pCallingPool ) continue;
+
+			// The index has to be read before the counter, so that readCounterValues fails if the counter
+			// belonged to a thread that has exited since. A pool that's still registered with a zero index
+			// is part way through retire(), and its named totals might or might not be in the retired totals
+			// yet, so the only thing to do is wait until it's gone and start again.
+			uint32_t poolIndex=__atomic_load_n( &pPool->index_, __ATOMIC_ACQUIRE );
+			if( poolIndex==0 )
+			{
+				sawRetiringPool=true;
+				continue;
+			}
+			memcounter::IMemoryCounter* const* pNamedCounters=__atomic_load_n( &pPool->pNamedCounters_, __ATOMIC_ACQUIRE );
+			if( pNamedCounters==NULL ) continue;
+			const memcounter::IMemoryCounter* pCounter=__atomic_load_n( &pNamedCounters[nameId], __ATOMIC_ACQUIRE );
+			if( pCounter==NULL ) continue;
+
+			memcounter::CounterValues values;
+			bool isActive;
+			memcounter::GlobalMemoryCounter* pInheritedCounter;
+			if( !readCounterValues( poolIndex, static_cast<const memcounter::MemoryCounterImplementation*>( pCounter ), values, isActive, pInheritedCounter ) )
+			{
+				sawRetiringPool=true;
+				continue;
+			}
+			for( int index=0; index<memcounter::CounterValues::numberOfQuantities; ++index )
+			{
+				namedCurrent[index]+=values.current[index];
+				namedMaximum[index]+=values.maximum[index];
+			}
+			if( pInheritedCounter )
+			{
+				// What the thread's spawned threads counted, the same as MemoryCounterImplementation::addTotals
+				long int inheritedCurrent[memcounter::GlobalCounterShard::numberOfQuantities];
+				long int inheritedMaximum[memcounter::GlobalCounterShard::numberOfQuantities];
+				pInheritedCounter->totals( inheritedCurrent, inheritedMaximum );
+				for( int index=0; index<memcounter::GlobalCounterShard::numberOfQuantities; ++index )
+				{
+					namedCurrent[index]+=inheritedCurrent[index];
+					namedMaximum[index]+=inheritedMaximum[index];
+				}
+			}
+			++numberOfThreads;
+		}
+		__atomic_thread_fence( __ATOMIC_ACQUIRE );
+		after=__atomic_load_n( &globals.retirementSequence, __ATOMIC_RELAXED );
+		if( sawRetiringPool ) sched_yield();
+	} while( sawRetiringPool || (before & 1) || before!=after );
+
+	for( int index=0; index<memcounter::CounterValues::numberOfQuantities; ++index )
+	{
+		current[index]+=namedCurrent[index];
+		maximum[index]+=namedMaximum[index];
+	}
+	return numberOfThreads;
+}
+
+void memcounter::ThreadMemoryCounterPool::writeReport( memcounter::ReportWriter& writer )
+{
+	// Enough to get past a thread that's part way through an update, but not to hang if it's this thread that was interrupted
+	const unsigned maximumAttempts=1000;
+
+	uint64_t slotsUsed=__atomic_load_n( &nextPoolIndex, __ATOMIC_ACQUIRE );
+	size_t numberOfSlots=slotsUsed<maximumNumberOfPools ? slotsUsed : maximumNumberOfPools;
+	for( size_t slot=0; slot<numberOfSlots; ++slot )
+	{
+		// Pools are never freed, so the worst that can happen is reading one that's being retired
+		const memcounter::ThreadMemoryCounterPool* pPool=__atomic_load_n( &registeredPools[slot], __ATOMIC_ACQUIRE );
+		if( pPool==NULL ) continue;
+		uint32_t enabledSlots=__atomic_load_n( &pPool->enabledSlots_, __ATOMIC_RELAXED );
+		uint32_t activeSlots=__atomic_load_n( &pPool->activeSlots_, __ATOMIC_RELAXED );
+		for( uint32_t bits=enabledSlots; bits!=0; bits&=bits-1 )
+		{
+			int enabledSlot=__builtin_ctz( bits );
+			memcounter::CounterValues values;
+			uint32_t before, after;
+			unsigned attempts=0;
+			do
+			{
+				before=__atomic_load_n( &pPool->pLive_->sequence, __ATOMIC_ACQUIRE );
+				values.loadFrom( pPool->pLive_->values[enabledSlot] );
+				__atomic_thread_fence( __ATOMIC_ACQUIRE );
+				after=__atomic_load_n( &pPool->pLive_->sequence, __ATOMIC_RELAXED );
+			} while( ( (before & 1) || before!=after ) && ++attempts!=maximumAttempts );
+			writer << "thread " << pPool->index_ << " counter slot " << enabledSlot << ( activeSlots & (1u<<enabledSlot) ? "" : " (paused)" )
+					<< ": size " << values.current[memcounter::CounterValues::size] << " (maximum " << values.maximum[memcounter::CounterValues::size]
+					<< "), usable size " << values.current[memcounter::CounterValues::usableSize] << " (maximum " << values.maximum[memcounter::CounterValues::usableSize]
+					<< "), allocations " << values.current[memcounter::CounterValues::numberOfAllocations] << " (maximum " << values.maximum[memcounter::CounterValues::numberOfAllocations] << ")\n";
+		}
+	}
+
+	size_t numberOfGlobalCounters=memcounter::GlobalMemoryCounter::numberCreated();
+	for( size_t globalCounterIndex=0; globalCounterIndex<numberOfGlobalCounters; ++globalCounterIndex )
+	{
+		long int current[memcounter::GlobalCounterShard::numberOfQuantities]={ 0, 0, 0 };
+		long int maximum[memcounter::GlobalCounterShard::numberOfQuantities]={ 0, 0, 0 };
+		addGlobalCounterTotals( globalCounterIndex, current, maximum, maximumAttempts );
+		writer << "global counter " << globalCounterIndex
+				<< ": size " << current[memcounter::GlobalCounterShard::size] << " (maximum " << maximum[memcounter::GlobalCounterShard::size]
+				<< "), usable size " << current[memcounter::GlobalCounterShard::usableSize] << " (maximum " << maximum[memcounter::GlobalCounterShard::usableSize]
+				<< "), allocations " << current[memcounter::GlobalCounterShard::numberOfAllocations] << " (maximum " << maximum[memcounter::GlobalCounterShard::numberOfAllocations] << ")\n";
+	}
+
+	// Read without the lock, which whoever was interrupted might be holding
+	size_t numberOfRetiredPools=__atomic_load_n( &retiredPools.numberOfPools, __ATOMIC_RELAXED );
+	if( numberOfRetiredPools!=0 )
+	{
+		const memcounter::CounterValues& values=retiredPools.values;
+		writer << numberOfRetiredPools << " exited threads' counters: size " << values.current[memcounter::CounterValues::size] << " (maximum " << values.maximum[memcounter::CounterValues::size]
+				<< "), allocations " << values.current[memcounter::CounterValues::numberOfAllocations] << " (maximum " << values.maximum[memcounter::CounterValues::numberOfAllocations] << ")\n";
+	}
+}
+
+void memcounter::ThreadMemoryCounterPool::applyRemoteFrees()
+{
+	// Taking the blocks off the call sites can grow the counters' vectors, which mustn't be counted
+	bool countingWasEnabled=memcounter::threadState.countingEnabled;
+	memcounter::threadState.countingEnabled=false;
+
+	memcounter::RemoteFreeQueue::Entry entry;
+	while( remoteFrees_.pop( entry ) )
+	{
+		removeFromAllEnabledCounters( entry.size, entry.usableSize, entry.weight, entry.callSite );
+		if( entry.lifetime!=memcounter::RemoteFreeQueue::noLifetime ) recordLifetime( entry.size, entry.weight, entry.lifetime );
+	}
+
+	long int bytes, usableBytes, allocations;
+	if( remoteFrees_.popOverflow( bytes, usableBytes, allocations ) )
+	{
+		const long int delta[memcounter::CounterValues::numberOfQuantities]={ -bytes, -usableBytes, -allocations, 0 };
+		applyToAllEnabledCounters( delta );
+	}
+
+	memcounter::threadState.countingEnabled=countingWasEnabled;
+}
+
+bool memcounter::ThreadMemoryCounterPool::informEnabled( memcounter::MemoryCounterImplementation* pEnabledCounter )
+{
+	// Any batched changes and remote frees happened before this counter was enabled
+	drainRemoteFrees();
+	flushPendingChanges();
+	flushPendingHistogram();
+
+	// If the counter already has a slot it might just have been paused
+	if( pEnabledCounter->enabledSlot_<0 )
+	{
+		if( enabledSlots_==~uint32_t(0) )
+		{
+			std::cerr << " *MEMCOUNTER* - can't have more than " << maximumEnabledCounters << " counters enabled at once in a thread, the counter will stay disabled" << std::endl;
+			return false;
+		}
+
+		// Move the values into the lowest free slot
+		size_t slot=__builtin_ctz( ~enabledSlots_ );
+		beginValuesChange();
+		enabledSlots_|=( 1u<<slot );
+		pLive_->values[slot]=pEnabledCounter->values_;
+		pLive_->nameIds[slot]=pEnabledCounter->nameId_;
+		enabledCounters_[slot]=pEnabledCounter;
+		pEnabledCounter->enabledSlot_=slot;
+		publishSlots();
+		endValuesChange();
+	}
+	memcounter::threadState.pausedSlots&=~( 1u<<pEnabledCounter->enabledSlot_ );
+	syncActiveSlots();
 
-	// If it wasn't found, add it
-	if( iFindResult==enabledCounters_.end() ) enabledCounters_.push_back( pEnabledRecorder );
 	memcounter::enableThisThread();
+	return true;
+}
+
+void memcounter::ThreadMemoryCounterPool::informDisabled( memcounter::MemoryCounterImplementation* pDisabledCounter )
+{
+	int slot=pDisabledCounter->enabledSlot_;
+	if( slot>=0 )
+	{
+		drainRemoteFrees();
+		flushPendingChanges();
+		flushPendingHistogram();
+		if( profileOnDisable ) writeProfileFile( pDisabledCounter );
+
+		// Move the values back into the counter. The slots don't move, because the client API keeps hold
+		// of them (see ClientThreadState), so there's just a hole left.
+		beginValuesChange();
+		pDisabledCounter->values_=pLive_->values[slot];
+		pDisabledCounter->enabledSlot_=-1;
+		enabledSlots_&=~( 1u<<slot );
+		publishSlots();
+		endValuesChange();
+		memcounter::threadState.pausedSlots&=~( 1u<<slot );
+		syncActiveSlots();
+
+		// The next counter to get the slot mustn't be paused and unpaused by the ThreadCounter this was made for
+		if( pDisabledCounter->pClientSlotBit_ )
+		{
+			*pDisabledCounter->pClientSlotBit_=0;
+			pDisabledCounter->pClientSlotBit_=NULL;
+		}
+	}
+
+	if( !hasActiveCounters() ) memcounter::disableThisThread();
+}
+
+size_t memcounter::ThreadMemoryCounterPool::addToProfile( memcounter::HeapProfile& profile, const memcounter::IMemoryCounter* pOnlyCounter, const memcounter::CounterNameTable* pNames )
+{
+	size_t numberOfSamples=profile.numberOfSamples();
+	for( size_t index=0; index<createdCounters_.size(); ++index )
+	{
+		const memcounter::MemoryCounterImplementation* pCounter=static_cast<const memcounter::MemoryCounterImplementation*>( createdCounters_[index] );
+		if( pOnlyCounter!=NULL && pOnlyCounter!=pCounter ) continue;
+
+		const char* counterName=( pNames!=NULL && pCounter->nameId_!=0 ) ? pNames->name( pCounter->nameId_ ) : NULL;
+		char numberedName[32];
+		if( counterName==NULL )
+		{
+			snprintf( numberedName, sizeof(numberedName), "counter %lu", static_cast<unsigned long>(index) );
+			counterName=numberedName;
+		}
+		pCounter->addToProfile( profile, counterName, index_ );
+	}
+	return profile.numberOfSamples()-numberOfSamples;
+}
+
+void memcounter::ThreadMemoryCounterPool::setProfileFile( const char* filePrefix, bool onDisable, const memcounter::CounterNameTable* pNames )
+{
+	profileFilePrefix=filePrefix;
+	profileOnDisable=( filePrefix!=NULL && onDisable );
+	pProfileCounterNames=pNames;
 }
 
-void memcounter::ThreadMemoryCounterPool::informDisabled( memcounter::ICountingInterface* pDisabledRecorder )
+void memcounter::ThreadMemoryCounterPool::writeProfileFile( const memcounter::IMemoryCounter* pOnlyCounter )
 {
-	// Try and find this recorder in the list
-	std::list<memcounter::ICountingInterface*>::iterator iFindResult=std::find( enabledCounters_.begin(), enabledCounters_.end(), pDisabledRecorder );
+	if( profileFilePrefix==NULL ) return;
 
-	// Erase it if it was found
-	if( iFindResult!=enabledCounters_.end() ) enabledCounters_.erase( iFindResult );
+	bool countingWasEnabled=memcounter::threadState.countingEnabled;
+	memcounter::threadState.countingEnabled=false;
 
-	if( enabledCounters_.empty() ) memcounter::disableThisThread();
+	// Nothing is written for a thread that never counted anything, so there isn't a file for every thread
+	memcounter::HeapProfile profile;
+	if( addToProfile( profile, pOnlyCounter, pProfileCounterNames )!=0 )
+	{
+		char filename[4096];
+		unsigned fileNumber=__atomic_add_fetch( &numberOfProfileFiles, 1, __ATOMIC_RELAXED );
+		snprintf( filename, sizeof(filename), "%s.%ld.%u.pb", profileFilePrefix, long(getpid()), fileNumber );
+		int fileDescriptor=open( filename, O_WRONLY | O_CREAT | O_TRUNC, 0644 );
+		if( fileDescriptor<0 ) std::cerr << " *MEMCOUNTER* - couldn't open " << filename << " for the heap profile" << std::endl;
+		else
+		{
+			if( !profile.write( fileDescriptor ) ) std::cerr << " *MEMCOUNTER* - couldn't write all of the heap profile to " << filename << std::endl;
+			close( fileDescriptor );
+		}
+	}
+
+	memcounter::threadState.countingEnabled=countingWasEnabled;
+}
+
+uint32_t memcounter::ThreadMemoryCounterPool::globalCountersForSpawnedThread()
+{
+	syncActiveSlots();
+	uint32_t result=enabledGlobalCounters_;
+	for( uint32_t mask=activeSlots_; mask; mask&=mask-1 )
+	{
+		if( memcounter::GlobalMemoryCounter* pInherited=enabledCounters_[__builtin_ctz( mask )]->inheritedCounter() ) result|=( 1u<<pInherited->index() );
+	}
+	return result;
+}
+
+void memcounter::ThreadMemoryCounterPool::informGlobalEnabled( size_t globalCounterIndex )
+{
+	drainRemoteFrees();
+	if( !isGlobalCounterEnabled( globalCounterIndex ) ) memcounter::GlobalMemoryCounter::addReferences( 1u<<globalCounterIndex );
+	enabledGlobalCounters_|=( 1u<<globalCounterIndex );
+	memcounter::enableThisThread();
+}
+
+void memcounter::ThreadMemoryCounterPool::informGlobalDisabled( size_t globalCounterIndex )
+{
+	drainRemoteFrees();
+	bool wasEnabled=isGlobalCounterEnabled( globalCounterIndex );
+	enabledGlobalCounters_&=~( 1u<<globalCounterIndex );
+	syncActiveSlots();
+	if( !hasActiveCounters() ) memcounter::disableThisThread();
+	// Only once the thread has stopped counting into it, since this might let the index be reused
+	if( wasEnabled ) memcounter::GlobalMemoryCounter::releaseReferences( 1u<<globalCounterIndex );
 }
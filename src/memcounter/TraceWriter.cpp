@@ -0,0 +1,267 @@
+#include "memcounter/TraceWriter.h"
+
+#include <iostream>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "memcounter/CycleClock.h"
+
+namespace // Use the unnamed namespace
+{
+	const uint64_t writeIntervalNanoseconds=10000000; ///< How often the thread writes out the full chunks
+
+	/** @brief Writes all of the bytes unless there's an error, in which case it returns false. */
+	bool writeAll( int fileDescriptor, const void* pData, size_t numberOfBytes )
+	{
+		const char* pBytes=static_cast<const char*>( pData );
+		while( numberOfBytes>0 )
+		{
+			ssize_t result=write( fileDescriptor, pBytes, numberOfBytes );
+			if( result<0 )
+			{
+				if( errno==EINTR ) continue;
+				return false;
+			}
+			pBytes+=result;
+			numberOfBytes-=result;
+		}
+		return true;
+	}
+}
+
+memcounter::TraceWriter::TraceWriter()
+	: fileDescriptor_(-1), pChunks_(NULL), numberOfChunks_(0), emptyHead_(0), fullHead_(0), bytesWritten_(0), maximumFileSize_(0),
+	  eventsDroppedByWriter_(0), running_(false), stopping_(false)
+{
+	memset( &header_, 0, sizeof(header_) );
+}
+
+memcounter::TraceWriter::~TraceWriter()
+{
+	// The chunks are deliberately left, threads still running might be using them as the program exits
+}
+
+bool memcounter::TraceWriter::start( const char* filename, size_t numberOfChunks, uint64_t maximumFileSize )
+{
+	if( running_ || numberOfChunks==0 || numberOfChunks>=(1ull<<32) ) return false;
+
+	fileDescriptor_=open( filename, O_WRONLY | O_CREAT | O_TRUNC, 0644 );
+	if( fileDescriptor_<0 )
+	{
+		std::cerr << "memcounter - couldn't open the trace file \"" << filename << "\": " << strerror(errno) << std::endl;
+		return false;
+	}
+
+	// Pages are only really allocated once a thread writes to them, so spare chunks cost nothing
+	void* pMemory=mmap( NULL, numberOfChunks*sizeof(Chunk), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0 );
+	if( pMemory==MAP_FAILED )
+	{
+		std::cerr << "memcounter - couldn't allocate " << numberOfChunks << " trace buffers: " << strerror(errno) << std::endl;
+		close( fileDescriptor_ );
+		fileDescriptor_=-1;
+		return false;
+	}
+	pChunks_=static_cast<Chunk*>( pMemory );
+	numberOfChunks_=numberOfChunks;
+	for( size_t index=0; index<numberOfChunks; ++index )
+	{
+		pChunks_[index].number=index+1;
+		pChunks_[index].nextChunk=( index+1<numberOfChunks ? index+2 : 0 );
+	}
+	emptyHead_=1;
+
+	timespec now;
+	clock_gettime( CLOCK_REALTIME, &now );
+	memcpy( header_.magic, memcounter::traceMagic, sizeof(header_.magic) );
+	header_.version=memcounter::traceVersion;
+	header_.chunkHeaderSize=sizeof(memcounter::TraceChunkHeader);
+	header_.startCycles=memcounter::cycleCount();
+	header_.startTimeNanoseconds=uint64_t(now.tv_sec)*1000000000ull+now.tv_nsec;
+	header_.nanosecondsPerCycle=0;
+	if( !writeAll( fileDescriptor_, &header_, sizeof(header_) ) )
+	{
+		std::cerr << "memcounter - couldn't write to the trace file \"" << filename << "\": " << strerror(errno) << std::endl;
+		close( fileDescriptor_ );
+		fileDescriptor_=-1;
+		return false;
+	}
+	bytesWritten_=sizeof(header_);
+	maximumFileSize_=maximumFileSize;
+
+	// Keep signals away from the thread, they're the program's business
+	sigset_t allSignals, oldSignals;
+	sigfillset( &allSignals );
+	pthread_sigmask( SIG_SETMASK, &allSignals, &oldSignals );
+	int result=pthread_create( &thread_, NULL, &threadFunction, this );
+	pthread_sigmask( SIG_SETMASK, &oldSignals, NULL );
+	if( result!=0 )
+	{
+		std::cerr << "memcounter - couldn't start the trace thread: " << strerror(result) << std::endl;
+		close( fileDescriptor_ );
+		fileDescriptor_=-1;
+		return false;
+	}
+
+	running_=true;
+	return true;
+}
+
+void memcounter::TraceWriter::stop()
+{
+	if( !running_ ) return;
+
+	__atomic_store_n( &stopping_, true, __ATOMIC_RELEASE );
+	pthread_join( thread_, NULL );
+	running_=false;
+
+	// Now the cycle count can be converted to time, which takes a while after the library loaded to be accurate
+	header_.nanosecondsPerCycle=memcounter::nanosecondsPerCycle();
+	if( pwrite( fileDescriptor_, &header_, sizeof(header_), 0 )!=ssize_t(sizeof(header_)) )
+	{
+		std::cerr << "memcounter - couldn't finish the trace file: " << strerror(errno) << std::endl;
+	}
+	close( fileDescriptor_ );
+	fileDescriptor_=-1;
+
+	if( eventsDroppedByWriter_!=0 ) std::cerr << "memcounter - the trace file reached its size limit, " << eventsDroppedByWriter_ << " events weren't written" << std::endl;
+}
+
+memcounter::TraceWriter::Chunk* memcounter::TraceWriter::takeEmptyChunk()
+{
+	// Chunks are never freed, so reading nextChunk of one that has just been taken by another thread
+	// is harmless, the compare and swap will fail.
+	uint64_t head=__atomic_load_n( &emptyHead_, __ATOMIC_ACQUIRE );
+	while( uint32_t number=uint32_t(head) )
+	{
+		Chunk* pChunk=&pChunks_[number-1];
+		uint64_t newHead=( ((head>>32)+1)<<32 ) | __atomic_load_n( &pChunk->nextChunk, __ATOMIC_RELAXED );
+		if( __atomic_compare_exchange_n( &emptyHead_, &head, newHead, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE ) ) return pChunk;
+	}
+	return NULL;
+}
+
+void memcounter::TraceWriter::submit( Chunk* pChunk )
+{
+	// The writer always takes the whole list, so there's no problem with the head changing and changing back
+	uint32_t head=__atomic_load_n( &fullHead_, __ATOMIC_RELAXED );
+	do
+	{
+		__atomic_store_n( &pChunk->nextChunk, head, __ATOMIC_RELAXED );
+	} while( !__atomic_compare_exchange_n( &fullHead_, &head, pChunk->number, false, __ATOMIC_RELEASE, __ATOMIC_RELAXED ) );
+}
+
+void memcounter::TraceWriter::putBackEmptyChunk( Chunk* pChunk )
+{
+	uint64_t head=__atomic_load_n( &emptyHead_, __ATOMIC_RELAXED );
+	do
+	{
+		__atomic_store_n( &pChunk->nextChunk, uint32_t(head), __ATOMIC_RELAXED );
+	} while( !__atomic_compare_exchange_n( &emptyHead_, &head, ( ((head>>32)+1)<<32 ) | pChunk->number, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED ) );
+}
+
+void* memcounter::TraceWriter::threadFunction( void* pWriter )
+{
+	memcounter::TraceWriter& writer=*static_cast<memcounter::TraceWriter*>( pWriter );
+
+	while( true )
+	{
+		// Check before writing, so that everything submitted before stop() was called gets written
+		bool stopping=__atomic_load_n( &writer.stopping_, __ATOMIC_ACQUIRE );
+		writer.writeFullChunks();
+		if( stopping ) return NULL;
+
+		timespec sleepTime;
+		sleepTime.tv_sec=0;
+		sleepTime.tv_nsec=writeIntervalNanoseconds;
+		while( nanosleep( &sleepTime, &sleepTime )!=0 && errno==EINTR ) {}
+	}
+}
+
+void memcounter::TraceWriter::writeFullChunks()
+{
+	uint32_t number=__atomic_exchange_n( &fullHead_, 0, __ATOMIC_ACQUIRE );
+
+	// The list is most recent first, so turn it round to write each thread's chunks in order
+	uint32_t previous=0;
+	while( number!=0 )
+	{
+		Chunk& chunk=pChunks_[number-1];
+		uint32_t next=chunk.nextChunk;
+		chunk.nextChunk=previous;
+		previous=number;
+		number=next;
+	}
+
+	for( number=previous; number!=0; )
+	{
+		Chunk* pChunk=&pChunks_[number-1];
+		number=pChunk->nextChunk;
+
+		const memcounter::TraceChunkHeader& header=pChunk->header;
+		if( header.numberOfEvents!=0 || header.droppedEvents!=0 )
+		{
+			size_t chunkSize=sizeof(memcounter::TraceChunkHeader)+header.numberOfBytes;
+			if( fileDescriptor_<0 || ( maximumFileSize_!=0 && bytesWritten_+chunkSize>maximumFileSize_ ) )
+			{
+				eventsDroppedByWriter_+=header.numberOfEvents;
+			}
+			else if( writeAll( fileDescriptor_, &header, chunkSize ) ) bytesWritten_+=chunkSize;
+			else
+			{
+				std::cerr << "memcounter - couldn't write to the trace file, no more will be written: " << strerror(errno) << std::endl;
+				eventsDroppedByWriter_+=header.numberOfEvents;
+				maximumFileSize_=bytesWritten_; // Stop trying
+			}
+		}
+		putBackEmptyChunk( pChunk );
+	}
+}
+
+memcounter::TraceBuffer::TraceBuffer()
+	: pChunk_(NULL), pPosition_(NULL), pLimit_(NULL), previousCycles_(0), previousAddress_(0), activeSlots_(0), globalCounters_(0), droppedEvents_(0)
+{
+}
+
+void memcounter::TraceBuffer::flush( memcounter::TraceWriter& writer )
+{
+	if( pChunk_==NULL ) return;
+
+	pChunk_->header.numberOfBytes=pPosition_-pChunk_->data;
+	pChunk_->header.lastCycles=previousCycles_;
+	writer.submit( pChunk_ );
+	pChunk_=NULL;
+	pPosition_=pLimit_=NULL;
+}
+
+bool memcounter::TraceBuffer::startNewChunk( memcounter::TraceWriter& writer, uint32_t thread, uint64_t cycles )
+{
+	flush( writer );
+
+	pChunk_=writer.takeEmptyChunk();
+	if( pChunk_==NULL )
+	{
+		++droppedEvents_;
+		return false;
+	}
+
+	memcounter::TraceChunkHeader& header=pChunk_->header;
+	header.numberOfBytes=0;
+	header.numberOfEvents=0;
+	header.thread=thread;
+	header.droppedEvents=droppedEvents_;
+	header.firstCycles=header.lastCycles=cycles;
+	droppedEvents_=0;
+
+	// Each chunk starts from scratch so that it can be decoded on its own
+	previousCycles_=cycles;
+	previousAddress_=0;
+	activeSlots_=globalCounters_=0;
+	pPosition_=pChunk_->data;
+	pLimit_=pChunk_->data+memcounter::TraceWriter::chunkDataSize;
+	return true;
+}
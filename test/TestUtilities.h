@@ -0,0 +1,58 @@
+#ifndef memcounter_test_TestUtilities_h
+#define memcounter_test_TestUtilities_h
+
+#include <dlfcn.h>
+#include <iostream>
+
+/*
+ * A few things the behaviour tests share. Every test is run by ctest with intrusiveMemoryAnalyser
+ * preloaded (see CMakeLists.txt), finds the functions it needs with dlsym the same way a user's
+ * program would, and returns non-zero if any check failed.
+ */
+
+/// Records a failure with where it happened if the condition is false, and carries on
+#define TEST_CHECK( condition ) memcountertest::check( (condition), #condition, __FILE__, __LINE__ )
+
+namespace memcountertest
+{
+	inline int& numberOfFailures()
+	{
+		static int failures=0;
+		return failures;
+	}
+
+	inline bool check( bool passed, const char* description, const char* file, int line )
+	{
+		if( !passed )
+		{
+			std::cerr << file << ":" << line << ": check failed: " << description << std::endl;
+			++numberOfFailures();
+		}
+		return passed;
+	}
+
+	/** @brief Looks up a function in the preloaded library. Returns false, and says so, if it isn't there. */
+	template<class FunctionPointer>
+	bool findFunction( FunctionPointer& pFunction, const char* name )
+	{
+		void* symbol=dlsym( RTLD_DEFAULT, name );
+		if( symbol==NULL )
+		{
+			std::cerr << "Couldn't find " << name << ", the test has to be run with intrusiveMemoryAnalyser preloaded" << std::endl;
+			++numberOfFailures();
+			return false;
+		}
+		*reinterpret_cast<void**>(&pFunction)=symbol;
+		return true;
+	}
+
+	/** @brief What main should return. */
+	inline int result()
+	{
+		if( numberOfFailures()!=0 ) std::cerr << numberOfFailures() << " checks failed" << std::endl;
+		return numberOfFailures()==0 ? 0 : 1;
+	}
+
+} // end of the memcountertest namespace
+
+#endif
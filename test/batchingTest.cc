@@ -0,0 +1,68 @@
+#include "memcounter/IMemoryCounter.h"
+#include "TestUtilities.h"
+
+#include <stdlib.h>
+
+
+/*
+ * Run with MEMCOUNTER_BATCH_SIZE set larger than the number of allocations between reads, so
+ * that every value read has to come from a flush of the thread's batch rather than from the
+ * batch filling up. The values and maximums should be exactly what they are without batching.
+ */
+int main()
+{
+	using memcounter::IMemoryCounter;
+
+	IMemoryCounter* (*createNewMemoryCounter)( void );
+	if( !memcountertest::findFunction( createNewMemoryCounter, "createNewMemoryCounter" ) ) return memcountertest::result();
+
+	IMemoryCounter* pOuter=createNewMemoryCounter();
+	IMemoryCounter* pInner=createNewMemoryCounter();
+	pOuter->enable();
+
+	// volatile, otherwise the compiler is free to remove a malloc and free pair completely
+	void* volatile pFirst=malloc( 1000 );
+	TEST_CHECK( pOuter->currentSize()==1000 );
+	TEST_CHECK( pOuter->currentNumberOfAllocations()==1 );
+
+	// A counter enabled part way through must not get the changes batched before it was enabled
+	void* volatile pSecond=malloc( 300 );
+	pInner->enable();
+	void* volatile pThird=malloc( 2000 );
+	TEST_CHECK( pInner->currentSize()==2000 );
+
+	// The peak is between two reads, and never shows up in a value that's read, but the maximum
+	// still has to be exact
+	free( pThird );
+	void* volatile pFourth=malloc( 10 );
+	TEST_CHECK( pOuter->currentSize()==1310 );
+	TEST_CHECK( pOuter->maximumSize()==3300 );
+	TEST_CHECK( pInner->currentSize()==10 );
+	TEST_CHECK( pInner->maximumSize()==2000 );
+	TEST_CHECK( pInner->currentNumberOfAllocations()==1 );
+
+	// Disabling takes the counter's share of the batch with it, and nothing after
+	void* volatile pFifth=malloc( 40 );
+	pInner->disable();
+	free( pSecond );
+	free( pFourth );
+	free( pFifth );
+	TEST_CHECK( pInner->currentSize()==50 );
+	TEST_CHECK( pInner->currentNumberOfAllocations()==2 );
+	TEST_CHECK( pOuter->currentSize()==1000 );
+
+	// Lots of allocations, enough to fill the batch several times over
+	const size_t numberOfBlocks=1000;
+	void* volatile pBlocks[numberOfBlocks];
+	for( size_t index=0; index<numberOfBlocks; ++index ) pBlocks[index]=malloc( 8 );
+	TEST_CHECK( pOuter->currentSize()==long(1000+numberOfBlocks*8) );
+	TEST_CHECK( pOuter->maximumSize()==long(1000+numberOfBlocks*8) );
+	for( size_t index=0; index<numberOfBlocks; ++index ) free( pBlocks[index] );
+	free( pFirst );
+	TEST_CHECK( pOuter->currentSize()==0 );
+	TEST_CHECK( pOuter->currentNumberOfAllocations()==0 );
+	TEST_CHECK( pOuter->maximumSize()==long(1000+numberOfBlocks*8) );
+	pOuter->disable();
+
+	return memcountertest::result();
+}
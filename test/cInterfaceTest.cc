@@ -0,0 +1,156 @@
+#include "memcounter/CInterface.h"
+#include "TestUtilities.h"
+
+#include <pthread.h>
+#include <stddef.h> // needed for offsetof
+#include <stdlib.h>
+
+
+namespace // Use the unnamed namespace
+{
+	MemcounterHandle (*createCounter)( void )=NULL;
+	MemcounterHandle (*createGlobalCounter)( void )=NULL;
+	int (*enableCounter)( MemcounterHandle handle )=NULL;
+	int (*disableCounter)( MemcounterHandle handle )=NULL;
+	int (*resetCounter)( MemcounterHandle handle )=NULL;
+	int (*resetCounterMaximum)( MemcounterHandle handle )=NULL;
+	int (*counterIsEnabled)( MemcounterHandle handle )=NULL;
+	int (*takeSnapshot)( MemcounterHandle handle, MemcounterSnapshot* pSnapshot, size_t snapshotSize )=NULL;
+	int (*takeSnapshots)( const MemcounterHandle* handles, size_t numberOfHandles, MemcounterSnapshot* pSnapshots, size_t snapshotSize )=NULL;
+
+	pthread_barrier_t barrier;
+	MemcounterHandle mainThreadHandle=0;
+	MemcounterHandle globalHandle=0;
+	MemcounterHandle otherThreadHandle=0;
+
+	/** @brief Tries to use the main thread's counter, which has 102 bytes in it, counts 300 bytes in a counter of its own, and adds 40 to the global counter. */
+	void* otherThread( void* )
+	{
+		// Another thread's counter can be read, but not changed
+		TEST_CHECK( enableCounter( mainThreadHandle )==MEMCOUNTER_WRONG_THREAD );
+		TEST_CHECK( disableCounter( mainThreadHandle )==MEMCOUNTER_WRONG_THREAD );
+		TEST_CHECK( resetCounter( mainThreadHandle )==MEMCOUNTER_WRONG_THREAD );
+		TEST_CHECK( resetCounterMaximum( mainThreadHandle )==MEMCOUNTER_WRONG_THREAD );
+		TEST_CHECK( counterIsEnabled( mainThreadHandle )==MEMCOUNTER_WRONG_THREAD );
+		MemcounterSnapshot snapshot;
+		TEST_CHECK( takeSnapshot( mainThreadHandle, &snapshot, sizeof(MemcounterSnapshot) )==MEMCOUNTER_SUCCESS );
+		TEST_CHECK( snapshot.handle==mainThreadHandle );
+		TEST_CHECK( snapshot.flags==( MEMCOUNTER_SNAPSHOT_VALID | MEMCOUNTER_SNAPSHOT_ENABLED ) );
+		TEST_CHECK( snapshot.currentSize==102 && snapshot.currentNumberOfAllocations==2 );
+
+		otherThreadHandle=createCounter();
+		TEST_CHECK( otherThreadHandle!=0 && otherThreadHandle!=mainThreadHandle );
+		TEST_CHECK( enableCounter( otherThreadHandle )==MEMCOUNTER_SUCCESS );
+		// volatile, otherwise the compiler is free to remove a malloc and free pair completely
+		void* volatile pOwn=malloc( 300 );
+		TEST_CHECK( disableCounter( otherThreadHandle )==MEMCOUNTER_SUCCESS );
+
+		// Global counters can be used from anywhere
+		TEST_CHECK( enableCounter( globalHandle )==MEMCOUNTER_SUCCESS );
+		TEST_CHECK( counterIsEnabled( globalHandle )==1 );
+		void* volatile pGlobal=malloc( 40 );
+		TEST_CHECK( disableCounter( globalHandle )==MEMCOUNTER_SUCCESS );
+
+		// Let the main thread read this thread's counter, then wait for it to finish before exiting
+		pthread_barrier_wait( &barrier );
+		pthread_barrier_wait( &barrier );
+		free( pOwn );
+		free( pGlobal );
+		return NULL;
+	}
+}
+
+/*
+ * Uses counters through the plain C interface: handles for the calling thread's counters, another
+ * thread's counters and global counters, what's refused from the wrong thread, bulk snapshots, and
+ * handles that have gone stale because their thread exited.
+ */
+int main()
+{
+	if( !memcountertest::findFunction( createCounter, "memcounterCreateCounter" )
+		|| !memcountertest::findFunction( createGlobalCounter, "memcounterCreateGlobalCounter" )
+		|| !memcountertest::findFunction( enableCounter, "memcounterEnable" )
+		|| !memcountertest::findFunction( disableCounter, "memcounterDisable" )
+		|| !memcountertest::findFunction( resetCounter, "memcounterReset" )
+		|| !memcountertest::findFunction( resetCounterMaximum, "memcounterResetMaximum" )
+		|| !memcountertest::findFunction( counterIsEnabled, "memcounterIsEnabled" )
+		|| !memcountertest::findFunction( takeSnapshot, "memcounterSnapshot" )
+		|| !memcountertest::findFunction( takeSnapshots, "memcounterSnapshots" ) ) return memcountertest::result();
+
+	// Handles that were never given out
+	MemcounterSnapshot snapshot;
+	TEST_CHECK( enableCounter( 0 )==MEMCOUNTER_INVALID_HANDLE );
+	TEST_CHECK( counterIsEnabled( 0xffffffff )==MEMCOUNTER_INVALID_HANDLE );
+	TEST_CHECK( takeSnapshot( 12345678, &snapshot, sizeof(MemcounterSnapshot) )==MEMCOUNTER_INVALID_HANDLE );
+	TEST_CHECK( snapshot.flags==0 && snapshot.currentSize==0 );
+
+	mainThreadHandle=createCounter();
+	globalHandle=createGlobalCounter();
+	if( !TEST_CHECK( mainThreadHandle!=0 && globalHandle!=0 ) ) return memcountertest::result();
+	TEST_CHECK( counterIsEnabled( mainThreadHandle )==0 );
+	TEST_CHECK( enableCounter( mainThreadHandle )==MEMCOUNTER_SUCCESS );
+	TEST_CHECK( counterIsEnabled( mainThreadHandle )==1 );
+	// volatile, otherwise the compiler is free to remove a malloc and free pair completely
+	void* volatile pMain=malloc( 100 );
+
+	TEST_CHECK( enableCounter( globalHandle )==MEMCOUNTER_SUCCESS );
+	void* volatile pGlobal=malloc( 2 );
+	TEST_CHECK( disableCounter( globalHandle )==MEMCOUNTER_SUCCESS );
+
+	pthread_barrier_init( &barrier, NULL, 2 );
+	pthread_t thread;
+	pthread_create( &thread, NULL, &otherThread, NULL );
+	pthread_barrier_wait( &barrier );
+
+	// All three counters in one go, with a bad handle in the middle
+	MemcounterHandle handles[4]={ mainThreadHandle, 0, otherThreadHandle, globalHandle };
+	MemcounterSnapshot snapshots[4];
+	TEST_CHECK( takeSnapshots( handles, 4, snapshots, sizeof(MemcounterSnapshot) )==3 );
+	TEST_CHECK( snapshots[0].handle==mainThreadHandle && snapshots[0].flags==( MEMCOUNTER_SNAPSHOT_VALID | MEMCOUNTER_SNAPSHOT_ENABLED ) );
+	// The 2 byte block was allocated while both of the main thread's counters were enabled
+	TEST_CHECK( snapshots[0].currentSize==102 && snapshots[0].maximumSize==102 && snapshots[0].currentNumberOfAllocations==2 );
+	TEST_CHECK( snapshots[1].flags==0 && snapshots[1].currentSize==0 );
+	TEST_CHECK( snapshots[2].handle==otherThreadHandle && snapshots[2].flags==MEMCOUNTER_SNAPSHOT_VALID );
+	TEST_CHECK( snapshots[2].currentSize==300 && snapshots[2].currentNumberOfAllocations==1 );
+	TEST_CHECK( snapshots[3].flags==( MEMCOUNTER_SNAPSHOT_VALID | MEMCOUNTER_SNAPSHOT_GLOBAL ) );
+	TEST_CHECK( snapshots[3].currentSize==42 && snapshots[3].currentNumberOfAllocations==2 );
+
+	// A caller built against a shorter struct only gets what it knows about
+	const size_t shortSize=offsetof( MemcounterSnapshot, currentUsableSize );
+	MemcounterSnapshot shortSnapshot;
+	shortSnapshot.currentUsableSize=-7;
+	shortSnapshot.currentNumberOfAllocations=-7;
+	TEST_CHECK( takeSnapshot( otherThreadHandle, &shortSnapshot, shortSize )==MEMCOUNTER_SUCCESS );
+	TEST_CHECK( shortSnapshot.currentSize==300 && shortSnapshot.maximumSize==300 );
+	TEST_CHECK( shortSnapshot.currentUsableSize==-7 && shortSnapshot.currentNumberOfAllocations==-7 );
+
+	pthread_barrier_wait( &barrier );
+	pthread_join( thread, NULL );
+	pthread_barrier_destroy( &barrier );
+
+	// The other thread's counter went with it, but the global counter keeps its counts
+	TEST_CHECK( takeSnapshot( otherThreadHandle, &snapshot, sizeof(MemcounterSnapshot) )==MEMCOUNTER_INVALID_HANDLE );
+	TEST_CHECK( !(snapshot.flags & MEMCOUNTER_SNAPSHOT_VALID) );
+	TEST_CHECK( enableCounter( otherThreadHandle )==MEMCOUNTER_INVALID_HANDLE );
+	TEST_CHECK( takeSnapshots( handles, 4, snapshots, sizeof(MemcounterSnapshot) )==2 );
+	TEST_CHECK( !(snapshots[2].flags & MEMCOUNTER_SNAPSHOT_VALID) );
+	TEST_CHECK( takeSnapshot( globalHandle, &snapshot, sizeof(MemcounterSnapshot) )==MEMCOUNTER_SUCCESS );
+	TEST_CHECK( snapshot.currentSize==42 );
+
+	// A new counter doesn't bring the stale handle back
+	MemcounterHandle newHandle=createCounter();
+	TEST_CHECK( newHandle!=0 && newHandle!=otherThreadHandle );
+	TEST_CHECK( counterIsEnabled( otherThreadHandle )==MEMCOUNTER_INVALID_HANDLE );
+
+	free( pMain );
+	free( pGlobal );
+	TEST_CHECK( takeSnapshot( mainThreadHandle, &snapshot, sizeof(MemcounterSnapshot) )==MEMCOUNTER_SUCCESS );
+	TEST_CHECK( snapshot.currentSize==0 && snapshot.maximumSize==102 );
+	TEST_CHECK( resetCounterMaximum( mainThreadHandle )==MEMCOUNTER_SUCCESS );
+	TEST_CHECK( takeSnapshot( mainThreadHandle, &snapshot, sizeof(MemcounterSnapshot) )==MEMCOUNTER_SUCCESS );
+	TEST_CHECK( snapshot.maximumSize==0 );
+	TEST_CHECK( disableCounter( mainThreadHandle )==MEMCOUNTER_SUCCESS );
+	TEST_CHECK( counterIsEnabled( mainThreadHandle )==0 );
+
+	return memcountertest::result();
+}
@@ -0,0 +1,94 @@
+#include "memcounter/IMemoryCounter.h"
+#include "TestUtilities.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+
+
+namespace // Use the unnamed namespace
+{
+	// volatile, otherwise the compiler is free to remove a malloc and free pair completely
+	void* volatile pBlocks[30];
+
+	void __attribute__((noinline)) allocateSmall( size_t index )
+	{
+		pBlocks[index]=malloc( 16 );
+		__asm__ __volatile__( "" ); // Stops the malloc being a tail call, which would leave this function off the stack
+	}
+
+	void __attribute__((noinline)) allocateLarge( size_t index )
+	{
+		pBlocks[index]=malloc( 1000 );
+		__asm__ __volatile__( "" );
+	}
+
+	/** @brief Whether one of the return addresses in the stack is in the function rather than the other one.
+	 *
+	 * Functions are assumed to be less than 256 bytes long, and to end where the other one starts if that's after them.
+	 */
+	bool stackIsIn( const std::vector<void*>& stack, void (*pFunction)( size_t ), void (*pOtherFunction)( size_t ) )
+	{
+		uintptr_t start=reinterpret_cast<uintptr_t>( pFunction );
+		uintptr_t end=start+256;
+		uintptr_t otherStart=reinterpret_cast<uintptr_t>( pOtherFunction );
+		if( otherStart>start && otherStart<end ) end=otherStart;
+		for( size_t index=0; index<stack.size(); ++index )
+		{
+			uintptr_t address=reinterpret_cast<uintptr_t>( stack[index] );
+			if( address>start && address<end ) return true;
+		}
+		return false;
+	}
+}
+
+/*
+ * Run with MEMCOUNTER_CALLSITE_DEPTH set. Allocates from two functions and checks that each gets
+ * a call site with the right counts, and that the stacks say where they were allocated. Built
+ * with frame pointers, which the default unwinder needs.
+ */
+int main()
+{
+	using memcounter::IMemoryCounter;
+
+	IMemoryCounter* (*createNewMemoryCounter)( void );
+	if( !memcountertest::findFunction( createNewMemoryCounter, "createNewMemoryCounter" ) ) return memcountertest::result();
+
+	IMemoryCounter* pCounter=createNewMemoryCounter();
+	pCounter->enable();
+	for( size_t index=0; index<20; ++index ) allocateSmall( index );
+	for( size_t index=20; index<30; ++index ) allocateLarge( index );
+	for( size_t index=25; index<30; ++index ) free( pBlocks[index] );
+	std::vector<memcounter::CallSiteCounts> sites=pCounter->callSites();
+	pCounter->disable();
+
+	if( TEST_CHECK( sites.size()==2 ) )
+	{
+		// Largest current bytes first
+		const memcounter::CallSiteCounts& large=sites[0];
+		const memcounter::CallSiteCounts& small=sites[1];
+		TEST_CHECK( large.currentBytes==5000 && large.maximumBytes==10000 );
+		TEST_CHECK( large.currentAllocations==5 && large.totalAllocations==10 );
+		TEST_CHECK( small.currentBytes==320 && small.maximumBytes==320 );
+		TEST_CHECK( small.currentAllocations==20 && small.totalAllocations==20 );
+		TEST_CHECK( !large.stack.empty() && large.stack.size()<=8 );
+		TEST_CHECK( stackIsIn( large.stack, &allocateLarge, &allocateSmall ) && !stackIsIn( large.stack, &allocateSmall, &allocateLarge ) );
+		TEST_CHECK( stackIsIn( small.stack, &allocateSmall, &allocateLarge ) && !stackIsIn( small.stack, &allocateLarge, &allocateSmall ) );
+	}
+
+	// Frees while the counter is enabled come off the call site they were allocated from
+	pCounter->enable();
+	for( size_t index=0; index<10; ++index ) free( pBlocks[index] );
+	sites=pCounter->callSites();
+	pCounter->disable();
+	if( TEST_CHECK( sites.size()==2 ) )
+	{
+		TEST_CHECK( sites[0].currentBytes==5000 );
+		TEST_CHECK( sites[1].currentBytes==160 && sites[1].currentAllocations==10 );
+	}
+
+	pCounter->enable();
+	for( size_t index=10; index<25; ++index ) free( pBlocks[index] );
+	pCounter->disable();
+
+	return memcountertest::result();
+}
@@ -0,0 +1,109 @@
+#include "memcounter/CInterface.h"
+#include "TestUtilities.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+
+
+namespace // Use the unnamed namespace
+{
+	const int numberOfRounds=1000000;
+	pthread_barrier_t barrier;
+	MemcounterHandle (*createCounter)( void )=NULL;
+	int (*enableCounter)( MemcounterHandle handle )=NULL;
+	int (*disableCounter)( MemcounterHandle handle )=NULL;
+	int (*takeSnapshot)( MemcounterHandle handle, MemcounterSnapshot* pSnapshot, size_t snapshotSize )=NULL;
+
+	MemcounterHandle sharedHandle=0;
+	int writerFinished=0;
+
+	/** @brief Allocates and frees two blocks over and over, so the counter is only ever in one of four states between changes. */
+	void* writeThread( void* )
+	{
+		sharedHandle=createCounter();
+		enableCounter( sharedHandle );
+		pthread_barrier_wait( &barrier );
+
+		for( int round=0; round<numberOfRounds; ++round )
+		{
+			// volatile, otherwise the compiler is free to remove a malloc and free pair completely
+			void* volatile pFirst=malloc( 1000 );
+			void* volatile pSecond=malloc( 3000 );
+			free( pFirst );
+			free( pSecond );
+			// Moves the values between the counter and a slot in the pool, which the reader has to follow
+			if( round%100==0 )
+			{
+				disableCounter( sharedHandle );
+				enableCounter( sharedHandle );
+			}
+		}
+		disableCounter( sharedHandle );
+
+		__atomic_store_n( &writerFinished, 1, __ATOMIC_RELEASE );
+		// The handle stops being valid when the thread exits, so wait until the reader has finished
+		pthread_barrier_wait( &barrier );
+		return NULL;
+	}
+
+	/** @brief Whether the counts are ones the counter actually had between two changes, rather than a mixture. */
+	bool isConsistent( const MemcounterSnapshot& snapshot )
+	{
+		if( snapshot.currentSize==0 ) return snapshot.currentNumberOfAllocations==0;
+		if( snapshot.currentSize==1000 ) return snapshot.currentNumberOfAllocations==1;
+		if( snapshot.currentSize==4000 ) return snapshot.currentNumberOfAllocations==2;
+		if( snapshot.currentSize==3000 ) return snapshot.currentNumberOfAllocations==1;
+		return false;
+	}
+}
+
+/*
+ * Reads a per thread counter from another thread while its own thread keeps changing it. Every
+ * read has to see the counts as they were between two changes, never half of one.
+ */
+int main()
+{
+	if( !memcountertest::findFunction( createCounter, "memcounterCreateCounter" )
+		|| !memcountertest::findFunction( enableCounter, "memcounterEnable" )
+		|| !memcountertest::findFunction( disableCounter, "memcounterDisable" )
+		|| !memcountertest::findFunction( takeSnapshot, "memcounterSnapshot" ) ) return memcountertest::result();
+
+	pthread_barrier_init( &barrier, NULL, 2 );
+	pthread_t writer;
+	pthread_create( &writer, NULL, &writeThread, NULL );
+	pthread_barrier_wait( &barrier );
+	TEST_CHECK( sharedHandle!=0 );
+
+	size_t numberOfReads=0, numberOfFailedReads=0, numberOfTornReads=0;
+	bool finished=false;
+	while( !finished )
+	{
+		// Checked before the read, so there's always at least one read after the writer has finished
+		finished=__atomic_load_n( &writerFinished, __ATOMIC_ACQUIRE );
+		MemcounterSnapshot snapshot;
+		int result=takeSnapshot( sharedHandle, &snapshot, sizeof(MemcounterSnapshot) );
+		++numberOfReads;
+		if( result!=MEMCOUNTER_SUCCESS || !(snapshot.flags & MEMCOUNTER_SNAPSHOT_VALID) ) ++numberOfFailedReads;
+		else if( !isConsistent( snapshot ) ) ++numberOfTornReads;
+	}
+	std::cout << numberOfReads << " reads while the counter was changing" << std::endl;
+	TEST_CHECK( numberOfFailedReads==0 );
+	TEST_CHECK( numberOfTornReads==0 );
+
+	MemcounterSnapshot last;
+	TEST_CHECK( takeSnapshot( sharedHandle, &last, sizeof(MemcounterSnapshot) )==MEMCOUNTER_SUCCESS );
+	TEST_CHECK( last.currentSize==0 && last.currentNumberOfAllocations==0 );
+	TEST_CHECK( last.maximumSize==4000 && last.maximumNumberOfAllocations==2 );
+	TEST_CHECK( !(last.flags & MEMCOUNTER_SNAPSHOT_ENABLED) );
+
+	pthread_barrier_wait( &barrier );
+	pthread_join( writer, NULL );
+	pthread_barrier_destroy( &barrier );
+
+	// The counter went with its thread
+	MemcounterSnapshot afterExit;
+	TEST_CHECK( takeSnapshot( sharedHandle, &afterExit, sizeof(MemcounterSnapshot) )==MEMCOUNTER_INVALID_HANDLE );
+	TEST_CHECK( !(afterExit.flags & MEMCOUNTER_SNAPSHOT_VALID) );
+
+	return memcountertest::result();
+}
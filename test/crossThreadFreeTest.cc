@@ -0,0 +1,80 @@
+#include "memcounter/IMemoryCounter.h"
+#include "TestUtilities.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+
+namespace // Use the unnamed namespace
+{
+	struct FreeArguments
+	{
+		std::vector<void*>* pBlocks;
+		size_t first;
+		size_t last;
+	};
+
+	/** @brief Frees some of the blocks, from a thread with no counters at all. */
+	void* freeBlocks( void* pArguments )
+	{
+		FreeArguments& arguments=*static_cast<FreeArguments*>( pArguments );
+		for( size_t index=arguments.first; index<arguments.last; ++index ) free( (*arguments.pBlocks)[index] );
+		return NULL;
+	}
+
+	void freeInAnotherThread( std::vector<void*>& blocks, size_t first, size_t last )
+	{
+		FreeArguments arguments={ &blocks, first, last };
+		pthread_t thread;
+		pthread_create( &thread, NULL, &freeBlocks, &arguments );
+		pthread_join( thread, NULL );
+	}
+}
+
+/*
+ * Allocates blocks in the main thread and frees them in another. With MEMCOUNTER_CROSS_THREAD_FREES=1
+ * they have to come off the main thread's counter, without it they stay on it. More blocks are freed
+ * than the remote free queue holds, so the overflow totals get used too.
+ */
+int main()
+{
+	using memcounter::IMemoryCounter;
+
+	IMemoryCounter* (*createNewMemoryCounter)( void );
+	if( !memcountertest::findFunction( createNewMemoryCounter, "createNewMemoryCounter" ) ) return memcountertest::result();
+
+	const char* option=getenv( "MEMCOUNTER_CROSS_THREAD_FREES" );
+	bool crossThreadFrees=( option!=NULL && strcmp( option, "0" )!=0 );
+
+	const size_t numberOfBlocks=100000;
+	std::vector<void*> blocks( numberOfBlocks );
+	IMemoryCounter* pCounter=createNewMemoryCounter();
+	pCounter->enable();
+	for( size_t index=0; index<numberOfBlocks; ++index ) blocks[index]=malloc( 24 );
+	TEST_CHECK( pCounter->currentSize()==long(numberOfBlocks*24) );
+
+	// A few first, which fit in the queue
+	freeInAnotherThread( blocks, 0, 1000 );
+	long int expectedSize=( crossThreadFrees ? (numberOfBlocks-1000)*24 : numberOfBlocks*24 );
+	TEST_CHECK( pCounter->currentSize()==expectedSize );
+	TEST_CHECK( pCounter->currentNumberOfAllocations()==expectedSize/24 );
+	TEST_CHECK( pCounter->maximumSize()==long(numberOfBlocks*24) );
+
+	// Then everything else, which doesn't
+	freeInAnotherThread( blocks, 1000, numberOfBlocks );
+	expectedSize=( crossThreadFrees ? 0 : numberOfBlocks*24 );
+	TEST_CHECK( pCounter->currentSize()==expectedSize );
+	TEST_CHECK( pCounter->currentNumberOfAllocations()==expectedSize/24 );
+
+	// Frees that are queued while the counter is disabled don't come off it
+	for( size_t index=0; index<100; ++index ) blocks[index]=malloc( 1000 );
+	pCounter->disable();
+	freeInAnotherThread( blocks, 0, 100 );
+	pCounter->enable();
+	TEST_CHECK( pCounter->currentSize()==expectedSize+100*1000 );
+	pCounter->disable();
+
+	return memcountertest::result();
+}
@@ -0,0 +1,67 @@
+#include "memcounter/IMemoryCounter.h"
+#include "TestUtilities.h"
+
+#include <stdlib.h>
+
+
+/*
+ * Enables and disables lots of counters in different orders, to check that the values follow
+ * each counter in and out of the pool's slots, and that a counter that can't get a slot says so.
+ */
+int main()
+{
+	using memcounter::IMemoryCounter;
+
+	IMemoryCounter* (*createNewMemoryCounter)( void );
+	if( !memcountertest::findFunction( createNewMemoryCounter, "createNewMemoryCounter" ) ) return memcountertest::result();
+
+	// One more than there are slots
+	const size_t numberOfCounters=33;
+	IMemoryCounter* pCounters[numberOfCounters];
+	for( size_t index=0; index<numberOfCounters; ++index ) pCounters[index]=createNewMemoryCounter();
+
+	for( size_t index=0; index<numberOfCounters-1; ++index ) pCounters[index]->enable();
+	pCounters[numberOfCounters-1]->enable();
+	TEST_CHECK( pCounters[numberOfCounters-2]->isEnabled() );
+	TEST_CHECK( !pCounters[numberOfCounters-1]->isEnabled() );
+
+	// volatile, otherwise the compiler is free to remove a malloc and free pair completely
+	void* volatile pFirst=malloc( 100 );
+	for( size_t index=0; index<numberOfCounters-1; ++index ) TEST_CHECK( pCounters[index]->currentSize()==100 );
+	TEST_CHECK( pCounters[numberOfCounters-1]->currentSize()==0 );
+
+	// Disabling every third counter leaves holes that the counters enabled next should fill
+	for( size_t index=0; index<numberOfCounters-1; index+=3 ) pCounters[index]->disable();
+	void* volatile pSecond=malloc( 50 );
+	pCounters[numberOfCounters-1]->enable();
+	TEST_CHECK( pCounters[numberOfCounters-1]->isEnabled() );
+	void* volatile pThird=malloc( 7 );
+
+	for( size_t index=0; index<numberOfCounters-1; ++index )
+	{
+		long int expected=( index%3==0 ? 100 : 157 );
+		TEST_CHECK( pCounters[index]->currentSize()==expected );
+		TEST_CHECK( pCounters[index]->maximumSize()==expected );
+	}
+	TEST_CHECK( pCounters[numberOfCounters-1]->currentSize()==7 );
+
+	// The values come back with a counter when it's enabled again, wherever it ends up
+	pCounters[numberOfCounters-1]->disable();
+	for( size_t index=0; index<numberOfCounters-1; index+=3 ) pCounters[index]->enable();
+	free( pFirst );
+	for( size_t index=0; index<numberOfCounters-1; ++index )
+	{
+		long int expected=( index%3==0 ? 0 : 57 );
+		TEST_CHECK( pCounters[index]->currentSize()==expected );
+		TEST_CHECK( pCounters[index]->currentNumberOfAllocations()==( index%3==0 ? 0 : 2 ) );
+	}
+	TEST_CHECK( pCounters[numberOfCounters-1]->currentSize()==7 );
+
+	// Paused and resumed in reverse order
+	for( size_t index=numberOfCounters-1; index>0; --index ) pCounters[index-1]->disable();
+	free( pSecond );
+	free( pThird );
+	for( size_t index=0; index<numberOfCounters-1; ++index ) TEST_CHECK( pCounters[index]->currentSize()==( index%3==0 ? 0 : 57 ) );
+
+	return memcountertest::result();
+}
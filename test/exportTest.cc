@@ -0,0 +1,173 @@
+#include "memcounter/IMemoryCounter.h"
+#include "TestUtilities.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+
+
+namespace // Use the unnamed namespace
+{
+	memcounter::IMemoryCounter* (*createNewMemoryCounter)( void )=NULL;
+	memcounter::IMemoryCounter* (*createNamedMemoryCounter)( const char* name )=NULL;
+	memcounter::IMemoryCounter* (*createNewGlobalMemoryCounter)( void )=NULL;
+	void (*writeJson)( memcounter::IMemoryCounter* pCounter, int fileDescriptor )=NULL;
+	void (*writeCsv)( memcounter::IMemoryCounter* const* pCounters, size_t numberOfCounters, int fileDescriptor )=NULL;
+
+	/** @brief Everything written to the file so far. */
+	std::string fileContents( int fileDescriptor )
+	{
+		std::string contents;
+		char buffer[4096];
+		ssize_t size;
+		lseek( fileDescriptor, 0, SEEK_SET );
+		while( ( size=read( fileDescriptor, buffer, sizeof(buffer) ) )>0 ) contents.append( buffer, size );
+		return contents;
+	}
+
+	/** @brief Splits the text into lines, and each line into CSV fields, taking quoted fields into account. */
+	std::vector< std::vector<std::string> > parseCsv( const std::string& text )
+	{
+		std::vector< std::vector<std::string> > rows;
+		std::vector<std::string> fields;
+		std::string field;
+		bool inQuotes=false;
+		for( size_t index=0; index<text.size(); ++index )
+		{
+			char character=text[index];
+			if( inQuotes )
+			{
+				if( character!='"' ) field+=character;
+				else if( index+1<text.size() && text[index+1]=='"' ) field+=text[++index];
+				else inQuotes=false;
+			}
+			else if( character=='"' ) inQuotes=true;
+			else if( character==',' )
+			{
+				fields.push_back( field );
+				field.clear();
+			}
+			else if( character=='\n' )
+			{
+				fields.push_back( field );
+				field.clear();
+				rows.push_back( fields );
+				fields.clear();
+			}
+			else field+=character;
+		}
+		TEST_CHECK( !inQuotes && fields.empty() && field.empty() ); // every row has to be finished with a newline
+		return rows;
+	}
+
+	/** @brief The number after "key": in the JSON, or -1 if it isn't there or isn't followed by a comma or closing brace. */
+	long int jsonNumber( const std::string& json, const char* key )
+	{
+		std::string quotedKey=std::string("\"")+key+"\":";
+		size_t position=json.find( quotedKey );
+		if( position==std::string::npos ) return -1;
+		const char* pStart=json.c_str()+position+quotedKey.size();
+		char* pEnd;
+		long int number=strtol( pStart, &pEnd, 10 );
+		return ( pEnd!=pStart && ( *pEnd==',' || *pEnd=='}' ) ) ? number : -1;
+	}
+
+	/** @brief Checks one CSV row against the counts it should have. */
+	void checkRow( const std::vector<std::string>& row, const char* snapshot, const char* counter, const char* enabled, long int currentSize, long int maximumSize, long int currentAllocations, long int maximumAllocations )
+	{
+		if( !TEST_CHECK( row.size()==11 ) ) return;
+		TEST_CHECK( row[0]==snapshot );
+		TEST_CHECK( row[1].find( '.' )==row[1].size()-4 && strtoul( row[1].c_str(), NULL, 10 )>1500000000 );
+		TEST_CHECK( row[2]==counter );
+		TEST_CHECK( row[3].empty() );
+		TEST_CHECK( row[4]==enabled );
+		TEST_CHECK( strtol( row[5].c_str(), NULL, 10 )==currentSize );
+		TEST_CHECK( strtol( row[6].c_str(), NULL, 10 )==maximumSize );
+		// The usable sizes depend on the allocator, but can't be less than what was asked for
+		TEST_CHECK( strtol( row[7].c_str(), NULL, 10 )>=currentSize );
+		TEST_CHECK( strtol( row[8].c_str(), NULL, 10 )>=maximumSize );
+		TEST_CHECK( strtol( row[9].c_str(), NULL, 10 )==currentAllocations );
+		TEST_CHECK( strtol( row[10].c_str(), NULL, 10 )==maximumAllocations );
+	}
+}
+
+/*
+ * Writes a plain, a named and a global counter out with writeMemoryCounterJson and, twice, with
+ * writeMemoryCountersCsv, then parses what was written back and checks the numbers. One of the names
+ * has a comma and quotes in it, which have to come back out of the CSV the same as they went in.
+ */
+int main()
+{
+	if( !memcountertest::findFunction( createNewMemoryCounter, "createNewMemoryCounter" )
+		|| !memcountertest::findFunction( createNamedMemoryCounter, "createNamedMemoryCounter" )
+		|| !memcountertest::findFunction( createNewGlobalMemoryCounter, "createNewGlobalMemoryCounter" )
+		|| !memcountertest::findFunction( writeJson, "writeMemoryCounterJson" )
+		|| !memcountertest::findFunction( writeCsv, "writeMemoryCountersCsv" ) ) return memcountertest::result();
+
+	memcounter::IMemoryCounter* pGlobalCounter=createNewGlobalMemoryCounter();
+	pGlobalCounter->enable();
+	// volatile, otherwise the compiler is free to remove a malloc and free pair completely
+	void* volatile pGlobalBlock=malloc( 500 );
+	pGlobalCounter->disable();
+
+	memcounter::IMemoryCounter* pNamedCounter=createNamedMemoryCounter( "exportTestNamed" );
+	pNamedCounter->enable();
+	void* volatile pNamedBlock=malloc( 2000 );
+	pNamedCounter->disable();
+
+	memcounter::IMemoryCounter* pQuotedCounter=createNamedMemoryCounter( "exportTest, \"quoted\"" );
+	pQuotedCounter->enable();
+	void* volatile pFreedBlock=malloc( 300 );
+	free( pFreedBlock );
+	pQuotedCounter->disable();
+
+	char jsonFilename[]="/tmp/exportTestJsonXXXXXX";
+	char csvFilename[]="/tmp/exportTestCsvXXXXXX";
+	int jsonFile=mkstemp( jsonFilename );
+	int csvFile=mkstemp( csvFilename );
+	if( !TEST_CHECK( jsonFile>=0 && csvFile>=0 ) ) return memcountertest::result();
+	unlink( jsonFilename );
+	unlink( csvFilename );
+
+	// The plain counter stays enabled while everything is written, the exports mustn't count into it
+	memcounter::IMemoryCounter* pPlainCounter=createNewMemoryCounter();
+	pPlainCounter->enable();
+	void* volatile pPlainBlock=malloc( 1000 );
+	memcounter::IMemoryCounter* counters[4]={ pPlainCounter, pNamedCounter, pQuotedCounter, pGlobalCounter };
+	writeJson( pPlainCounter, jsonFile );
+	writeCsv( counters, 4, csvFile );
+	writeCsv( counters, 4, csvFile );
+	pPlainCounter->disable();
+
+	std::string json=fileContents( jsonFile );
+	TEST_CHECK( json.size()>2 && json[0]=='{' && json.find( '\n' )==json.size()-1 && json.compare( json.size()-2, 2, "}\n" )==0 );
+	TEST_CHECK( json.find( "\"enabled\":true," )!=std::string::npos );
+	TEST_CHECK( jsonNumber( json, "currentSize" )==1000 && jsonNumber( json, "maximumSize" )==1000 );
+	TEST_CHECK( jsonNumber( json, "currentUsableSize" )>=1000 && jsonNumber( json, "maximumUsableSize" )>=1000 );
+	TEST_CHECK( jsonNumber( json, "currentNumberOfAllocations" )==1 && jsonNumber( json, "maximumNumberOfAllocations" )==1 );
+	TEST_CHECK( json.find( "\"subCounters\":[]}" )!=std::string::npos );
+
+	std::vector< std::vector<std::string> > rows=parseCsv( fileContents( csvFile ) );
+	// The column names only go in once, at the start of the file
+	if( !TEST_CHECK( rows.size()==9 ) ) return memcountertest::result();
+	TEST_CHECK( rows[0].size()==11 && rows[0][0]=="snapshot" && rows[0][2]=="counter" && rows[0][10]=="maximum_allocations" );
+	for( size_t snapshot=0; snapshot<2; ++snapshot )
+	{
+		const char* snapshotNumber=( snapshot==0 ? "1" : "2" );
+		checkRow( rows[1+snapshot*4], snapshotNumber, "0", "1", 1000, 1000, 1, 1 );
+		checkRow( rows[2+snapshot*4], snapshotNumber, "exportTestNamed", "0", 2000, 2000, 1, 1 );
+		checkRow( rows[3+snapshot*4], snapshotNumber, "exportTest, \"quoted\"", "0", 0, 300, 0, 1 );
+		checkRow( rows[4+snapshot*4], snapshotNumber, "3", "0", 500, 500, 1, 1 );
+	}
+	// Both snapshots are taken at the same time as far as their own rows go
+	TEST_CHECK( rows[1][1]==rows[4][1] && rows[5][1]==rows[8][1] );
+
+	close( jsonFile );
+	close( csvFile );
+	free( pPlainBlock );
+	free( pNamedBlock );
+	free( pGlobalBlock );
+	return memcountertest::result();
+}
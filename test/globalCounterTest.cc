@@ -0,0 +1,77 @@
+#include "memcounter/IMemoryCounter.h"
+#include "TestUtilities.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+
+
+namespace // Use the unnamed namespace
+{
+	const size_t numberOfThreads=4;
+	const size_t blocksPerThread=100;
+	memcounter::IMemoryCounter* pGlobalCounter;
+	pthread_barrier_t barrier;
+
+	/** @brief Allocates a different amount in each thread, waits while the totals are checked, then frees it all. */
+	void* allocateAndFree( void* pArgument )
+	{
+		size_t blockSize=1000*( reinterpret_cast<size_t>(pArgument)+1 );
+		void* pBlocks[blocksPerThread];
+		pGlobalCounter->enable();
+		for( size_t index=0; index<blocksPerThread; ++index ) pBlocks[index]=malloc( blockSize );
+		pthread_barrier_wait( &barrier );
+		pthread_barrier_wait( &barrier );
+		for( size_t index=0; index<blocksPerThread; ++index ) free( pBlocks[index] );
+		pGlobalCounter->disable();
+		pthread_barrier_wait( &barrier );
+		pthread_barrier_wait( &barrier );
+		return NULL;
+	}
+}
+
+/*
+ * Several threads count into the same global counter, which is read from a thread that
+ * doesn't have it enabled.
+ */
+int main()
+{
+	using memcounter::IMemoryCounter;
+
+	IMemoryCounter* (*createNewGlobalMemoryCounter)( void );
+	if( !memcountertest::findFunction( createNewGlobalMemoryCounter, "createNewGlobalMemoryCounter" ) ) return memcountertest::result();
+
+	pGlobalCounter=createNewGlobalMemoryCounter();
+	pthread_barrier_init( &barrier, NULL, numberOfThreads+1 );
+	pthread_t threads[numberOfThreads];
+	for( size_t index=0; index<numberOfThreads; ++index ) pthread_create( &threads[index], NULL, &allocateAndFree, reinterpret_cast<void*>(index) );
+
+	// Each thread has allocated 100 blocks of 1000 times one more than its index
+	long int totalSize=0;
+	for( size_t index=0; index<numberOfThreads; ++index ) totalSize+=long(blocksPerThread*1000*(index+1));
+	pthread_barrier_wait( &barrier );
+	TEST_CHECK( pGlobalCounter->currentSize()==totalSize );
+	TEST_CHECK( pGlobalCounter->currentNumberOfAllocations()==long(numberOfThreads*blocksPerThread) );
+	TEST_CHECK( pGlobalCounter->currentUsableSize()>=totalSize );
+	pthread_barrier_wait( &barrier );
+
+	// Everything's been freed, but the maximum is still the sum of each thread's maximum
+	pthread_barrier_wait( &barrier );
+	TEST_CHECK( pGlobalCounter->currentSize()==0 );
+	TEST_CHECK( pGlobalCounter->currentNumberOfAllocations()==0 );
+	TEST_CHECK( pGlobalCounter->maximumSize()==totalSize );
+
+	// Resetting from this thread clears the other threads' shares too
+	pGlobalCounter->reset();
+	TEST_CHECK( pGlobalCounter->maximumSize()==0 );
+	pthread_barrier_wait( &barrier );
+	for( size_t index=0; index<numberOfThreads; ++index ) pthread_join( threads[index], NULL );
+
+	// Counting in this thread too
+	pGlobalCounter->enable();
+	void* volatile pBlock=malloc( 123 );
+	TEST_CHECK( pGlobalCounter->currentSize()==123 );
+	free( pBlock );
+	pGlobalCounter->disable();
+
+	return memcountertest::result();
+}
@@ -0,0 +1,101 @@
+#include "memcounter/IMemoryCounter.h"
+
+#include <dlfcn.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+#include <vector>
+#include <iostream>
+#include <iomanip>
+
+
+namespace // Use the unnamed namespace
+{
+	/** @brief Returns a monotonic time in nanoseconds */
+	inline uint64_t nanoseconds()
+	{
+		timespec time;
+		clock_gettime( CLOCK_MONOTONIC, &time );
+		return uint64_t(time.tv_sec)*1000000000+time.tv_nsec;
+	}
+
+	/** @brief Times malloc/free pairs of the given size and returns the average time per pair in nanoseconds.
+	 *
+	 * The pointers are kept in a vector so that the allocator can't just hand back the same block
+	 * every time, and so that the compiler can't optimise the calls away.
+	 */
+	double timeMallocFree( size_t size, size_t numberOfBlocks, size_t repeats )
+	{
+		std::vector<void*> pointers( numberOfBlocks );
+		uint64_t startTime=nanoseconds();
+		for( size_t repeat=0; repeat<repeats; ++repeat )
+		{
+			for( std::vector<void*>::iterator iPointer=pointers.begin(); iPointer!=pointers.end(); ++iPointer ) *iPointer=malloc( size );
+			for( std::vector<void*>::iterator iPointer=pointers.begin(); iPointer!=pointers.end(); ++iPointer ) free( *iPointer );
+		}
+		uint64_t endTime=nanoseconds();
+		return double(endTime-startTime)/double(numberOfBlocks*repeats);
+	}
+
+	void runAllSizes( const std::string& description )
+	{
+		const size_t sizes[]={ 16, 32, 128, 1024, 8192 };
+		std::cout << std::setw(32) << std::left << description;
+		for( size_t index=0; index<sizeof(sizes)/sizeof(sizes[0]); ++index )
+		{
+			timeMallocFree( sizes[index], 1000, 10 ); // warm up
+			std::cout << std::setw(10) << std::right << std::fixed << std::setprecision(1) << timeMallocFree( sizes[index], 1000, 2000 );
+		}
+		std::cout << std::endl;
+	}
+
+} // end of the unnamed namespace
+
+/*
+ * Microbenchmark of the allocation hooks. Run it normally to get the time for the plain
+ * allocator, and through intrusiveMemoryAnalyser to get the time through the hooks both
+ * with no counter enabled (the "not counting" path) and with one or several counters
+ * enabled. All times are nanoseconds per malloc/free pair.
+ */
+int main( int argc, char* argv[] )
+{
+	using memcounter::IMemoryCounter;
+
+	// My current build settings throw errors if argc or argv aren't used, so
+	// put in some dummy uses to shut the compiler up.
+	if( argc>0 )
+	{
+		argv[0]=argv[0];
+	}
+
+	std::cout << std::setw(32) << std::left << "ns per malloc/free pair" << std::right
+			<< std::setw(10) << "16B" << std::setw(10) << "32B" << std::setw(10) << "128B"
+			<< std::setw(10) << "1kB" << std::setw(10) << "8kB" << std::endl;
+
+	IMemoryCounter* (*createNewMemoryCounter)( void );
+
+	if( void *sym = dlsym(0, "createNewMemoryCounter") )
+	{
+		createNewMemoryCounter = __extension__(IMemoryCounter*(*)(void)) sym;
+	}
+	else
+	{
+		runAllSizes( "library not loaded" );
+		return 0;
+	}
+
+	std::vector<IMemoryCounter*> counters;
+	for( size_t index=0; index<4; ++index ) counters.push_back( createNewMemoryCounter() );
+
+	runAllSizes( "hooks, no counters enabled" );
+
+	counters[0]->enable();
+	runAllSizes( "hooks, 1 counter enabled" );
+
+	for( size_t index=1; index<counters.size(); ++index ) counters[index]->enable();
+	runAllSizes( "hooks, 4 counters enabled" );
+
+	for( size_t index=0; index<counters.size(); ++index ) counters[index]->disable();
+
+	return 0;
+}
@@ -0,0 +1,115 @@
+#include "memcounter/IMemoryCounter.h"
+#include "TestUtilities.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+
+
+namespace // Use the unnamed namespace
+{
+	// volatile, otherwise the compiler is free to remove a malloc and free pair completely
+	void* volatile pChildBlock;
+	void* volatile pGrandchildBlock;
+	void* volatile pUncountedBlock;
+
+	void* grandchild( void* )
+	{
+		pGrandchildBlock=malloc( 700 );
+		return NULL;
+	}
+
+	/** @brief Allocates, and starts a thread of its own that does too. */
+	void* child( void* )
+	{
+		pChildBlock=malloc( 5000 );
+		pthread_t thread;
+		pthread_create( &thread, NULL, &grandchild, NULL );
+		pthread_join( thread, NULL );
+		return NULL;
+	}
+
+	void* uncounted( void* )
+	{
+		pUncountedBlock=malloc( 90000 );
+		return NULL;
+	}
+
+	/** @brief Starts the thread and waits for it, with the counter paused so that starting the thread isn't counted itself. */
+	void runThread( memcounter::IMemoryCounter* pCounter, void* (*pFunction)( void* ) )
+	{
+		pthread_t thread;
+		pthread_create( &thread, NULL, pFunction, NULL );
+		bool wasEnabled=pCounter->isEnabled();
+		pCounter->disable();
+		pthread_join( thread, NULL );
+		if( wasEnabled ) pCounter->enable();
+	}
+
+	memcounter::IMemoryCounter* (*createNewMemoryCounter)( void )=NULL;
+
+	/** @brief Counts a thread it starts with a new counter of its own, and returns non-NULL if the count was wrong. */
+	void* countChildInOwnCounter( void* )
+	{
+		memcounter::IMemoryCounter* pCounter=createNewMemoryCounter();
+		pCounter->enable();
+		runThread( pCounter, &child );
+		pCounter->disable();
+		long int threadsSize=pCounter->currentSize();
+		free( pChildBlock );
+		free( pGrandchildBlock );
+		return ( threadsSize>=5700 && threadsSize<5700+4096 ) ? NULL : pCounter;
+	}
+}
+
+/*
+ * Run with MEMCOUNTER_INHERIT_COUNTERS=1. Threads started while the counter is enabled, and the
+ * threads they start, count against it. Threads started while it's disabled don't.
+ */
+int main()
+{
+	using memcounter::IMemoryCounter;
+
+	if( !memcountertest::findFunction( createNewMemoryCounter, "createNewMemoryCounter" ) ) return memcountertest::result();
+
+	IMemoryCounter* pCounter=createNewMemoryCounter();
+	pCounter->enable();
+	void* volatile pBlock=malloc( 100 );
+	pCounter->disable();
+	long int ownSize=pCounter->currentSize();
+
+	pCounter->enable();
+	runThread( pCounter, &child );
+	pCounter->disable();
+	long int threadsSize=pCounter->currentSize()-ownSize;
+	TEST_CHECK( ownSize==100 );
+	TEST_CHECK( threadsSize>=5700 && threadsSize<5700+4096 ); // Allow for anything pthread_create allocates
+	long int withThreads=pCounter->currentSize();
+
+	runThread( pCounter, &uncounted );
+	TEST_CHECK( pCounter->currentSize()==withThreads );
+
+	// The spawned threads' share stays when this thread's own blocks are freed
+	free( pChildBlock );
+	free( pGrandchildBlock );
+	free( pUncountedBlock );
+	pCounter->enable();
+	free( pBlock );
+	pCounter->disable();
+	TEST_CHECK( pCounter->currentSize()==withThreads-100 );
+
+	// Each of these threads' counters needs a global counter for the thread it starts. There are more
+	// of them than there are global counters, so they only all work if the global counters are given
+	// back when the threads exit, and they only count from zero if the counts were reset.
+	size_t numberOfWrongCounts=0;
+	for( int owner=0; owner<40; ++owner )
+	{
+		pthread_t thread;
+		void* pWrong=NULL;
+		pthread_create( &thread, NULL, &countChildInOwnCounter, NULL );
+		pthread_join( thread, &pWrong );
+		if( pWrong ) ++numberOfWrongCounts;
+	}
+	TEST_CHECK( numberOfWrongCounts==0 );
+
+	return memcountertest::result();
+}
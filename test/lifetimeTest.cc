@@ -0,0 +1,74 @@
+#include "memcounter/IMemoryCounter.h"
+#include "TestUtilities.h"
+
+#include <stdlib.h>
+#include <time.h>
+
+
+namespace // Use the unnamed namespace
+{
+	/** @brief Finds the bin holding blocks of the given size, assuming each size was only freed once. Returns NULL if there isn't one. */
+	const memcounter::LifetimeBinCounts* binWithBytes( const std::vector<memcounter::LifetimeBinCounts>& histogram, long int bytes )
+	{
+		for( size_t index=0; index<histogram.size(); ++index )
+		{
+			if( histogram[index].bytes==bytes ) return &histogram[index];
+		}
+		return NULL;
+	}
+}
+
+/*
+ * Run with MEMCOUNTER_LIFETIMES=1. Frees one block straight away and another after a sleep, and
+ * checks they land in bins that fit how long they were allocated for. The cycle counter is
+ * converted to time with a rate measured when the library starts, so the bins are only checked
+ * to within a factor of two either way.
+ */
+int main()
+{
+	using memcounter::IMemoryCounter;
+
+	IMemoryCounter* (*createNewMemoryCounter)( void );
+	if( !memcountertest::findFunction( createNewMemoryCounter, "createNewMemoryCounter" ) ) return memcountertest::result();
+
+	IMemoryCounter* pCounter=createNewMemoryCounter();
+	pCounter->enable();
+	// volatile, otherwise the compiler is free to remove a malloc and free pair completely
+	void* volatile pShortLived=malloc( 100 );
+	free( pShortLived );
+	void* volatile pLongLived=malloc( 3000 );
+	timespec sleepTime={ 0, 50000000 };
+	nanosleep( &sleepTime, NULL );
+	free( pLongLived );
+	// Only freed blocks are in the histogram, including the old block of a realloc. This one lives for
+	// a few milliseconds, so that it's in a different bin to both of the others.
+	void* volatile pReallocated=malloc( 70000 );
+	sleepTime.tv_nsec=3000000;
+	nanosleep( &sleepTime, NULL );
+	pReallocated=realloc( pReallocated, 140000 );
+	std::vector<memcounter::LifetimeBinCounts> histogram=pCounter->lifetimeHistogram();
+	free( pReallocated );
+	pCounter->disable();
+
+	long int totalAllocations=0;
+	for( size_t index=0; index<histogram.size(); ++index )
+	{
+		totalAllocations+=histogram[index].allocations;
+		if( index>0 ) TEST_CHECK( histogram[index].shortestNanoseconds==histogram[index-1].longestNanoseconds );
+	}
+	TEST_CHECK( totalAllocations==3 );
+
+	const memcounter::LifetimeBinCounts* pShortBin=binWithBytes( histogram, 100 );
+	const memcounter::LifetimeBinCounts* pLongBin=binWithBytes( histogram, 3000 );
+	TEST_CHECK( binWithBytes( histogram, 70000 )!=NULL );
+	if( TEST_CHECK( pShortBin!=NULL && pLongBin!=NULL ) )
+	{
+		std::cout << "Freed straight away: " << pShortBin->shortestNanoseconds << " to " << pShortBin->longestNanoseconds
+			<< " ns, after 50ms: " << pLongBin->shortestNanoseconds << " to " << pLongBin->longestNanoseconds << " ns" << std::endl;
+		TEST_CHECK( pShortBin->allocations==1 && pLongBin->allocations==1 );
+		TEST_CHECK( pShortBin->shortestNanoseconds<1e6 );
+		TEST_CHECK( pLongBin->longestNanoseconds>25e6 && pLongBin->shortestNanoseconds<1e9 );
+	}
+
+	return memcountertest::result();
+}
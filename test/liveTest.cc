@@ -0,0 +1,183 @@
+#include "memcounter/IMemoryCounter.h"
+#include "memcounter/LiveFormat.h"
+#include "TestUtilities.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+
+namespace // Use the unnamed namespace
+{
+	const char* const counterName="liveTestNamed";
+	memcounter::IMemoryCounter* (*createNewMemoryCounter)( void )=NULL;
+	memcounter::IMemoryCounter* (*createNamedMemoryCounter)( const char* name )=NULL;
+	memcounter::IMemoryCounter* (*createNewGlobalMemoryCounter)( void )=NULL;
+	memcounter::IMemoryCounter* pGlobalCounter=NULL;
+
+	/** @brief Adds a block that's never freed to the global counter then exits, so that its part of the counter is retired. */
+	void* countAndExit( void* )
+	{
+		pGlobalCounter->enable();
+		// volatile, otherwise the compiler is free to remove the malloc
+		void* volatile pBlock=malloc( 200 );
+		pGlobalCounter->disable();
+		return pBlock;
+	}
+
+	/** @brief A consistent copy of the block's slots, the same way memcounterTop reads them. False if it isn't in use or keeps changing. */
+	bool readThreadBlock( const memcounter::LiveThreadBlock& block, memcounter::LiveThreadBlock& copy )
+	{
+		for( int attempt=0; attempt<1000; ++attempt )
+		{
+			uint32_t before=__atomic_load_n( &block.sequence, __ATOMIC_ACQUIRE );
+			if( before & 1 ) continue;
+			copy.threadIndex=__atomic_load_n( &block.threadIndex, __ATOMIC_RELAXED );
+			copy.threadId=__atomic_load_n( &block.threadId, __ATOMIC_RELAXED );
+			copy.enabledSlots=__atomic_load_n( &block.enabledSlots, __ATOMIC_RELAXED );
+			copy.activeSlots=__atomic_load_n( &block.activeSlots, __ATOMIC_RELAXED );
+			for( uint32_t bits=copy.enabledSlots; bits!=0; bits&=bits-1 )
+			{
+				int slot=__builtin_ctz( bits );
+				copy.nameIds[slot]=__atomic_load_n( &block.nameIds[slot], __ATOMIC_RELAXED );
+				copy.values[slot].loadFrom( block.values[slot] );
+			}
+			__atomic_thread_fence( __ATOMIC_ACQUIRE );
+			if( __atomic_load_n( &block.sequence, __ATOMIC_RELAXED )==before ) return copy.threadIndex!=0;
+		}
+		return false;
+	}
+
+	bool isCounterName( const memcounter::LiveFileHeader& header, const char* pSegment, uint32_t nameId )
+	{
+		if( nameId==0 || nameId>header.maximumNumberOfNames ) return false;
+		const memcounter::LiveName& name=reinterpret_cast<const memcounter::LiveName*>( pSegment+header.namesOffset )[nameId-1];
+		uint32_t length=__atomic_load_n( &name.length, __ATOMIC_ACQUIRE );
+		return length==strlen( counterName ) && memcmp( name.text, counterName, length )==0;
+	}
+}
+
+/*
+ * Runs with MEMCOUNTER_LIVE=1 and reads the process's own shared memory segment the way memcounterTop
+ * does: the header, this thread's block with a plain and a named counter in it, the counter's name, and
+ * a global counter made up of this thread's shard and the retired shard of a thread that has exited.
+ */
+int main()
+{
+	if( !memcountertest::findFunction( createNewMemoryCounter, "createNewMemoryCounter" )
+		|| !memcountertest::findFunction( createNamedMemoryCounter, "createNamedMemoryCounter" )
+		|| !memcountertest::findFunction( createNewGlobalMemoryCounter, "createNewGlobalMemoryCounter" ) ) return memcountertest::result();
+
+	pGlobalCounter=createNewGlobalMemoryCounter();
+	pthread_t thread;
+	pthread_create( &thread, NULL, &countAndExit, NULL );
+	void* pThreadBlock;
+	pthread_join( thread, &pThreadBlock );
+	pGlobalCounter->enable();
+	// volatile, otherwise the compiler is free to remove a malloc and free pair completely
+	void* volatile pGlobalBlock=malloc( 500 );
+	pGlobalCounter->disable();
+
+	// Both stay enabled, so the named counter has the plain counter's block as well
+	memcounter::IMemoryCounter* pNamedCounter=createNamedMemoryCounter( counterName );
+	pNamedCounter->enable();
+	void* volatile pNamedBlock=malloc( 3000 );
+	memcounter::IMemoryCounter* pPlainCounter=createNewMemoryCounter();
+	pPlainCounter->enable();
+	void* volatile pPlainBlock=malloc( 1000 );
+
+	char segmentName[64];
+	snprintf( segmentName, sizeof(segmentName), "/memcounter.%ld", long(getpid()) );
+	int fileDescriptor=shm_open( segmentName, O_RDONLY, 0 );
+	struct stat segmentStatus;
+	if( !TEST_CHECK( fileDescriptor>=0 && fstat( fileDescriptor, &segmentStatus )==0 ) ) return memcountertest::result();
+	void* pMemory=mmap( NULL, segmentStatus.st_size, PROT_READ, MAP_SHARED, fileDescriptor, 0 );
+	close( fileDescriptor );
+	if( !TEST_CHECK( pMemory!=MAP_FAILED ) ) return memcountertest::result();
+	const char* pSegment=static_cast<const char*>( pMemory );
+
+	const memcounter::LiveFileHeader& header=*reinterpret_cast<const memcounter::LiveFileHeader*>( pSegment );
+	TEST_CHECK( memcmp( header.magic, memcounter::liveMagic, sizeof(header.magic) )==0 );
+	TEST_CHECK( header.version==memcounter::liveVersion );
+	TEST_CHECK( header.processId==getpid() );
+	TEST_CHECK( header.headerSize==sizeof(memcounter::LiveFileHeader) && sizeof(memcounter::LiveFileHeader)==96 );
+	TEST_CHECK( header.nameSize==sizeof(memcounter::LiveName) );
+	TEST_CHECK( header.globalBlockSize==sizeof(memcounter::LiveGlobalBlock) );
+	TEST_CHECK( header.threadBlockSize==sizeof(memcounter::LiveThreadBlock) );
+	TEST_CHECK( header.namesOffset>=header.headerSize && header.namesOffset%64==0 );
+	TEST_CHECK( header.globalsOffset>=header.namesOffset+header.maximumNumberOfNames*header.nameSize && header.globalsOffset%64==0 );
+	TEST_CHECK( header.threadsOffset>=header.globalsOffset+header.globalBlockSize && header.threadsOffset%64==0 );
+	TEST_CHECK( header.threadsOffset+header.maximumNumberOfThreads*header.threadBlockSize==uint64_t(segmentStatus.st_size) );
+	TEST_CHECK( header.maximumNumberOfThreads==8 ); // from MEMCOUNTER_LIVE_THREADS
+	// The main thread and the one that exited, unless the exited one's block was reused
+	uint32_t numberOfBlocks=__atomic_load_n( &header.numberOfThreadBlocksUsed, __ATOMIC_ACQUIRE );
+	TEST_CHECK( numberOfBlocks>=1 && numberOfBlocks<=header.maximumNumberOfThreads );
+
+	// This thread's block
+	const memcounter::LiveThreadBlock* pBlocks=reinterpret_cast<const memcounter::LiveThreadBlock*>( pSegment+header.threadsOffset );
+	const int32_t threadId=syscall( SYS_gettid );
+	size_t numberOfMatchingBlocks=0;
+	for( uint32_t block=0; block<numberOfBlocks; ++block )
+	{
+		memcounter::LiveThreadBlock copy;
+		if( !readThreadBlock( pBlocks[block], copy ) || copy.threadId!=threadId ) continue;
+		++numberOfMatchingBlocks;
+
+		TEST_CHECK( __builtin_popcount( copy.enabledSlots )==2 );
+		TEST_CHECK( copy.activeSlots==copy.enabledSlots );
+		size_t numberOfNamed=0, numberOfPlain=0;
+		for( uint32_t bits=copy.enabledSlots; bits!=0; bits&=bits-1 )
+		{
+			const memcounter::CounterValues& values=copy.values[__builtin_ctz( bits )];
+			uint32_t nameId=copy.nameIds[__builtin_ctz( bits )];
+			if( nameId!=0 )
+			{
+				TEST_CHECK( isCounterName( header, pSegment, nameId ) );
+				TEST_CHECK( values.current[memcounter::CounterValues::size]==4000 && values.maximum[memcounter::CounterValues::size]==4000 );
+				TEST_CHECK( values.current[memcounter::CounterValues::numberOfAllocations]==2 );
+				TEST_CHECK( values.current[memcounter::CounterValues::totalAllocations]==2 );
+				++numberOfNamed;
+			}
+			else
+			{
+				TEST_CHECK( values.current[memcounter::CounterValues::size]==1000 && values.current[memcounter::CounterValues::numberOfAllocations]==1 );
+				TEST_CHECK( values.current[memcounter::CounterValues::usableSize]>=1000 );
+				++numberOfPlain;
+			}
+		}
+		TEST_CHECK( numberOfNamed==1 && numberOfPlain==1 );
+	}
+	TEST_CHECK( numberOfMatchingBlocks==1 );
+
+	// The global counter, added up from the live threads' shards and the retired ones
+	const memcounter::LiveGlobalBlock& globals=*reinterpret_cast<const memcounter::LiveGlobalBlock*>( pSegment+header.globalsOffset );
+	TEST_CHECK( __atomic_load_n( &globals.numberOfGlobalCounters, __ATOMIC_ACQUIRE )==1 );
+	TEST_CHECK( !( __atomic_load_n( &globals.retirementSequence, __ATOMIC_ACQUIRE ) & 1 ) );
+	long int current[memcounter::GlobalCounterShard::numberOfQuantities]={ 0, 0, 0 };
+	long int maximum[memcounter::GlobalCounterShard::numberOfQuantities]={ 0, 0, 0 };
+	for( uint32_t block=0; block<numberOfBlocks; ++block )
+	{
+		if( __atomic_load_n( &pBlocks[block].threadIndex, __ATOMIC_ACQUIRE )!=0 ) pBlocks[block].globalShards[0].addTo( current, maximum, globals.generations[0] );
+	}
+	long int retiredCurrent[memcounter::GlobalCounterShard::numberOfQuantities]={ 0, 0, 0 };
+	long int retiredMaximum[memcounter::GlobalCounterShard::numberOfQuantities]={ 0, 0, 0 };
+	globals.retiredShards[0].addTo( retiredCurrent, retiredMaximum, globals.generations[0] );
+	TEST_CHECK( retiredCurrent[memcounter::GlobalCounterShard::size]==200 );
+	TEST_CHECK( current[memcounter::GlobalCounterShard::size]+retiredCurrent[memcounter::GlobalCounterShard::size]==700 );
+	TEST_CHECK( current[memcounter::GlobalCounterShard::numberOfAllocations]+retiredCurrent[memcounter::GlobalCounterShard::numberOfAllocations]==2 );
+
+	pPlainCounter->disable();
+	pNamedCounter->disable();
+	free( pPlainBlock );
+	free( pNamedBlock );
+	free( pGlobalBlock );
+	free( pThreadBlock );
+	munmap( pMemory, segmentStatus.st_size );
+	return memcountertest::result();
+}
@@ -0,0 +1,148 @@
+#include "memcounter/IMemoryCounter.h"
+#include "memcounter/CInterface.h"
+#include "TestUtilities.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+namespace // Use the unnamed namespace
+{
+	const size_t numberOfThreads=4;
+	pthread_barrier_t barrier;
+	memcounter::IMemoryCounter* (*createNamedMemoryCounter)( const char* name );
+
+	/** @brief Counts one block in its own counter with the shared name, and keeps running while the totals are read. */
+	void* countAndWait( void* pArgument )
+	{
+		size_t blockSize=1000*( reinterpret_cast<size_t>(pArgument)+1 );
+		memcounter::IMemoryCounter* pCounter=createNamedMemoryCounter( "namedTotalsTest" );
+		pCounter->enable();
+		// volatile, otherwise the compiler is free to remove the malloc, and the free too
+		void* volatile pBlock=malloc( blockSize );
+		pCounter->disable();
+		pthread_barrier_wait( &barrier );
+		pthread_barrier_wait( &barrier );
+		// Some exit with the block freed, some without
+		if( reinterpret_cast<size_t>(pArgument)%2==0 )
+		{
+			pCounter->enable();
+			free( pBlock );
+			pCounter->disable();
+		}
+		return NULL;
+	}
+
+	/** @brief Counts a block that's never freed, then exits straight away. */
+	void* countAndExit( void* )
+	{
+		memcounter::IMemoryCounter* pCounter=createNamedMemoryCounter( "namedTotalsChurn" );
+		pCounter->enable();
+		// volatile, otherwise the compiler is free to remove the malloc
+		void* volatile pBlock=malloc( 1000 );
+		pCounter->disable();
+		return pBlock;
+	}
+
+	const size_t numberOfStarters=4;
+	const size_t threadsPerStarter=1000;
+	const size_t numberOfExitingThreads=numberOfStarters*threadsPerStarter;
+
+	/** @brief Starts threads that exit as soon as they've counted their block, one after the other. */
+	void* startExitingThreads( void* )
+	{
+		for( size_t index=0; index<threadsPerStarter; ++index )
+		{
+			pthread_t thread;
+			pthread_create( &thread, NULL, &countAndExit, NULL );
+			pthread_join( thread, NULL );
+		}
+		return NULL;
+	}
+
+	bool namedTotals( size_t (*memcounterNamedTotals)( MemcounterNamedTotals*, size_t, size_t ), const char* name, MemcounterNamedTotals& result )
+	{
+		MemcounterNamedTotals totals[64];
+		size_t numberOfNames=memcounterNamedTotals( totals, 64, sizeof(MemcounterNamedTotals) );
+		for( size_t index=0; index<numberOfNames && index<64; ++index )
+		{
+			if( strcmp( totals[index].name, name )==0 )
+			{
+				result=totals[index];
+				return true;
+			}
+		}
+		return false;
+	}
+}
+
+/*
+ * The named totals have to include threads that are still running, as well as the calling thread
+ * and the ones that have exited.
+ */
+int main()
+{
+	size_t (*memcounterNamedTotals)( MemcounterNamedTotals*, size_t, size_t )=NULL;
+	if( !memcountertest::findFunction( createNamedMemoryCounter, "createNamedMemoryCounter" )
+		|| !memcountertest::findFunction( memcounterNamedTotals, "memcounterNamedTotals" ) ) return memcountertest::result();
+
+	createNamedMemoryCounter( "namedTotalsTest" )->enable();
+	void* volatile pBlock=malloc( 50 );
+	createNamedMemoryCounter( "namedTotalsTest" )->disable();
+
+	pthread_barrier_init( &barrier, NULL, numberOfThreads+1 );
+	pthread_t threads[numberOfThreads];
+	for( size_t index=0; index<numberOfThreads; ++index ) pthread_create( &threads[index], NULL, &countAndWait, reinterpret_cast<void*>(index) );
+	pthread_barrier_wait( &barrier );
+
+	// Everything's still running, and each thread has one block of 1000 times one more than its index
+	MemcounterNamedTotals totals;
+	if( TEST_CHECK( namedTotals( memcounterNamedTotals, "namedTotalsTest", totals ) ) )
+	{
+		TEST_CHECK( totals.numberOfThreads==numberOfThreads+1 );
+		TEST_CHECK( totals.currentSize==50+1000+2000+3000+4000 );
+		TEST_CHECK( totals.currentNumberOfAllocations==long(numberOfThreads+1) );
+	}
+
+	pthread_barrier_wait( &barrier );
+	for( size_t index=0; index<numberOfThreads; ++index ) pthread_join( threads[index], NULL );
+
+	// Threads 0 and 2 freed theirs before exiting
+	if( TEST_CHECK( namedTotals( memcounterNamedTotals, "namedTotalsTest", totals ) ) )
+	{
+		TEST_CHECK( totals.numberOfThreads==numberOfThreads+1 );
+		TEST_CHECK( totals.currentSize==50+2000+4000 );
+		TEST_CHECK( totals.maximumSize==50+1000+2000+3000+4000 );
+	}
+
+	createNamedMemoryCounter( "namedTotalsTest" )->enable();
+	free( pBlock );
+	createNamedMemoryCounter( "namedTotalsTest" )->disable();
+
+	// Threads that exit while the totals are being read. None of them free their block, so the totals can
+	// only go up. A thread that's part way through exiting mustn't be missed out, or counted twice.
+	pthread_t starters[numberOfStarters];
+	for( size_t index=0; index<numberOfStarters; ++index ) pthread_create( &starters[index], NULL, &startExitingThreads, NULL );
+	long int lastSize=0;
+	uint32_t lastNumberOfThreads=0;
+	size_t numberOfReads=0, numberOfDecreases=0, numberOfBadSizes=0;
+	// Stops after a read that sees every thread, so there's always at least one after they've all exited
+	while( lastNumberOfThreads<numberOfExitingThreads )
+	{
+		if( !namedTotals( memcounterNamedTotals, "namedTotalsChurn", totals ) ) continue;
+		++numberOfReads;
+		if( totals.currentSize<lastSize || totals.numberOfThreads<lastNumberOfThreads ) ++numberOfDecreases;
+		if( totals.currentSize%1000!=0 || totals.currentSize>long(totals.numberOfThreads)*1000 ) ++numberOfBadSizes;
+		lastSize=totals.currentSize;
+		lastNumberOfThreads=totals.numberOfThreads;
+	}
+	for( size_t index=0; index<numberOfStarters; ++index ) pthread_join( starters[index], NULL );
+	std::cout << numberOfReads << " reads of the totals while threads were exiting" << std::endl;
+	TEST_CHECK( numberOfDecreases==0 );
+	TEST_CHECK( numberOfBadSizes==0 );
+	TEST_CHECK( lastNumberOfThreads==numberOfExitingThreads );
+	TEST_CHECK( lastSize==long(numberOfExitingThreads)*1000 );
+
+	return memcountertest::result();
+}
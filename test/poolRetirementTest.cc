@@ -0,0 +1,86 @@
+#include "memcounter/IMemoryCounter.h"
+#include "memcounter/CInterface.h"
+#include "TestUtilities.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+namespace // Use the unnamed namespace
+{
+	const size_t numberOfThreads=50;
+	void* pBlocks[numberOfThreads];
+	memcounter::IMemoryCounter* pGlobalCounter;
+	memcounter::IMemoryCounter* (*createNamedMemoryCounter)( const char* name );
+
+	/** @brief Allocates a block and exits without freeing it or disabling anything. */
+	void* leakAndExit( void* pArgument )
+	{
+		size_t index=reinterpret_cast<size_t>( pArgument );
+		pGlobalCounter->enable();
+		createNamedMemoryCounter( "retirementTestWorker" )->enable();
+		pBlocks[index]=malloc( 1000 );
+		return NULL;
+	}
+
+	/** @brief Finds the totals for the name, or returns false if it's not there. */
+	bool namedTotals( size_t (*memcounterNamedTotals)( MemcounterNamedTotals*, size_t, size_t ), const char* name, MemcounterNamedTotals& result )
+	{
+		MemcounterNamedTotals totals[64];
+		size_t numberOfNames=memcounterNamedTotals( totals, 64, sizeof(MemcounterNamedTotals) );
+		for( size_t index=0; index<numberOfNames && index<64; ++index )
+		{
+			if( strcmp( totals[index].name, name )==0 )
+			{
+				result=totals[index];
+				return true;
+			}
+		}
+		return false;
+	}
+}
+
+/*
+ * Run with MEMCOUNTER_CROSS_THREAD_FREES=1. Threads exit one after the other with their counters still
+ * enabled, so each one's pool is retired and then reused by the next. What they counted has to stay
+ * in the global and named totals, and frees of their blocks afterwards have to come off the global counter.
+ */
+int main()
+{
+	using memcounter::IMemoryCounter;
+
+	IMemoryCounter* (*createNewGlobalMemoryCounter)( void )=NULL;
+	size_t (*memcounterNamedTotals)( MemcounterNamedTotals*, size_t, size_t )=NULL;
+	if( !memcountertest::findFunction( createNewGlobalMemoryCounter, "createNewGlobalMemoryCounter" )
+		|| !memcountertest::findFunction( createNamedMemoryCounter, "createNamedMemoryCounter" )
+		|| !memcountertest::findFunction( memcounterNamedTotals, "memcounterNamedTotals" ) ) return memcountertest::result();
+
+	pGlobalCounter=createNewGlobalMemoryCounter();
+	for( size_t index=0; index<numberOfThreads; ++index )
+	{
+		pthread_t thread;
+		pthread_create( &thread, NULL, &leakAndExit, reinterpret_cast<void*>(index) );
+		pthread_join( thread, NULL );
+	}
+
+	TEST_CHECK( pGlobalCounter->currentSize()==long(numberOfThreads*1000) );
+	TEST_CHECK( pGlobalCounter->currentNumberOfAllocations()==long(numberOfThreads) );
+	TEST_CHECK( pGlobalCounter->maximumSize()==long(numberOfThreads*1000) );
+
+	MemcounterNamedTotals totals;
+	if( TEST_CHECK( namedTotals( memcounterNamedTotals, "retirementTestWorker", totals ) ) )
+	{
+		TEST_CHECK( totals.numberOfThreads==numberOfThreads );
+		TEST_CHECK( totals.currentSize==long(numberOfThreads*1000) );
+		TEST_CHECK( totals.currentNumberOfAllocations==long(numberOfThreads) );
+	}
+
+	// The threads have gone, so the frees come off what they left in the global counter
+	for( size_t index=0; index<numberOfThreads; ++index ) free( pBlocks[index] );
+	TEST_CHECK( pGlobalCounter->currentSize()==0 );
+	TEST_CHECK( pGlobalCounter->currentNumberOfAllocations()==0 );
+	TEST_CHECK( pGlobalCounter->maximumSize()==long(numberOfThreads*1000) );
+
+	return memcountertest::result();
+}
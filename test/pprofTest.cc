@@ -0,0 +1,266 @@
+#include "memcounter/IMemoryCounter.h"
+#include "TestUtilities.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <map>
+#include <string>
+#include <vector>
+
+
+namespace // Use the unnamed namespace
+{
+	memcounter::IMemoryCounter* (*createNewMemoryCounter)( void )=NULL;
+	memcounter::IMemoryCounter* (*createNamedMemoryCounter)( const char* name )=NULL;
+	bool (*writeProfile)( int fileDescriptor )=NULL;
+	bool (*writeCounterProfile)( memcounter::IMemoryCounter* pCounter, int fileDescriptor )=NULL;
+
+	/** @brief Reads one protocol buffers message, field by field. Only what the profile uses is handled, anything else stops it. */
+	class ProtobufReader
+	{
+	public:
+		ProtobufReader( const std::string& data ) : data_(data), position_(0), failed_(false) {}
+
+		/** @brief Moves on to the next field, and returns false if there isn't one or the message is broken. */
+		bool next()
+		{
+			if( failed_ || position_>=data_.size() ) return false;
+			uint64_t tag=varint();
+			field_=uint32_t( tag>>3 );
+			if( ( tag & 7 )==0 ) value_=varint();
+			else if( ( tag & 7 )==2 )
+			{
+				uint64_t length=varint();
+				if( length>data_.size()-position_ ) failed_=true;
+				else
+				{
+					bytes_=data_.substr( position_, length );
+					position_+=length;
+				}
+			}
+			else failed_=true; // HeapProfile only writes varints and length delimited fields
+			return !failed_;
+		}
+
+		inline uint32_t field() const { return field_; }
+		inline uint64_t value() const { return value_; }
+		inline const std::string& bytes() const { return bytes_; }
+		/** @brief True if the whole message was read without finding anything wrong. */
+		inline bool finished() const { return !failed_ && position_==data_.size(); }
+
+		/** @brief The values of a packed repeated field. */
+		static std::vector<uint64_t> packedVarints( const std::string& bytes )
+		{
+			ProtobufReader reader( bytes );
+			std::vector<uint64_t> values;
+			while( !reader.failed_ && reader.position_<bytes.size() ) values.push_back( reader.varint() );
+			TEST_CHECK( !reader.failed_ );
+			return values;
+		}
+	protected:
+		uint64_t varint()
+		{
+			uint64_t result=0;
+			for( int shift=0; shift<64 && position_<data_.size(); shift+=7 )
+			{
+				unsigned char byte=data_[position_++];
+				result|=uint64_t( byte & 0x7f )<<shift;
+				if( !( byte & 0x80 ) ) return result;
+			}
+			failed_=true;
+			return 0;
+		}
+
+		const std::string data_;
+		size_t position_;
+		bool failed_;
+		uint32_t field_;
+		uint64_t value_;
+		std::string bytes_;
+	};
+
+	/** @brief What's needed from one Sample message. */
+	struct Sample
+	{
+		size_t numberOfLocations;
+		std::vector<uint64_t> values;
+		std::string counterName;
+		uint64_t thread;
+	};
+
+	/** @brief The sample type names and the samples, with the label strings looked up. */
+	struct Profile
+	{
+		std::vector<std::string> sampleTypes;
+		std::vector<Sample> samples;
+	};
+
+	/** @brief Decodes the profile.proto fields the checks need. Returns false if the message couldn't be read. */
+	bool decodeProfile( const std::string& data, Profile& profile )
+	{
+		std::vector<std::string> strings;
+		std::vector<uint64_t> sampleTypeIndices;
+		std::vector<std::string> sampleMessages;
+		ProtobufReader reader( data );
+		while( reader.next() )
+		{
+			if( reader.field()==6 ) strings.push_back( reader.bytes() ); // string_table
+			else if( reader.field()==2 ) sampleMessages.push_back( reader.bytes() ); // sample
+			else if( reader.field()==1 ) // sample_type
+			{
+				ProtobufReader valueType( reader.bytes() );
+				while( valueType.next() ) if( valueType.field()==1 ) sampleTypeIndices.push_back( valueType.value() );
+			}
+		}
+		if( !reader.finished() || strings.empty() || !strings[0].empty() ) return false;
+
+		for( size_t index=0; index<sampleTypeIndices.size(); ++index )
+		{
+			if( sampleTypeIndices[index]>=strings.size() ) return false;
+			profile.sampleTypes.push_back( strings[sampleTypeIndices[index]] );
+		}
+		for( size_t index=0; index<sampleMessages.size(); ++index )
+		{
+			Sample sample;
+			sample.numberOfLocations=0;
+			sample.thread=0;
+			ProtobufReader sampleReader( sampleMessages[index] );
+			while( sampleReader.next() )
+			{
+				if( sampleReader.field()==1 ) sample.numberOfLocations+=ProtobufReader::packedVarints( sampleReader.bytes() ).size();
+				else if( sampleReader.field()==2 ) sample.values=ProtobufReader::packedVarints( sampleReader.bytes() );
+				else if( sampleReader.field()==3 )
+				{
+					uint64_t key=0, text=0, number=0;
+					ProtobufReader label( sampleReader.bytes() );
+					while( label.next() )
+					{
+						if( label.field()==1 ) key=label.value();
+						else if( label.field()==2 ) text=label.value();
+						else if( label.field()==3 ) number=label.value();
+					}
+					if( key>=strings.size() || text>=strings.size() ) return false;
+					if( strings[key]=="counter" ) sample.counterName=strings[text];
+					else if( strings[key]=="thread" ) sample.thread=number;
+				}
+			}
+			if( !sampleReader.finished() ) return false;
+			profile.samples.push_back( sample );
+		}
+		return true;
+	}
+
+	/** @brief Writes a profile with the function to a temporary file, reads it back and decodes it. */
+	template<class WriteFunction>
+	bool writeAndDecode( WriteFunction write, Profile& profile )
+	{
+		char filename[]="/tmp/pprofTestXXXXXX";
+		int fileDescriptor=mkstemp( filename );
+		if( !TEST_CHECK( fileDescriptor>=0 ) ) return false;
+		unlink( filename );
+		bool written=write( fileDescriptor );
+
+		std::string data;
+		char buffer[4096];
+		ssize_t size;
+		lseek( fileDescriptor, 0, SEEK_SET );
+		while( ( size=read( fileDescriptor, buffer, sizeof(buffer) ) )>0 ) data.append( buffer, size );
+		close( fileDescriptor );
+		return TEST_CHECK( written ) && TEST_CHECK( decodeProfile( data, profile ) );
+	}
+
+	memcounter::IMemoryCounter* pNamedCounter=NULL;
+	bool writeNamedCounterProfile( int fileDescriptor ) { return writeCounterProfile( pNamedCounter, fileDescriptor ); }
+
+	/** @brief Adds up the values of every sample labelled with the counter name, and returns how many there were. */
+	size_t sampleTotals( const Profile& profile, const std::string& counterName, uint64_t (&totals)[4] )
+	{
+		size_t numberOfSamples=0;
+		for( size_t index=0; index<4; ++index ) totals[index]=0;
+		for( std::vector<Sample>::const_iterator iSample=profile.samples.begin(); iSample!=profile.samples.end(); ++iSample )
+		{
+			if( iSample->counterName!=counterName ) continue;
+			++numberOfSamples;
+			TEST_CHECK( iSample->thread==1 );
+			if( !TEST_CHECK( iSample->values.size()==4 ) ) continue;
+			for( size_t index=0; index<4; ++index ) totals[index]+=iSample->values[index];
+		}
+		return numberOfSamples;
+	}
+
+	// Two different places to allocate from, so that there are two call sites when they're recorded
+	void* __attribute__((noinline)) allocateFirst( size_t size ) { return malloc( size ); }
+	void* __attribute__((noinline)) allocateSecond( size_t size ) { return malloc( size ); }
+}
+
+/*
+ * Writes heap profiles with writeMemoryCounterProfile and writeHeapProfile, decodes the protocol buffers
+ * that come out, and checks the sample values against what was allocated. It's run both with and without
+ * MEMCOUNTER_CALLSITE_DEPTH; the samples are split by call site in the first case and one per counter in
+ * the second, but they have to add up to the same.
+ */
+int main()
+{
+	if( !memcountertest::findFunction( createNewMemoryCounter, "createNewMemoryCounter" )
+		|| !memcountertest::findFunction( createNamedMemoryCounter, "createNamedMemoryCounter" )
+		|| !memcountertest::findFunction( writeProfile, "writeHeapProfile" )
+		|| !memcountertest::findFunction( writeCounterProfile, "writeMemoryCounterProfile" ) ) return memcountertest::result();
+	const bool callSitesRecorded=( getenv( "MEMCOUNTER_CALLSITE_DEPTH" )!=NULL );
+
+	// Three blocks of 1000 and two of 500, then one of the 1000s freed
+	pNamedCounter=createNamedMemoryCounter( "pprofTestNamed" );
+	pNamedCounter->enable();
+	// volatile, otherwise the compiler is free to remove a malloc and free pair completely
+	void* volatile pBlocks[5];
+	for( size_t index=0; index<3; ++index ) pBlocks[index]=allocateFirst( 1000 );
+	for( size_t index=3; index<5; ++index ) pBlocks[index]=allocateSecond( 500 );
+	free( pBlocks[0] );
+	pNamedCounter->disable();
+
+	// Nothing left in use, but the allocation still shows in the alloc_ values
+	memcounter::IMemoryCounter* pPlainCounter=createNewMemoryCounter();
+	pPlainCounter->enable();
+	void* volatile pFreedBlock=allocateFirst( 700 );
+	free( pFreedBlock );
+	pPlainCounter->disable();
+
+	Profile counterProfile;
+	if( writeAndDecode( &writeNamedCounterProfile, counterProfile ) )
+	{
+		TEST_CHECK( counterProfile.sampleTypes.size()==4 && counterProfile.sampleTypes[0]=="inuse_space" && counterProfile.sampleTypes[1]=="inuse_objects"
+				&& counterProfile.sampleTypes[2]=="alloc_space" && counterProfile.sampleTypes[3]=="alloc_objects" );
+		uint64_t totals[4];
+		size_t numberOfSamples=sampleTotals( counterProfile, "pprofTestNamed", totals );
+		// Only the one counter
+		TEST_CHECK( numberOfSamples==counterProfile.samples.size() );
+		TEST_CHECK( totals[0]==3000 && totals[1]==4 && totals[2]==4000 && totals[3]==5 );
+		// At least one for each function, more if the compiler unrolled the loops into more than one call each
+		if( callSitesRecorded ) TEST_CHECK( numberOfSamples>=2 );
+		else TEST_CHECK( numberOfSamples==1 );
+		for( size_t index=0; index<counterProfile.samples.size(); ++index )
+		{
+			TEST_CHECK( ( counterProfile.samples[index].numberOfLocations!=0 )==callSitesRecorded );
+		}
+	}
+
+	Profile threadProfile;
+	if( writeAndDecode( writeProfile, threadProfile ) )
+	{
+		uint64_t totals[4];
+		TEST_CHECK( sampleTotals( threadProfile, "pprofTestNamed", totals )!=0 );
+		TEST_CHECK( totals[0]==3000 && totals[1]==4 && totals[2]==4000 && totals[3]==5 );
+		// The plain counter hasn't got a name, so it's labelled with where it is in the pool's counters
+		size_t numberOfPlain=0;
+		for( std::vector<Sample>::const_iterator iSample=threadProfile.samples.begin(); iSample!=threadProfile.samples.end(); ++iSample )
+		{
+			if( iSample->counterName.compare( 0, 8, "counter " )!=0 || !TEST_CHECK( iSample->values.size()==4 ) ) continue;
+			TEST_CHECK( iSample->values[0]==0 && iSample->values[1]==0 && iSample->values[2]==700 && iSample->values[3]==1 );
+			++numberOfPlain;
+		}
+		TEST_CHECK( numberOfPlain==1 );
+	}
+
+	for( size_t index=1; index<5; ++index ) free( pBlocks[index] );
+	return memcountertest::result();
+}
@@ -0,0 +1,104 @@
+#include "memcounter/IMemoryCounter.h"
+#include "TestUtilities.h"
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <fstream>
+#include <sstream>
+#include <string>
+
+
+namespace // Use the unnamed namespace
+{
+	memcounter::IMemoryCounter* (*createNewMemoryCounter)( void );
+	memcounter::IMemoryCounter* (*createNewGlobalMemoryCounter)( void );
+	// volatile, otherwise the compiler is free to remove the mallocs
+	void* volatile pGlobalBlock;
+	void* volatile pBlock;
+
+	/** @brief Counts 500 bytes in a global counter and 1234 bytes in a counter that's left enabled, then ends the process. */
+	void countAndEnd( bool withSignal )
+	{
+		memcounter::IMemoryCounter* pGlobalCounter=createNewGlobalMemoryCounter();
+		pGlobalCounter->enable();
+		pGlobalBlock=malloc( 500 );
+		pGlobalCounter->disable();
+
+		memcounter::IMemoryCounter* pCounter=createNewMemoryCounter();
+		pCounter->enable();
+		pBlock=malloc( 1234 );
+
+		if( withSignal ) raise( SIGTERM );
+		exit( 7 );
+	}
+
+	/** @brief Runs countAndEnd in a child process and returns its status from waitpid. */
+	int runChild( bool withSignal, pid_t& childId )
+	{
+		childId=fork();
+		if( childId==0 ) countAndEnd( withSignal );
+		int status=0;
+		waitpid( childId, &status, 0 );
+		return status;
+	}
+
+	/** @brief Returns the part of the report from the line naming the process up to the next report, or an empty string if there isn't one. */
+	std::string reportFor( const std::string& reports, pid_t processId )
+	{
+		std::ostringstream heading;
+		heading << "memcounter - report for process " << processId << " on ";
+		size_t start=reports.find( heading.str() );
+		if( start==std::string::npos ) return std::string();
+		size_t end=reports.find( "memcounter - report for process", start+1 );
+		return reports.substr( start, end==std::string::npos ? std::string::npos : end-start );
+	}
+
+	void checkReport( const std::string& report )
+	{
+		TEST_CHECK( report.find( "thread 1 counter slot 0: size 1234 (maximum 1234), usable size " )!=std::string::npos );
+		TEST_CHECK( report.find( "allocations 1 (maximum 1)\n" )!=std::string::npos );
+		TEST_CHECK( report.find( "global counter 0: size 500 (maximum 500), usable size " )!=std::string::npos );
+	}
+}
+
+/*
+ * Ends two child processes, one by calling exit and one with a signal, and checks that each appended
+ * a report to MEMCOUNTER_REPORT_FILE with the counters it had at the time.
+ */
+int main()
+{
+	if( !memcountertest::findFunction( createNewMemoryCounter, "createNewMemoryCounter" )
+		|| !memcountertest::findFunction( createNewGlobalMemoryCounter, "createNewGlobalMemoryCounter" ) ) return memcountertest::result();
+
+	const char* filename=getenv( "MEMCOUNTER_REPORT_FILE" );
+	if( !TEST_CHECK( filename!=NULL ) ) return memcountertest::result();
+	// Reports are appended, so get rid of the ones from the last run
+	unlink( filename );
+
+	pid_t exitingChild, signalledChild;
+	int exitStatus=runChild( false, exitingChild );
+	TEST_CHECK( WIFEXITED(exitStatus) && WEXITSTATUS(exitStatus)==7 );
+	// The report mustn't get in the way of the signal doing what it would have done anyway
+	int signalStatus=runChild( true, signalledChild );
+	TEST_CHECK( WIFSIGNALED(signalStatus) && WTERMSIG(signalStatus)==SIGTERM );
+
+	std::ifstream file( filename );
+	std::ostringstream contents;
+	contents << file.rdbuf();
+	const std::string reports=contents.str();
+
+	std::string exitReport=reportFor( reports, exitingChild );
+	TEST_CHECK( exitReport.find( " on exit with status 7\n" )!=std::string::npos );
+	checkReport( exitReport );
+
+	std::string signalReport=reportFor( reports, signalledChild );
+	std::ostringstream signalHeading;
+	signalHeading << " on signal " << SIGTERM << "\n";
+	TEST_CHECK( signalReport.find( signalHeading.str() )!=std::string::npos );
+	checkReport( signalReport );
+
+	return memcountertest::result();
+}
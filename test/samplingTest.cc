@@ -0,0 +1,69 @@
+#include "memcounter/IMemoryCounter.h"
+#include "TestUtilities.h"
+
+#include <stdlib.h>
+#include <vector>
+
+
+namespace // Use the unnamed namespace
+{
+	/** @brief Whether the estimate is within the given fraction of the real value. */
+	bool isWithin( long int estimate, long int actual, double tolerance )
+	{
+		double difference=double(estimate-actual);
+		if( difference<0 ) difference=-difference;
+		return difference<=tolerance*double(actual);
+	}
+}
+
+/*
+ * Run with MEMCOUNTER_SAMPLING_INTERVAL=4096. Sampling is random, so the sizes and numbers of
+ * allocations can only be checked against a tolerance. The tolerances here are about four
+ * standard deviations for these allocations, so a failure means the estimate is biased rather
+ * than unlucky. Frees have to take off exactly what was added though.
+ */
+int main()
+{
+	using memcounter::IMemoryCounter;
+
+	IMemoryCounter* (*createNewMemoryCounter)( void )=NULL;
+	bool (*setSamplingInterval)( size_t )=NULL;
+	if( !memcountertest::findFunction( createNewMemoryCounter, "createNewMemoryCounter" ) ) return memcountertest::result();
+	if( !memcountertest::findFunction( setSamplingInterval, "setSamplingInterval" ) ) return memcountertest::result();
+
+	const size_t sizes[]={ 16, 64, 256, 1000, 4000 };
+	const size_t numberOfSizes=sizeof(sizes)/sizeof(sizes[0]);
+	const size_t numberOfBlocks=50000;
+	std::vector<void*> blocks( numberOfBlocks );
+	long int totalSize=0;
+
+	IMemoryCounter* pCounter=createNewMemoryCounter();
+	pCounter->enable();
+	for( size_t index=0; index<numberOfBlocks; ++index )
+	{
+		blocks[index]=malloc( sizes[index%numberOfSizes] );
+		totalSize+=sizes[index%numberOfSizes];
+	}
+	long int estimatedSize=pCounter->currentSize();
+	long int estimatedNumber=pCounter->currentNumberOfAllocations();
+	std::cout << "Estimated " << estimatedSize << " bytes in " << estimatedNumber << " blocks, actually "
+		<< totalSize << " bytes in " << numberOfBlocks << " blocks" << std::endl;
+	TEST_CHECK( isWithin( estimatedSize, totalSize, 0.05 ) );
+	TEST_CHECK( isWithin( estimatedNumber, numberOfBlocks, 0.15 ) );
+	TEST_CHECK( pCounter->maximumSize()==estimatedSize );
+
+	for( size_t index=0; index<numberOfBlocks; ++index ) free( blocks[index] );
+	TEST_CHECK( pCounter->currentSize()==0 );
+	TEST_CHECK( pCounter->currentNumberOfAllocations()==0 );
+
+	// Switching sampling off while running makes every allocation count as itself again
+	TEST_CHECK( setSamplingInterval( 0 ) );
+	for( size_t index=0; index<numberOfSizes; ++index ) blocks[index]=malloc( sizes[index] );
+	TEST_CHECK( pCounter->currentSize()==16+64+256+1000+4000 );
+	TEST_CHECK( pCounter->currentNumberOfAllocations()==long(numberOfSizes) );
+	for( size_t index=0; index<numberOfSizes; ++index ) free( blocks[index] );
+	TEST_CHECK( pCounter->currentSize()==0 );
+	pCounter->disable();
+
+	return memcountertest::result();
+}
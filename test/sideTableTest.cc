@@ -0,0 +1,170 @@
+#include "memcounter/BlockSideTable.h"
+#include "TestUtilities.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+#include <vector>
+
+
+namespace // Use the unnamed namespace
+{
+	/** @brief A block address that looks like a real one, i.e. sixteen byte aligned. */
+	inline const void* address( uint64_t number )
+	{
+		return reinterpret_cast<const void*>( uintptr_t(0x10000000)+uintptr_t(number)*16 );
+	}
+
+	inline uint64_t nanoseconds()
+	{
+		timespec time;
+		clock_gettime( CLOCK_MONOTONIC, &time );
+		return uint64_t(time.tv_sec)*1000000000+time.tv_nsec;
+	}
+
+	memcounter::BlockDetails detailsFor( uint64_t number )
+	{
+		memcounter::BlockDetails details={ size_t(number*3+1), 1, uint32_t(number), uint32_t(number>>8), number };
+		return details;
+	}
+
+	/** @brief Time taken to look up blocks that aren't in the table, in nanoseconds per lookup. */
+	double timeMisses( memcounter::BlockSideTable& table, uint64_t firstNumber, size_t numberOfLookups )
+	{
+		memcounter::BlockDetails details;
+		size_t found=0;
+		uint64_t startTime=nanoseconds();
+		for( size_t index=0; index<numberOfLookups; ++index ) found+=table.erase( address( firstNumber+index ), details );
+		uint64_t endTime=nanoseconds();
+		TEST_CHECK( found==0 );
+		return double(endTime-startTime)/double(numberOfLookups);
+	}
+
+	struct ThreadArguments
+	{
+		memcounter::BlockSideTable* pTable;
+		uint64_t firstNumber;
+		size_t numberOfBlocks;
+		size_t numberOfErrors;
+	};
+
+	/** @brief Fills and empties the table with blocks nobody else uses, over and over, and counts anything that goes wrong. */
+	void* churnThread( void* pArguments )
+	{
+		ThreadArguments& arguments=*static_cast<ThreadArguments*>( pArguments );
+		for( int repeat=0; repeat<50; ++repeat )
+		{
+			for( size_t index=0; index<arguments.numberOfBlocks; ++index )
+			{
+				if( !arguments.pTable->insert( address( arguments.firstNumber+index ), detailsFor( arguments.firstNumber+index ) ) ) ++arguments.numberOfErrors;
+			}
+			for( size_t index=0; index<arguments.numberOfBlocks; ++index )
+			{
+				memcounter::BlockDetails details;
+				uint64_t number=arguments.firstNumber+index;
+				if( !arguments.pTable->erase( address( number ), details ) || details.size!=detailsFor( number ).size || details.allocationTime!=number ) ++arguments.numberOfErrors;
+			}
+		}
+		return NULL;
+	}
+}
+
+/*
+ * Tests of the block side table on its own, without the hooks.
+ */
+int main()
+{
+	const size_t capacity=262144;
+
+	// Basic insert and erase, including erasing things that aren't there
+	{
+		memcounter::BlockSideTable table;
+		TEST_CHECK( table.initialise( capacity ) );
+		for( uint64_t number=0; number<1000; ++number ) TEST_CHECK( table.insert( address( number ), detailsFor( number ) ) );
+		TEST_CHECK( table.statistics().liveEntries==1000 );
+
+		memcounter::BlockDetails details;
+		TEST_CHECK( !table.erase( address( 5000 ), details ) );
+		for( uint64_t number=0; number<1000; ++number )
+		{
+			TEST_CHECK( table.erase( address( number ), details ) && details.size==detailsFor( number ).size && details.callSite==uint32_t(number) );
+		}
+		TEST_CHECK( !table.erase( address( 10 ), details ) );
+		TEST_CHECK( table.statistics().liveEntries==0 );
+	}
+
+	// Erase half of a nearly full table in a scattered order. Entries move back into the gaps, so
+	// everything left has to still be found with the right details.
+	{
+		memcounter::BlockSideTable table;
+		table.initialise( capacity );
+		const size_t numberOfBlocks=capacity*3/4;
+		for( uint64_t number=0; number<numberOfBlocks; ++number ) table.insert( address( number ), detailsFor( number ) );
+		memcounter::BlockSideTable::Statistics full=table.statistics();
+		TEST_CHECK( full.liveEntries+full.failedInserts==numberOfBlocks );
+		TEST_CHECK( full.failedInserts==0 );
+
+		memcounter::BlockDetails details;
+		size_t wrong=0;
+		for( uint64_t step=0; step<numberOfBlocks; ++step )
+		{
+			uint64_t number=( step*7919 )%numberOfBlocks; // 7919 is prime, so this visits every block once
+			if( number%2==0 && !table.erase( address( number ), details ) ) ++wrong;
+		}
+		for( uint64_t number=0; number<numberOfBlocks; ++number )
+		{
+			bool wasErased=table.erase( address( number ), details );
+			if( wasErased!=( number%2==1 ) || ( wasErased && details.allocationTime!=number ) ) ++wrong;
+		}
+		TEST_CHECK( wrong==0 );
+		TEST_CHECK( table.statistics().liveEntries==0 );
+	}
+
+	// After a lot of churn the table has to be as quick to search as a new one. Erased entries used
+	// to be left as tombstones, which made every lookup of an untracked block scan a whole shard.
+	{
+		memcounter::BlockSideTable table;
+		table.initialise( capacity );
+		double freshMiss=timeMisses( table, 10*capacity, 100000 );
+
+		for( uint64_t round=0; round<20; ++round )
+		{
+			uint64_t firstNumber=round*capacity/2;
+			for( uint64_t number=firstNumber; number<firstNumber+capacity/2; ++number ) table.insert( address( number ), detailsFor( number ) );
+			memcounter::BlockDetails details;
+			for( uint64_t number=firstNumber; number<firstNumber+capacity/2; ++number ) table.erase( address( number ), details );
+		}
+		memcounter::BlockSideTable::Statistics churned=table.statistics();
+		TEST_CHECK( churned.liveEntries==0 );
+		TEST_CHECK( churned.failedInserts==0 );
+		double churnedMiss=timeMisses( table, 10*capacity, 100000 );
+		std::cout << "Lookup of an untracked block: " << freshMiss << " ns in a new table, " << churnedMiss << " ns after churn" << std::endl;
+		// Generous, since the two should be about the same and scanning a shard is a hundred times slower
+		TEST_CHECK( churnedMiss<10*freshMiss+100 );
+	}
+
+	// Several threads inserting and erasing in the same table at once
+	{
+		memcounter::BlockSideTable table;
+		table.initialise( capacity );
+		const size_t numberOfThreads=4;
+		ThreadArguments arguments[numberOfThreads];
+		pthread_t threads[numberOfThreads];
+		for( size_t index=0; index<numberOfThreads; ++index )
+		{
+			ThreadArguments threadArguments={ &table, index*100000, 20000, 0 };
+			arguments[index]=threadArguments;
+			pthread_create( &threads[index], NULL, &churnThread, &arguments[index] );
+		}
+		size_t numberOfErrors=0;
+		for( size_t index=0; index<numberOfThreads; ++index )
+		{
+			pthread_join( threads[index], NULL );
+			numberOfErrors+=arguments[index].numberOfErrors;
+		}
+		TEST_CHECK( numberOfErrors==0 );
+		TEST_CHECK( table.statistics().liveEntries==0 );
+	}
+
+	return memcountertest::result();
+}
@@ -0,0 +1,81 @@
+#include "memcounter/IMemoryCounter.h"
+#include "memcounter/SizeHistogram.h"
+#include "TestUtilities.h"
+
+#include <stdlib.h>
+
+
+/*
+ * Checks the size class arithmetic on its own, then that a counter puts blocks in the classes
+ * it says they're in.
+ */
+int main()
+{
+	using memcounter::IMemoryCounter;
+	using memcounter::SizeHistogram;
+
+	// Every class has to start where the one before it ends, and every size has to round trip
+	// through its class, so the classes cover all sizes with no gaps or overlaps.
+	size_t wrong=0;
+	TEST_CHECK( SizeHistogram::lowestSize( 0 )==0 );
+	TEST_CHECK( SizeHistogram::highestSize( SizeHistogram::numberOfClasses-1 )==~size_t(0) );
+	TEST_CHECK( SizeHistogram::sizeClass( ~size_t(0) )==SizeHistogram::numberOfClasses-1 );
+	for( size_t sizeClass=0; sizeClass<SizeHistogram::numberOfClasses; ++sizeClass )
+	{
+		size_t lowest=SizeHistogram::lowestSize( sizeClass );
+		size_t highest=SizeHistogram::highestSize( sizeClass );
+		if( SizeHistogram::sizeClass( lowest )!=sizeClass || SizeHistogram::sizeClass( highest )!=sizeClass ) ++wrong;
+		if( sizeClass>0 && lowest!=SizeHistogram::highestSize( sizeClass-1 )+1 ) ++wrong;
+		// No more than 25% wide once past the classes that hold a single size
+		if( highest!=lowest && double(highest-lowest+1)>0.25*double(lowest)+0.5 ) ++wrong;
+	}
+	TEST_CHECK( wrong==0 );
+	for( size_t size=0; size<100000; ++size )
+	{
+		size_t sizeClass=SizeHistogram::sizeClass( size );
+		if( size<SizeHistogram::lowestSize( sizeClass ) || size>SizeHistogram::highestSize( sizeClass ) ) ++wrong;
+	}
+	TEST_CHECK( wrong==0 );
+
+	IMemoryCounter* (*createNewMemoryCounter)( void );
+	if( !memcountertest::findFunction( createNewMemoryCounter, "createNewMemoryCounter" ) ) return memcountertest::result();
+
+	// Sizes either side of the edges of a class
+	const size_t sizes[]={ 0, 7, 8, 9, 10, 11, 12, 1023, 1024, 1279, 1280 };
+	const size_t numberOfBlocks=sizeof(sizes)/sizeof(sizes[0]);
+	void* pBlocks[numberOfBlocks];
+
+	IMemoryCounter* pCounter=createNewMemoryCounter();
+	pCounter->enable();
+	for( size_t index=0; index<numberOfBlocks; ++index ) pBlocks[index]=malloc( sizes[index] );
+	free( pBlocks[numberOfBlocks-1] );
+	std::vector<memcounter::SizeClassCounts> histogram=pCounter->sizeHistogram();
+	pCounter->disable();
+
+	TEST_CHECK( histogram.size()==SizeHistogram::sizeClass( 1280 )+1 );
+	long int expectedAllocations[SizeHistogram::numberOfClasses]={ 0 };
+	long int expectedBytes[SizeHistogram::numberOfClasses]={ 0 };
+	for( size_t index=0; index<numberOfBlocks; ++index )
+	{
+		++expectedAllocations[SizeHistogram::sizeClass( sizes[index] )];
+		expectedBytes[SizeHistogram::sizeClass( sizes[index] )]+=sizes[index];
+	}
+	for( size_t sizeClass=0; sizeClass<histogram.size(); ++sizeClass )
+	{
+		const memcounter::SizeClassCounts& counts=histogram[sizeClass];
+		if( counts.lowestSize!=SizeHistogram::lowestSize( sizeClass ) || counts.highestSize!=SizeHistogram::highestSize( sizeClass ) ) ++wrong;
+		if( counts.totalAllocations!=expectedAllocations[sizeClass] || counts.totalBytes!=expectedBytes[sizeClass] ) ++wrong;
+	}
+	TEST_CHECK( wrong==0 );
+	// 8 and 9 share a class, 1280 is the start of a new one and has been freed
+	TEST_CHECK( SizeHistogram::sizeClass( 8 )==SizeHistogram::sizeClass( 9 ) );
+	TEST_CHECK( SizeHistogram::sizeClass( 1279 )+1==SizeHistogram::sizeClass( 1280 ) );
+	TEST_CHECK( histogram.back().totalAllocations==1 && histogram.back().currentAllocations==0 && histogram.back().currentBytes==0 );
+	TEST_CHECK( histogram[SizeHistogram::sizeClass( 1024 )].currentBytes==1024+1279 );
+
+	pCounter->enable();
+	for( size_t index=0; index<numberOfBlocks-1; ++index ) free( pBlocks[index] );
+	pCounter->disable();
+
+	return memcountertest::result();
+}
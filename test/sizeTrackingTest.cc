@@ -0,0 +1,107 @@
+#include "memcounter/IMemoryCounter.h"
+#include "TestUtilities.h"
+
+#include <malloc.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+/*
+ * Checks what a counter reports for the same allocations with each MEMCOUNTER_SIZE_TRACKING
+ * method. ctest runs it once for each. With headers or the side table the counter has the sizes
+ * that were asked for, in usable mode it has what malloc_usable_size says for the blocks. Usable
+ * mode can't tell which blocks were counted, so it's also checked that it does what the README
+ * says for blocks it didn't count.
+ */
+int main()
+{
+	using memcounter::IMemoryCounter;
+
+	IMemoryCounter* (*createNewMemoryCounter)( void );
+	if( !memcountertest::findFunction( createNewMemoryCounter, "createNewMemoryCounter" ) ) return memcountertest::result();
+
+	const char* mode=getenv( "MEMCOUNTER_SIZE_TRACKING" );
+	bool usableMode=( mode!=NULL && strcmp( mode, "usable" )==0 );
+
+	const size_t sizes[]={ 1, 13, 100, 1000, 4097, 100000 };
+	const size_t numberOfBlocks=sizeof(sizes)/sizeof(sizes[0]);
+	void* pBlocks[numberOfBlocks+2];
+
+	IMemoryCounter* pCounter=createNewMemoryCounter();
+	pCounter->enable();
+	for( size_t index=0; index<numberOfBlocks; ++index ) pBlocks[index]=malloc( sizes[index] );
+	pBlocks[numberOfBlocks]=calloc( 10, 30 );
+	void* pAligned=NULL;
+	int alignedResult=posix_memalign( &pAligned, 64, 200 );
+	pBlocks[numberOfBlocks+1]=pAligned;
+
+	long int currentSize=pCounter->currentSize();
+	long int currentUsableSize=pCounter->currentUsableSize();
+	long int numberOfAllocations=pCounter->currentNumberOfAllocations();
+
+	size_t requested=300+200, actualUsable=0;
+	for( size_t index=0; index<numberOfBlocks; ++index ) requested+=sizes[index];
+	// Only real malloc blocks can be given to malloc_usable_size, which they aren't if there's a header in front
+	if( usableMode ) for( size_t index=0; index<numberOfBlocks+2; ++index ) actualUsable+=malloc_usable_size( pBlocks[index] );
+
+	TEST_CHECK( alignedResult==0 && reinterpret_cast<uintptr_t>(pAligned)%64==0 );
+	TEST_CHECK( numberOfAllocations==long(numberOfBlocks+2) );
+	if( usableMode )
+	{
+		TEST_CHECK( currentSize==currentUsableSize );
+		TEST_CHECK( currentUsableSize==long(actualUsable) );
+	}
+	else
+	{
+		TEST_CHECK( currentSize==long(requested) );
+		TEST_CHECK( currentUsableSize>=currentSize );
+	}
+
+	// Growing a block changes the size by the difference, and doesn't count as another allocation
+	size_t oldUsableSize=( usableMode ? malloc_usable_size( pBlocks[2] ) : 0 );
+	void* pGrown=realloc( pBlocks[2], 5000 );
+	if( pGrown ) pBlocks[2]=pGrown;
+	long int grownSize=pCounter->currentSize();
+	TEST_CHECK( pCounter->currentNumberOfAllocations()==long(numberOfBlocks+2) );
+	if( usableMode ) TEST_CHECK( grownSize==currentSize-long(oldUsableSize)+long(malloc_usable_size(pBlocks[2])) );
+	else TEST_CHECK( grownSize==currentSize+4900 );
+
+	for( size_t index=0; index<numberOfBlocks+2; ++index ) free( pBlocks[index] );
+	TEST_CHECK( pCounter->currentSize()==0 );
+	TEST_CHECK( pCounter->currentUsableSize()==0 );
+	TEST_CHECK( pCounter->currentNumberOfAllocations()==0 );
+	TEST_CHECK( pCounter->maximumSize()==grownSize );
+	pCounter->disable();
+
+	// Blocks allocated while the counter was disabled don't come off it when they're freed, apart
+	// from in usable mode where every block freed while counting does.
+	// volatile, otherwise the compiler is free to remove a malloc and free pair completely
+	void* volatile pUncounted=malloc( 64 );
+	long int uncountedUsableSize=long(malloc_usable_size( pUncounted ));
+	pCounter->enable();
+	free( pUncounted );
+	if( usableMode )
+	{
+		TEST_CHECK( pCounter->currentSize()==-uncountedUsableSize );
+		TEST_CHECK( pCounter->currentUsableSize()==-uncountedUsableSize );
+		TEST_CHECK( pCounter->currentNumberOfAllocations()==-1 );
+	}
+	else
+	{
+		TEST_CHECK( pCounter->currentSize()==0 );
+		TEST_CHECK( pCounter->currentNumberOfAllocations()==0 );
+	}
+	pCounter->disable();
+
+	// Frees while nothing is counting never come off, whatever the mode
+	pCounter->reset();
+	pCounter->enable();
+	void* volatile pCounted=malloc( 32 );
+	pCounter->disable();
+	free( pCounted );
+	TEST_CHECK( pCounter->currentNumberOfAllocations()==1 );
+	TEST_CHECK( pCounter->currentSize()>=32 );
+
+	return memcountertest::result();
+}
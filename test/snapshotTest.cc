@@ -0,0 +1,88 @@
+#include "memcounter/IMemoryCounter.h"
+#include "TestUtilities.h"
+
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+
+namespace // Use the unnamed namespace
+{
+	char filename[4096];
+	char contents[65536];
+
+	/**
+	 * @brief Asks for a snapshot and waits for the writer thread to append it to the file.
+	 *
+	 * Doesn't allocate anything, so that the counter that's enabled while it runs only has what the
+	 * test put in it. Returns the snapshot, or NULL if it takes too long.
+	 */
+	const char* takeSnapshot( int snapshotNumber )
+	{
+		char heading[256];
+		snprintf( heading, sizeof(heading), "memcounter - snapshot %d of process %ld at unix time ", snapshotNumber, long(getpid()) );
+		kill( getpid(), SIGUSR2 );
+
+		for( int attempt=0; attempt<5000; ++attempt )
+		{
+			int fileDescriptor=open( filename, O_RDONLY );
+			ssize_t size=( fileDescriptor<0 ? 0 : read( fileDescriptor, contents, sizeof(contents)-1 ) );
+			if( fileDescriptor>=0 ) close( fileDescriptor );
+			contents[size>0 ? size : 0]=0;
+			// Each snapshot finishes with a blank line, so one that's only partly written yet doesn't count
+			char* pStart=strstr( contents, heading );
+			char* pEnd=( pStart==NULL ? NULL : strstr( pStart, "\n\n" ) );
+			if( pEnd!=NULL )
+			{
+				pEnd[2]=0;
+				return pStart;
+			}
+			usleep( 1000 );
+		}
+		return NULL;
+	}
+}
+
+/*
+ * Sends itself SIGUSR2 twice with MEMCOUNTER_SNAPSHOT_FILE set, and checks that the program carries
+ * on and that each signal appends a snapshot of the counters as they were at the time.
+ */
+int main()
+{
+	memcounter::IMemoryCounter* (*createNewMemoryCounter)( void );
+	if( !memcountertest::findFunction( createNewMemoryCounter, "createNewMemoryCounter" ) ) return memcountertest::result();
+
+	const char* prefix=getenv( "MEMCOUNTER_SNAPSHOT_FILE" );
+	if( !TEST_CHECK( prefix!=NULL ) ) return memcountertest::result();
+	snprintf( filename, sizeof(filename), "%s.%ld", prefix, long(getpid()) );
+	// Snapshots are appended, so make sure there isn't one from an earlier process with the same id
+	unlink( filename );
+
+	memcounter::IMemoryCounter* pCounter=createNewMemoryCounter();
+	pCounter->enable();
+	// volatile, otherwise the compiler is free to remove a malloc and free pair completely
+	void* volatile pFirst=malloc( 1234 );
+	void* volatile pSecond=malloc( 766 );
+
+	const char* pSnapshot=takeSnapshot( 1 );
+	if( TEST_CHECK( pSnapshot!=NULL ) )
+	{
+		TEST_CHECK( strstr( pSnapshot, "\nthread 1 counter slot 0: size 2000 (maximum 2000), usable size " )!=NULL );
+		TEST_CHECK( strstr( pSnapshot, "allocations 2 (maximum 2)\n" )!=NULL );
+	}
+
+	free( pFirst );
+	pSnapshot=takeSnapshot( 2 );
+	if( TEST_CHECK( pSnapshot!=NULL ) )
+	{
+		TEST_CHECK( strstr( pSnapshot, "\nthread 1 counter slot 0: size 766 (maximum 2000), usable size " )!=NULL );
+		TEST_CHECK( strstr( pSnapshot, "allocations 1 (maximum 2)\n" )!=NULL );
+	}
+
+	pCounter->disable();
+	free( pSecond );
+	return memcountertest::result();
+}
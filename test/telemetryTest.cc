@@ -0,0 +1,155 @@
+#include "memcounter/IMemoryCounter.h"
+#include "memcounter/TelemetryFormat.h"
+#include "TestUtilities.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+namespace // Use the unnamed namespace
+{
+	const char* const counterName="telemetryTestNamed";
+	memcounter::IMemoryCounter* (*createNamedMemoryCounter)( const char* name );
+
+	/** @brief Counts a block that's never freed in a counter with the name, then exits. */
+	void* countAndExit( void* )
+	{
+		memcounter::IMemoryCounter* pCounter=createNamedMemoryCounter( counterName );
+		pCounter->enable();
+		// volatile, otherwise the compiler is free to remove the malloc
+		void* volatile pBlock=malloc( 2000 );
+		pCounter->disable();
+		return pBlock;
+	}
+
+	/** @brief Whether the name with the given id in the file is the test's counter name. */
+	bool isCounterName( const memcounter::TelemetryFileHeader& header, uint32_t nameId )
+	{
+		if( nameId==0 || nameId>header.maximumNumberOfNames ) return false;
+		const memcounter::LiveName& name=reinterpret_cast<const memcounter::LiveName*>( &header+1 )[nameId-1];
+		uint32_t length=__atomic_load_n( &name.length, __ATOMIC_ACQUIRE );
+		return length==strlen( counterName ) && memcmp( name.text, counterName, length )==0;
+	}
+
+	/** @brief Waits until the writer has finished another sample, and returns how many records have been written. Zero if it takes too long. */
+	uint64_t waitForSample( const memcounter::TelemetryFileHeader& header, uint64_t numberWritten )
+	{
+		for( int attempt=0; attempt<5000; ++attempt )
+		{
+			uint64_t newNumberWritten=__atomic_load_n( &header.numberOfRecordsWritten, __ATOMIC_ACQUIRE );
+			if( newNumberWritten!=numberWritten ) return newNumberWritten;
+			usleep( 1000 );
+		}
+		return 0;
+	}
+}
+
+/*
+ * Counts some blocks in a global counter, a plain counter and a named counter that's also used by a
+ * thread that has exited, then reads the telemetry file the library is writing while the program is
+ * still running. A sample taken after all that has to have a record for each with the right counts.
+ */
+int main()
+{
+	using memcounter::IMemoryCounter;
+
+	IMemoryCounter* (*createNewMemoryCounter)( void );
+	IMemoryCounter* (*createNewGlobalMemoryCounter)( void );
+	if( !memcountertest::findFunction( createNewMemoryCounter, "createNewMemoryCounter" )
+		|| !memcountertest::findFunction( createNewGlobalMemoryCounter, "createNewGlobalMemoryCounter" )
+		|| !memcountertest::findFunction( createNamedMemoryCounter, "createNamedMemoryCounter" ) ) return memcountertest::result();
+
+	const char* filename=getenv( "MEMCOUNTER_TELEMETRY_FILE" );
+	if( !TEST_CHECK( filename!=NULL ) ) return memcountertest::result();
+
+	pthread_t thread;
+	pthread_create( &thread, NULL, &countAndExit, NULL );
+	void* pThreadBlock;
+	pthread_join( thread, &pThreadBlock );
+
+	IMemoryCounter* pGlobalCounter=createNewGlobalMemoryCounter();
+	pGlobalCounter->enable();
+	// volatile, otherwise the compiler is free to remove a malloc and free pair completely
+	void* volatile pGlobalBlock=malloc( 500 );
+	pGlobalCounter->disable();
+
+	// Both stay enabled, so the named counter has the plain counter's block as well
+	IMemoryCounter* pNamedCounter=createNamedMemoryCounter( counterName );
+	pNamedCounter->enable();
+	void* volatile pNamedBlock=malloc( 3000 );
+	IMemoryCounter* pPlainCounter=createNewMemoryCounter();
+	pPlainCounter->enable();
+	void* volatile pPlainBlock=malloc( 1000 );
+
+	int fileDescriptor=open( filename, O_RDONLY );
+	struct stat fileStatus;
+	if( !TEST_CHECK( fileDescriptor>=0 && fstat( fileDescriptor, &fileStatus )==0 ) ) return memcountertest::result();
+	void* pMemory=mmap( NULL, fileStatus.st_size, PROT_READ, MAP_SHARED, fileDescriptor, 0 );
+	close( fileDescriptor );
+	if( !TEST_CHECK( pMemory!=MAP_FAILED ) ) return memcountertest::result();
+
+	const memcounter::TelemetryFileHeader& header=*static_cast<const memcounter::TelemetryFileHeader*>( pMemory );
+	TEST_CHECK( memcmp( header.magic, memcounter::telemetryMagic, sizeof(header.magic) )==0 );
+	TEST_CHECK( header.version==memcounter::telemetryVersion );
+	TEST_CHECK( header.recordSize==sizeof(memcounter::TelemetryRecord) );
+	TEST_CHECK( header.recordsOffset+header.capacity*sizeof(memcounter::TelemetryRecord)==uint64_t(fileStatus.st_size) );
+	const memcounter::TelemetryRecord* pRecords=reinterpret_cast<const memcounter::TelemetryRecord*>( static_cast<const char*>( pMemory )+header.recordsOffset );
+
+	// A sample that was already going when everything above finished might have missed some of it, so wait for the one after
+	uint64_t firstRecord=waitForSample( header, __atomic_load_n( &header.numberOfRecordsWritten, __ATOMIC_ACQUIRE ) );
+	uint64_t lastRecord=waitForSample( header, firstRecord );
+	if( !TEST_CHECK( firstRecord!=0 && lastRecord!=0 ) ) return memcountertest::result();
+	TEST_CHECK( lastRecord-firstRecord<=header.capacity );
+
+	size_t numberOfGlobal=0, numberOfPlain=0, numberOfNamed=0, numberOfNamedTotals=0;
+	for( uint64_t recordNumber=firstRecord; recordNumber<lastRecord; ++recordNumber )
+	{
+		memcounter::TelemetryRecord record=pRecords[recordNumber%header.capacity];
+		if( !TEST_CHECK( record.sequence==uint32_t(recordNumber+1) ) ) continue;
+
+		if( record.kind==memcounter::TelemetryRecord::globalCounter )
+		{
+			TEST_CHECK( record.currentSize==500 && record.maximumSize==500 );
+			TEST_CHECK( record.currentNumberOfAllocations==1 );
+			++numberOfGlobal;
+		}
+		else if( record.kind==memcounter::TelemetryRecord::threadCounter && record.nameId==0 )
+		{
+			TEST_CHECK( record.currentSize==1000 && record.currentNumberOfAllocations==1 );
+			TEST_CHECK( record.thread!=0 );
+			++numberOfPlain;
+		}
+		else if( record.kind==memcounter::TelemetryRecord::threadCounter )
+		{
+			TEST_CHECK( isCounterName( header, record.nameId ) );
+			TEST_CHECK( record.currentSize==4000 && record.currentNumberOfAllocations==2 );
+			++numberOfNamed;
+		}
+		else if( record.kind==memcounter::TelemetryRecord::namedTotal )
+		{
+			TEST_CHECK( isCounterName( header, record.nameId ) && record.counter==record.nameId );
+			TEST_CHECK( record.thread==2 );
+			TEST_CHECK( record.currentSize==6000 && record.currentNumberOfAllocations==3 );
+			++numberOfNamedTotals;
+		}
+		else TEST_CHECK( record.kind<=memcounter::TelemetryRecord::namedTotal );
+	}
+	TEST_CHECK( numberOfGlobal==1 );
+	TEST_CHECK( numberOfPlain==1 );
+	TEST_CHECK( numberOfNamed==1 );
+	TEST_CHECK( numberOfNamedTotals==1 );
+
+	pPlainCounter->disable();
+	pNamedCounter->disable();
+	free( pPlainBlock );
+	free( pNamedBlock );
+	free( pGlobalBlock );
+	free( pThreadBlock );
+	munmap( pMemory, fileStatus.st_size );
+	return memcountertest::result();
+}
@@ -0,0 +1,95 @@
+#include "memcounter/ThreadCounter.h"
+#include "TestUtilities.h"
+
+#include <stdlib.h>
+
+
+/*
+ * Switches ThreadCounters on and off with the inline client API, including nested scopes, and
+ * checks that a counter disabled behind the ThreadCounter's back is let go of properly, so that
+ * the ThreadCounter can't pause or unpause whichever counter gets the slot next.
+ */
+int main()
+{
+	if( memcounter::ThreadCounter::createFunction()==NULL )
+	{
+		std::cerr << "Couldn't find createNewClientMemoryCounter, the test has to be run with intrusiveMemoryAnalyser preloaded" << std::endl;
+		return 1;
+	}
+
+	memcounter::ThreadCounter first;
+	if( !TEST_CHECK( first.counter()!=NULL ) ) return memcountertest::result();
+	TEST_CHECK( !first.isEnabled() );
+	TEST_CHECK( !first.counter()->isEnabled() ); // a paused counter says it's disabled too
+
+	// volatile, otherwise the compiler is free to remove a malloc and free pair completely
+	void* volatile pBeforeAnyScope=malloc( 100 );
+	TEST_CHECK( first.counter()->currentSize()==0 );
+
+	void* volatile pInScope;
+	{
+		memcounter::ScopedCounter scope( first );
+		TEST_CHECK( first.isEnabled() );
+		pInScope=malloc( 200 );
+	}
+	TEST_CHECK( !first.isEnabled() );
+	void* volatile pAfterScope=malloc( 300 );
+	TEST_CHECK( first.counter()->currentSize()==200 );
+	TEST_CHECK( first.counter()->currentNumberOfAllocations()==1 );
+
+	// A scope inside code where the counter is already enabled leaves it enabled
+	first.enable();
+	{
+		memcounter::ScopedCounter outer( first );
+		memcounter::ScopedCounter inner( first );
+	}
+	TEST_CHECK( first.isEnabled() );
+	free( pInScope );
+	first.disable();
+	TEST_CHECK( first.counter()->currentSize()==0 );
+	TEST_CHECK( first.counter()->maximumSize()==200 );
+
+	// Each ThreadCounter only switches its own slot
+	memcounter::ThreadCounter second;
+	TEST_CHECK( second.counter()!=NULL );
+	void* volatile pSecondOnly;
+	{
+		memcounter::ScopedCounter scope( second );
+		pSecondOnly=malloc( 50 );
+	}
+	TEST_CHECK( second.counter()->currentSize()==50 );
+	TEST_CHECK( first.counter()->currentSize()==0 );
+
+	// Disabling the counter directly gives up the slot, and detaches it from the ThreadCounter
+	first.counter()->disable();
+	TEST_CHECK( !first.isEnabled() );
+	first.enable();
+	TEST_CHECK( !first.isEnabled() );
+	TEST_CHECK( !first.counter()->isEnabled() );
+
+	// The slot first had is free again, so this is likely to get it. first mustn't be able to pause it.
+	memcounter::ThreadCounter third;
+	TEST_CHECK( third.counter()!=NULL );
+	third.enable();
+	first.disable();
+	TEST_CHECK( third.isEnabled() );
+	void* volatile pThirdOnly=malloc( 10 );
+	third.disable();
+	TEST_CHECK( third.counter()->currentSize()==10 );
+	TEST_CHECK( first.counter()->currentSize()==0 );
+	TEST_CHECK( second.counter()->currentSize()==50 );
+
+	// The detached counter still works as an ordinary counter
+	first.counter()->enable();
+	void* volatile pDetached=malloc( 20 );
+	first.counter()->disable();
+	TEST_CHECK( first.counter()->currentSize()==20 );
+	TEST_CHECK( !first.isEnabled() );
+
+	free( pBeforeAnyScope );
+	free( pAfterScope );
+	free( pSecondOnly );
+	free( pThirdOnly );
+	free( pDetached );
+	return memcountertest::result();
+}
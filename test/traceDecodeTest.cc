@@ -0,0 +1,87 @@
+#include "memcounter/TraceFormat.h"
+#include "TestUtilities.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cstring>
+#include <map>
+#include <set>
+
+
+/*
+ * Decodes the trace written by traceTest with TraceChunkDecoder, and checks that it has exactly the
+ * events that traceTest made, in order within each thread. This is run on its own, not preloaded.
+ */
+int main( int argc, char* argv[] )
+{
+	if( argc!=2 )
+	{
+		std::cerr << "Usage: " << argv[0] << " <trace file>" << std::endl;
+		return 1;
+	}
+
+	int fileDescriptor=open( argv[1], O_RDONLY );
+	struct stat fileStatus;
+	if( !TEST_CHECK( fileDescriptor>=0 && fstat( fileDescriptor, &fileStatus )==0 ) ) return memcountertest::result();
+	if( !TEST_CHECK( size_t(fileStatus.st_size)>=sizeof(memcounter::TraceFileHeader) ) ) return memcountertest::result();
+	void* pMemory=mmap( NULL, fileStatus.st_size, PROT_READ, MAP_PRIVATE, fileDescriptor, 0 );
+	close( fileDescriptor );
+	if( !TEST_CHECK( pMemory!=MAP_FAILED ) ) return memcountertest::result();
+
+	const memcounter::TraceFileHeader& header=*static_cast<const memcounter::TraceFileHeader*>( pMemory );
+	TEST_CHECK( memcmp( header.magic, memcounter::traceMagic, sizeof(header.magic) )==0 );
+	TEST_CHECK( header.version==memcounter::traceVersion );
+	TEST_CHECK( header.chunkHeaderSize==sizeof(memcounter::TraceChunkHeader) );
+	TEST_CHECK( header.nanosecondsPerCycle>0 ); // only filled in if the program exited normally
+
+	std::map<memcounter::TraceEvent::Type,size_t> numberOfEvents;
+	std::map<uint64_t,size_t> numberOfAllocationsBySize;
+	std::set<uint32_t> threads;
+	std::map<uint32_t,uint64_t> lastCycles; // by thread
+	size_t numberWithoutCounters=0;
+
+	const uint8_t* pPosition=static_cast<const uint8_t*>( pMemory )+sizeof(memcounter::TraceFileHeader);
+	const uint8_t* pEnd=static_cast<const uint8_t*>( pMemory )+fileStatus.st_size;
+	while( pPosition<pEnd )
+	{
+		if( !TEST_CHECK( size_t(pEnd-pPosition)>=sizeof(memcounter::TraceChunkHeader) ) ) break;
+		const memcounter::TraceChunkHeader& chunk=*reinterpret_cast<const memcounter::TraceChunkHeader*>( pPosition );
+		pPosition+=sizeof(memcounter::TraceChunkHeader);
+		if( !TEST_CHECK( size_t(pEnd-pPosition)>=chunk.numberOfBytes ) ) break;
+		TEST_CHECK( chunk.droppedEvents==0 );
+		threads.insert( chunk.thread );
+
+		memcounter::TraceChunkDecoder decoder( chunk, pPosition );
+		memcounter::TraceEvent event;
+		uint32_t numberDecoded=0;
+		while( decoder.next( event ) )
+		{
+			++numberDecoded;
+			++numberOfEvents[event.type];
+			if( event.type!=memcounter::TraceEvent::free ) ++numberOfAllocationsBySize[event.size];
+			if( event.activeSlots==0 && event.type!=memcounter::TraceEvent::free ) ++numberWithoutCounters;
+			TEST_CHECK( event.address!=0 );
+			TEST_CHECK( event.cycles>=lastCycles[chunk.thread] );
+			lastCycles[chunk.thread]=event.cycles;
+		}
+		TEST_CHECK( numberDecoded==chunk.numberOfEvents );
+		TEST_CHECK( chunk.numberOfEvents==0 || lastCycles[chunk.thread]==chunk.lastCycles );
+		pPosition+=chunk.numberOfBytes;
+	}
+
+	TEST_CHECK( threads.size()==2 );
+	TEST_CHECK( numberOfEvents[memcounter::TraceEvent::malloc]==11 );
+	TEST_CHECK( numberOfEvents[memcounter::TraceEvent::realloc]==1 );
+	TEST_CHECK( numberOfEvents[memcounter::TraceEvent::free]==4 );
+	TEST_CHECK( numberOfEvents.size()==3 );
+	TEST_CHECK( numberOfAllocationsBySize[1000]==10 );
+	TEST_CHECK( numberOfAllocationsBySize[2500]==1 );
+	TEST_CHECK( numberOfAllocationsBySize[7000]==1 );
+	TEST_CHECK( numberOfAllocationsBySize.size()==3 );
+	TEST_CHECK( numberWithoutCounters==0 );
+
+	munmap( pMemory, fileStatus.st_size );
+	return memcountertest::result();
+}
@@ -0,0 +1,53 @@
+#include "memcounter/IMemoryCounter.h"
+#include "TestUtilities.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+
+
+namespace // Use the unnamed namespace
+{
+	memcounter::IMemoryCounter* (*createNewMemoryCounter)( void );
+
+	/** @brief Counts a block of 7000 bytes that's never freed, then exits. */
+	void* countAndExit( void* )
+	{
+		memcounter::IMemoryCounter* pCounter=createNewMemoryCounter();
+		pCounter->enable();
+		// volatile, otherwise the compiler is free to remove the malloc
+		void* volatile pBlock=malloc( 7000 );
+		pCounter->disable();
+		return pBlock;
+	}
+}
+
+/*
+ * Makes a known set of allocations to be written to the trace given in MEMCOUNTER_TRACE_FILE. The
+ * trace is only finished when the program exits, so traceDecodeTest and the analyser check it after.
+ *
+ * A second thread counts 7000 bytes and exits first. Then the main thread allocates ten blocks of
+ * 1000 bytes, reallocs one of them to 2500 and frees four of the others, so the peak is 18500 bytes
+ * and 14500 bytes are left in seven blocks.
+ */
+int main()
+{
+	if( !memcountertest::findFunction( createNewMemoryCounter, "createNewMemoryCounter" ) ) return memcountertest::result();
+
+	pthread_t thread;
+	pthread_create( &thread, NULL, &countAndExit, NULL );
+	void* pThreadBlock;
+	pthread_join( thread, &pThreadBlock );
+	TEST_CHECK( pThreadBlock!=NULL );
+
+	memcounter::IMemoryCounter* pCounter=createNewMemoryCounter();
+	pCounter->enable();
+	// volatile, otherwise the compiler is free to remove a malloc and free pair completely
+	void* volatile pBlocks[10];
+	for( size_t index=0; index<10; ++index ) pBlocks[index]=malloc( 1000 );
+	pBlocks[4]=realloc( pBlocks[4], 2500 );
+	for( size_t index=0; index<4; ++index ) free( pBlocks[index] );
+	pCounter->disable();
+	TEST_CHECK( pCounter->currentSize()==7500 && pCounter->maximumSize()==11500 );
+
+	return memcountertest::result();
+}
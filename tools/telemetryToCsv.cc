@@ -0,0 +1,129 @@
+#include "memcounter/TelemetryFormat.h"
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <iomanip>
+
+/*
+ * Converts a telemetry file written with MEMCOUNTER_TELEMETRY_FILE to CSV on standard output, one
+ * line per counter per sample, oldest first. The file can still be being written to, in which case
+ * any records that get overwritten while they're being read are left out.
+ *
+ * The kind column is "global" for global counters, "thread" for a counter enabled in a running
+ * thread, with the thread's index in the thread column and its slot in the counter column, or
+ * "named" for the totals of a name over every thread, with the number of threads in the thread
+ * column. The name column is empty for counters without a name.
+ */
+
+namespace // Use the unnamed namespace
+{
+	/** @brief Copies the record and returns true if it's the one with the given record number and wasn't changed while being copied. */
+	bool readRecord( const memcounter::TelemetryRecord& record, uint64_t recordNumber, memcounter::TelemetryRecord& copy )
+	{
+		uint32_t expectedSequence=uint32_t(recordNumber+1);
+		if( __atomic_load_n( &record.sequence, __ATOMIC_ACQUIRE )!=expectedSequence ) return false;
+		copy=record;
+		__atomic_thread_fence( __ATOMIC_ACQUIRE );
+		return __atomic_load_n( &record.sequence, __ATOMIC_RELAXED )==expectedSequence;
+	}
+
+	const char* kindName( uint32_t kind )
+	{
+		switch( kind )
+		{
+			case memcounter::TelemetryRecord::globalCounter: return "global";
+			case memcounter::TelemetryRecord::threadCounter: return "thread";
+			case memcounter::TelemetryRecord::namedTotal: return "named";
+			default: return "unknown";
+		}
+	}
+
+	/** @brief Writes the name with the given id as a CSV field, quoted if it needs to be. Nothing if it hasn't got one. */
+	void writeName( std::ostream& output, const memcounter::TelemetryFileHeader& header, uint32_t nameId )
+	{
+		if( nameId==0 || nameId>header.maximumNumberOfNames ) return;
+		const memcounter::LiveName& name=reinterpret_cast<const memcounter::LiveName*>( &header+1 )[nameId-1];
+		uint32_t length=__atomic_load_n( &name.length, __ATOMIC_ACQUIRE );
+		if( length>sizeof(name.text) ) length=sizeof(name.text);
+
+		output << '"';
+		for( uint32_t index=0; index<length; ++index )
+		{
+			if( name.text[index]=='"' ) output << '"';
+			output << name.text[index];
+		}
+		output << '"';
+	}
+}
+
+int main( int argc, char* argv[] )
+{
+	if( argc!=2 )
+	{
+		std::cerr << "Usage: " << argv[0] << " <telemetry file>" << std::endl;
+		return 1;
+	}
+
+	int fileDescriptor=open( argv[1], O_RDONLY );
+	struct stat fileStatus;
+	if( fileDescriptor<0 || fstat( fileDescriptor, &fileStatus )!=0 )
+	{
+		std::cerr << "Couldn't open " << argv[1] << ": " << strerror(errno) << std::endl;
+		return 1;
+	}
+	if( size_t(fileStatus.st_size)<sizeof(memcounter::TelemetryFileHeader) )
+	{
+		std::cerr << argv[1] << " is too short to be a telemetry file" << std::endl;
+		return 1;
+	}
+
+	void* pMemory=mmap( NULL, fileStatus.st_size, PROT_READ, MAP_SHARED, fileDescriptor, 0 );
+	close( fileDescriptor );
+	if( pMemory==MAP_FAILED )
+	{
+		std::cerr << "Couldn't map " << argv[1] << ": " << strerror(errno) << std::endl;
+		return 1;
+	}
+
+	const memcounter::TelemetryFileHeader& header=*static_cast<const memcounter::TelemetryFileHeader*>( pMemory );
+	if( memcmp( header.magic, memcounter::telemetryMagic, sizeof(header.magic) )!=0 || header.version!=memcounter::telemetryVersion
+		|| header.recordSize!=sizeof(memcounter::TelemetryRecord) || header.nameSize!=sizeof(memcounter::LiveName)
+		|| header.recordsOffset!=sizeof(memcounter::TelemetryFileHeader)+uint64_t(header.maximumNumberOfNames)*sizeof(memcounter::LiveName)
+		|| header.recordsOffset>uint64_t(fileStatus.st_size)
+		|| header.capacity>( fileStatus.st_size-header.recordsOffset )/sizeof(memcounter::TelemetryRecord) )
+	{
+		std::cerr << argv[1] << " isn't a telemetry file this version can read" << std::endl;
+		return 1;
+	}
+	const memcounter::TelemetryRecord* pRecords=reinterpret_cast<const memcounter::TelemetryRecord*>( static_cast<const char*>( pMemory )+header.recordsOffset );
+
+	uint64_t numberWritten=__atomic_load_n( &header.numberOfRecordsWritten, __ATOMIC_ACQUIRE );
+	uint64_t firstRecord=( numberWritten>header.capacity ? numberWritten-header.capacity : 0 );
+	size_t numberSkipped=0;
+
+	std::cout << "seconds,unix_time,kind,thread,counter,name,current_size,maximum_size,current_allocations,maximum_allocations" << "\n";
+	std::cout << std::fixed;
+	for( uint64_t recordNumber=firstRecord; recordNumber<numberWritten; ++recordNumber )
+	{
+		memcounter::TelemetryRecord record;
+		if( !readRecord( pRecords[recordNumber%header.capacity], recordNumber, record ) )
+		{
+			++numberSkipped;
+			continue;
+		}
+		double seconds=record.nanoseconds*1e-9;
+		std::cout << std::setprecision(3) << seconds << "," << ( header.startTimeNanoseconds+record.nanoseconds )*1e-9 << "," << kindName( record.kind )
+				<< "," << record.thread << "," << record.counter << ",";
+		writeName( std::cout, header, record.nameId );
+		std::cout << "," << record.currentSize << "," << record.maximumSize << "," << record.currentNumberOfAllocations << "," << record.maximumNumberOfAllocations << "\n";
+	}
+
+	if( numberSkipped!=0 ) std::cerr << numberSkipped << " records were overwritten while being read and have been left out" << std::endl;
+	return 0;
+}
@@ -0,0 +1,335 @@
+#include "memcounter/LiveFormat.h"
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+
+/*
+ * Shows the counters of a running process that has the library preloaded, refreshing every so often like
+ * top. It attaches read only to the shared memory segment the process keeps its counters in (see
+ * LiveExport), so the process being watched doesn't do anything extra and doesn't need to be stopped.
+ *
+ * For each thread it shows the counters enabled in it, then the same counters added up by name across
+ * threads, then the global counters. The allocation rate comes from how much each counter's total number of
+ * allocations went up since the last refresh.
+ */
+
+namespace // Use the unnamed namespace
+{
+	/** @brief A consistent copy of the parts of a LiveThreadBlock that are shown. */
+	struct ThreadCopy
+	{
+		uint32_t threadIndex;
+		int32_t threadId;
+		uint32_t enabledSlots;
+		uint32_t activeSlots;
+		uint32_t nameIds[memcounter::LiveThreadBlock::numberOfSlots];
+		memcounter::CounterValues values[memcounter::LiveThreadBlock::numberOfSlots];
+	};
+
+	/** @brief One line of the per thread table. */
+	struct Row
+	{
+		int32_t threadId;
+		uint32_t slot;
+		bool paused;
+		std::string name;
+		long int size;
+		long int maximumSize;
+		long int allocations;
+		double allocationRate; ///< Negative if there's nothing to compare with yet
+	};
+
+	/** @brief One line of the table added up by name. */
+	struct Total
+	{
+		Total() : numberOfThreads(0), size(0), maximumSize(0), allocations(0), allocationRate(0) {}
+		size_t numberOfThreads;
+		long int size;
+		long int maximumSize; ///< The sum of each thread's maximum, which can be more than was ever in use at once
+		long int allocations;
+		double allocationRate;
+	};
+
+	/** @brief What a counter's total allocations were at the last refresh, to work out the rate from. */
+	struct PreviousTotal
+	{
+		uint32_t threadIndex;
+		uint32_t nameId;
+		long int totalAllocations;
+	};
+
+	bool largerSize( const Row& first, const Row& second )
+	{
+		return first.size>second.size;
+	}
+
+	/** @brief Copies the block if it wasn't changed while being copied. Returns false if it was, or if it isn't in use. */
+	bool readThreadBlock( const memcounter::LiveThreadBlock& block, ThreadCopy& copy )
+	{
+		for( int attempt=0; attempt<1000; ++attempt )
+		{
+			uint32_t before=__atomic_load_n( &block.sequence, __ATOMIC_ACQUIRE );
+			if( before & 1 ) continue;
+			copy.threadIndex=__atomic_load_n( &block.threadIndex, __ATOMIC_RELAXED );
+			copy.threadId=__atomic_load_n( &block.threadId, __ATOMIC_RELAXED );
+			copy.enabledSlots=__atomic_load_n( &block.enabledSlots, __ATOMIC_RELAXED );
+			copy.activeSlots=__atomic_load_n( &block.activeSlots, __ATOMIC_RELAXED );
+			for( uint32_t bits=copy.enabledSlots; bits!=0; bits&=bits-1 )
+			{
+				int slot=__builtin_ctz( bits );
+				copy.nameIds[slot]=__atomic_load_n( &block.nameIds[slot], __ATOMIC_RELAXED );
+				copy.values[slot].loadFrom( block.values[slot] );
+			}
+			__atomic_thread_fence( __ATOMIC_ACQUIRE );
+			if( __atomic_load_n( &block.sequence, __ATOMIC_RELAXED )==before ) return copy.threadIndex!=0;
+		}
+		return false;
+	}
+
+	std::string counterName( const memcounter::LiveFileHeader& header, const char* pSegment, uint32_t nameId, uint32_t slot )
+	{
+		if( nameId!=0 && nameId<=header.maximumNumberOfNames )
+		{
+			const memcounter::LiveName& name=reinterpret_cast<const memcounter::LiveName*>( pSegment+header.namesOffset )[nameId-1];
+			uint32_t length=__atomic_load_n( &name.length, __ATOMIC_ACQUIRE );
+			if( length!=0 ) return std::string( name.text, std::min( length, uint32_t(sizeof(name.text)) ) );
+		}
+		std::ostringstream text;
+		text << "(slot " << slot << ")";
+		return text.str();
+	}
+
+	/** @brief Adds up every thread's shard of the global counter the same way the library does. */
+	void globalCounterTotals( const memcounter::LiveFileHeader& header, const char* pSegment, size_t globalCounterIndex,
+			long int (&current)[memcounter::GlobalCounterShard::numberOfQuantities], long int (&maximum)[memcounter::GlobalCounterShard::numberOfQuantities] )
+	{
+		const memcounter::LiveGlobalBlock& globals=*reinterpret_cast<const memcounter::LiveGlobalBlock*>( pSegment+header.globalsOffset );
+		const memcounter::LiveThreadBlock* pBlocks=reinterpret_cast<const memcounter::LiveThreadBlock*>( pSegment+header.threadsOffset );
+		const memcounter::GlobalCounterGenerations& generations=globals.generations[globalCounterIndex];
+		uint32_t before, after;
+		unsigned attempts=0;
+		do
+		{
+			for( int index=0; index<memcounter::GlobalCounterShard::numberOfQuantities; ++index ) current[index]=maximum[index]=0;
+
+			before=__atomic_load_n( &globals.retirementSequence, __ATOMIC_ACQUIRE );
+			uint32_t numberOfBlocks=std::min( __atomic_load_n( &header.numberOfThreadBlocksUsed, __ATOMIC_ACQUIRE ), header.maximumNumberOfThreads );
+			for( uint32_t block=0; block<numberOfBlocks; ++block )
+			{
+				if( __atomic_load_n( &pBlocks[block].threadIndex, __ATOMIC_ACQUIRE )!=0 ) pBlocks[block].globalShards[globalCounterIndex].addTo( current, maximum, generations, 1000 );
+			}
+			globals.retiredShards[globalCounterIndex].addTo( current, maximum, generations, 1000 );
+			__atomic_thread_fence( __ATOMIC_ACQUIRE );
+			after=__atomic_load_n( &globals.retirementSequence, __ATOMIC_RELAXED );
+		} while( ( (before & 1) || before!=after ) && ++attempts!=1000 );
+	}
+
+	/** @brief Bytes to the nearest sensible unit, e.g. "12.3M". */
+	std::string formatBytes( long int bytes )
+	{
+		static const char units[]={ 'B', 'K', 'M', 'G', 'T' };
+		double value=double(bytes);
+		size_t unit=0;
+		while( ( value>=1024 || value<=-1024 ) && unit+1<sizeof(units) )
+		{
+			value/=1024;
+			++unit;
+		}
+		char text[32];
+		if( unit==0 ) snprintf( text, sizeof(text), "%ldB", bytes );
+		else snprintf( text, sizeof(text), "%.1f%c", value, units[unit] );
+		return text;
+	}
+
+	std::string formatRate( double rate )
+	{
+		if( rate<0 ) return "-";
+		char text[32];
+		snprintf( text, sizeof(text), "%.0f/s", rate );
+		return text;
+	}
+
+	double secondsNow()
+	{
+		timespec now;
+		clock_gettime( CLOCK_MONOTONIC, &now );
+		return now.tv_sec+now.tv_nsec*1e-9;
+	}
+}
+
+int main( int argc, char* argv[] )
+{
+	long int intervalMilliseconds=250;
+	long int numberOfIterations=0;
+	int option;
+	while( ( option=getopt( argc, argv, "i:n:" ) )!=-1 )
+	{
+		if( option=='i' ) intervalMilliseconds=strtol( optarg, NULL, 0 );
+		else if( option=='n' ) numberOfIterations=strtol( optarg, NULL, 0 );
+		else optind=argc+1;
+	}
+	if( optind!=argc-1 || intervalMilliseconds<=0 )
+	{
+		std::cerr << "Usage: " << argv[0] << " [-i <refresh milliseconds>] [-n <number of refreshes>] <process id>" << std::endl;
+		return 1;
+	}
+	long int processId=strtol( argv[optind], NULL, 0 );
+
+	char segmentName[64];
+	snprintf( segmentName, sizeof(segmentName), "/memcounter.%ld", processId );
+	int fileDescriptor=shm_open( segmentName, O_RDONLY, 0 );
+	struct stat fileStatus;
+	if( fileDescriptor<0 || fstat( fileDescriptor, &fileStatus )!=0 )
+	{
+		std::cerr << "Couldn't open " << segmentName << ": " << strerror(errno) << ". Is process " << processId << " running with the library and MEMCOUNTER_LIVE on?" << std::endl;
+		return 1;
+	}
+	if( size_t(fileStatus.st_size)<sizeof(memcounter::LiveFileHeader) )
+	{
+		std::cerr << segmentName << " is too short to be a memcounter segment" << std::endl;
+		return 1;
+	}
+
+	void* pMemory=mmap( NULL, fileStatus.st_size, PROT_READ, MAP_SHARED, fileDescriptor, 0 );
+	close( fileDescriptor );
+	if( pMemory==MAP_FAILED )
+	{
+		std::cerr << "Couldn't map " << segmentName << ": " << strerror(errno) << std::endl;
+		return 1;
+	}
+
+	const char* pSegment=static_cast<const char*>( pMemory );
+	const memcounter::LiveFileHeader& header=*static_cast<const memcounter::LiveFileHeader*>( pMemory );
+	__atomic_thread_fence( __ATOMIC_ACQUIRE );
+	if( memcmp( header.magic, memcounter::liveMagic, sizeof(header.magic) )!=0 || header.version!=memcounter::liveVersion
+		|| header.headerSize!=sizeof(memcounter::LiveFileHeader) || header.nameSize!=sizeof(memcounter::LiveName)
+		|| header.globalBlockSize!=sizeof(memcounter::LiveGlobalBlock) || header.threadBlockSize!=sizeof(memcounter::LiveThreadBlock)
+		|| header.threadsOffset+uint64_t(header.maximumNumberOfThreads)*sizeof(memcounter::LiveThreadBlock)>uint64_t(fileStatus.st_size)
+		|| header.namesOffset+uint64_t(header.maximumNumberOfNames)*sizeof(memcounter::LiveName)>header.globalsOffset )
+	{
+		std::cerr << segmentName << " isn't a segment this version can read" << std::endl;
+		return 1;
+	}
+	const memcounter::LiveThreadBlock* pBlocks=reinterpret_cast<const memcounter::LiveThreadBlock*>( pSegment+header.threadsOffset );
+	const memcounter::LiveGlobalBlock& globals=*reinterpret_cast<const memcounter::LiveGlobalBlock*>( pSegment+header.globalsOffset );
+
+	const bool clearScreen=isatty( STDOUT_FILENO );
+	std::vector<PreviousTotal> previousTotals;
+	double previousSeconds=0;
+	for( long int iteration=0; numberOfIterations==0 || iteration<numberOfIterations; ++iteration )
+	{
+		if( iteration!=0 ) usleep( intervalMilliseconds*1000 );
+		bool processEnded=( kill( pid_t(processId), 0 )!=0 && errno==ESRCH );
+
+		double seconds=secondsNow();
+		double elapsed=seconds-previousSeconds;
+		uint32_t numberOfBlocks=std::min( __atomic_load_n( &header.numberOfThreadBlocksUsed, __ATOMIC_ACQUIRE ), header.maximumNumberOfThreads );
+		previousTotals.resize( size_t(numberOfBlocks)*memcounter::LiveThreadBlock::numberOfSlots );
+
+		std::vector<Row> rows;
+		std::map<std::string,Total> totals;
+		size_t numberOfThreads=0;
+		for( uint32_t block=0; block<numberOfBlocks; ++block )
+		{
+			ThreadCopy copy;
+			if( !readThreadBlock( pBlocks[block], copy ) ) continue;
+			++numberOfThreads;
+			for( uint32_t bits=copy.enabledSlots; bits!=0; bits&=bits-1 )
+			{
+				uint32_t slot=__builtin_ctz( bits );
+				const memcounter::CounterValues& values=copy.values[slot];
+				Row row;
+				row.threadId=copy.threadId;
+				row.slot=slot;
+				row.paused=!( copy.activeSlots & (1u<<slot) );
+				row.name=counterName( header, pSegment, copy.nameIds[slot], slot );
+				row.size=values.current[memcounter::CounterValues::size];
+				row.maximumSize=values.maximum[memcounter::CounterValues::size];
+				row.allocations=values.current[memcounter::CounterValues::numberOfAllocations];
+
+				// The rate only means something if it's the same counter as last time and it hasn't been reset
+				PreviousTotal& previous=previousTotals[size_t(block)*memcounter::LiveThreadBlock::numberOfSlots+slot];
+				long int totalAllocations=values.current[memcounter::CounterValues::totalAllocations];
+				if( iteration!=0 && previous.threadIndex==copy.threadIndex && previous.nameId==copy.nameIds[slot] && totalAllocations>=previous.totalAllocations )
+				{
+					row.allocationRate=( totalAllocations-previous.totalAllocations )/elapsed;
+				}
+				else row.allocationRate=-1;
+				previous.threadIndex=copy.threadIndex;
+				previous.nameId=copy.nameIds[slot];
+				previous.totalAllocations=totalAllocations;
+				rows.push_back( row );
+
+				Total& total=totals[row.name];
+				++total.numberOfThreads;
+				total.size+=row.size;
+				total.maximumSize+=row.maximumSize;
+				total.allocations+=row.allocations;
+				if( row.allocationRate>0 ) total.allocationRate+=row.allocationRate;
+			}
+		}
+		previousSeconds=seconds;
+		std::stable_sort( rows.begin(), rows.end(), &largerSize );
+
+		std::ostringstream screen;
+		if( clearScreen ) screen << "\033[H\033[2J";
+		screen << "memcounterTop - process " << processId << ( processEnded ? " (ended)" : "" ) << ", " << numberOfThreads << " threads, "
+				<< rows.size() << " enabled counters, up " << std::fixed << std::setprecision(0)
+				<< ( time( NULL )-double(header.startTimeNanoseconds)*1e-9 ) << "s\n\n";
+
+		screen << std::setw(8) << "TID" << std::setw(5) << "SLOT" << "  " << std::left << std::setw(32) << "COUNTER" << std::right
+				<< std::setw(10) << "SIZE" << std::setw(10) << "PEAK" << std::setw(12) << "ALLOCS" << std::setw(12) << "ALLOC RATE" << "\n";
+		for( std::vector<Row>::const_iterator iRow=rows.begin(); iRow!=rows.end(); ++iRow )
+		{
+			screen << std::setw(8) << iRow->threadId << std::setw(5) << iRow->slot << ( iRow->paused ? " p" : "  " ) << std::left << std::setw(32) << iRow->name.substr( 0, 31 ) << std::right
+					<< std::setw(10) << formatBytes( iRow->size ) << std::setw(10) << formatBytes( iRow->maximumSize ) << std::setw(12) << iRow->allocations
+					<< std::setw(12) << formatRate( iRow->allocationRate ) << "\n";
+		}
+
+		screen << "\n" << std::setw(8) << "THREADS" << std::setw(5) << "" << "  " << std::left << std::setw(32) << "COUNTER (ALL THREADS)" << std::right
+				<< std::setw(10) << "SIZE" << std::setw(10) << "PEAKS" << std::setw(12) << "ALLOCS" << std::setw(12) << "ALLOC RATE" << "\n";
+		for( std::map<std::string,Total>::const_iterator iTotal=totals.begin(); iTotal!=totals.end(); ++iTotal )
+		{
+			const Total& total=iTotal->second;
+			screen << std::setw(8) << total.numberOfThreads << std::setw(5) << "" << "  " << std::left << std::setw(32) << iTotal->first.substr( 0, 31 ) << std::right
+					<< std::setw(10) << formatBytes( total.size ) << std::setw(10) << formatBytes( total.maximumSize ) << std::setw(12) << total.allocations
+					<< std::setw(12) << ( iteration==0 ? std::string("-") : formatRate( total.allocationRate ) ) << "\n";
+		}
+
+		size_t numberOfGlobalCounters=std::min( size_t(__atomic_load_n( &globals.numberOfGlobalCounters, __ATOMIC_ACQUIRE )), size_t(memcounter::GlobalMemoryCounter::maximumNumberOfCounters) );
+		if( numberOfGlobalCounters!=0 )
+		{
+			screen << "\n" << std::setw(13) << "GLOBAL" << "  " << std::left << std::setw(32) << "" << std::right
+					<< std::setw(10) << "SIZE" << std::setw(10) << "PEAK" << std::setw(12) << "ALLOCS" << "\n";
+			for( size_t globalCounterIndex=0; globalCounterIndex<numberOfGlobalCounters; ++globalCounterIndex )
+			{
+				long int current[memcounter::GlobalCounterShard::numberOfQuantities];
+				long int maximum[memcounter::GlobalCounterShard::numberOfQuantities];
+				globalCounterTotals( header, pSegment, globalCounterIndex, current, maximum );
+				screen << std::setw(13) << globalCounterIndex << "  " << std::setw(32) << ""
+						<< std::setw(10) << formatBytes( current[memcounter::GlobalCounterShard::size] ) << std::setw(10) << formatBytes( maximum[memcounter::GlobalCounterShard::size] )
+						<< std::setw(12) << current[memcounter::GlobalCounterShard::numberOfAllocations] << "\n";
+			}
+		}
+
+		std::cout << screen.str() << std::flush;
+		if( processEnded ) break;
+	}
+	return 0;
+}
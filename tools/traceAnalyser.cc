@@ -0,0 +1,689 @@
+#include "memcounter/TraceFormat.h"
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <map>
+#include <algorithm>
+
+/*
+ * Analyses an allocation trace written with MEMCOUNTER_TRACE_FILE. It prints how much tracked memory
+ * was in use over time, the peak overall and for each counter, how fast memory was allocated and freed,
+ * and the sizes that accounted for most of the allocations.
+ *
+ * The trace is memory mapped and cut into time segments that are worked on in parallel. The events in a
+ * segment are taken in time order by merging the chunks that overlap it. The awkward part is frees,
+ * since the size of a freed block is only known from its allocation, which may be in an earlier segment.
+ * So it's done in three passes:
+ *   1. In parallel, each segment matches up the frees and allocations within it. What's left is a list of
+ *      frees of blocks allocated in an earlier segment, and the blocks still allocated at the end.
+ *   2. In order, the segments' leftover frees are looked up in the blocks left by the segments before.
+ *   3. In parallel, now that every free has a size, each segment works out how the totals changed and
+ *      the highest they got relative to the start of the segment.
+ * Adding up the segments in order then gives the absolute values. Only the blocks live at segment
+ * boundaries are ever held for the whole trace, so the memory needed doesn't grow with the trace length.
+ */
+
+namespace // Use the unnamed namespace
+{
+	/** @brief Open addressing hash table with 64 bit keys, which can't be zero. Much faster than std::map for millions of blocks. */
+	template<class Value>
+	class HashTable
+	{
+	public:
+		HashTable() : keys_(16,0), values_(16), size_(0) {}
+
+		Value* find( uint64_t key )
+		{
+			for( size_t index=home( key ); keys_[index]!=0; index=(index+1)&(keys_.size()-1) )
+			{
+				if( keys_[index]==key ) return &values_[index];
+			}
+			return NULL;
+		}
+
+		/** @brief Returns the value for the key, adding a default one if it isn't there. */
+		Value& insert( uint64_t key )
+		{
+			if( (size_+1)*2>keys_.size() ) grow();
+			size_t index=home( key );
+			for( ; keys_[index]!=0; index=(index+1)&(keys_.size()-1) )
+			{
+				if( keys_[index]==key ) return values_[index];
+			}
+			keys_[index]=key;
+			values_[index]=Value();
+			++size_;
+			return values_[index];
+		}
+
+		/** @brief Removes the key and copies out its value. Returns false if it wasn't there. */
+		bool erase( uint64_t key, Value& value )
+		{
+			size_t mask=keys_.size()-1;
+			size_t index=home( key );
+			for( ; keys_[index]!=key; index=(index+1)&mask )
+			{
+				if( keys_[index]==0 ) return false;
+			}
+			value=values_[index];
+			--size_;
+
+			// Move later entries back into the gap if that's still on or after their home, so that lookups don't need tombstones
+			for( size_t next=(index+1)&mask; keys_[next]!=0; next=(next+1)&mask )
+			{
+				size_t nextHome=home( keys_[next] );
+				if( ( (next-nextHome)&mask )>=( (next-index)&mask ) )
+				{
+					keys_[index]=keys_[next];
+					values_[index]=values_[next];
+					index=next;
+				}
+			}
+			keys_[index]=0;
+			return true;
+		}
+
+		size_t size() const { return size_; }
+		/// For going through every entry. An index is in use if its key isn't zero.
+		size_t capacity() const { return keys_.size(); }
+		uint64_t keyAt( size_t index ) const { return keys_[index]; }
+		const Value& valueAt( size_t index ) const { return values_[index]; }
+	private:
+		size_t home( uint64_t key ) const { return size_t( (key*0x9E3779B97F4A7C15ull)>>17 ) & (keys_.size()-1); }
+
+		void grow()
+		{
+			std::vector<uint64_t> oldKeys( keys_.size()*2, 0 );
+			std::vector<Value> oldValues( values_.size()*2 );
+			oldKeys.swap( keys_ );
+			oldValues.swap( values_ );
+			size_=0;
+			for( size_t index=0; index<oldKeys.size(); ++index )
+			{
+				if( oldKeys[index]!=0 ) insert( oldKeys[index] )=oldValues[index];
+			}
+		}
+
+		std::vector<uint64_t> keys_;
+		std::vector<Value> values_;
+		size_t size_;
+	};
+
+	/** @brief A chunk from the file. The header is copied out because chunks aren't aligned in the file. */
+	struct Chunk
+	{
+		memcounter::TraceChunkHeader header;
+		const uint8_t* pData;
+	};
+
+	/** @brief An event with the thread it came from. A realloc is a free of oldAddress then an allocation of address, either of which can be zero. */
+	struct Event
+	{
+		uint64_t cycles;
+		uint64_t address;
+		uint64_t oldAddress;
+		uint64_t size;
+		uint32_t weight;
+		uint32_t thread;
+		uint32_t activeSlots;
+		uint32_t globalCounters;
+	};
+
+	/** @brief A block that has been allocated, with what's needed to take it off the right counters when it's freed. */
+	struct Block
+	{
+		uint64_t size;
+		uint32_t weight; ///< Zero for a free whose allocation isn't in the trace
+		uint32_t thread;
+		uint32_t activeSlots;
+		uint32_t globalCounters;
+	};
+
+	/** @brief How a total changed over a segment. */
+	struct Change
+	{
+		int64_t current; ///< Relative to the start of the segment
+		int64_t peak; ///< The highest current reached, also relative to the start
+		uint64_t peakCycles;
+		Change() : current(0), peak(0), peakCycles(0) {}
+		void add( int64_t bytes, uint64_t cycles )
+		{
+			current+=bytes;
+			if( current>peak )
+			{
+				peak=current;
+				peakCycles=cycles;
+			}
+		}
+	};
+
+	struct SizeCount
+	{
+		uint64_t allocations;
+		uint64_t bytes;
+		SizeCount() : allocations(0), bytes(0) {}
+	};
+
+	/** @brief Counters are identified by the bits in the trace, which are slots in each thread's pool or global counter numbers. */
+	const uint64_t globalCounterKey=1ull<<63;
+	inline uint64_t slotKey( uint32_t thread, uint32_t slot ) { return ( uint64_t(thread)<<32 ) | slot; }
+
+	struct Segment
+	{
+		uint64_t startCycles; ///< Events from startCycles up to but not including endCycles
+		uint64_t endCycles;
+		std::vector<size_t> chunks; ///< Indices of the chunks that overlap the segment
+
+		// From the first pass
+		std::vector<uint64_t> unresolvedFrees; ///< Addresses of frees whose block was allocated in an earlier segment, in time order
+		std::vector< std::pair<uint64_t,Block> > survivors; ///< Blocks allocated in the segment and not freed in it
+		// From the second pass
+		std::vector<Block> resolvedFrees; ///< The block for each of unresolvedFrees
+
+		// From the third pass
+		Change heap;
+		std::map<uint64_t,Change> counters;
+		uint64_t numberOfEvents;
+		uint64_t allocations;
+		uint64_t bytesAllocated;
+		uint64_t frees;
+		HashTable<SizeCount> sizes; ///< Keyed by size plus one, so that zero sized blocks can go in
+		Segment() : numberOfEvents(0), allocations(0), bytesAllocated(0), frees(0) {}
+	};
+
+	struct Trace
+	{
+		memcounter::TraceFileHeader header;
+		std::vector<Chunk> chunks;
+		std::vector<Segment> segments;
+		uint64_t droppedEvents;
+		uint64_t numberOfThreads;
+	};
+
+	/** @brief Goes through a segment's events in time order, by merging the events of the chunks that overlap it.
+	 *
+	 * The events in each chunk are already in order, so this only needs a heap with an entry per chunk,
+	 * rather than gathering up and sorting every event in the segment.
+	 */
+	class SegmentEvents
+	{
+	public:
+		SegmentEvents( const Trace& trace, const Segment& segment ) : endCycles_(segment.endCycles)
+		{
+			streams_.reserve( segment.chunks.size() );
+			for( std::vector<size_t>::const_iterator iChunk=segment.chunks.begin(); iChunk!=segment.chunks.end(); ++iChunk )
+			{
+				const Chunk& chunk=trace.chunks[*iChunk];
+				Stream stream={ memcounter::TraceChunkDecoder( chunk.header, chunk.pData ), memcounter::TraceEvent(), chunk.header.thread };
+				// Skip what came before the segment, the previous segment deals with that
+				bool hasEvent;
+				while( (hasEvent=stream.decoder.next( stream.event )) && stream.event.cycles<segment.startCycles ) {}
+				if( !hasEvent || stream.event.cycles>=endCycles_ ) continue;
+				streams_.push_back( stream );
+				heap_.push_back( streams_.size()-1 );
+			}
+			std::make_heap( heap_.begin(), heap_.end(), Later( streams_ ) );
+		}
+
+		/** @brief Copies out the next event, and returns false if there aren't any more. */
+		bool next( Event& event )
+		{
+			if( heap_.empty() ) return false;
+			std::pop_heap( heap_.begin(), heap_.end(), Later( streams_ ) );
+			Stream& stream=streams_[heap_.back()];
+
+			const memcounter::TraceEvent& traceEvent=stream.event;
+			event.cycles=traceEvent.cycles;
+			event.address=( traceEvent.type==memcounter::TraceEvent::free ? 0 : traceEvent.address );
+			event.oldAddress=( traceEvent.type==memcounter::TraceEvent::free ? traceEvent.address : traceEvent.oldAddress );
+			event.size=traceEvent.size;
+			event.weight=traceEvent.weight;
+			event.thread=stream.thread;
+			event.activeSlots=traceEvent.activeSlots;
+			event.globalCounters=traceEvent.globalCounters;
+
+			if( stream.decoder.next( stream.event ) && stream.event.cycles<endCycles_ ) std::push_heap( heap_.begin(), heap_.end(), Later( streams_ ) );
+			else heap_.pop_back();
+			return true;
+		}
+	private:
+		struct Stream
+		{
+			memcounter::TraceChunkDecoder decoder;
+			memcounter::TraceEvent event; ///< The next event from the chunk
+			uint32_t thread;
+		};
+		/// Orders the heap so that the earliest event is on top. Ties go to the earlier chunk, so that each thread's events stay in order.
+		struct Later
+		{
+			const std::vector<Stream>& streams;
+			Later( const std::vector<Stream>& streams_ ) : streams(streams_) {}
+			bool operator()( size_t first, size_t second ) const
+			{
+				if( streams[first].event.cycles!=streams[second].event.cycles ) return streams[first].event.cycles>streams[second].event.cycles;
+				return first>second;
+			}
+		};
+
+		uint64_t endCycles_;
+		std::vector<Stream> streams_; ///< In the order of Segment::chunks
+		std::vector<size_t> heap_; ///< Indices into streams_ of the chunks that still have events in the segment
+	};
+
+	/** @brief The first pass, see the description at the top. */
+	void matchWithinSegment( Trace& trace, size_t segmentIndex )
+	{
+		Segment& segment=trace.segments[segmentIndex];
+		SegmentEvents events( trace, segment );
+
+		HashTable<Block> liveBlocks;
+		Event event;
+		while( events.next( event ) )
+		{
+			Block block;
+			if( event.oldAddress!=0 && !liveBlocks.erase( event.oldAddress, block ) ) segment.unresolvedFrees.push_back( event.oldAddress );
+			if( event.address!=0 )
+			{
+				Block& newBlock=liveBlocks.insert( event.address );
+				newBlock.size=event.size;
+				newBlock.weight=event.weight;
+				newBlock.thread=event.thread;
+				newBlock.activeSlots=event.activeSlots;
+				newBlock.globalCounters=event.globalCounters;
+			}
+		}
+
+		segment.survivors.reserve( liveBlocks.size() );
+		for( size_t index=0; index<liveBlocks.capacity(); ++index )
+		{
+			if( liveBlocks.keyAt(index)!=0 ) segment.survivors.push_back( std::make_pair( liveBlocks.keyAt(index), liveBlocks.valueAt(index) ) );
+		}
+	}
+
+	/** @brief Adds the change to every counter the block was in. */
+	void changeCounters( Segment& segment, const Block& block, int64_t bytes, uint64_t cycles )
+	{
+		for( uint32_t bits=block.globalCounters; bits!=0; bits&=bits-1 )
+		{
+			segment.counters[ globalCounterKey | __builtin_ctz( bits ) ].add( bytes, cycles );
+		}
+		for( uint32_t bits=block.activeSlots; bits!=0; bits&=bits-1 )
+		{
+			segment.counters[ slotKey( block.thread, __builtin_ctz( bits ) ) ].add( bytes, cycles );
+		}
+	}
+
+	/** @brief The third pass, see the description at the top. */
+	void measureSegment( Trace& trace, size_t segmentIndex )
+	{
+		Segment& segment=trace.segments[segmentIndex];
+		SegmentEvents events( trace, segment );
+
+		// This goes through the events in the same order as matchWithinSegment, so the frees it can't
+		// match come up in the same order as resolvedFrees.
+		HashTable<Block> liveBlocks;
+		std::vector<Block>::const_iterator iResolvedFree=segment.resolvedFrees.begin();
+		Event event;
+		while( events.next( event ) )
+		{
+			++segment.numberOfEvents;
+			Block block;
+			if( event.oldAddress!=0 )
+			{
+				if( !liveBlocks.erase( event.oldAddress, block ) )
+				{
+					if( iResolvedFree!=segment.resolvedFrees.end() ) block=*iResolvedFree++;
+					else block.weight=0;
+				}
+				if( block.weight!=0 )
+				{
+					int64_t bytes=int64_t( block.size*block.weight );
+					segment.heap.add( -bytes, event.cycles );
+					changeCounters( segment, block, -bytes, event.cycles );
+					segment.frees+=block.weight;
+				}
+			}
+			if( event.address!=0 )
+			{
+				block.size=event.size;
+				block.weight=event.weight;
+				block.thread=event.thread;
+				block.activeSlots=event.activeSlots;
+				block.globalCounters=event.globalCounters;
+				liveBlocks.insert( event.address )=block;
+
+				int64_t bytes=int64_t( block.size*block.weight );
+				segment.heap.add( bytes, event.cycles );
+				changeCounters( segment, block, bytes, event.cycles );
+				segment.allocations+=block.weight;
+				segment.bytesAllocated+=bytes;
+				SizeCount& sizeCount=segment.sizes.insert( block.size+1 );
+				sizeCount.allocations+=block.weight;
+				sizeCount.bytes+=bytes;
+			}
+		}
+	}
+
+	/** @brief Runs a pass over every segment, with the segments shared out between the threads as they become free. */
+	class ParallelPass
+	{
+	public:
+		ParallelPass( Trace& trace, void (*pFunction)( Trace&, size_t ), size_t numberOfThreads )
+			: trace_(trace), pFunction_(pFunction), nextSegment_(0)
+		{
+			std::vector<pthread_t> threads( numberOfThreads );
+			size_t numberStarted=0;
+			for( ; numberStarted<numberOfThreads; ++numberStarted )
+			{
+				if( pthread_create( &threads[numberStarted], NULL, &threadFunction, this )!=0 ) break;
+			}
+			// If no threads could be started this thread does all of the work
+			if( numberStarted==0 ) threadFunction( this );
+			for( size_t index=0; index<numberStarted; ++index ) pthread_join( threads[index], NULL );
+		}
+	private:
+		static void* threadFunction( void* pPass )
+		{
+			ParallelPass& pass=*static_cast<ParallelPass*>( pPass );
+			size_t segmentIndex;
+			while( (segmentIndex=__atomic_fetch_add( &pass.nextSegment_, 1, __ATOMIC_RELAXED ))<pass.trace_.segments.size() )
+			{
+				(*pass.pFunction_)( pass.trace_, segmentIndex );
+			}
+			return NULL;
+		}
+
+		Trace& trace_;
+		void (*pFunction_)( Trace&, size_t );
+		size_t nextSegment_;
+	};
+
+	struct EarlierChunk { bool operator()( const Chunk& first, const Chunk& second ) const { return first.header.firstCycles<second.header.firstCycles; } };
+
+	/** @brief Finds the chunks in the file, and splits the time it covers into segments. Returns false if the file isn't a trace. */
+	bool indexTrace( const uint8_t* pFile, size_t fileSize, size_t numberOfSegments, Trace& trace )
+	{
+		if( fileSize<sizeof(memcounter::TraceFileHeader) ) return false;
+		memcpy( &trace.header, pFile, sizeof(trace.header) );
+		if( memcmp( trace.header.magic, memcounter::traceMagic, sizeof(trace.header.magic) )!=0 || trace.header.version!=memcounter::traceVersion
+			|| trace.header.chunkHeaderSize<sizeof(memcounter::TraceChunkHeader) ) return false;
+
+		trace.droppedEvents=0;
+		uint64_t startCycles=UINT64_MAX, endCycles=0;
+		std::vector<uint32_t> threads;
+		for( size_t offset=sizeof(memcounter::TraceFileHeader); offset+trace.header.chunkHeaderSize<=fileSize; )
+		{
+			Chunk chunk;
+			memcpy( &chunk.header, pFile+offset, sizeof(chunk.header) );
+			offset+=trace.header.chunkHeaderSize;
+			// A chunk that's cut short is from a program that was killed while the chunk was being written
+			if( chunk.header.numberOfBytes>fileSize-offset ) break;
+			chunk.pData=pFile+offset;
+			offset+=chunk.header.numberOfBytes;
+
+			trace.droppedEvents+=chunk.header.droppedEvents;
+			threads.push_back( chunk.header.thread );
+			if( chunk.header.numberOfEvents==0 ) continue;
+			startCycles=std::min( startCycles, chunk.header.firstCycles );
+			endCycles=std::max( endCycles, chunk.header.lastCycles );
+			trace.chunks.push_back( chunk );
+		}
+		std::sort( threads.begin(), threads.end() );
+		trace.numberOfThreads=std::unique( threads.begin(), threads.end() )-threads.begin();
+		if( trace.chunks.empty() ) return true;
+
+		// Each thread's chunks are written in order, so this only swaps chunks from different threads
+		std::stable_sort( trace.chunks.begin(), trace.chunks.end(), EarlierChunk() );
+
+		uint64_t segmentLength=( endCycles-startCycles )/numberOfSegments+1;
+		trace.segments.resize( numberOfSegments );
+		for( size_t index=0; index<numberOfSegments; ++index )
+		{
+			trace.segments[index].startCycles=startCycles+index*segmentLength;
+			trace.segments[index].endCycles=startCycles+(index+1)*segmentLength;
+		}
+		for( size_t chunkIndex=0; chunkIndex<trace.chunks.size(); ++chunkIndex )
+		{
+			const memcounter::TraceChunkHeader& header=trace.chunks[chunkIndex].header;
+			size_t lastSegment=std::min( size_t( (header.lastCycles-startCycles)/segmentLength ), numberOfSegments-1 );
+			for( size_t segment=( header.firstCycles-startCycles )/segmentLength; segment<=lastSegment; ++segment )
+			{
+				trace.segments[segment].chunks.push_back( chunkIndex );
+			}
+		}
+		return true;
+	}
+
+	/** @brief The second pass, see the description at the top. Leaves liveBlocks with the blocks still allocated at the end of the trace. */
+	void resolveFrees( Trace& trace, HashTable<Block>& liveBlocks, uint64_t& numberOfUnknownFrees )
+	{
+		numberOfUnknownFrees=0;
+		for( std::vector<Segment>::iterator iSegment=trace.segments.begin(); iSegment!=trace.segments.end(); ++iSegment )
+		{
+			iSegment->resolvedFrees.resize( iSegment->unresolvedFrees.size() );
+			for( size_t index=0; index<iSegment->unresolvedFrees.size(); ++index )
+			{
+				Block& block=iSegment->resolvedFrees[index];
+				if( !liveBlocks.erase( iSegment->unresolvedFrees[index], block ) )
+				{
+					block.weight=0;
+					++numberOfUnknownFrees;
+				}
+			}
+			for( size_t index=0; index<iSegment->survivors.size(); ++index )
+			{
+				liveBlocks.insert( iSegment->survivors[index].first )=iSegment->survivors[index].second;
+			}
+			std::vector<uint64_t>().swap( iSegment->unresolvedFrees );
+			std::vector< std::pair<uint64_t,Block> >().swap( iSegment->survivors );
+		}
+	}
+
+	struct CounterTotal
+	{
+		int64_t current;
+		int64_t peak;
+		uint64_t peakCycles;
+		CounterTotal() : current(0), peak(0), peakCycles(0) {}
+		/// Adds on a segment's change, which is relative to where this total was at the start of it
+		void add( const Change& change )
+		{
+			if( current+change.peak>peak )
+			{
+				peak=current+change.peak;
+				peakCycles=change.peakCycles;
+			}
+			current+=change.current;
+		}
+	};
+
+	struct MoreBytes { bool operator()( const std::pair<uint64_t,SizeCount>& first, const std::pair<uint64_t,SizeCount>& second ) const { return first.second.bytes>second.second.bytes; } };
+	struct MoreAllocations { bool operator()( const std::pair<uint64_t,SizeCount>& first, const std::pair<uint64_t,SizeCount>& second ) const { return first.second.allocations>second.second.allocations; } };
+
+	void printUsage( const char* program )
+	{
+		std::cerr << "Usage: " << program << " [-j threads] [-i intervals] [-n sizes] <trace file>" << "\n"
+				<< "    -j  How many threads to analyse with, the default is one per processor" << "\n"
+				<< "    -i  How many intervals to split the timeline into, the default is 20" << "\n"
+				<< "    -n  How many of the most common allocation sizes to list, the default is 10" << std::endl;
+	}
+}
+
+int main( int argc, char* argv[] )
+{
+	long numberOfThreads=sysconf( _SC_NPROCESSORS_ONLN );
+	size_t numberOfIntervals=20;
+	size_t numberOfSizes=10;
+	int option;
+	while( (option=getopt( argc, argv, "j:i:n:" ))!=-1 )
+	{
+		if( option=='j' ) numberOfThreads=strtol( optarg, NULL, 0 );
+		else if( option=='i' ) numberOfIntervals=strtoul( optarg, NULL, 0 );
+		else if( option=='n' ) numberOfSizes=strtoul( optarg, NULL, 0 );
+		else
+		{
+			printUsage( argv[0] );
+			return 1;
+		}
+	}
+	if( optind!=argc-1 || numberOfIntervals==0 )
+	{
+		printUsage( argv[0] );
+		return 1;
+	}
+	if( numberOfThreads<1 ) numberOfThreads=1;
+	const char* filename=argv[optind];
+
+	int fileDescriptor=open( filename, O_RDONLY );
+	struct stat fileStatus;
+	if( fileDescriptor<0 || fstat( fileDescriptor, &fileStatus )!=0 )
+	{
+		std::cerr << "Couldn't open " << filename << ": " << strerror(errno) << std::endl;
+		return 1;
+	}
+	void* pMemory=( fileStatus.st_size>0 ? mmap( NULL, fileStatus.st_size, PROT_READ, MAP_PRIVATE, fileDescriptor, 0 ) : MAP_FAILED );
+	close( fileDescriptor );
+	if( pMemory==MAP_FAILED )
+	{
+		std::cerr << "Couldn't map " << filename << ": " << strerror(errno) << std::endl;
+		return 1;
+	}
+	madvise( pMemory, fileStatus.st_size, MADV_WILLNEED );
+
+	// Several segments per interval per thread, so that the threads stay busy if the events are bunched up in time
+	size_t segmentsPerInterval=( numberOfThreads*4+numberOfIntervals-1 )/numberOfIntervals;
+	Trace trace;
+	if( !indexTrace( static_cast<const uint8_t*>(pMemory), fileStatus.st_size, numberOfIntervals*segmentsPerInterval, trace ) )
+	{
+		std::cerr << filename << " isn't a trace file this version can read" << std::endl;
+		return 1;
+	}
+	if( trace.chunks.empty() )
+	{
+		std::cout << "The trace has no events" << std::endl;
+		return 0;
+	}
+
+	ParallelPass( trace, &matchWithinSegment, numberOfThreads );
+	HashTable<Block> liveAtEnd;
+	uint64_t numberOfUnknownFrees;
+	resolveFrees( trace, liveAtEnd, numberOfUnknownFrees );
+	ParallelPass( trace, &measureSegment, numberOfThreads );
+
+	// Times are printed in seconds if the trace was finished properly, otherwise in millions of cycles
+	double secondsPerCycle=trace.header.nanosecondsPerCycle*1e-9;
+	const char* timeUnit=" s";
+	if( secondsPerCycle==0 )
+	{
+		std::cout << "The trace wasn't finished, so times are in millions of cycles" << "\n";
+		secondsPerCycle=1e-6;
+		timeUnit=" Mcycles";
+	}
+	uint64_t traceStart=trace.segments.front().startCycles;
+	double duration=( trace.segments.back().endCycles-traceStart )*secondsPerCycle;
+
+	CounterTotal heap;
+	std::map<uint64_t,CounterTotal> counters;
+	uint64_t numberOfEvents=0, allocations=0, bytesAllocated=0, frees=0;
+	HashTable<SizeCount> sizes;
+
+	std::cout << std::fixed << std::setprecision(3);
+	std::cout << "Timeline of tracked memory in use:" << "\n"
+			<< std::setw(12) << "start" << std::setw(16) << "peak bytes" << std::setw(16) << "end bytes" << std::setw(16) << "allocations/s" << std::setw(18) << "bytes allocated/s" << "\n";
+	for( size_t interval=0; interval<numberOfIntervals; ++interval )
+	{
+		int64_t intervalPeak=heap.current;
+		uint64_t intervalAllocations=0, intervalBytes=0;
+		for( size_t index=interval*segmentsPerInterval; index<(interval+1)*segmentsPerInterval; ++index )
+		{
+			const Segment& segment=trace.segments[index];
+			intervalPeak=std::max( intervalPeak, heap.current+segment.heap.peak );
+			heap.add( segment.heap );
+			for( std::map<uint64_t,Change>::const_iterator iCounter=segment.counters.begin(); iCounter!=segment.counters.end(); ++iCounter )
+			{
+				counters[iCounter->first].add( iCounter->second );
+			}
+			numberOfEvents+=segment.numberOfEvents;
+			intervalAllocations+=segment.allocations;
+			intervalBytes+=segment.bytesAllocated;
+			frees+=segment.frees;
+			for( size_t sizeIndex=0; sizeIndex<segment.sizes.capacity(); ++sizeIndex )
+			{
+				if( segment.sizes.keyAt(sizeIndex)==0 ) continue;
+				SizeCount& total=sizes.insert( segment.sizes.keyAt(sizeIndex) );
+				total.allocations+=segment.sizes.valueAt(sizeIndex).allocations;
+				total.bytes+=segment.sizes.valueAt(sizeIndex).bytes;
+			}
+		}
+		allocations+=intervalAllocations;
+		bytesAllocated+=intervalBytes;
+
+		const Segment& firstSegment=trace.segments[interval*segmentsPerInterval];
+		const Segment& lastSegment=trace.segments[(interval+1)*segmentsPerInterval-1];
+		double intervalLength=( lastSegment.endCycles-firstSegment.startCycles )*secondsPerCycle;
+		std::cout << std::setprecision(3) << std::setw(10) << ( firstSegment.startCycles-traceStart )*secondsPerCycle << timeUnit
+				<< std::setw(16) << intervalPeak << std::setw(16) << heap.current
+				<< std::setprecision(0) << std::setw(16) << intervalAllocations/intervalLength << std::setw(18) << intervalBytes/intervalLength << "\n";
+	}
+
+	std::cout << std::setprecision(3) << "\n"
+			<< numberOfEvents << " events from " << trace.numberOfThreads << " threads over " << duration << timeUnit << "\n"
+			<< "Peak tracked memory in use was " << heap.peak << " bytes at " << ( heap.peakCycles-traceStart )*secondsPerCycle << timeUnit << "\n"
+			<< std::setprecision(0) << allocations << " allocations, " << allocations/duration << " per second, totalling " << bytesAllocated
+			<< " bytes, " << bytesAllocated/duration << " bytes per second" << "\n"
+			<< frees << " frees, " << frees/duration << " per second" << "\n";
+
+	uint64_t bytesLeft=0, blocksLeft=0;
+	for( size_t index=0; index<liveAtEnd.capacity(); ++index )
+	{
+		if( liveAtEnd.keyAt(index)==0 ) continue;
+		blocksLeft+=liveAtEnd.valueAt(index).weight;
+		bytesLeft+=liveAtEnd.valueAt(index).size*liveAtEnd.valueAt(index).weight;
+	}
+	std::cout << blocksLeft << " blocks totalling " << bytesLeft << " bytes were still allocated at the end of the trace" << "\n";
+	if( trace.droppedEvents!=0 ) std::cout << "Warning: " << trace.droppedEvents << " events were dropped while recording, so the sizes could be out" << "\n";
+	if( numberOfUnknownFrees!=0 ) std::cout << numberOfUnknownFrees << " frees were of blocks whose allocation isn't in the trace" << "\n";
+
+	std::cout << "\n" << "Counter peaks:" << "\n";
+	std::cout << std::setprecision(3);
+	for( std::map<uint64_t,CounterTotal>::const_iterator iCounter=counters.begin(); iCounter!=counters.end(); ++iCounter )
+	{
+		if( iCounter->first & globalCounterKey ) std::cout << "    global counter " << ( iCounter->first & ~globalCounterKey );
+		else std::cout << "    thread " << ( iCounter->first>>32 ) << " slot " << uint32_t( iCounter->first );
+		std::cout << ": peak " << iCounter->second.peak << " bytes at " << ( iCounter->second.peakCycles-traceStart )*secondsPerCycle << timeUnit
+				<< ", " << iCounter->second.current << " bytes at the end" << "\n";
+	}
+
+	// Call sites aren't in the trace, so the sizes are the nearest thing to where the memory went
+	std::vector< std::pair<uint64_t,SizeCount> > sortedSizes;
+	for( size_t index=0; index<sizes.capacity(); ++index )
+	{
+		if( sizes.keyAt(index)!=0 ) sortedSizes.push_back( std::make_pair( sizes.keyAt(index)-1, sizes.valueAt(index) ) );
+	}
+	size_t numberToList=std::min( numberOfSizes, sortedSizes.size() );
+	std::partial_sort( sortedSizes.begin(), sortedSizes.begin()+numberToList, sortedSizes.end(), MoreBytes() );
+	std::cout << "\n" << "Allocation sizes with the most bytes allocated:" << "\n";
+	for( size_t index=0; index<numberToList; ++index )
+	{
+		std::cout << std::setw(14) << sortedSizes[index].first << " bytes: " << sortedSizes[index].second.allocations << " allocations, " << sortedSizes[index].second.bytes << " bytes" << "\n";
+	}
+	std::partial_sort( sortedSizes.begin(), sortedSizes.begin()+numberToList, sortedSizes.end(), MoreAllocations() );
+	std::cout << "\n" << "Allocation sizes allocated most often:" << "\n";
+	for( size_t index=0; index<numberToList; ++index )
+	{
+		std::cout << std::setw(14) << sortedSizes[index].first << " bytes: " << sortedSizes[index].second.allocations << " allocations, " << sortedSizes[index].second.bytes << " bytes" << "\n";
+	}
+	std::cout.flush();
+
+	return 0;
+}